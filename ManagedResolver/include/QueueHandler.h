@@ -12,39 +12,117 @@
 
 #include <cstdint>
 #include <chrono>
+#include <array>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
 
 #include "ipc/ExtsanData.h"
+#include "ipc/SharedMemory.h"
+#include "ipc/spinlock.h"
+#include "detector/ThreadRegistry.h"
 #include "LoggerTypes.h"
-#include "sparsepp/spp.h"
 
 namespace msr {
+	/**
+	* Processes the event queues of extsan using a pool of workers.
+	* Each worker drains its home queues first and steals from
+	* the fullest queue when they are empty. A queue is only processed by a
+	* single worker at a time, hence the events of each application thread
+	* are processed in order. Idle workers spin for a while before they sleep
+	* until a producer wakes them up.
+	*
+	* All records of a thread are sent via the same queue, hence the thread
+	* states are kept per queue and are only used by the worker which
+	* currently processes it. If a thread id is reused in another queue,
+	* both incarnations have their own state.
+	*/
 	class QueueHandler {
+	public:
+		using shm_t = ipc::SharedMemory<ipc::QueueMetadata, false>;
+		using spill_t = ipc::SharedMemory<ipc::SpillArea, false>;
+
+	private:
 		using Queue_t = ipc::queue_t;
-		using Map_t = spp::sparse_hash_map<uint64_t, void*>;
 
-		ipc::QueueMetadata & _qmeta;
+		/// number of idle rounds before a worker sleeps
+		static constexpr unsigned spin_rounds = 1000;
+		/// maximum number of records processed per queue before switching
+		static constexpr unsigned batch_records = 4096;
+		/// timeout of a sleep, bounds the latency if a wake-up is missed
+		static constexpr std::chrono::milliseconds sleep_timeout{ 10 };
+
+		/// consumer side state of an application thread
+		struct ThreadState {
+			void * tsan;
+			/// identifier of the fork edge, see \ref ipc::event::ForkJoin
+			uint64_t edge;
+			/// callstack which is currently entered in tsan
+			std::vector<uint64_t> stack;
+			/// id of the entered callstack
+			uint32_t stack_id{ 0 };
+			/// interned callstacks of this thread, indexed by id
+			std::vector<ipc::event::StackDef> stacks;
+		};
+
+		/// tsan sync address of a fork / join edge
+		struct EdgeSync {
+			uint64_t addr;
+			/// uses which are still expected, the edge is removed at zero
+			int64_t  pending;
+		};
+
+		/// first sync address of the fork / join edges
+		static constexpr uint64_t edge_base = 0x10000000;
+
+		std::shared_ptr<shm_t> _shm;
+		ipc::QueueMetadata &   _qmeta;
+		/// overflow queues, only if events are spilled
+		std::unique_ptr<spill_t> _spill;
+		unsigned               _num_workers;
+		/// true if the queue is currently processed by a worker
+		std::atomic<bool>      _busy[ipc::QueueMetadata::max_queues];
+		/// records processed per queue (incl. spilled ones), orders the control records
+		std::array<uint64_t, ipc::QueueMetadata::max_queues> _consumed{ 0 };
+		/// thread states of each queue, only used by the worker which holds _busy
+		detector::ThreadRegistry<ThreadState> _threads[ipc::QueueMetadata::max_queues];
+
+		/* The sides of a fork / join edge are processed in the queues of the
+		*  parent and the child. As tsan only supports 32 bit addresses, each
+		*  edge gets a unique address while it is in use. */
+		ipc::spinlock          _edge_mx;
+		std::unordered_map<uint64_t, EdgeSync> _edges;
+		uint64_t               _next_edge{ edge_base };
 
 		// for stats
 		using tp_t = decltype(std::chrono::system_clock::now());
 		tp_t _last_sample;
-		std::array<uint64_t, ipc::QueueMetadata::num_queues> _events{ 0 };
-		std::array<uint64_t, ipc::QueueMetadata::num_queues> _last_evtcnt{ 0 };
-
-		std::array<Map_t, ipc::QueueMetadata::num_queues> _tids;
+		std::array<uint64_t, ipc::QueueMetadata::max_queues> _events{ 0 };
+		std::array<uint64_t, ipc::QueueMetadata::max_queues> _words{ 0 };
+		std::array<uint64_t, ipc::QueueMetadata::max_queues> _last_evtcnt{ 0 };
+		std::array<uint64_t, ipc::QueueMetadata::max_queues> _last_wordcnt{ 0 };
 
 	public:
-		explicit QueueHandler(ipc::QueueMetadata & qmeta)
-			: _qmeta(qmeta)
-		{
-			logger->debug("ringbuffer size {}MB", 
-				(Queue_t::slots * sizeof(Queue_t::value_type)) / (1024*1024));
-			init_detector();
-		}
+		/**
+		* \param num_queues number of queues and workers, 0 uses one per core
+		* \param overflow   behavior of the producers if a queue is full
+		* \param spill_file backing file of the overflow queues (only for SPILL),
+		*                   relative to the working directory of msr
+		*/
+		QueueHandler(
+			std::shared_ptr<shm_t> shm,
+			unsigned num_queues = 0,
+			ipc::OverflowPolicy overflow = ipc::OverflowPolicy::DROP,
+			const std::string & spill_file = "drace-events.spill");
 
-		/* TODO */
+		/** Starts the workers */
 		void start();
 
-		void process(int queueid);
+		/** Work loop of a single worker */
+		void process(unsigned worker);
 
 		template<typename Duration = std::chrono::seconds>
 		void monitor(Duration dur = std::chrono::seconds(2))
@@ -59,6 +137,37 @@ namespace msr {
 		void init_detector();
 		void print_stats();
 
+		/**
+		* Processes up to \ref batch_records records of a queue,
+		* if it is not processed by another worker.
+		* \return true if records were processed
+		*/
+		bool drain(unsigned queueid);
+
+		/** Processes up to budget records of a queue, the size is added to words */
+		template<typename Queue>
+		unsigned process_queue(unsigned queueid, Queue & queue, unsigned budget, size_t & words);
+
+		/** Returns true if the channel holds control records which are not applied yet */
+		static bool control_pending(const ipc::Channel & channel);
+
+		/**
+		* Applies the control records of a queue which are due, i.e. whose
+		* position is not behind the processed records. Requires _busy[queueid].
+		* 
+eturn number of applied records
+		*/
+		unsigned apply_control(unsigned queueid);
+
+		/** Drains the fullest queue which is not processed by another worker */
+		bool steal();
+
+		/** Spins or sleeps until new records might be available */
+		void idle(unsigned round);
+
+		/** Processes a single record of a queue, returns its size in words */
+		size_t process_record(unsigned queueid, const ipc::event::Header * hdr);
+
 		/**
 		 * split address at 32-bit boundary (zero above)
 		 * TODO: TSAN seems to only support 32 bit addresses!!!
@@ -68,17 +177,28 @@ namespace msr {
 			return (addr & 0x00000000FFFFFFFF);
 		}
 
-		void _acquire(ipc::event::Mutex*, int queueid);
-		void _release(ipc::event::Mutex*, int queueid);
-		void _happens_before();
-		void _happens_after();
-		void _read(ipc::event::MemAccess*, int queueid);
-		void _write(ipc::event::MemAccess*, int queueid);
-		void _allocate(ipc::event::Allocation*, int queueid);
-		void _free(ipc::event::Allocation*, int queueid);
-		void _fork(ipc::event::ForkJoin*, int queueid);
-		void _join(ipc::event::ForkJoin*, int queueid);
-		void _detach(ipc::event::DetachFinish*, int queueid);
-		void _finish(ipc::event::DetachFinish*, int queueid);
+		/** Enters the callstack of a record in tsan, only the diff is applied */
+		void update_stack(ThreadState * thr, const uint64_t * stack, size_t size);
+
+		void _stack(ThreadState*, const ipc::event::StackDef*);
+		void _accesses(ThreadState*, const ipc::event::Accesses*);
+		void _acquire(ThreadState*, const ipc::event::Mutex*);
+		void _release(ThreadState*, const ipc::event::Mutex*);
+		void _happens_before(ThreadState*, const ipc::event::Sync*);
+		void _happens_after(ThreadState*, const ipc::event::Sync*);
+		void _allocate(ThreadState*, const ipc::event::Allocation*);
+		void _free(const ipc::event::Allocation*);
+		void _fork(unsigned queueid, const ipc::event::ForkJoin*);
+		void _join(unsigned queueid, const ipc::event::ForkJoin*);
+		void _finish(unsigned queueid, uint32_t thread_id);
+
+		/**
+		* Returns the sync address of a fork / join edge and adds delta to
+		* its pending uses. The edge is removed once no use is pending.
+		*/
+		void * edge_sync(uint64_t id, int64_t delta);
+
+		/** Removes the thread state from tsan and deletes it */
+		void end_thread(ThreadState * thr, bool joined);
 	};
 }
@@ -15,67 +15,276 @@
 #include <memory>
 #include <thread>
 #include <chrono>
-#include <thread>
+#include <algorithm>
+#include <cstdint>
 
-#include <windows.h>
 #include "tsan-if.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <climits>
+#endif
+
 namespace msr {
+	constexpr std::chrono::milliseconds QueueHandler::sleep_timeout;
+
+	/**
+	* Resolves a path relative to the working directory of msr,
+	* as the producers run in other directories
+	*/
+	static std::string absolute_path(const std::string & path) {
+#ifdef _WIN32
+		char buf[MAX_PATH];
+		DWORD len = GetFullPathNameA(path.c_str(), MAX_PATH, buf, nullptr);
+		if (len == 0 || len >= MAX_PATH)
+			throw std::runtime_error("could not resolve path of spill file");
+		return std::string(buf, len);
+#else
+		if (!path.empty() && path[0] == '/')
+			return path;
+		char buf[PATH_MAX];
+		if (nullptr == getcwd(buf, sizeof(buf)))
+			throw std::runtime_error("could not resolve path of spill file");
+		return std::string(buf) + "/" + path;
+#endif
+	}
+
+	QueueHandler::QueueHandler(
+		std::shared_ptr<shm_t> shm,
+		unsigned num_queues,
+		ipc::OverflowPolicy overflow,
+		const std::string & spill_file)
+		: _shm(shm), _qmeta(*(shm->get()))
+	{
+		if (num_queues == 0)
+			num_queues = std::thread::hardware_concurrency();
+		// at least one private and the shared queue
+		if (num_queues > ipc::QueueMetadata::max_queues)
+			num_queues = ipc::QueueMetadata::max_queues;
+		if (num_queues < 2)
+			num_queues = 2;
+		_qmeta.num_queues = num_queues;
+		_num_workers = num_queues;
+		for (auto & busy : _busy)
+			busy.store(false, std::memory_order_relaxed);
+
+		if (overflow == ipc::OverflowPolicy::SPILL) {
+			const std::string path = absolute_path(spill_file);
+			if (path.size() >= sizeof(_qmeta.spill_file))
+				throw std::runtime_error("path of spill file is too long");
+			std::copy(path.begin(), path.end(), _qmeta.spill_file);
+			_qmeta.spill_file[path.size()] = '\0';
+			_spill = std::unique_ptr<spill_t>(new spill_t("drace-events-spill", true, _qmeta.spill_file));
+			logger->info("spill overflowing events to {}", path);
+		}
+		_qmeta.overflow = overflow;
+
+		logger->debug("ringbuffer size {}MB, {} queues",
+			(Queue_t::slots * sizeof(Queue_t::word_t)) / (1024*1024), num_queues);
+		init_detector();
+	}
+
 	void QueueHandler::start() {
-		logger->info("queue handler started");
+		logger->info("queue handler started with {} workers", _num_workers);
 
-		for (int i = 0; i < ipc::QueueMetadata::num_queues; ++i) {
+		for (unsigned i = 0; i < _num_workers; ++i) {
 			std::thread t(&QueueHandler::process, this, i);
 			t.detach();
 		}
 	}
 
-	void QueueHandler::process(int queueid) {
-		using ipc::event::Type;
-		auto pitem = std::make_unique<ipc::event::BufferEntry>();
-
-		SetThreadAffinityMask(GetCurrentThread(), 1 << (queueid % std::thread::hardware_concurrency()));
-
-		logger->info("process messages on queue {}", queueid);
+	void QueueHandler::process(unsigned worker) {
+		logger->info("process messages on worker {}", worker);
+		unsigned round = 0;
 		while (true) {
-			auto & queue = _qmeta.queues[queueid];
-			if (queue.remove(pitem.get())) {
-				++_events[queueid];
-				switch (pitem->type) {
-				case Type::ACQUIRE:
-					_acquire((ipc::event::Mutex*) pitem->buffer, queueid);
-					break;
-				case Type::RELEASE:
-					_release((ipc::event::Mutex*) pitem->buffer, queueid);
-					break;
-				case Type::MEMREAD:
-					_read((ipc::event::MemAccess*) pitem->buffer, queueid);
-					break;
-				case Type::MEMWRITE:
-					_write((ipc::event::MemAccess*) pitem->buffer, queueid);
-					break;
-				case Type::ALLOCATION:
-					_allocate((ipc::event::Allocation*) pitem->buffer, queueid);
-					break;
-				case Type::FREE:
-					_free((ipc::event::Allocation*) pitem->buffer, queueid);
-					break;
-				case Type::FORK:
-					_fork((ipc::event::ForkJoin*) pitem->buffer, queueid);
-					break;
-				case Type::JOIN:
-					break;
-				case Type::DETACH:
-					break;
-				case Type::FINISH:
-					break;
-				}
-				//std::cout << "Got " << (short)pitem->type << std::endl;
+			bool work = false;
+			for (unsigned q = worker; q < _qmeta.num_queues; q += _num_workers) {
+				work |= drain(q);
+			}
+			if (!work) {
+				work = steal();
+			}
+			if (work) {
+				round = 0;
 			}
 			else {
-				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				idle(round++);
+			}
+		}
+	}
+
+	template<typename Queue>
+	unsigned QueueHandler::process_queue(unsigned queueid, Queue & queue, unsigned budget, size_t & words) {
+		ipc::Channel & channel = _qmeta.channels[queueid];
+		unsigned records = 0;
+		const uint64_t * rec;
+		while (records < budget && nullptr != (rec = queue.front())) {
+			if (control_pending(channel))
+				apply_control(queueid);
+			// records are processed in place and released afterwards
+			size_t size = process_record(queueid, reinterpret_cast<const ipc::event::Header*>(rec));
+			queue.pop(size);
+			++_consumed[queueid];
+			++records;
+			words += size;
+		}
+		return records;
+	}
+
+	bool QueueHandler::control_pending(const ipc::Channel & channel) {
+		return channel.control_tail.load(std::memory_order_acquire)
+			!= channel.control_head.load(std::memory_order_relaxed);
+	}
+
+	unsigned QueueHandler::apply_control(unsigned queueid) {
+		using namespace ipc::event;
+		ipc::Channel & channel = _qmeta.channels[queueid];
+		const uint32_t tail = channel.control_tail.load(std::memory_order_acquire);
+		uint32_t head = channel.control_head.load(std::memory_order_relaxed);
+		unsigned applied = 0;
+		for (; head != tail; ++head, ++applied) {
+			const ipc::ControlRecord & rec = channel.control[head % ipc::Channel::control_slots];
+			// positions are ordered, the next one is due after more records
+			if (rec.position > _consumed[queueid])
+				break;
+			// control records only carry the parent side of fork / join edges
+			void * sync = edge_sync(rec.identifier, -1);
+			ThreadState * thr = _threads[queueid].find(rec.thread_id);
+			if (nullptr == thr) {
+				logger->trace("control record of unknown thread {}", rec.thread_id);
+				continue;
+			}
+			if (rec.type == Type::HAPPENS_BEFORE)
+				__tsan_happens_before(thr->tsan, sync);
+			else
+				__tsan_happens_after(thr->tsan, sync);
+		}
+		channel.control_head.store(head, std::memory_order_release);
+		return applied;
+	}
+
+	bool QueueHandler::drain(unsigned queueid) {
+		ipc::Channel & channel = _qmeta.channels[queueid];
+		ipc::spill_queue_t * spill = _spill ? &(_spill->get()->queues[queueid]) : nullptr;
+		const size_t pending = channel.queue.read_available();
+		if ((pending == 0 && (nullptr == spill || spill->read_available() == 0) && !control_pending(channel))
+			|| _busy[queueid].exchange(true, std::memory_order_acquire))
+		{
+			return false;
+		}
+
+		if (pending > channel.high_water.load(std::memory_order_relaxed))
+			channel.high_water.store(pending, std::memory_order_relaxed);
+
+		size_t words = 0;
+		unsigned records = process_queue(queueid, channel.queue, batch_records, words);
+		// the overflow queue only holds records which are newer than the ones in the queue,
+		// a producer might switch back to the queue meanwhile, hence check it per record
+		while (nullptr != spill && records < batch_records && channel.queue.read_available() == 0) {
+			const unsigned spilled = process_queue(queueid, *spill, 1, words);
+			if (spilled == 0)
+				break;
+			records += spilled;
+		}
+		// edges behind the last processed record
+		unsigned applied = control_pending(channel) ? apply_control(queueid) : 0;
+		_events[queueid] += records;
+		_words[queueid] += words;
+
+		_busy[queueid].store(false, std::memory_order_release);
+		return records > 0 || applied > 0;
+	}
+
+	bool QueueHandler::steal() {
+		unsigned victim = 0;
+		size_t level = 0;
+		for (unsigned q = 0; q < _qmeta.num_queues; ++q) {
+			if (_busy[q].load(std::memory_order_relaxed))
+				continue;
+			size_t avail = _qmeta.channels[q].queue.read_available();
+			if (_spill)
+				avail += _spill->get()->queues[q].read_available();
+			if (control_pending(_qmeta.channels[q]))
+				++avail;
+			if (avail > level) {
+				level = avail;
+				victim = q;
 			}
 		}
+		return level > 0 && drain(victim);
+	}
+
+	void QueueHandler::idle(unsigned round) {
+		if (round < spin_rounds) {
+			std::this_thread::yield();
+			return;
+		}
+
+		_qmeta.sleeping.fetch_add(1, std::memory_order_seq_cst);
+		// a producer might have committed before it observed the sleeping worker
+		bool empty = true;
+		for (unsigned q = 0; q < _qmeta.num_queues && empty; ++q) {
+			empty = (_qmeta.channels[q].queue.read_available() == 0)
+				&& (!_spill || _spill->get()->queues[q].read_available() == 0)
+				&& !control_pending(_qmeta.channels[q]);
+		}
+		if (empty && _shm->wait(sleep_timeout)) {
+			_qmeta.wake_pending.store(false, std::memory_order_release);
+		}
+		_qmeta.sleeping.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	size_t QueueHandler::process_record(unsigned queueid, const ipc::event::Header * hdr) {
+		using namespace ipc::event;
+
+		if (hdr->type == Type::FORK) {
+			_fork(queueid, payload<ForkJoin>(hdr));
+			return hdr->words;
+		}
+
+		ThreadState * thr = _threads[queueid].find(hdr->thread_id);
+		if (nullptr == thr) {
+			logger->trace("record of unknown thread {}", hdr->thread_id);
+			return hdr->words;
+		}
+
+		switch (hdr->type) {
+		case Type::STACK:
+			_stack(thr, payload<StackDef>(hdr));
+			break;
+		case Type::ACCESSES:
+			_accesses(thr, payload<Accesses>(hdr));
+			break;
+		case Type::ACQUIRE:
+			_acquire(thr, payload<Mutex>(hdr));
+			break;
+		case Type::RELEASE:
+			_release(thr, payload<Mutex>(hdr));
+			break;
+		case Type::HAPPENS_BEFORE:
+			_happens_before(thr, payload<Sync>(hdr));
+			break;
+		case Type::HAPPENS_AFTER:
+			_happens_after(thr, payload<Sync>(hdr));
+			break;
+		case Type::ALLOCATION:
+			_allocate(thr, payload<Allocation>(hdr));
+			break;
+		case Type::FREE:
+			_free(payload<Allocation>(hdr));
+			break;
+		case Type::JOIN:
+			_join(queueid, payload<ForkJoin>(hdr));
+			break;
+		case Type::FINISH:
+			_finish(queueid, hdr->thread_id);
+			break;
+		default:
+			break;
+		}
+		return hdr->words;
 	}
 
 	static void callback(__tsan_race_info* raceInfo, void* params) {
@@ -92,68 +301,177 @@ namespace msr {
 		auto timediff = std::chrono::system_clock::now() - _last_sample;
 		_last_sample = std::chrono::system_clock::now();
 
-		for (int i = 0; i < ipc::QueueMetadata::num_queues; ++i) {
+		for (unsigned i = 0; i < _qmeta.num_queues; ++i) {
 			auto evtdiff = _events[i] - _last_evtcnt[i];
+			auto worddiff = _words[i] - _last_wordcnt[i];
 			_last_evtcnt[i] = _events[i];
-			auto & queue = _qmeta.queues[i];
-			double level = static_cast<double>(queue.readAvailable()) / Queue_t::slots;
+			_last_wordcnt[i] = _words[i];
+			auto & queue = _qmeta.channels[i].queue;
+			double level = static_cast<double>(queue.read_available()) / Queue_t::slots;
 
-			// we are interesed in MB/s = B/us throughput 
-			auto proc_byte = evtdiff * sizeof(Queue_t::value_type);
+			// we are interesed in MB/s = B/us throughput
+			auto proc_byte = worddiff * sizeof(Queue_t::word_t);
 			double per_us_byte = static_cast<double>(proc_byte) / std::chrono::duration_cast<std::chrono::microseconds>(timediff).count();
 			double per_s_elem = (static_cast<double>(evtdiff) / std::chrono::duration_cast<std::chrono::microseconds>(timediff).count());
-			logger->debug("queue {} throughput {:.2f}MB/s, {:.2f}MElem/s, level(read) {:03.2f}%",
-				i, per_us_byte, per_s_elem, level * 100);
+			const ipc::Channel & channel = _qmeta.channels[i];
+			double high_water = static_cast<double>(channel.high_water.load(std::memory_order_relaxed)) / Queue_t::slots;
+			logger->debug("queue {} throughput {:.2f}MB/s, {:.2f}MRec/s, level(read) {:03.2f}%, high-water {:03.2f}%",
+				i, per_us_byte, per_s_elem, level * 100, high_water * 100);
+
+			const uint64_t dropped = channel.dropped_records.load(std::memory_order_relaxed);
+			const uint64_t spilled = channel.spilled_records.load(std::memory_order_relaxed);
+			const uint64_t blocked = channel.blocked.load(std::memory_order_relaxed);
+			if (dropped > 0 || spilled > 0 || blocked > 0) {
+				logger->info("queue {} overflow: dropped {} records ({} accesses), spilled {} records, blocked {} times",
+					i, dropped, channel.dropped_accesses.load(std::memory_order_relaxed), spilled, blocked);
+			}
+		}
+	}
+
+	void QueueHandler::update_stack(ThreadState * thr, const uint64_t * stack, size_t size) {
+		auto & cur = thr->stack;
+		// length of the common prefix
+		size_t common = std::mismatch(cur.begin(), cur.begin() + std::min(cur.size(), size), stack).first - cur.begin();
+
+		for (size_t i = cur.size(); i > common; --i) {
+			__tsan_func_exit(thr->tsan);
+		}
+		cur.resize(common);
+		for (size_t i = common; i < size; ++i) {
+			__tsan_func_enter(thr->tsan, (void*)stack[i]);
+			cur.push_back(stack[i]);
 		}
 	}
 
 	// ----- TSAN Messages -----
-	void QueueHandler::_acquire(ipc::event::Mutex* entry, int queueid) {
-		void* thr = _tids[queueid][entry->thread_id];
-		logger->trace("thr {}@{}", entry->thread_id, thr);
-		if (entry->write) {
-			__tsan_MutexLock(thr, 0, (void*)lower_half(entry->addr), entry->recursive, false);
+	void QueueHandler::_stack(ThreadState * thr, const ipc::event::StackDef * entry) {
+		if (entry->id >= ipc::event::max_stack_ids) {
+			logger->warn("stack id {} of thread {} is out of range", entry->id, thr->tsan);
+			return;
 		}
-		else {
-			__tsan_MutexReadLock(thr, 0, (void*)lower_half(entry->addr), false);
+		if (thr->stacks.size() <= entry->id) {
+			thr->stacks.resize(entry->id + 1, ipc::event::StackDef{ 0, 0, 0 });
+		}
+		thr->stacks[entry->id] = *entry;
+		if (thr->stack_id == entry->id) {
+			// entered stack is redefined
+			thr->stack_id = UINT32_MAX;
 		}
 	}
-	void QueueHandler::_release(ipc::event::Mutex* entry, int queueid) {
-		void* thr = _tids[queueid][entry->thread_id];
-		if (entry->write) {
-			__tsan_MutexUnlock(thr, 0, (void*)lower_half(entry->addr), false);
+
+	void QueueHandler::_accesses(ThreadState * thr, const ipc::event::Accesses * entry) {
+		logger->trace("accesses: thr {}, count {}, stack {}", thr->tsan, entry->count, entry->stack_id);
+		if (entry->stack_id != thr->stack_id) {
+			// resolve the interned stack, innermost frame first
+			std::vector<uint64_t> pcs;
+			uint32_t id = entry->stack_id;
+			while (id != 0 && id < thr->stacks.size() && pcs.size() < thr->stacks.size()) {
+				pcs.push_back(thr->stacks[id].pc);
+				id = thr->stacks[id].parent;
+			}
+			std::reverse(pcs.begin(), pcs.end());
+			update_stack(thr, pcs.data(), pcs.size());
+			thr->stack_id = entry->stack_id;
 		}
-		else {
-			__tsan_MutexReadUnlock(thr, 0, (void*)lower_half(entry->addr));
+
+		const detector::MemAccess * refs = entry->accesses();
+		for (uint32_t i = 0; i < entry->count; ++i) {
+			void * addr = (void*)lower_half(refs[i].addr());
+			// ranges, e.g. coalesced accesses
+			if (refs[i].write()) {
+				tsan_write_range(thr->tsan, addr, refs[i].size(), (void*)refs[i].pc);
+			}
+			else {
+				tsan_read_range(thr->tsan, addr, refs[i].size(), (void*)refs[i].pc);
+			}
 		}
 	}
-	void QueueHandler::_read(ipc::event::MemAccess* entry, int queueid) {
-		logger->trace("read: tid {}, addr {}, stacksize {}", entry->thread_id, (void*)entry->addr, entry->stacksize);
+	void QueueHandler::_acquire(ThreadState * thr, const ipc::event::Mutex * entry) {
+		__tsan_mutex_after_lock(thr->tsan, (void*)lower_half(entry->addr), (void*)entry->write);
+	}
+	void QueueHandler::_release(ThreadState * thr, const ipc::event::Mutex * entry) {
+		__tsan_mutex_before_unlock(thr->tsan, (void*)lower_half(entry->addr), (void*)entry->write);
+	}
+	void QueueHandler::_happens_before(ThreadState * thr, const ipc::event::Sync * entry) {
+		__tsan_happens_before(thr->tsan, (void*)lower_half(entry->identifier));
+	}
+	void QueueHandler::_happens_after(ThreadState * thr, const ipc::event::Sync * entry) {
+		__tsan_happens_after(thr->tsan, (void*)lower_half(entry->identifier));
+	}
+	void QueueHandler::_allocate(ThreadState * thr, const ipc::event::Allocation * entry) {
+		logger->trace("allocate: addr {}, size {}", entry->addr, entry->size);
+		__tsan_malloc(thr->tsan, (void*)entry->pc, (void*)lower_half(entry->addr), entry->size);
+	}
 
-		void* thr = _tids[queueid][entry->thread_id];
-		if (nullptr == thr) return;
-		__tsan_read(thr, (void*)lower_half(entry->addr), kSizeLog1, entry->callstack.data(), entry->stacksize);
+	void QueueHandler::_free(const ipc::event::Allocation * entry) {
+		logger->trace("free: addr {}, size {}", entry->addr, entry->size);
+		__tsan_free((void*)lower_half(entry->addr), entry->size);
+	}
+
+	void QueueHandler::_fork(unsigned queueid, const ipc::event::ForkJoin * entry) {
+		auto * thr = new ThreadState;
+		thr->tsan = __tsan_create_thread(entry->child);
+		thr->edge = entry->sync_id();
+		logger->trace("Fork child {}@{}", entry->child, thr->tsan);
+
+		// the edge is used by the parent side and until the end of the child
+		void * sync = edge_sync(thr->edge, static_cast<int64_t>(entry->edges) + 1);
+		// the parent side is processed in the queue of the parent
+		if (entry->parent != entry->child) {
+			__tsan_happens_after(thr->tsan, sync);
+		}
+
+		ThreadState * prev = _threads[queueid].insert(entry->child, thr);
+		if (nullptr != prev) {
+			// the tid was reused without a join
+			end_thread(prev, false);
+		}
 	}
-	void QueueHandler::_write(ipc::event::MemAccess* entry, int queueid) {
-		logger->trace("write: tid {}, addr {}, stacksize {}", entry->thread_id, (void*)entry->addr, entry->stacksize);
 
-		void* thr = _tids[queueid][entry->thread_id];
+	void QueueHandler::_join(unsigned queueid, const ipc::event::ForkJoin * entry) {
+		ThreadState * thr = _threads[queueid].erase(entry->child);
 		if (nullptr == thr) return;
-		__tsan_write(thr, (void*)lower_half(entry->addr), kSizeLog1, entry->callstack.data(), entry->stacksize);
+		logger->trace("Join child {}@{}", entry->child, thr->tsan);
+
+		// the parent side is processed in the queue of the parent
+		if (entry->parent != entry->child) {
+			__tsan_happens_before(thr->tsan, edge_sync(entry->sync_id(), static_cast<int64_t>(entry->edges)));
+		}
+		end_thread(thr, true);
 	}
-	void QueueHandler::_allocate(ipc::event::Allocation* entry, int queueid) {
-		logger->trace("allocate: tid {}, addr {}, size {}", entry->thread_id, entry->addr, entry->size);
-		__tsan_malloc_use_user_tid(entry->thread_id, 0x42, lower_half(entry->addr), entry->size);
+
+	void QueueHandler::_finish(unsigned queueid, uint32_t thread_id) {
+		ThreadState * thr = _threads[queueid].erase(thread_id);
+		if (nullptr == thr) return;
+		logger->trace("Finish thread {}@{}", thread_id, thr->tsan);
+		end_thread(thr, false);
 	}
 
-	void QueueHandler::_free(ipc::event::Allocation* entry, int queueid) {
-		logger->trace("free: addr {}, size {}", entry->addr, entry->size);
-		__tsan_reset_range(lower_half(entry->addr), entry->size);
+	void * QueueHandler::edge_sync(uint64_t id, int64_t delta) {
+		std::lock_guard<ipc::spinlock> lg(_edge_mx);
+		auto it = _edges.find(id);
+		if (it == _edges.end()) {
+			// addresses are not reused, as tsan keeps the clock of a sync address
+			it = _edges.emplace(id, EdgeSync{ _next_edge, 0 }).first;
+			_next_edge = (_next_edge + 8) & 0xFFFFFFFF;
+		}
+		const uint64_t addr = it->second.addr;
+		it->second.pending += delta;
+		if (it->second.pending == 0)
+			_edges.erase(it);
+		return (void*)addr;
 	}
 
-	void QueueHandler::_fork(ipc::event::ForkJoin* entry, int queueid) {
-		void* thr = __tsan_create_thread(entry->child);
-		logger->trace("Fork child {}@{}", entry->child, thr);
-		_tids[queueid][entry->child] = thr;
+	void QueueHandler::end_thread(ThreadState * thr, bool joined) {
+		if (joined) {
+			// we cannot use __tsan_ThreadJoin here, as local tid is not tracked
+			__tsan_ThreadFinish(thr->tsan);
+		}
+		else {
+			__tsan_go_end(thr->tsan);
+		}
+		// the thread no longer holds the edge
+		edge_sync(thr->edge, -1);
+		delete thr;
 	}
-}
\ No newline at end of file
+}
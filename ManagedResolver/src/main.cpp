@@ -72,9 +72,15 @@ int main(int argc, char** argv) {
 	int loglevel = 1;
 	bool display_help = false;
     bool exec_once = false;
+	unsigned num_queues = 0;
+	std::string overflow = "drop";
+	std::string spill_file = "drace-events.spill";
 	auto cli = (
 		clipp::repeatable(clipp::option("-v", "--verbose")(clipp::increment(loglevel))) % "verbose, use multiple times to increase log-level (e.g. -v -v)",
         (clipp::option("--once").set(exec_once) % "exit after DRace finishes"),
+		(clipp::option("-q", "--queues") & clipp::value("n", num_queues)) % "number of event queues for extsan (default: number of cores)",
+		(clipp::option("--overflow") & clipp::value("policy", overflow)) % "handling of events if an extsan queue is full: block, drop or spill (default: drop)",
+		(clipp::option("--spill-file") & clipp::value("file", spill_file)) % "overflow file for --overflow spill (default: drace-events.spill)",
 		(clipp::option("--version")([]() {
 		std::cout << "Managed Symbol Resolver (MSR)\n" 
 			      << "Version: " << DRACE_BUILD_VERSION << "\n"
@@ -83,7 +89,8 @@ int main(int argc, char** argv) {
 		clipp::option("-h", "--usage").set(display_help)
 	);
 
-	if (!clipp::parse(argc, argv, cli) || display_help) {
+	if (!clipp::parse(argc, argv, cli) || display_help
+		|| (overflow != "block" && overflow != "drop" && overflow != "spill")) {
 		std::cout << clipp::make_man_page(cli, "msr.exe") << std::endl;
 		std::exit(display_help ? 0 : 1);
 	}
@@ -134,7 +141,12 @@ int main(int argc, char** argv) {
 #ifdef EXTSAN
 		// Event message queue
 		auto shm_queue = std::make_shared<ipc::SharedMemory<ipc::QueueMetadata, false>>("drace-events", true);
-		qhandler = std::make_shared<QueueHandler>(*(shm_queue->get()));
+		ipc::OverflowPolicy policy = ipc::OverflowPolicy::DROP;
+		if (overflow == "block")
+			policy = ipc::OverflowPolicy::BLOCK;
+		else if (overflow == "spill")
+			policy = ipc::OverflowPolicy::SPILL;
+		qhandler = std::make_shared<QueueHandler>(shm_queue, num_queues, policy, spill_file);
 		q_fut = std::async(std::launch::async, [=]() {qhandler->start(); });
 		qm_fut = std::async(std::launch::async, [=]() {qhandler->monitor(); });
 #endif
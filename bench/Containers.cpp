@@ -11,9 +11,13 @@
 
 #include <benchmark/benchmark.h>
 
+#include <container/SmallMap.h>
+
 #include <unordered_map>
 #include <random>
 #include <limits>
+#include <vector>
+#include <memory>
 
 /* This benchmark simulates the load of mutex tracking in the drace client
 *  Various numbers of concurrent mutexes are simulated, showing
@@ -44,7 +48,8 @@ static void StdUMapMutexLoad(benchmark::State& state) {
 }
 
 static void LinearSearchMutexLoad(benchmark::State& state) {
-	uint64_t * buf = new uint64_t[state.range(0)*2];
+	// keys are drawn from [0, range], hence range + 1 distinct keys
+	uint64_t * buf = new uint64_t[(state.range(0) + 1) * 2];
 	std::uniform_int_distribution<uint64_t> dist(0, state.range(0));
 
 	size_t size = 0;
@@ -82,6 +87,96 @@ static void LinearSearchMutexLoad(benchmark::State& state) {
 	delete[] buf;
 }
 
+static void SmallMapMutexLoad(benchmark::State& state) {
+	// heap allocated, as the map is too large for some stacks
+	auto map = std::make_unique<container::SmallMap<uint64_t, int, 128>>();
+	std::uniform_int_distribution<uint64_t> dist(0, state.range(0));
+
+	for (auto _ : state) {
+		auto key = generate_key(dist);
+		(*map)[key]++;
+
+		if (dropout(prng) > 0.6) {
+			map->erase(key);
+		}
+	}
+	state.counters["size"] = static_cast<double>(map->size());
+}
+
+/* Lock-nesting traces as seen by the mutex book:
+*  Each thread holds a stack of mutexes (up to the nesting depth),
+*  re-acquires recursive mutexes and releases in LIFO order.
+*  The mutexes are taken from a pool of 4096 distinct locks.
+*/
+struct LockOp {
+	uint64_t mutex;
+	bool     acquire;
+};
+
+static std::vector<LockOp> make_nesting_trace(size_t depth, size_t length) {
+	std::mt19937 gen(42);
+	std::uniform_int_distribution<uint64_t> pool(0, 4095);
+	std::uniform_real_distribution<float> coin(0, 1);
+
+	std::vector<LockOp> trace;
+	std::vector<uint64_t> held;
+	trace.reserve(length);
+	while (trace.size() < length) {
+		if (held.size() < depth && (held.empty() || coin(gen) > 0.5)) {
+			// re-enter a held (recursive) mutex or take a new one
+			uint64_t m = (!held.empty() && coin(gen) > 0.9) ?
+				held[gen() % held.size()] : (0x10000 + pool(gen) * 64);
+			held.push_back(m);
+			trace.push_back(LockOp{ m, true });
+		}
+		else {
+			trace.push_back(LockOp{ held.back(), false });
+			held.pop_back();
+		}
+	}
+	return trace;
+}
+
+template<typename Book>
+static void ReplayNesting(benchmark::State& state, Book & book) {
+	const auto trace = make_nesting_trace(state.range(0), 1 << 16);
+	size_t pos = 0;
+	unsigned sum = 0;
+	for (auto _ : state) {
+		const LockOp & op = trace[pos];
+		if (op.acquire) {
+			sum += ++book[op.mutex];
+		}
+		else {
+			auto & cnt = book[op.mutex];
+			if (--cnt == 0) {
+				book.erase(op.mutex);
+			}
+		}
+		if (++pos == trace.size()) {
+			// trace is not balanced at its end
+			book.clear();
+			pos = 0;
+		}
+	}
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void StdUMapLockNesting(benchmark::State& state) {
+	std::unordered_map<uint64_t, unsigned> book;
+	ReplayNesting(state, book);
+}
+
+static void SmallMapLockNesting(benchmark::State& state) {
+	auto book = std::make_unique<container::SmallMap<uint64_t, unsigned, 128>>();
+	ReplayNesting(state, *book);
+}
+
 // Register the function as a benchmark
 BENCHMARK(StdUMapMutexLoad)->RangeMultiplier(2)->Range(1, 1024);
 BENCHMARK(LinearSearchMutexLoad)->RangeMultiplier(2)->Range(1, 1024);
+BENCHMARK(SmallMapMutexLoad)->RangeMultiplier(2)->Range(1, 1024);
+// nesting depth, the last one exceeds the inline slots
+BENCHMARK(StdUMapLockNesting)->RangeMultiplier(4)->Range(1, 256);
+BENCHMARK(SmallMapLockNesting)->RangeMultiplier(4)->Range(1, 256);
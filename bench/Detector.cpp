@@ -12,36 +12,180 @@
 #include <benchmark/benchmark.h>
 #include <detector/detector_if.h>
 
-#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
-// TSAN can only be initialized once (BUG)
-#if 0
-static void DetectorRW(benchmark::State& state) {
-	int num_threads = 8;
+/* Throughput of the detector backend which is selected by DRACE_DETECTOR.
+*  Build the bench once per detector to compare them. Each benchmark
+*  runs on a freshly initialized detector.
+*/
 
-	detector::init(0, nullptr, nullptr);
+static std::atomic<unsigned long> num_races{ 0 };
 
-	for (auto _ : state) {
-		state.PauseTiming();
-		std::vector<detector::tls_t> tls(num_threads);
-		// generate threads
-		for (int i = 0; i < num_threads; ++i) {
-			detector::fork(1, i+2, &(tls[i]));
-		}
-		state.ResumeTiming();
+static void count_race(const detector::Race * race) {
+	num_races.fetch_add(1, std::memory_order_relaxed);
+}
+
+/** returns a thread id which was not used before */
+static detector::tid_t next_tid() {
+	static std::atomic<detector::tid_t> tid{ 1 };
+	return tid.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+/**
+ * Initializes the detector before and finalizes it after each benchmark.
+ * In multi-threaded runs, the first thread initializes and the last one
+ * finalizes (all threads set up before the timed loop starts).
+ */
+class DetectorBench : public benchmark::Fixture {
+	static std::mutex _mx;
+	static int        _users;
 
-		for (int i = 0; i < 10000; ++i) {
-			int tid = i % num_threads;
-			detector::write(tls[tid], (void*)i, (void*)i, 1);
+public:
+	void SetUp(const benchmark::State & state) override {
+		std::lock_guard<std::mutex> lg(_mx);
+		if (_users++ == 0) {
+			const char * argv = "drace-bench.exe";
+			num_races.store(0, std::memory_order_relaxed);
+			detector::init(1, &argv, count_race);
 		}
+	}
 
-		// cleanup threads
-		for (int i = 1; i < num_threads; ++i) {
-			detector::join(1, i+1);
+	void TearDown(const benchmark::State & state) override {
+		std::lock_guard<std::mutex> lg(_mx);
+		if (--_users == 0) {
+			detector::finalize();
 		}
 	}
-	detector::finalize();
+
+	static detector::tls_t fork_thread() {
+		detector::tls_t tls;
+		detector::fork(1, next_tid(), &tls);
+		return tls;
+	}
+
+	static void report(benchmark::State & state, int64_t items) {
+		state.SetItemsProcessed(items);
+		state.counters["races"] = static_cast<double>(num_races.load(std::memory_order_relaxed));
+	}
+};
+std::mutex DetectorBench::_mx;
+int        DetectorBench::_users = 0;
+
+/// base of the memory used in the benchmarks (heap-like address)
+static constexpr uint64_t mem_base = 0x0000020A00000000ull;
+
+/* Single thread read / write throughput on a working set of range(0) bytes */
+BENCHMARK_DEFINE_F(DetectorBench, ReadWrite)(benchmark::State & state) {
+	const uint64_t words = static_cast<uint64_t>(state.range(0)) / 8;
+	detector::tls_t tls = fork_thread();
+
+	uint64_t i = 0;
+	for (auto _ : state) {
+		void * addr = (void*)(mem_base + (i % words) * 8);
+		detector::write(tls, (void*)0x1000, addr, 8);
+		detector::read(tls, (void*)0x1001, addr, 8);
+		++i;
+	}
+	report(state, state.iterations() * 2);
+}
+BENCHMARK_REGISTER_F(DetectorBench, ReadWrite)->Arg(1 << 12)->Arg(1 << 24);
+
+/* Single thread throughput of batched accesses, as used by the drace client */
+BENCHMARK_DEFINE_F(DetectorBench, AccessBatch)(benchmark::State & state) {
+	constexpr size_t batch_size = 1024;
+	detector::tls_t tls = fork_thread();
+
+	std::vector<detector::MemAccess> batch;
+	batch.reserve(batch_size);
+	for (size_t i = 0; i < batch_size; ++i) {
+		batch.push_back(detector::MemAccess::make((void*)(mem_base + i * 8), 0x2000 + i, 8, (i % 4) == 0));
+	}
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(detector::access_batch(tls, batch.data(), batch.size(), 0, 0));
+	}
+	report(state, state.iterations() * batch_size);
+}
+BENCHMARK_REGISTER_F(DetectorBench, AccessBatch);
+
+/* Multiple threads read a shared range and write neighbouring words,
+*  hence all threads update the same shadow memory
+*/
+BENCHMARK_DEFINE_F(DetectorBench, Contended)(benchmark::State & state) {
+	constexpr uint64_t words = 1024;
+	constexpr uint64_t max_threads = 64;
+	static std::atomic<uint64_t> next_index{ 0 };
+	const uint64_t index = next_index.fetch_add(1, std::memory_order_relaxed) % max_threads;
+	detector::tls_t tls = fork_thread();
+
+	const uint64_t shared = mem_base + 0x100000;
+	const uint64_t own = mem_base + 0x200000 + index * 8;
+	uint64_t i = 0;
+	for (auto _ : state) {
+		const uint64_t w = i % words;
+		detector::read(tls, (void*)0x3000, (void*)(shared + w * 8), 8);
+		detector::write(tls, (void*)0x3001, (void*)(own + w * max_threads * 8), 8);
+		++i;
+	}
+	report(state, state.iterations() * 2);
+}
+BENCHMARK_REGISTER_F(DetectorBench, Contended)->ThreadRange(1, 8)->UseRealTime();
+
+/* Cost of a lock / unlock pair on range(0) distinct mutexes */
+BENCHMARK_DEFINE_F(DetectorBench, AcquireRelease)(benchmark::State & state) {
+	const uint64_t mutexes = static_cast<uint64_t>(state.range(0));
+	detector::tls_t tls = fork_thread();
+
+	uint64_t i = 0;
+	for (auto _ : state) {
+		void * mx = (void*)(mem_base + 0x300000 + (i % mutexes) * 64);
+		detector::acquire(tls, mx, 1, true);
+		detector::release(tls, mx, true);
+		++i;
+	}
+	report(state, state.iterations());
+}
+BENCHMARK_REGISTER_F(DetectorBench, AcquireRelease)->Arg(1)->Arg(1024);
+
+/* Cost of a fork / join pair while range(0) other threads are alive */
+BENCHMARK_DEFINE_F(DetectorBench, ForkJoin)(benchmark::State & state) {
+	const int live = static_cast<int>(state.range(0));
+	const detector::tid_t parent = next_tid();
+	detector::tls_t parent_tls;
+	detector::fork(1, parent, &parent_tls);
+
+	std::vector<detector::tls_t> threads;
+	for (int i = 0; i < live; ++i) {
+		threads.push_back(fork_thread());
+	}
+
+	for (auto _ : state) {
+		detector::tls_t tls;
+		const detector::tid_t tid = next_tid();
+		detector::fork(parent, tid, &tls);
+		detector::join(parent, tid);
+	}
+	report(state, state.iterations());
+}
+BENCHMARK_REGISTER_F(DetectorBench, ForkJoin)->Arg(1)->Arg(128)->Arg(4096);
+
+/* Allocation churn with blocks of range(0) bytes */
+BENCHMARK_DEFINE_F(DetectorBench, AllocFree)(benchmark::State & state) {
+	constexpr uint64_t live_blocks = 256;
+	const size_t size = static_cast<size_t>(state.range(0));
+	const uint64_t stride = (size + 15) & ~15ull;
+	detector::tls_t tls = fork_thread();
+
+	uint64_t i = 0;
+	for (auto _ : state) {
+		void * block = (void*)(mem_base + 0x1000000 + (i % live_blocks) * stride);
+		detector::allocate(tls, (void*)0x4000, block, size);
+		detector::write(tls, (void*)0x4001, block, 8);
+		detector::deallocate(tls, block);
+		++i;
+	}
+	report(state, state.iterations());
 }
-// Register the function as a benchmark
-BENCHMARK(DetectorRW);
-#endif
+BENCHMARK_REGISTER_F(DetectorBench, AllocFree)->Arg(64)->Arg(1 << 16);
@@ -0,0 +1,111 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <detector/AllocationIndex.h>
+#include <ipc/spinlock.h>
+
+#include <map>
+#include <mutex>
+#include <functional>
+#include <vector>
+#include <random>
+
+/* This benchmark simulates the heap block tracking of the tsan detector.
+*  Each thread allocates, looks up and frees blocks in its own address range,
+*  while all threads share a single index. The std::map guarded by a spinlock
+*  is the former implementation, the AllocationIndex replaces it.
+*/
+
+/// number of blocks each thread keeps alive
+constexpr size_t live_blocks = 256;
+/// lookups per allocation / deallocation pair
+constexpr int lookups = 4;
+
+static inline uint64_t thread_base(int thread_index) {
+	// 16 MiB per thread, well below the 32 bit limit for 64 threads
+	return (static_cast<uint64_t>(thread_index) + 1) << 24;
+}
+
+class LockedMapIndex {
+	std::map<uint64_t, size_t, std::greater<uint64_t>> _map;
+	ipc::spinlock _mx;
+
+public:
+	void insert(uint64_t begin, size_t size) {
+		std::lock_guard<ipc::spinlock> lg(_mx);
+		_map.emplace(begin, size);
+	}
+
+	bool erase(uint64_t begin) {
+		std::lock_guard<ipc::spinlock> lg(_mx);
+		return _map.erase(begin) != 0;
+	}
+
+	bool contains(uint64_t addr) {
+		std::lock_guard<ipc::spinlock> lg(_mx);
+		auto it = _map.lower_bound(addr);
+		return (it != _map.end() && addr < (it->first + it->second));
+	}
+};
+
+template<typename Index>
+static void HeapChurn(benchmark::State& state, Index & index) {
+	std::mt19937 prng(state.thread_index);
+	std::uniform_int_distribution<size_t> block_size(16, 512);
+
+	const uint64_t base = thread_base(state.thread_index);
+	std::vector<uint64_t> blocks(live_blocks, 0);
+	uint64_t next = base;
+	size_t pos = 0;
+	size_t hits = 0;
+
+	for (auto _ : state) {
+		// free oldest block
+		if (blocks[pos] != 0) {
+			index.erase(blocks[pos]);
+		}
+		// bump allocator with wrap-around inside the thread range
+		const size_t size = block_size(prng);
+		if (next + size >= thread_base(state.thread_index + 1)) {
+			next = base;
+		}
+		index.insert(next, size);
+		blocks[pos] = next;
+		next += (size + 15) & ~size_t(15);
+		pos = (pos + 1) % live_blocks;
+
+		for (int i = 0; i < lookups; ++i) {
+			const uint64_t addr = base + (prng() % (next - base + 1));
+			hits += index.contains(addr);
+		}
+	}
+	benchmark::DoNotOptimize(hits);
+
+	for (auto b : blocks) {
+		if (b != 0) index.erase(b);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void StdMapSpinlockHeap(benchmark::State& state) {
+	static LockedMapIndex index;
+	HeapChurn(state, index);
+}
+
+static void AllocationIndexHeap(benchmark::State& state) {
+	static detector::AllocationIndex<> index;
+	HeapChurn(state, index);
+}
+
+BENCHMARK(StdMapSpinlockHeap)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(AllocationIndexHeap)->ThreadRange(1, 64)->UseRealTime();
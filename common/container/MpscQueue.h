@@ -0,0 +1,133 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+namespace container {
+    /**
+     * Bounded lock-free multi-producer, single-consumer queue.
+     *
+     * Each slot carries a sequence number which tells whether it is free
+     * for the producer of a given position or ready for the consumer.
+     * Producers reserve a position with a single CAS and copy the element
+     * into the slot, hence they never wait for each other or the consumer.
+     * If the queue is full, \ref push fails instead of blocking.
+     *
+     * \tparam T trivially copyable element type
+     */
+    template<typename T>
+    class MpscQueue {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+        struct Cell {
+            std::atomic<size_t> seq;
+            T                   data;
+        };
+
+        /// number of slots, a power of 2
+        const size_t                     _size;
+        const size_t                     _mask;
+        std::unique_ptr<Cell[]>          _cells;
+        alignas(64) std::atomic<size_t>  _head{ 0 };
+        alignas(64) std::atomic<size_t>  _tail{ 0 };
+
+        static size_t round_up(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity)
+                size <<= 1;
+            return size;
+        }
+
+    public:
+        /** \param capacity number of slots, rounded up to a power of 2 */
+        explicit MpscQueue(size_t capacity)
+            : _size(round_up(capacity)),
+              _mask(_size - 1),
+              _cells(new Cell[_size])
+        {
+            for (size_t i = 0; i < _size; ++i) {
+                _cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        MpscQueue(const MpscQueue &) = delete;
+        MpscQueue & operator=(const MpscQueue &) = delete;
+
+        /**
+         * Copies val into the queue (producer side, thread safe)
+         * \param position if not null, receives the position of the element
+         * \return false if the queue is full
+         */
+        bool push(const T & val, size_t * position = nullptr) {
+            size_t pos = _head.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell & cell = _cells[pos & _mask];
+                const size_t seq = cell.seq.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        cell.data = val;
+                        cell.seq.store(pos + 1, std::memory_order_release);
+                        if (nullptr != position)
+                            *position = pos;
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    // slot is not consumed yet
+                    return false;
+                }
+                else {
+                    pos = _head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+         * Removes the oldest element (consumer side, single thread only)
+         * \return false if no element is ready
+         */
+        bool pop(T & val) {
+            const size_t tail = _tail.load(std::memory_order_relaxed);
+            Cell & cell = _cells[tail & _mask];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            if (seq != tail + 1)
+                return false;
+            val = cell.data;
+            cell.seq.store(tail + _size, std::memory_order_release);
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /** Number of positions reserved by producers so far */
+        inline size_t produced() const {
+            return _head.load(std::memory_order_acquire);
+        }
+
+        /**
+         * Number of elements removed by the consumer so far.
+         * An element is not necessarily processed when it is removed.
+         */
+        inline size_t consumed() const {
+            return _tail.load(std::memory_order_acquire);
+        }
+
+        inline size_t capacity() const {
+            return _size;
+        }
+    };
+} // namespace container
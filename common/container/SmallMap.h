@@ -0,0 +1,138 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstddef>
+#include <unordered_map>
+
+namespace container {
+    /**
+     * Map with a fixed number of inline, cache-line aligned slots.
+     *
+     * Designed for a small number of short-living entries
+     * (e.g. the held mutexes of a thread): Keys and values are stored in
+     * separate arrays and searched linearly, which is faster than hashing
+     * for only a few entries. Erased entries are replaced by the last one,
+     * hence only the occupied prefix is scanned.
+     * If all inline slots are occupied, further entries are stored in an
+     * (on demand allocated) overflow map.
+     *
+     * \note not thread safe
+     */
+    template<typename Key, typename Value, size_t N>
+    class alignas(64) SmallMap {
+        static_assert(N > 0, "at least one inline slot is required");
+
+        using overflow_t = std::unordered_map<Key, Value>;
+
+        Key        _keys[N];
+        Value      _values[N];
+        size_t     _size{ 0 };
+        overflow_t * _overflow{ nullptr };
+
+    public:
+        SmallMap() = default;
+        SmallMap(const SmallMap &) = delete;
+        SmallMap & operator=(const SmallMap &) = delete;
+
+        ~SmallMap() {
+            delete _overflow;
+        }
+
+        /** Returns a pointer to the value of key, nullptr if not found */
+        inline Value * find(const Key & key) {
+            for (size_t i = 0; i < _size; ++i) {
+                if (_keys[i] == key)
+                    return &_values[i];
+            }
+            if (nullptr != _overflow) {
+                auto it = _overflow->find(key);
+                if (it != _overflow->end())
+                    return &(it->second);
+            }
+            return nullptr;
+        }
+
+        /** Returns the value of key, inserts a value-initialized one if not found */
+        inline Value & operator[](const Key & key) {
+            Value * val = find(key);
+            if (nullptr != val)
+                return *val;
+
+            if (_size < N) {
+                _keys[_size] = key;
+                _values[_size] = Value();
+                return _values[_size++];
+            }
+            if (nullptr == _overflow) {
+                _overflow = new overflow_t();
+            }
+            return (*_overflow)[key];
+        }
+
+        inline size_t count(const Key & key) {
+            return (nullptr != find(key)) ? 1 : 0;
+        }
+
+        /** Removes key from the map, returns the number of removed elements */
+        size_t erase(const Key & key) {
+            for (size_t i = 0; i < _size; ++i) {
+                if (_keys[i] == key) {
+                    --_size;
+                    _keys[i] = _keys[_size];
+                    _values[i] = _values[_size];
+                    refill();
+                    return 1;
+                }
+            }
+            if (nullptr != _overflow) {
+                return _overflow->erase(key);
+            }
+            return 0;
+        }
+
+        inline size_t size() const {
+            return _size + ((nullptr != _overflow) ? _overflow->size() : 0);
+        }
+
+        inline bool empty() const {
+            return size() == 0;
+        }
+
+        /** Number of entries which are not stored inline */
+        inline size_t overflow_size() const {
+            return (nullptr != _overflow) ? _overflow->size() : 0;
+        }
+
+        void clear() {
+            _size = 0;
+            if (nullptr != _overflow) {
+                _overflow->clear();
+            }
+        }
+
+        static constexpr size_t capacity() {
+            return N;
+        }
+
+    private:
+        /** Moves an entry of the overflow map into the free inline slot */
+        inline void refill() {
+            if (nullptr == _overflow || _overflow->empty())
+                return;
+            auto it = _overflow->begin();
+            _keys[_size] = it->first;
+            _values[_size] = it->second;
+            ++_size;
+            _overflow->erase(it);
+        }
+    };
+} // namespace container
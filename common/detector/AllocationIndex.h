@@ -0,0 +1,386 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <mutex> // for lock_guard
+#include <cstdint>
+#include <cstddef>
+
+#include <ipc/spinlock.h>
+
+namespace detector {
+    /**
+     * Concurrent index of live heap blocks.
+     *
+     * The address space is split into regions of 2^region_bits bytes which
+     * are located using a lazily populated three-level radix table keyed on
+     * the high bits of the address. Each region stores the blocks beginning
+     * inside it in append-only chunks of slots. A per-chunk bitmask tracks
+     * the occupied slots, so empty regions are skipped quickly.
+     *
+     * A block which spans multiple regions additionally marks the regions
+     * it covers with its begin (span markers). Whole tables which are
+     * covered are marked in the parent table instead of per region, hence
+     * a block sets at most a few thousand markers. A lookup checks the
+     * blocks beginning in the region of the address and the markers on
+     * the path to the region, hence it takes constant time.
+     *
+     * Readers (\c find, \c contains) never take a lock. Writers only lock
+     * the region the block begins in, hence allocations in distinct regions
+     * do not contend. Blocks must not overlap.
+     */
+    template<
+        /// size of a region (2^n bytes)
+        unsigned region_bits = 12,
+        /// number of slots per chunk
+        unsigned chunk_slots = 32,
+        /// number of significant address bits
+        unsigned address_bits = 48>
+    class AllocationIndex {
+    public:
+        using self_t = AllocationIndex<region_bits, chunk_slots, address_bits>;
+
+    private:
+        /// bits resolved by the second and third level
+        static constexpr unsigned table_bits = 12;
+        static constexpr unsigned l1_bits = address_bits - region_bits - 2 * table_bits;
+        static constexpr size_t   l1_size = size_t(1) << l1_bits;
+        static constexpr size_t   table_size = size_t(1) << table_bits;
+        static constexpr uint64_t region_size = uint64_t(1) << region_bits;
+        /// address range of a single L3 / L2 table
+        static constexpr unsigned l3_span_bits = region_bits + table_bits;
+        static constexpr unsigned l2_span_bits = region_bits + 2 * table_bits;
+        static constexpr uint64_t full_mask = (chunk_slots == 64) ?
+            ~uint64_t(0) : ((uint64_t(1) << (chunk_slots % 64)) - 1);
+
+        static_assert(address_bits > region_bits + 2 * table_bits && address_bits <= 64,
+            "unsupported address width");
+        static_assert(chunk_slots > 0 && chunk_slots <= 64, "chunk_slots must fit into bitmask");
+
+        struct Slot {
+            /// begin of block, 0 if slot is free
+            std::atomic<uint64_t> begin{ 0 };
+            std::atomic<uint64_t> size{ 0 };
+        };
+
+        struct Chunk {
+            /// bit i is set if slots[i] is occupied
+            std::atomic<uint64_t> used{ 0 };
+            std::atomic<Chunk*>   next{ nullptr };
+            Slot                  slots[chunk_slots];
+        };
+
+        struct Region {
+            /// serializes writers of this region
+            ipc::spinlock mx;
+            Chunk         head;
+        };
+
+        template<typename Entry>
+        struct Table {
+            std::atomic<Entry*> entries[table_size];
+            /// begin of the block which covers the whole entry, 0 if none
+            std::atomic<uint64_t> cover[table_size];
+
+            Table() {
+                for (auto & e : entries) e.store(nullptr, std::memory_order_relaxed);
+                for (auto & c : cover) c.store(0, std::memory_order_relaxed);
+            }
+        };
+        using L3Table = Table<Region>;
+        using L2Table = Table<L3Table>;
+
+        std::atomic<L2Table*> * _l1;
+        /// span markers of the L2 tables
+        std::atomic<uint64_t> * _l1_cover;
+
+    public:
+        AllocationIndex()
+            : _l1(new std::atomic<L2Table*>[l1_size]),
+              _l1_cover(new std::atomic<uint64_t>[l1_size])
+        {
+            for (size_t i = 0; i < l1_size; ++i) {
+                _l1[i].store(nullptr, std::memory_order_relaxed);
+                _l1_cover[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        AllocationIndex(const self_t &) = delete;
+        self_t & operator=(const self_t &) = delete;
+
+        ~AllocationIndex() {
+            clear();
+            delete[] _l1;
+            delete[] _l1_cover;
+        }
+
+        /**
+         * Removes all blocks and frees the index memory.
+         * \warning not thread-safe
+         */
+        void clear() {
+            for (size_t i = 0; i < l1_size; ++i) {
+                _l1_cover[i].store(0, std::memory_order_relaxed);
+                L2Table * l2 = _l1[i].exchange(nullptr, std::memory_order_relaxed);
+                if (nullptr == l2) continue;
+                for (auto & e2 : l2->entries) {
+                    L3Table * l3 = e2.load(std::memory_order_relaxed);
+                    if (nullptr == l3) continue;
+                    for (auto & e3 : l3->entries) {
+                        Region * reg = e3.load(std::memory_order_relaxed);
+                        if (nullptr == reg) continue;
+                        Chunk * c = reg->head.next.load(std::memory_order_relaxed);
+                        while (nullptr != c) {
+                            Chunk * n = c->next.load(std::memory_order_relaxed);
+                            delete c;
+                            c = n;
+                        }
+                        delete reg;
+                    }
+                    delete l3;
+                }
+                delete l2;
+            }
+        }
+
+        /** Registers the block [begin, begin + size) */
+        void insert(uint64_t begin, size_t size) {
+            if (begin == 0) return;
+            Region * reg = get_region(begin, true);
+            {
+                std::lock_guard<ipc::spinlock> lg(reg->mx);
+                Chunk * c = &(reg->head);
+                while (true) {
+                    const uint64_t used = c->used.load(std::memory_order_relaxed);
+                    if (used != full_mask) {
+                        unsigned i = 0;
+                        while (used & (uint64_t(1) << i)) ++i;
+                        Slot & s = c->slots[i];
+                        // publish size before begin, as readers validate using begin
+                        s.size.store(size, std::memory_order_relaxed);
+                        s.begin.store(begin, std::memory_order_release);
+                        c->used.store(used | (uint64_t(1) << i), std::memory_order_release);
+                        break;
+                    }
+                    Chunk * n = c->next.load(std::memory_order_relaxed);
+                    if (nullptr == n) {
+                        n = new Chunk;
+                        c->next.store(n, std::memory_order_release);
+                    }
+                    c = n;
+                }
+            }
+            mark_span(begin, size, begin);
+        }
+
+        /**
+         * Removes the block beginning at \c begin.
+         * \return true if the block was registered. Then, size is set to the block size
+         */
+        bool erase(uint64_t begin, size_t * size = nullptr) {
+            Region * reg = get_region(begin, false);
+            if (nullptr == reg) return false;
+
+            uint64_t block_size = 0;
+            {
+                std::lock_guard<ipc::spinlock> lg(reg->mx);
+                Chunk * c = &(reg->head);
+                unsigned i = 0;
+                for (; nullptr != c; c = c->next.load(std::memory_order_relaxed)) {
+                    const uint64_t used = c->used.load(std::memory_order_relaxed);
+                    for (i = 0; i < chunk_slots; ++i) {
+                        if ((used & (uint64_t(1) << i))
+                            && c->slots[i].begin.load(std::memory_order_relaxed) == begin)
+                            break;
+                    }
+                    if (i < chunk_slots) break;
+                }
+                if (nullptr == c) return false;
+
+                Slot & s = c->slots[i];
+                block_size = s.size.load(std::memory_order_relaxed);
+                s.begin.store(0, std::memory_order_release);
+                c->used.fetch_and(~(uint64_t(1) << i), std::memory_order_release);
+            }
+            if (nullptr != size)
+                *size = static_cast<size_t>(block_size);
+            mark_span(begin, block_size, 0);
+            return true;
+        }
+
+        /**
+         * Searches the block which contains \c addr (lock-free, constant time).
+         * \return true if found. Then, begin and size are set accordingly
+         */
+        bool find(uint64_t addr, uint64_t * begin, size_t * size) const {
+            const uint64_t region_beg = addr & ~(region_size - 1);
+            uint64_t best_beg = 0;
+            uint64_t best_size = 0;
+            const L3Table * l3 = get_l3(region_beg, false);
+            if (nullptr != l3) {
+                const Region * reg = l3->entries[l3_idx(region_beg)].load(std::memory_order_acquire);
+                if (nullptr != reg && closest_block(reg, addr, &best_beg, &best_size)) {
+                    // blocks do not overlap, hence only the closest block can contain addr
+                    if (addr < best_beg + best_size) {
+                        *begin = best_beg;
+                        *size = static_cast<size_t>(best_size);
+                        return true;
+                    }
+                    return false;
+                }
+            }
+
+            // a block which begins in a previous region and covers this one
+            uint64_t cover = _l1_cover[l1_idx(addr)].load(std::memory_order_acquire);
+            if (0 == cover) {
+                const L2Table * l2 = _l1[l1_idx(addr)].load(std::memory_order_acquire);
+                if (nullptr != l2)
+                    cover = l2->cover[l2_idx(addr)].load(std::memory_order_acquire);
+            }
+            if (0 == cover && nullptr != l3) {
+                cover = l3->cover[l3_idx(addr)].load(std::memory_order_acquire);
+            }
+            if (0 == cover || cover > addr) return false;
+
+            // validate the marker, the block might have been erased concurrently
+            const Region * reg = get_region(cover, false);
+            if (nullptr == reg || !closest_block(reg, cover, &best_beg, &best_size)
+                || best_beg != cover || addr >= best_beg + best_size)
+            {
+                return false;
+            }
+            *begin = best_beg;
+            *size = static_cast<size_t>(best_size);
+            return true;
+        }
+
+        /** Returns true if addr is inside a registered block (lock-free) */
+        inline bool contains(uint64_t addr) const {
+            uint64_t beg;
+            size_t   sz;
+            return find(addr, &beg, &sz);
+        }
+
+    private:
+        /**
+         * Searches the block of the region which begins closest before or at addr.
+         * \return false if no block of the region begins before addr
+         */
+        static bool closest_block(const Region * reg, uint64_t addr, uint64_t * begin, uint64_t * size) {
+            uint64_t best_beg = 0;
+            uint64_t best_size = 0;
+            for (const Chunk * c = &(reg->head); nullptr != c; c = c->next.load(std::memory_order_acquire)) {
+                const uint64_t used = c->used.load(std::memory_order_acquire);
+                if (used == 0) continue;
+                for (unsigned i = 0; i < chunk_slots; ++i) {
+                    if (!(used & (uint64_t(1) << i))) continue;
+                    const Slot & s = c->slots[i];
+                    uint64_t b = s.begin.load(std::memory_order_acquire);
+                    if (b == 0 || b > addr || b <= best_beg) continue;
+                    uint64_t sz = s.size.load(std::memory_order_relaxed);
+                    // slot was recycled concurrently, skip
+                    if (s.begin.load(std::memory_order_acquire) != b) continue;
+                    best_beg = b;
+                    best_size = sz;
+                }
+            }
+            *begin = best_beg;
+            *size = best_size;
+            return best_beg != 0;
+        }
+
+        /**
+         * Sets the span markers of all regions which the block [begin, begin + size)
+         * covers, except the one it begins in, to value. Marks whole tables
+         * at the parent level. Missing tables are only allocated when marking.
+         */
+        void mark_span(uint64_t begin, uint64_t size, uint64_t value) {
+            const uint64_t first = (begin & ~(region_size - 1)) + region_size;
+            const uint64_t end = begin + size;
+            // the block does not reach the next region (or the address space ends)
+            if (size == 0 || end <= first || first == 0) return;
+
+            uint64_t r = first;
+            while (r < end && r != 0) {
+                const uint64_t l2_span = uint64_t(1) << l2_span_bits;
+                const uint64_t l3_span = uint64_t(1) << l3_span_bits;
+                std::atomic<uint64_t> * marker;
+                uint64_t step;
+                if ((r & (l2_span - 1)) == 0 && end - r >= l2_span) {
+                    marker = &_l1_cover[l1_idx(r)];
+                    step = l2_span;
+                }
+                else if ((r & (l3_span - 1)) == 0 && end - r >= l3_span) {
+                    L2Table * l2 = get_or_create(_l1[l1_idx(r)], value != 0);
+                    marker = (nullptr == l2) ? nullptr : &(l2->cover[l2_idx(r)]);
+                    step = l3_span;
+                }
+                else {
+                    L3Table * l3 = get_l3(r, value != 0);
+                    marker = (nullptr == l3) ? nullptr : &(l3->cover[l3_idx(r)]);
+                    step = region_size;
+                }
+                if (nullptr != marker) {
+                    if (value != 0) {
+                        marker->store(value, std::memory_order_release);
+                    }
+                    else {
+                        // only remove the own marker
+                        uint64_t expected = begin;
+                        marker->compare_exchange_strong(expected, 0, std::memory_order_acq_rel);
+                    }
+                }
+                r += step;
+            }
+        }
+
+        static inline size_t l1_idx(uint64_t addr) {
+            return static_cast<size_t>((addr >> (region_bits + 2 * table_bits)) & (l1_size - 1));
+        }
+        static inline size_t l2_idx(uint64_t addr) {
+            return static_cast<size_t>((addr >> (region_bits + table_bits)) & (table_size - 1));
+        }
+        static inline size_t l3_idx(uint64_t addr) {
+            return static_cast<size_t>((addr >> region_bits) & (table_size - 1));
+        }
+
+        /** Loads the entry of a table. If create is set, a missing entry is allocated */
+        template<typename Entry>
+        static Entry * get_or_create(std::atomic<Entry*> & slot, bool create) {
+            Entry * e = slot.load(std::memory_order_acquire);
+            if (nullptr == e && create) {
+                Entry * fresh = new Entry;
+                if (slot.compare_exchange_strong(e, fresh, std::memory_order_acq_rel)) {
+                    e = fresh;
+                }
+                else {
+                    // another thread was faster
+                    delete fresh;
+                }
+            }
+            return e;
+        }
+
+        L3Table * get_l3(uint64_t addr, bool create) const {
+            L2Table * l2 = get_or_create(_l1[l1_idx(addr)], create);
+            if (nullptr == l2) return nullptr;
+            return get_or_create(l2->entries[l2_idx(addr)], create);
+        }
+
+        /** Returns the region of addr. If create is set, missing tables are allocated */
+        Region * get_region(uint64_t addr, bool create) const {
+            L3Table * l3 = get_l3(addr, create);
+            if (nullptr == l3) return nullptr;
+            return get_or_create(l3->entries[l3_idx(addr)], create);
+        }
+    };
+} // namespace detector
@@ -0,0 +1,167 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include <detector/detector_if.h>
+
+namespace detector {
+    /**
+     * Concurrent map from thread ids to per-thread detector state.
+     *
+     * Thread ids are located using a lazily populated three-level radix
+     * table, hence the memory only grows with the range of used ids.
+     * Lookups, insertions and removals never lock and take constant time.
+     * The registry does not own the stored states.
+     *
+     * \note Thread ids have to fit into \c tid_bits bits
+     */
+    template<
+        /// type of the per-thread state
+        typename T,
+        /// number of significant bits of a thread id
+        unsigned tid_bits = 32>
+    class ThreadRegistry {
+    public:
+        using self_t = ThreadRegistry<T, tid_bits>;
+
+    private:
+        static constexpr unsigned leaf_bits = 12;
+        static constexpr unsigned table_bits = 12;
+        static constexpr unsigned l1_bits = tid_bits - leaf_bits - table_bits;
+        static constexpr size_t   leaf_size = size_t(1) << leaf_bits;
+        static constexpr size_t   table_size = size_t(1) << table_bits;
+        static constexpr size_t   l1_size = size_t(1) << l1_bits;
+
+        static_assert(tid_bits > leaf_bits + table_bits && tid_bits <= 40,
+            "unsupported thread id width");
+
+        template<typename Entry, size_t N>
+        struct Table {
+            std::atomic<Entry*> entries[N];
+
+            Table() {
+                for (auto & e : entries) e.store(nullptr, std::memory_order_relaxed);
+            }
+        };
+        using Leaf = Table<T, leaf_size>;
+        using L2Table = Table<Leaf, table_size>;
+
+        std::atomic<L2Table*> * _l1;
+
+    public:
+        ThreadRegistry()
+            : _l1(new std::atomic<L2Table*>[l1_size])
+        {
+            for (size_t i = 0; i < l1_size; ++i)
+                _l1[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        ThreadRegistry(const self_t &) = delete;
+        self_t & operator=(const self_t &) = delete;
+
+        ~ThreadRegistry() {
+            clear();
+            delete[] _l1;
+        }
+
+        /**
+         * Registers the state of thread tid.
+         * \return the previously registered state or nullptr
+         */
+        T * insert(tid_t tid, T * state) {
+            return entry(tid, true)->exchange(state, std::memory_order_acq_rel);
+        }
+
+        /**
+         * Removes thread tid.
+         * \return the removed state or nullptr if tid was not registered
+         */
+        T * erase(tid_t tid) {
+            std::atomic<T*> * e = entry(tid, false);
+            return (nullptr != e) ? e->exchange(nullptr, std::memory_order_acq_rel) : nullptr;
+        }
+
+        /** Returns the state of thread tid or nullptr */
+        T * find(tid_t tid) const {
+            std::atomic<T*> * e = entry(tid, false);
+            return (nullptr != e) ? e->load(std::memory_order_acquire) : nullptr;
+        }
+
+        /**
+         * Calls f(tid, state) for each registered thread.
+         * Concurrent modifications might or might not be observed.
+         */
+        template<typename F>
+        void for_each(F && f) const {
+            for (size_t i = 0; i < l1_size; ++i) {
+                L2Table * l2 = _l1[i].load(std::memory_order_acquire);
+                if (nullptr == l2) continue;
+                for (size_t j = 0; j < table_size; ++j) {
+                    Leaf * leaf = l2->entries[j].load(std::memory_order_acquire);
+                    if (nullptr == leaf) continue;
+                    for (size_t k = 0; k < leaf_size; ++k) {
+                        T * state = leaf->entries[k].load(std::memory_order_acquire);
+                        if (nullptr != state) {
+                            f(static_cast<tid_t>((((i << table_bits) | j) << leaf_bits) | k), state);
+                        }
+                    }
+                }
+            }
+        }
+
+        /**
+         * Removes all threads and frees the index memory.
+         * \warning not thread-safe
+         */
+        void clear() {
+            for (size_t i = 0; i < l1_size; ++i) {
+                L2Table * l2 = _l1[i].exchange(nullptr, std::memory_order_relaxed);
+                if (nullptr == l2) continue;
+                for (auto & e : l2->entries) {
+                    delete e.load(std::memory_order_relaxed);
+                }
+                delete l2;
+            }
+        }
+
+    private:
+        /** Returns the entry of tid. If create is not set, missing tables yield nullptr */
+        std::atomic<T*> * entry(tid_t tid, bool create) const {
+            const uint64_t id = static_cast<uint64_t>(tid);
+            L2Table * l2 = get_or_create(_l1[(id >> (leaf_bits + table_bits)) & (l1_size - 1)], create);
+            if (nullptr == l2) return nullptr;
+            Leaf * leaf = get_or_create(l2->entries[(id >> leaf_bits) & (table_size - 1)], create);
+            if (nullptr == leaf) return nullptr;
+            return &(leaf->entries[id & (leaf_size - 1)]);
+        }
+
+        /** Loads the entry of a table. If create is set, a missing entry is allocated */
+        template<typename Entry>
+        static Entry * get_or_create(std::atomic<Entry*> & slot, bool create) {
+            Entry * e = slot.load(std::memory_order_acquire);
+            if (nullptr == e && create) {
+                Entry * fresh = new Entry;
+                if (slot.compare_exchange_strong(e, fresh, std::memory_order_acq_rel)) {
+                    e = fresh;
+                }
+                else {
+                    // another thread was faster
+                    delete fresh;
+                }
+            }
+            return e;
+        }
+    };
+} // namespace detector
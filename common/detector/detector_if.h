@@ -10,6 +10,7 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <functional>
@@ -21,6 +22,99 @@ namespace detector {
 
     static constexpr int max_stack_size = 16;
 
+    /**
+     * Parent of a fork or join if the creating or joining thread is not known.
+     * The edge is drawn conservatively between the child and all running threads then.
+     */
+    static constexpr tid_t unknown_thread = 0;
+
+    /**
+     * Upper limit of process address space according to
+     * https://docs.microsoft.com/en-us/windows-hardware/drivers/gettingstarted/virtual-address-spaces
+     * Accesses above this limit are not analyzed.
+     */
+    static constexpr uint64_t proc_addr_limit = 0x7FFFFFFFFFFull;
+
+    /**
+     * Translates pc indices to program counters.
+     * The table is filled by the instrumentation. Each distinct pc of a memory
+     * accessing instruction gets an index which is stored in \ref MemAccess.
+     * Entries are stored in chunks which are never moved, hence lookups are lock-free.
+     */
+    struct PcTable {
+        static constexpr unsigned chunk_bits = 16;
+        static constexpr size_t   chunk_size = size_t(1) << chunk_bits;
+        /// indices are stored as sign-extended 32-bit immediates, hence use 31 bits
+        static constexpr size_t   max_chunks = size_t(1) << (31 - chunk_bits);
+
+        void ** chunks[max_chunks];
+
+        inline void * lookup(uint64_t idx) const {
+            return chunks[idx >> chunk_bits][idx & (chunk_size - 1)];
+        }
+    };
+
+    /**
+     * A single memory access as recorded by the instrumentation (16 bytes).
+     * The upper 16 bits of the address hold the access size and flags, as
+     * application addresses never use them. The pc is stored as index into
+     * a \ref PcTable.
+     * The layout is shared with the inline instrumentation, hence do not change it.
+     */
+    struct MemAccess {
+        /// position of the size / flags word in addr_info
+        static constexpr unsigned meta_shift = 48;
+        static constexpr uint64_t addr_mask = (uint64_t(1) << meta_shift) - 1;
+        /// bits 0-11 of the meta word: exact size, or log2 of the size if large
+        static constexpr unsigned size_bits = 12;
+        /// largest size which is stored exactly, larger ones are stored as log2
+        static constexpr size_t   max_exact_size = (size_t(1) << size_bits) - 1;
+        /// flags (bits 8-15 of the meta word)
+        static constexpr uint8_t  large_flag = 0x10;
+        /// function entry / exit marker, pc is a raw pc then
+        static constexpr uint8_t  marker_flag = 0x40;
+        static constexpr uint8_t  write_flag = 0x80;
+
+        /// address (bits 0-47), size (bits 48-59), flags (bits 60-63)
+        uint64_t addr_info;
+        /// index into pc table (or raw pc for markers)
+        uint64_t pc;
+
+        /** Returns log2 of size, rounded up to the next power of two */
+        static inline uint8_t size_log2(size_t size) {
+            uint8_t log = 0;
+            while (log < 63 && (size_t(1) << log) < size) ++log;
+            return log;
+        }
+
+        /** Returns the size / flags word of an access */
+        static inline uint16_t encode_meta(size_t size, bool write, bool marker = false) {
+            const bool large = size > max_exact_size;
+            const uint16_t flags = (large ? large_flag : 0)
+                | (write ? write_flag : 0)
+                | (marker ? marker_flag : 0);
+            const uint16_t sz = large ? size_log2(size) : static_cast<uint16_t>(size);
+            return static_cast<uint16_t>((flags << 8) | sz);
+        }
+
+        /** Creates an access record (mainly for testing) */
+        static inline MemAccess make(void* addr, uint64_t pc, size_t size, bool write) {
+            return MemAccess{
+                ((uint64_t)addr & addr_mask) | ((uint64_t)encode_meta(size, write) << meta_shift),
+                pc };
+        }
+
+        inline uint8_t  flags() const { return static_cast<uint8_t>(addr_info >> (meta_shift + 8)); }
+        inline uint64_t addr() const { return addr_info & addr_mask; }
+        inline size_t   size() const {
+            const size_t sz = static_cast<size_t>((addr_info >> meta_shift) & max_exact_size);
+            return (flags() & large_flag) ? (size_t(1) << sz) : sz;
+        }
+        inline bool     write() const { return (flags() & write_flag) != 0; }
+        inline bool     is_marker() const { return (flags() & marker_flag) != 0; }
+    };
+    static_assert(sizeof(MemAccess) == 16, "MemAccess has to be packed into 16 bytes");
+
     /** A single memory access */
     struct AccessEntry {
         unsigned thread_id;
@@ -40,6 +134,23 @@ namespace detector {
 
     using Callback = void(*)(const detector::Race*);
 
+    /**
+     * Losses and backpressure of detectors which analyze the events
+     * in a different process. In-process detectors report zeros.
+     */
+    struct DeliveryStats {
+        /// events which were not analyzed, as the event queue was full
+        uint64_t dropped_events{ 0 };
+        /// memory accesses in dropped events
+        uint64_t dropped_accesses{ 0 };
+        /// events which were written to the overflow queue
+        uint64_t spilled_events{ 0 };
+        /// number of times a thread waited for the analysis
+        uint64_t blocked{ 0 };
+        /// max. fill level of an event queue in percent
+        unsigned queue_high_water{ 0 };
+    };
+
     /**
     * Takes command line arguments and a callback to process a data-race.
     * Type of callback is (const detector::Race*) -> void
@@ -109,6 +220,29 @@ namespace detector {
         size_t   size
     );
 
+    /**
+     * Log a batch of memory accesses of a single thread.
+     * Accesses inside [excl_beg, excl_end) (e.g. the stack of the calling thread)
+     * and above \c proc_addr_limit are skipped.
+     * The pc of each access is decoded using pc_table. If no table is given,
+     * \ref MemAccess::pc is treated as raw pc.
+     * \return number of accesses which have been analyzed
+     */
+    size_t access_batch(
+        /// ptr to thread-local storage of calling thread
+        tls_t            tls,
+        /// begin of the access buffer
+        const MemAccess* refs,
+        /// number of accesses in buffer
+        size_t           num_refs,
+        /// begin of excluded address range
+        uint64_t         excl_beg,
+        /// end of excluded address range
+        uint64_t         excl_end,
+        /// table to translate pc indices
+        const PcTable *  pc_table = nullptr
+    );
+
     /** Log a memory allocation */
     void allocate(
         /// ptr to thread-local storage of calling thread
@@ -129,7 +263,13 @@ namespace detector {
         void* addr
     );
 
-    /** Log a thread-creation event */
+    /**
+     * Log a thread-creation event.
+     * The child happens after the events of the parent so far.
+     * If the parent is \ref unknown_thread, it happens after the events
+     * of all running threads. If the parent is not known to the detector,
+     * no edge is drawn.
+     */
     void fork(
         /// id of parent thread
         tid_t parent,
@@ -139,7 +279,11 @@ namespace detector {
         tls_t * tls
     );
 
-    /** Log a thread join event */
+    /**
+     * Log a thread join event.
+     * The later events of the parent happen after all events of the child.
+     * If the parent is \ref unknown_thread, this applies to all running threads.
+     */
     void join(
         /// id of parent thread
         tid_t parent,
@@ -152,6 +296,9 @@ namespace detector {
     /** Log a thread exit event (detached thread) */
     void finish(tls_t tls, tid_t thread_id);
 
+    /** Return the event delivery statistics, valid until finalize */
+    DeliveryStats delivery_stats();
+
     /** Return name of detector */
     std::string name();
     /** Return version of detector */
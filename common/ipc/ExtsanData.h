@@ -13,9 +13,12 @@
 #undef min
 #undef max
 
-#include <array>
+#include <atomic>
+#include <cstdint>
 
-#include "ringbuffer.hpp"
+#include <detector/detector_if.h>
+#include "RecordQueue.h"
+#include "spinlock.h"
 
 namespace ipc {
 	namespace event {
@@ -30,60 +33,215 @@ namespace ipc {
 			FORK,
 			JOIN,
 			DETACH,
-			FINISH
+			FINISH,
+			/// batch of memory accesses with a common callstack
+			ACCESSES,
+			HAPPENS_BEFORE,
+			HAPPENS_AFTER,
+			/// definition of an interned callstack
+			STACK
 		};
 
-		struct MemAccess {
+		/**
+		* Each record starts with a header, followed by the payload of its type.
+		* Records are multiples of 8 bytes. As the type is never NONE,
+		* the first word of a record is never zero.
+		*/
+		struct Header {
+			Type     type;
+			uint8_t  reserved;
+			/// size of the record in words, including the header
+			uint16_t words;
 			uint32_t thread_id;
-			uint32_t stacksize;
-			uint64_t addr;
-			std::array<uint64_t, 16> callstack;
 		};
 
+		/**
+		* Payload of ACCESSES records: count accesses which share the
+		* callstack stack_id, see \ref StackDef.
+		* The pc of each access is a raw pc.
+		*/
+		struct Accesses {
+			uint32_t stack_id;
+			uint32_t count;
+
+			inline detector::MemAccess * accesses() {
+				return reinterpret_cast<detector::MemAccess*>(this + 1);
+			}
+			inline const detector::MemAccess * accesses() const {
+				return reinterpret_cast<const detector::MemAccess*>(this + 1);
+			}
+		};
+
+		/**
+		* Payload of STACK records. Callstacks are interned per thread:
+		* stack id is the stack parent, extended by the frame pc.
+		* Id 0 is the empty stack. A stack is defined before its first use
+		* and ids are only valid in the thread of the record. An id might be
+		* redefined, which replaces the previous definition.
+		*/
+		struct StackDef {
+			uint32_t id;
+			uint32_t parent;
+			uint64_t pc;
+		};
+
+		/**
+		* Upper bound of stack ids. This bounds the memory of the stack
+		* tables on both sides to about 1-5 MiB per thread.
+		*/
+		static constexpr uint32_t max_stack_ids = 1 << 16;
+
 		struct Mutex {
-			unsigned long thread_id;
 			uint64_t addr;
-			int recursive;
-			bool write;
-			bool acquire;
+			int32_t  recursive;
+			bool     write;
+			bool     acquire;
+		};
+
+		/// payload of HAPPENS_BEFORE and HAPPENS_AFTER records
+		struct Sync {
+			uint64_t identifier;
 		};
 
 		struct Allocation {
-			unsigned long thread_id;
 			uint64_t pc;
 			uint64_t addr;
-			size_t size;
+			uint64_t size;
 		};
 
+		/**
+		* Payload of FORK and JOIN records, which are sent by the child.
+		* The parent side of the edge is sent as HAPPENS_BEFORE (fork) or
+		* HAPPENS_AFTER (join) of \ref sync_id via the control queue of the
+		* parent, see \ref ipc::Channel.
+		*/
 		struct ForkJoin {
-			unsigned long parent;
-			unsigned long child;
-		};
+			uint64_t parent;
+			uint64_t child;
+			/// number of control records with the parent side of this edge
+			uint64_t edges;
 
-		struct DetachFinish {
-			unsigned long thread_id;
+			/// identifier of the happens-before edge between parent and child
+			inline uint64_t sync_id() const {
+				return (parent << 32) | (child & 0xFFFFFFFF);
+			}
 		};
 
-		struct BufferEntry {
-			Type type{ Type::NONE };
-			char buffer[sizeof(MemAccess)];
-		};
+		static_assert(sizeof(Header) == 8, "record header has to be a single word");
 
-		template<typename T, class... Args>
-		struct GenericEntry {
-			Type type{ Type::NONE };
-			T buffer;
-		
-			GenericEntry(Type t, Args&&... args)
-				: type(t), buffer(std::forward<Args>(args)...) { }
-		};
+		/** Number of words of a record with payload T and extra bytes */
+		template<typename T>
+		constexpr size_t record_words(size_t extra = 0) {
+			return (sizeof(Header) + sizeof(T) + extra + 7) / 8;
+		}
+
+		/** Returns the payload of a record */
+		template<typename T>
+		inline T * payload(Header * hdr) {
+			return reinterpret_cast<T*>(hdr + 1);
+		}
+		template<typename T>
+		inline const T * payload(const Header * hdr) {
+			return reinterpret_cast<const T*>(hdr + 1);
+		}
 	}
 
-	using queue_t = ipc::Ringbuffer<ipc::event::BufferEntry, 1 << 20, false, 64>;
+	/// queue of one producing thread (8 MiB)
+	using queue_t = ipc::RecordQueue<(1 << 20)>;
+	/// overflow queue of one producing thread (32 MiB)
+	using spill_queue_t = ipc::RecordQueue<(1 << 22)>;
+
+	/// behavior of producers if their queue is full
+	enum class OverflowPolicy : uint32_t {
+		/// wait until the consumer catches up
+		BLOCK,
+		/// drop the event
+		DROP,
+		/// write the event to the overflow queue, drop if this is full as well
+		SPILL
+	};
+
+	/**
+	* Edge of a fork / join which is sent on behalf of a thread by another
+	* thread. It is applied once the consumer processed \c position records
+	* of the channel, i.e. right after the records which the thread committed
+	* before the edge was sent.
+	*/
+	struct ControlRecord {
+		uint64_t    position;
+		uint64_t    identifier;
+		uint32_t    thread_id;
+		/// HAPPENS_BEFORE or HAPPENS_AFTER
+		event::Type type;
+	};
+
+	/**
+	* A queue and its producer. Each application thread claims a queue
+	* exclusively, hence producers do not synchronize. If all queues are
+	* taken, threads share the last queue and synchronize using \c mxspin.
+	* Other threads only write to the small control queue of a channel.
+	*/
+	struct Channel {
+		static constexpr uint32_t control_slots = 64;
+
+		/// id of the producing thread, 0 if free
+		std::atomic<uint64_t> owner{ 0 };
+		/// only locked if the channel is shared
+		ipc::spinlock         mxspin;
+		/**
+		* producer only: records are written to the overflow queue.
+		* The producer only switches back once the overflow queue is empty
+		* and the consumer only reads it if the queue is empty, hence the
+		* order of the records is preserved.
+		*/
+		bool                  spilling{ false };
+
+		// statistics, written by the producer
+		std::atomic<uint64_t> dropped_records{ 0 };
+		/// memory accesses in dropped records
+		std::atomic<uint64_t> dropped_accesses{ 0 };
+		std::atomic<uint64_t> spilled_records{ 0 };
+		/// number of times the producer waited for free space
+		std::atomic<uint64_t> blocked{ 0 };
+		/// max. number of pending words, written by the consumer
+		std::atomic<uint64_t> high_water{ 0 };
+
+		/// number of committed records (including spilled ones), written by the producer
+		alignas(64) std::atomic<uint64_t> committed{ 0 };
+
+		/// serializes the producers of the control queue
+		alignas(64) ipc::spinlock control_mx;
+		std::atomic<uint32_t> control_tail{ 0 };
+		/// written by the consumer
+		std::atomic<uint32_t> control_head{ 0 };
+		ControlRecord         control[control_slots];
+
+		queue_t               queue;
+	};
 
 	struct QueueMetadata {
-		static constexpr unsigned num_queues{ 2 };
-		unsigned next_queue{ 0 };
-		queue_t queues[num_queues];
+		static constexpr unsigned max_queues{ 32 };
+		/// number of used queues, set by the consumer before the producer attaches
+		uint32_t num_queues{ max_queues };
+		OverflowPolicy overflow{ OverflowPolicy::DROP };
+		/// absolute path of the backing file of the \ref SpillArea (required to attach on POSIX)
+		char spill_file[256]{ 0 };
+
+		/// number of consumers which are about to sleep
+		alignas(64) std::atomic<uint32_t> sleeping{ 0 };
+		/// true if a consumer is notified but not yet woken up
+		std::atomic<bool>     wake_pending{ false };
+
+		Channel channels[max_queues];
+
+		/// the last used queue is shared by all threads without a queue
+		unsigned shared_queue() const {
+			return num_queues - 1;
+		}
+	};
+
+	/// overflow queues of the channels, stored in a memory-mapped file
+	struct SpillArea {
+		spill_queue_t queues[QueueMetadata::max_queues];
 	};
-}
\ No newline at end of file
+}
@@ -0,0 +1,127 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace ipc {
+
+	/**
+	* Lock-free single-producer single-consumer queue of variable-length
+	* records, suitable for shared memory.
+	*
+	* Records are stored as contiguous runs of 64-bit words, hence the
+	* producer can construct them in place (\c reserve, \c commit) and the
+	* consumer can read them without copying (\c front, \c pop).
+	* Records never wrap around. If a record does not fit before the end
+	* of the buffer, the rest of the buffer is skipped using a wrap marker.
+	* \note The first word of each record must not be zero (\c wrap_marker)
+	*/
+	template<
+		/// capacity in words, must be a power of 2
+		size_t capacity,
+		size_t cacheline_size = 64>
+	class RecordQueue {
+	public:
+		using word_t = uint64_t;
+		static constexpr size_t slots = capacity;
+		/// marks the end of the used part of the buffer
+		static constexpr word_t wrap_marker = 0;
+
+	private:
+		static constexpr size_t mask = capacity - 1;
+
+		static_assert(capacity != 0 && (capacity & mask) == 0, "capacity is not a power of 2");
+
+		/// written by producer, position after the last committed record
+		alignas(cacheline_size) std::atomic<uint64_t> _head{ 0 };
+		/// producer-only: begin of the reserved record and last known tail
+		uint64_t _reserved{ 0 };
+		uint64_t _tail_cache{ 0 };
+
+		/// written by consumer, position of the next record to read
+		alignas(cacheline_size) std::atomic<uint64_t> _tail{ 0 };
+
+		alignas(cacheline_size) word_t _data[capacity];
+
+	public:
+		/// largest record which can be stored
+		static constexpr size_t max_record = capacity / 2;
+
+		// ----- producer -----
+
+		/**
+		* Reserves space for a record of \c words words.
+		* \return pointer to the record or nullptr if the queue is full
+		*/
+		word_t * reserve(size_t words) {
+			uint64_t head = _head.load(std::memory_order_relaxed);
+			const size_t contiguous = capacity - (head & mask);
+			const size_t needed = (words > contiguous) ? words + contiguous : words;
+
+			if (capacity - (head - _tail_cache) < needed) {
+				_tail_cache = _tail.load(std::memory_order_acquire);
+				if (capacity - (head - _tail_cache) < needed)
+					return nullptr;
+			}
+			if (words > contiguous) {
+				// skip the rest of the buffer, published by commit
+				_data[head & mask] = wrap_marker;
+				head += contiguous;
+			}
+			_reserved = head;
+			return &(_data[head & mask]);
+		}
+
+		/** Publishes the record which was reserved last, using its final size */
+		void commit(size_t words) {
+			_head.store(_reserved + words, std::memory_order_release);
+		}
+
+		/** Number of words which can be reserved at most (approximation) */
+		size_t write_available() const {
+			return capacity - (_head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_acquire));
+		}
+
+		// ----- consumer -----
+
+		/**
+		* Returns the next record or nullptr if the queue is empty.
+		* The length of the record is encoded in the record itself.
+		*/
+		const word_t * front() {
+			uint64_t tail = _tail.load(std::memory_order_relaxed);
+			if (tail == _head.load(std::memory_order_acquire))
+				return nullptr;
+
+			if (_data[tail & mask] == wrap_marker) {
+				tail += capacity - (tail & mask);
+				_tail.store(tail, std::memory_order_release);
+				if (tail == _head.load(std::memory_order_acquire))
+					return nullptr;
+			}
+			return &(_data[tail & mask]);
+		}
+
+		/** Releases the record returned by \c front */
+		void pop(size_t words) {
+			_tail.store(_tail.load(std::memory_order_relaxed) + words, std::memory_order_release);
+		}
+
+		/** Number of words which are not yet consumed */
+		size_t read_available() const {
+			return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_relaxed);
+		}
+	};
+
+} // namespace ipc
@@ -83,8 +83,8 @@ namespace ipc {
 
 		/// Message IDs
 		SMDataID id;
-		/// Raw data buffer
-		char buffer[BUFFER_SIZE];
+		/// Raw data buffer, aligned as objects are placed in it
+		alignas(16) char buffer[BUFFER_SIZE];
 	};
 
 	struct ClientCB {
@@ -10,22 +10,40 @@
  * SPDX-License-Identifier: MIT
  */
 
+#ifdef _WIN32
 #include <windows.h>
 #include <stdio.h>
 #include <conio.h>
 #include <tchar.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <atomic>
+#include <string>
+#include <new>
+#endif
 
+#include <chrono>
 #include <stdexcept>
 
 namespace ipc {
+#ifdef _WIN32
 	/**
 	* Provides a shared memory abstraction for two participating units
 	* To synchronize accesses, \cnotify() and \cwait() can be used.
 	* Internally this is mapped to two windows events,
 	* one for sending and one for receiving.
+	* If a file is passed to the creator, the memory is backed by
+	* this (temporary) file instead of the paging file.
 	*/
 	template<
-		/// Type of shared memory. Object is constructed in place
+		/// Type of shared memory. Object is constructed in place by the creator
 		typename T = byte,
 		/// If true, no exceptions are used. To check liveness, use \cvalid()
 		bool nothrow = false>
@@ -34,18 +52,30 @@ namespace ipc {
 		HANDLE _event_in;
 		HANDLE _event_out;
 		HANDLE _hMapFile;
+		HANDLE _hFile{ INVALID_HANDLE_VALUE };
 		T*     _buffer{ nullptr };
 		public:
-			SharedMemory(const char * name, bool create = false)
+			SharedMemory(const char * name, bool create = false, const char * file = nullptr)
 				: _creator(create)
 			{
 				if (_creator) {
+					if (nullptr != file) {
+						// file is removed as soon as the creator closes it
+						_hFile = CreateFile(file, GENERIC_READ | GENERIC_WRITE,
+							FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS,
+							FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+						if (INVALID_HANDLE_VALUE == _hFile) {
+							_hMapFile = nullptr;
+							if (nothrow) return;
+							throw std::runtime_error("error creating backing file");
+						}
+					}
 					_hMapFile = CreateFileMapping(
-						INVALID_HANDLE_VALUE,    // use paging file
+						_hFile,                  // use paging file if no file is given
 						NULL,                    // default security
 						PAGE_READWRITE,          // read/write access
-						0,                       // maximum object size (high-order DWORD)
-						sizeof(T),				 // maximum object size (low-order DWORD)
+						(DWORD)((uint64_t)sizeof(T) >> 32), // maximum object size (high-order DWORD)
+						(DWORD)sizeof(T),        // maximum object size (low-order DWORD)
 						name);                   // name of mapping object
 				}
 				else {
@@ -83,7 +113,8 @@ namespace ipc {
 					throw std::runtime_error("error creating notification event");
 				}
 
-				new (_buffer) T;
+				// the object is owned by the creator, attaching units must not reset it
+				if (_creator) new (_buffer) T;
 			}
 
 			~SharedMemory() {
@@ -91,10 +122,11 @@ namespace ipc {
 				if (nullptr != _event_out) CloseHandle(_event_out);
 
 				// destruct object in buffer;
-				if (nullptr != _buffer) _buffer->~T();
+				if (_creator && nullptr != _buffer) _buffer->~T();
 
 				if (nullptr != _buffer) UnmapViewOfFile(_buffer);
 				if (nullptr != _hMapFile) CloseHandle(_hMapFile);
+				if (INVALID_HANDLE_VALUE != _hFile) CloseHandle(_hFile);
 			}
 
 			T* get() {
@@ -130,5 +162,179 @@ namespace ipc {
 				}
 			}
 	};
+#else
+	using byte = unsigned char;
+
+	/**
+	* Provides a shared memory abstraction for two participating units
+	* To synchronize accesses, \cnotify() and \cwait() can be used.
+	* The memory is a POSIX shared memory object. The two events
+	* (one for sending and one for receiving) are futex words which
+	* are placed in front of the object. Large objects are backed
+	* by transparent huge pages if the system supports it.
+	* If a file is passed, the memory is backed by this file instead.
+	* As the file is identified by its path, the path has to be passed
+	* by all units.
+	*/
+	template<
+		/// Type of shared memory. Object is constructed in place by the creator
+		typename T = byte,
+		/// If true, no exceptions are used. To check liveness, use \cvalid()
+		bool nothrow = false>
+		class SharedMemory {
+		/// auto-reset events, shared by both units
+		struct Header {
+			std::atomic<uint32_t> event_in;
+			std::atomic<uint32_t> event_out;
+		};
+
+		static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+			"futex words must be plain 32 bit integers");
+
+		static constexpr size_t huge_page_size = size_t(1) << 21;
+		/// offset of the object, keeps the events on a separate cache line
+		static constexpr size_t data_offset = (alignof(T) > 64) ? alignof(T) : 64;
+
+		bool        _creator;
+		std::string _name;
+		std::string _file;
+		int         _fd{ -1 };
+		size_t      _size{ 0 };
+		void*       _mapping{ nullptr };
+		Header*     _header{ nullptr };
+		T*          _buffer{ nullptr };
+		public:
+			SharedMemory(const char * name, bool create = false, const char * file = nullptr)
+				: _creator(create)
+			{
+				// object names start with a slash and contain no further slashes
+				_name = "/";
+				for (const char * c = name; *c != '\0'; ++c) {
+					_name += (*c == '/' || *c == '\\') ? '_' : *c;
+				}
+				if (nullptr != file) {
+					_file = file;
+				}
+
+				_size = mapping_size();
+				if (_creator) {
+					_fd = _file.empty()
+						? shm_open(_name.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)
+						: open(_file.c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+					if (_fd != -1 && ftruncate(_fd, _size) != 0) {
+						close(_fd);
+						_fd = -1;
+					}
+				}
+				else {
+					struct stat st;
+					_fd = _file.empty()
+						? shm_open(_name.c_str(), O_RDWR, 0)
+						: open(_file.c_str(), O_RDWR);
+					if (_fd != -1 && (fstat(_fd, &st) != 0 || (size_t)st.st_size < _size)) {
+						// object not (yet) fully created
+						close(_fd);
+						_fd = -1;
+					}
+				}
+
+				if (-1 == _fd) {
+					if (nothrow) return;
+					throw std::runtime_error("error creating/attaching file mapping");
+				}
+
+				void * mapping = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+				if (MAP_FAILED == mapping) {
+					if (nothrow) return;
+					throw std::runtime_error("error creating file view");
+				}
+				_mapping = mapping;
+#ifdef MADV_HUGEPAGE
+				if (_size >= huge_page_size) {
+					// only a hint, fails if huge pages are disabled for shared memory
+					madvise(_mapping, _size, MADV_HUGEPAGE);
+				}
+#endif
+				// a fresh object is zero filled, hence the events are not signaled
+				_header = reinterpret_cast<Header*>(_mapping);
+				_buffer = reinterpret_cast<T*>(reinterpret_cast<byte*>(_mapping) + data_offset);
+
+				// the object is owned by the creator, attaching units must not reset it
+				if (_creator) new (_buffer) T;
+			}
+
+			~SharedMemory() {
+				// destruct object in buffer;
+				if (_creator && nullptr != _buffer) _buffer->~T();
+
+				if (nullptr != _mapping) munmap(_mapping, _size);
+				if (-1 != _fd) close(_fd);
+				// the memory stays valid until all units have unmapped it
+				if (_creator && -1 != _fd) {
+					if (_file.empty())
+						shm_unlink(_name.c_str());
+					else
+						unlink(_file.c_str());
+				}
+			}
+
+			T* get() {
+				return _buffer;
+			}
+
+			void notify() const {
+				std::atomic<uint32_t> & evt = _creator ? _header->event_in : _header->event_out;
+				// a waiter only sleeps while the event is not signaled
+				if (evt.exchange(1, std::memory_order_release) == 0) {
+					if (futex(&evt, FUTEX_WAKE, 1, nullptr) == -1) {
+						if (nothrow) return;
+						throw std::runtime_error("error in FUTEX_WAKE");
+					}
+				}
+			}
+
+			template<typename duration = std::chrono::milliseconds>
+			bool wait(const duration & d = std::chrono::milliseconds(100)) const {
+				using clock = std::chrono::steady_clock;
+
+				std::atomic<uint32_t> & evt = _creator ? _header->event_out : _header->event_in;
+				const auto deadline = clock::now() + d;
+				while (true) {
+					// Event fired
+					if (evt.exchange(0, std::memory_order_acquire) == 1)
+						return true;
+
+					const auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - clock::now());
+					if (remaining.count() <= 0)
+						return false;
+
+					struct timespec ts;
+					ts.tv_sec = static_cast<time_t>(remaining.count() / 1000000000);
+					ts.tv_nsec = static_cast<long>(remaining.count() % 1000000000);
+					if (futex(&evt, FUTEX_WAIT, 0, &ts) == -1
+						&& errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+					{
+						// An error occurred
+						if (!nothrow)
+							throw std::runtime_error("FUTEX_WAIT failed");
+						return false;
+					}
+				}
+			}
+
+		private:
+			/** Size of header and object, large mappings are rounded to huge pages */
+			static size_t mapping_size() {
+				const size_t size = data_offset + sizeof(T);
+				const size_t page = (size >= huge_page_size) ? huge_page_size : (size_t)sysconf(_SC_PAGESIZE);
+				return (size + page - 1) & ~(page - 1);
+			}
+
+			/** Futex operation on a word which might be shared across processes */
+			static long futex(std::atomic<uint32_t> * word, int op, uint32_t val, const struct timespec * timeout) {
+				return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, val, timeout, nullptr, 0);
+			}
+	};
+#endif
 
 } // namespace ipc
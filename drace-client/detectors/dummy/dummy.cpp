@@ -42,6 +42,23 @@ void detector::read(tls_t tls, void* pc, void* addr, size_t size) { }
 
 void detector::write(tls_t tls, void* pc, void* addr, size_t size) { }
 
+size_t detector::access_batch(
+    tls_t tls,
+    const MemAccess* refs,
+    size_t num_refs,
+    uint64_t excl_beg,
+    uint64_t excl_end,
+    const PcTable* pc_table)
+{
+    size_t processed = 0;
+    for (const MemAccess * ref = refs; ref != refs + num_refs; ++ref) {
+        uint64_t addr = ref->addr();
+        if ((addr < excl_beg || addr >= excl_end) && addr <= proc_addr_limit)
+            ++processed;
+    }
+    return processed;
+}
+
 void detector::allocate(tls_t tls, void* pc, void* addr, size_t size) { }
 
 void detector::deallocate(tls_t tls, void* addr) { }
@@ -52,6 +69,10 @@ void detector::fork(tid_t parent, tid_t child, tls_t * tls) {
 
 void detector::join(tid_t parent, tid_t child) { }
 
+detector::DeliveryStats detector::delivery_stats() {
+    return DeliveryStats();
+}
+
 std::string detector::name() {
     return std::string("Dummy");
 }
@@ -12,15 +12,20 @@
 #include <string>
 #include <memory>
 #include <algorithm>
+#include <vector>
 #include <thread>
 #include <mutex>
 #include <iostream>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
 
 #include <detector/detector_if.h>
+#include <detector/AllocationIndex.h>
+#include <detector/ThreadRegistry.h>
 
 #include "ipc/ExtsanData.h"
 #include "ipc/SharedMemory.h"
-#include "ipc/ringbuffer.hpp"
 #include "ipc/spinlock.h"
 
 #undef min
@@ -31,45 +36,428 @@ namespace detector {
 	namespace extsan {
 
 		using shm_t = ipc::SharedMemory<ipc::QueueMetadata, true>;
+		using spill_t = ipc::SharedMemory<ipc::SpillArea, true>;
 
-		struct tls_data {
-			detector::tid_t thread_id;
-			ipc::queue_t* queue;
+		/// maximum number of accesses per record
+		static constexpr size_t max_batch = 4096;
+
+		/// maximum number of interned stacks per thread, the table is reset afterwards
+		static constexpr size_t max_stack_ids = ipc::event::max_stack_ids - 1;
+
+		/// interned callstack: stack parent extended by frame pc
+		struct StackNode {
+			uint32_t parent;
+			uint64_t pc;
+			/// true if the definition is already sent
+			bool     sent;
+		};
+
+		struct StackKeyHash {
+			size_t operator()(const std::pair<uint32_t, uint64_t> & key) const {
+				return std::hash<uint64_t>()(key.second ^ (key.first * 0x9E3779B97F4A7C15ull));
+			}
+		};
+
+		struct ThreadState {
+			detector::tid_t       thread_id;
+			ipc::Channel *        channel;
+			/// overflow queue of the channel, nullptr if events are not spilled
+			ipc::spill_queue_t *  spill;
+			/// true if the channel is shared with other threads
+			bool                  shared;
+			/// true if the reserved record is in the overflow queue
+			bool                  spilled;
+			/// interned stacks, stack id i is stored at index i-1
+			std::vector<StackNode> stack_nodes;
+			std::unordered_map<std::pair<uint32_t, uint64_t>, uint32_t, StackKeyHash> stack_ids;
+			/// shadow call stack, each entry is the id of the stack up to this frame
+			std::vector<uint32_t> stack;
 		};
+
+		static std::unique_ptr<shm_t>      shm;
+		static std::unique_ptr<spill_t>    spill_shm;
+		static ipc::OverflowPolicy         policy{ ipc::OverflowPolicy::DROP };
+		/* counters of the channels when this process attached */
+		static DeliveryStats               session_base;
+		static ThreadRegistry<ThreadState> threads;
+		/* serializes edges to foreign threads with their release */
+		static ipc::spinlock               lifecycle_mx;
+		/* sizes of live heap blocks, as free events only carry the address */
+		static AllocationIndex<>           allocations;
+
+		/** Wakes up a sleeping consumer, at most one notification is pending */
+		static void wake_consumer() {
+			ipc::QueueMetadata * qmeta = shm->get();
+			if (qmeta->sleeping.load(std::memory_order_seq_cst) != 0
+				&& !qmeta->wake_pending.exchange(true, std::memory_order_acq_rel))
+			{
+				shm->notify();
+			}
+		}
+
+		/**
+		* Only records which carry no synchronization can be dropped,
+		* otherwise the analysis would report false positives afterwards.
+		* Allocations are kept, as they reset the state of reused memory.
+		*/
+		static inline bool droppable(ipc::event::Type type) {
+			using ipc::event::Type;
+			return type == Type::ACCESSES || type == Type::STACK || type == Type::FREE;
+		}
+
+		/**
+		* Reserves a record in the queue of the thread.
+		* If the queue is full, the overflow policy is applied. Records which
+		* are not \ref droppable wait for the consumer regardless of the policy.
+		* On success, the header is initialized and the record has to be
+		* completed using \ref commit_record.
+		* A shared channel is locked in the meantime.
+		* \return header of the record or nullptr if the record is dropped
+		*/
+		static ipc::event::Header * reserve_record(ThreadState * thr, ipc::event::Type type, size_t words) {
+			ipc::Channel * ch = thr->channel;
+			if (thr->shared)
+				ch->mxspin.lock();
+
+			uint64_t * rec = nullptr;
+			if (ch->spilling && thr->spill->read_available() == 0) {
+				// consumer caught up, continue in the regular queue
+				ch->spilling = false;
+			}
+			if (!ch->spilling) {
+				rec = ch->queue.reserve(words);
+				if (nullptr == rec && nullptr != thr->spill) {
+					ch->spilling = true;
+				}
+			}
+			if (ch->spilling) {
+				rec = thr->spill->reserve(words);
+			}
+			if (nullptr == rec && (policy == ipc::OverflowPolicy::BLOCK || !droppable(type))) {
+				ch->blocked.fetch_add(1, std::memory_order_relaxed);
+				do {
+					wake_consumer();
+					std::this_thread::yield();
+					rec = ch->spilling ? thr->spill->reserve(words) : ch->queue.reserve(words);
+				} while (nullptr == rec);
+			}
+			thr->spilled = ch->spilling;
+
+			if (nullptr == rec) {
+				ch->dropped_records.fetch_add(1, std::memory_order_relaxed);
+				if (thr->shared)
+					ch->mxspin.unlock();
+				return nullptr; // Queue is full
+			}
+			auto * hdr = reinterpret_cast<ipc::event::Header*>(rec);
+			hdr->type = type;
+			hdr->reserved = 0;
+			hdr->words = static_cast<uint16_t>(words);
+			hdr->thread_id = static_cast<uint32_t>(thr->thread_id);
+			return hdr;
+		}
+
+		/** Publishes a record, words might be less than reserved */
+		static void commit_record(ThreadState * thr, ipc::event::Header * hdr, size_t words) {
+			ipc::Channel * ch = thr->channel;
+			hdr->words = static_cast<uint16_t>(words);
+			if (thr->spilled) {
+				thr->spill->commit(words);
+				ch->spilled_records.fetch_add(1, std::memory_order_relaxed);
+			}
+			else {
+				ch->queue.commit(words);
+			}
+			// single writer, as shared channels are locked
+			ch->committed.store(ch->committed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			if (thr->shared)
+				ch->mxspin.unlock();
+			wake_consumer();
+		}
+
+		/** Drops a reserved record */
+		static void abort_record(ThreadState * thr) {
+			if (thr->shared)
+				thr->channel->mxspin.unlock();
+		}
+
+		/**
+		* Sends an edge on behalf of another thread. It is placed behind
+		* the records which the thread committed so far.
+		*/
+		static void send_control(ThreadState * thr, ipc::event::Type type, uint64_t identifier) {
+			ipc::Channel * ch = thr->channel;
+			std::lock_guard<ipc::spinlock> lg(ch->control_mx);
+			const uint32_t tail = ch->control_tail.load(std::memory_order_relaxed);
+			while (tail - ch->control_head.load(std::memory_order_acquire) >= ipc::Channel::control_slots) {
+				// edges are never dropped
+				wake_consumer();
+				std::this_thread::yield();
+			}
+			// read under the lock, hence the positions of the control records are ordered
+			ipc::ControlRecord & rec = ch->control[tail % ipc::Channel::control_slots];
+			rec.position = ch->committed.load(std::memory_order_acquire);
+			rec.identifier = identifier;
+			rec.thread_id = static_cast<uint32_t>(thr->thread_id);
+			rec.type = type;
+			ch->control_tail.store(tail + 1, std::memory_order_release);
+			wake_consumer();
+		}
+
+		/** Sends a record with a fixed-size payload */
+		template<typename T>
+		static void send(ThreadState * thr, ipc::event::Type type, const T & data) {
+			constexpr size_t words = ipc::event::record_words<T>();
+			ipc::event::Header * hdr = reserve_record(thr, type, words);
+			if (nullptr == hdr)
+				return;
+			*ipc::event::payload<T>(hdr) = data;
+			commit_record(thr, hdr, words);
+		}
+
+		/** Sends a record without payload */
+		static void send(ThreadState * thr, ipc::event::Type type) {
+			ipc::event::Header * hdr = reserve_record(thr, type, 1);
+			if (nullptr != hdr)
+				commit_record(thr, hdr, 1);
+		}
+
+		/** Returns the id of stack parent extended by pc, creates it if needed */
+		static uint32_t intern_stack(ThreadState * thr, uint32_t parent, uint64_t pc) {
+			auto it = thr->stack_ids.find(std::make_pair(parent, pc));
+			if (it != thr->stack_ids.end())
+				return it->second;
+
+			thr->stack_nodes.push_back(StackNode{ parent, pc, false });
+			uint32_t id = static_cast<uint32_t>(thr->stack_nodes.size());
+			thr->stack_ids.emplace(std::make_pair(parent, pc), id);
+			return id;
+		}
+
+		/**
+		* Drops all interned stacks, except the current one.
+		* Ids are re-assigned from the start and redefined on their next use.
+		*/
+		static void reset_stacks(ThreadState * thr) {
+			std::vector<uint64_t> pcs;
+			pcs.reserve(thr->stack.size());
+			for (uint32_t id : thr->stack) {
+				pcs.push_back(thr->stack_nodes[id - 1].pc);
+			}
+			thr->stack_nodes.clear();
+			thr->stack_ids.clear();
+			thr->stack.clear();
+
+			uint32_t parent = 0;
+			for (uint64_t pc : pcs) {
+				parent = intern_stack(thr, parent, pc);
+				thr->stack.push_back(parent);
+			}
+		}
+
+		/**
+		* Sends the definitions of the current stack and its parents, if not sent yet.
+		* \return false if a definition could not be sent
+		*/
+		static bool define_stack(ThreadState * thr) {
+			// definitions are sent outermost first, hence the parents of a sent stack are sent
+			size_t first = thr->stack.size();
+			while (first > 0 && !thr->stack_nodes[thr->stack[first - 1] - 1].sent) {
+				--first;
+			}
+			for (size_t i = first; i < thr->stack.size(); ++i) {
+				const uint32_t sid = thr->stack[i];
+				StackNode & node = thr->stack_nodes[sid - 1];
+				ipc::event::Header * hdr = reserve_record(thr, ipc::event::Type::STACK,
+					ipc::event::record_words<ipc::event::StackDef>());
+				if (nullptr == hdr)
+					return false;
+				*ipc::event::payload<ipc::event::StackDef>(hdr) = ipc::event::StackDef{ sid, node.parent, node.pc };
+				commit_record(thr, hdr, ipc::event::record_words<ipc::event::StackDef>());
+				node.sent = true;
+			}
+			return true;
+		}
+
+		/** True if the access is not analyzed */
+		static inline bool excluded(uint64_t addr, uint64_t excl_beg, uint64_t excl_end) {
+			return (addr >= excl_beg && addr < excl_end) || addr > proc_addr_limit;
+		}
+
+		/**
+		* Sends accesses of the thread as a single record and
+		* translates the pcs on the fly.
+		* \return number of sent accesses
+		*/
+		static size_t send_accesses(ThreadState * thr, const MemAccess * refs, size_t num_refs,
+			uint64_t excl_beg, uint64_t excl_end, const PcTable * pc_table)
+		{
+			using namespace ipc::event;
+			const uint32_t stack_id = thr->stack.empty() ? 0 : thr->stack.back();
+			Header * hdr = nullptr;
+			if (define_stack(thr)) {
+				hdr = reserve_record(thr, Type::ACCESSES,
+					record_words<Accesses>(num_refs * sizeof(MemAccess)));
+			}
+			if (nullptr == hdr) {
+				// only count the accesses which would have been analyzed
+				uint64_t dropped = 0;
+				for (const MemAccess * ref = refs; ref != refs + num_refs; ++ref) {
+					if (!excluded(ref->addr(), excl_beg, excl_end))
+						++dropped;
+				}
+				thr->channel->dropped_accesses.fetch_add(dropped, std::memory_order_relaxed);
+				return 0;
+			}
+
+			Accesses * rec = payload<Accesses>(hdr);
+			rec->stack_id = stack_id;
+
+			MemAccess * out = rec->accesses();
+			size_t count = 0;
+			for (const MemAccess * ref = refs; ref != refs + num_refs; ++ref) {
+				if (excluded(ref->addr(), excl_beg, excl_end)) {
+					continue;
+				}
+				out[count].addr_info = ref->addr_info;
+				out[count].pc = pc_table ? (uint64_t)pc_table->lookup(ref->pc) : ref->pc;
+				++count;
+			}
+			if (count == 0) {
+				abort_record(thr);
+				return 0;
+			}
+			rec->count = static_cast<uint32_t>(count);
+			commit_record(thr, hdr, record_words<Accesses>(count * sizeof(MemAccess)));
+			return count;
+		}
+
+		/**
+		* Sends the parent side of a fork / join edge via the control queue of the parent.
+		* If the parent is unknown, it is sent on behalf of all running threads.
+		* Has to be called under lifecycle_mx, as the parent might exit concurrently.
+		* \return number of sent control records
+		*/
+		static uint64_t send_parent_edge(const ipc::event::ForkJoin & edge, ipc::event::Type type) {
+			uint64_t sent = 0;
+			if (edge.parent == unknown_thread) {
+				threads.for_each([&](detector::tid_t tid, ThreadState * other) {
+					if (tid != edge.child) {
+						send_control(other, type, edge.sync_id());
+						++sent;
+					}
+				});
+			}
+			else if (edge.parent != edge.child) {
+				ThreadState * parent = threads.find(edge.parent);
+				if (nullptr != parent) {
+					send_control(parent, type, edge.sync_id());
+					++sent;
+				}
+			}
+			return sent;
+		}
+
+		/**
+		* Sums up the counters of all channels. The queues outlive this process,
+		* hence the counters also contain events of previous sessions.
+		*/
+		static DeliveryStats sum_counters(const ipc::QueueMetadata * qmeta) {
+			DeliveryStats stats;
+			for (unsigned i = 0; i < qmeta->num_queues; ++i) {
+				const ipc::Channel & ch = qmeta->channels[i];
+				stats.dropped_events += ch.dropped_records.load(std::memory_order_relaxed);
+				stats.dropped_accesses += ch.dropped_accesses.load(std::memory_order_relaxed);
+				stats.spilled_events += ch.spilled_records.load(std::memory_order_relaxed);
+				stats.blocked += ch.blocked.load(std::memory_order_relaxed);
+			}
+			return stats;
+		}
+
+		/**
+		* Returns the channel to the pool, after the last record of the thread.
+		* Has to be called under lifecycle_mx
+		*/
+		static void release_thread(ThreadState * thr) {
+			if (!thr->shared)
+				thr->channel->owner.store(0, std::memory_order_release);
+			delete thr;
+		}
 	} // namespace extsan
 } // namespace detector
 
-std::unique_ptr<detector::extsan::shm_t> shm;
+using namespace detector::extsan;
 
 bool detector::init(int argc, const char **argv, Callback rc_clb) {
-	shm = std::make_unique<ipc::SharedMemory<ipc::QueueMetadata, true>>("drace-events", false);
+	shm = std::unique_ptr<shm_t>(new shm_t("drace-events", false));
+	ipc::QueueMetadata * qmeta = shm->get();
+	if (nullptr == qmeta || qmeta->num_queues < 1 || qmeta->num_queues > ipc::QueueMetadata::max_queues) {
+		std::cerr << "> extsan: could not attach to event queues (is msr running?)" << std::endl;
+		shm.reset();
+		return false;
+	}
+
+	policy = qmeta->overflow;
+	// only report the events of this session
+	session_base = sum_counters(qmeta);
+	for (unsigned i = 0; i < qmeta->num_queues; ++i) {
+		qmeta->channels[i].high_water.store(0, std::memory_order_relaxed);
+	}
+	if (policy == ipc::OverflowPolicy::SPILL) {
+		spill_shm = std::unique_ptr<spill_t>(new spill_t("drace-events-spill", false, qmeta->spill_file));
+		if (nullptr == spill_shm->get()) {
+			std::cerr << "> extsan: could not attach to overflow queues, events are dropped instead" << std::endl;
+			spill_shm.reset();
+			policy = ipc::OverflowPolicy::DROP;
+		}
+	}
 	return true;
 }
 
 void detector::finalize() {
+	std::lock_guard<ipc::spinlock> lg(lifecycle_mx);
+	threads.for_each([](detector::tid_t tid, ThreadState * thr) {
+		if (nullptr != threads.erase(tid)) {
+			release_thread(thr);
+		}
+	});
+	threads.clear();
+	allocations.clear();
+	spill_shm.reset();
 	shm.reset();
 }
 
+void detector::func_enter(tls_t tls, void* pc) {
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	if (thr->stack_nodes.size() >= max_stack_ids)
+		reset_stacks(thr);
+	const uint32_t parent = thr->stack.empty() ? 0 : thr->stack.back();
+	thr->stack.push_back(intern_stack(thr, parent, (uint64_t)pc));
+}
+
+void detector::func_exit(tls_t tls) {
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	if (!thr->stack.empty())
+		thr->stack.pop_back();
+}
+
 void detector::acquire(
 	tls_t tls,
 	void* mutex,
 	int recursive,
 	bool write)
 {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::ACQUIRE;
-	auto * buf = (ipc::event::Mutex*)(entry.buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	buf->acquire = true;
-	buf->addr = (uint64_t)mutex;
-	buf->recursive = recursive;
-	buf->write = write;
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+
+	ipc::event::Mutex buf;
+	buf.addr = (uint64_t)mutex;
+	buf.recursive = recursive;
+	buf.write = write;
+	buf.acquire = true;
+	send(thr, ipc::event::Type::ACQUIRE, buf);
 }
 
 /* Release a mutex */
@@ -78,139 +466,172 @@ void detector::release(
 	void* mutex,
 	bool write)
 {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::RELEASE;
-	auto * buf = (ipc::event::Mutex*)(entry.buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	buf->acquire = false;
-	buf->addr = (uint64_t)mutex;
-	buf->write = write;
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+
+	ipc::event::Mutex buf;
+	buf.addr = (uint64_t)mutex;
+	buf.recursive = 0;
+	buf.write = write;
+	buf.acquire = false;
+	send(thr, ipc::event::Type::RELEASE, buf);
 }
 
-void detector::happens_before(tid_t thread_id, void* identifier) { }
+void detector::happens_before(tls_t tls, void* identifier) {
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	send(thr, ipc::event::Type::HAPPENS_BEFORE, ipc::event::Sync{ (uint64_t)identifier });
+}
 
-void detector::happens_after(tid_t thread_id, void* identifier) { }
+void detector::happens_after(tls_t tls, void* identifier) {
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	send(thr, ipc::event::Type::HAPPENS_AFTER, ipc::event::Sync{ (uint64_t)identifier });
+}
 
-void detector::read(tls_t tls, void* callstack, unsigned stacksize, void* addr, size_t size)
+void detector::read(tls_t tls, void* pc, void* addr, size_t size)
 {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-
-	ipc::event::BufferEntry * entry = queue->get_next_write_slot();
-	if (nullptr == entry) {
-		std::this_thread::yield();
-		return; // Queue is full
-	}
-
-	entry->type = ipc::event::Type::MEMREAD;
-	auto * buf = (ipc::event::MemAccess*)(entry->buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	memcpy(buf->callstack.data(), callstack, stacksize * sizeof(void*));
-	buf->stacksize = stacksize;
-	buf->addr = (uint64_t)addr;
-	queue->commit_write();
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	MemAccess ref = MemAccess::make(addr, (uint64_t)pc, size, false);
+	send_accesses(thr, &ref, 1, 0, 0, nullptr);
 }
 
-void detector::write(tls_t tls, void* callstack, unsigned stacksize, void* addr, size_t size)
+void detector::write(tls_t tls, void* pc, void* addr, size_t size)
 {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	MemAccess ref = MemAccess::make(addr, (uint64_t)pc, size, true);
+	send_accesses(thr, &ref, 1, 0, 0, nullptr);
+}
 
-	ipc::event::BufferEntry * entry = queue->get_next_write_slot();
-	if (nullptr == entry) {
-		std::this_thread::yield();
-		return; // Queue is full
+size_t detector::access_batch(
+	tls_t tls,
+	const MemAccess* refs,
+	size_t num_refs,
+	uint64_t excl_beg,
+	uint64_t excl_end,
+	const PcTable* pc_table)
+{
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return 0;
+
+	// the whole batch is written as a single record (split only if huge)
+	size_t processed = 0;
+	for (size_t begin = 0; begin < num_refs; begin += max_batch) {
+		const size_t count = std::min(num_refs - begin, max_batch);
+		processed += send_accesses(thr, refs + begin, count, excl_beg, excl_end, pc_table);
 	}
-
-	entry->type = ipc::event::Type::MEMWRITE;
-	auto * buf = (ipc::event::MemAccess*)(entry->buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	memcpy(buf->callstack.data(), callstack, stacksize * sizeof(void*));
-	buf->stacksize = stacksize;
-	buf->addr = (uint64_t)addr;
-	queue->commit_write();
+	return processed;
 }
 
 void detector::allocate(tls_t tls, void* pc, void* addr, size_t size)
 {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::ALLOCATION;
-	auto * buf = (ipc::event::Allocation*)(entry.buffer);
-	buf->pc = (uint64_t)pc;
-	buf->addr = (uint64_t)addr;
-	buf->size = size;
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	allocations.insert((uint64_t)addr, size);
+	send(thr, ipc::event::Type::ALLOCATION, ipc::event::Allocation{ (uint64_t)pc, (uint64_t)addr, size });
 }
 
 void detector::deallocate(tls_t tls, void* addr) {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::FREE;
-	auto * buf = (ipc::event::Allocation*)(entry.buffer);
-	buf->addr = (uint64_t)addr;
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
 
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+	size_t size;
+	// ocasionally free is called more often than allocate, hence guard
+	if (allocations.erase((uint64_t)addr, &size)) {
+		send(thr, ipc::event::Type::FREE, ipc::event::Allocation{ 0, (uint64_t)addr, size });
+	}
 }
 
 void detector::fork(tid_t parent, tid_t child, tls_t * tls) {
-	using namespace extsan;
+	*tls = nullptr;
+	if (!shm) return;
 	ipc::QueueMetadata * qmeta = shm->get();
-	auto & queue = qmeta->queues[++qmeta->next_queue % ipc::QueueMetadata::num_queues];
-	auto tls_ = new tls_data;
 
-	tls_->thread_id = child;
-	tls_->queue = &queue;
+	auto * thr = new ThreadState;
+	thr->thread_id = child;
+	unsigned queue = qmeta->shared_queue();
+	thr->shared = true;
+	thr->spilled = false;
+	thr->stack.reserve(64);
+	thr->stack_nodes.reserve(1024);
+
+	// claim a private queue
+	for (unsigned i = 0; i < qmeta->shared_queue(); ++i) {
+		uint64_t expected = 0;
+		if (qmeta->channels[i].owner.compare_exchange_strong(expected, child, std::memory_order_acq_rel)) {
+			queue = i;
+			thr->shared = false;
+			break;
+		}
+	}
+	thr->channel = &(qmeta->channels[queue]);
+	thr->spill = spill_shm ? &(spill_shm->get()->queues[queue]) : nullptr;
+
+	ipc::event::ForkJoin edge{ parent, child, 0 };
+	std::lock_guard<ipc::spinlock> lg(lifecycle_mx);
+	// the parent releases in its own queue, the child acquires in the FORK record
+	edge.edges = send_parent_edge(edge, ipc::event::Type::HAPPENS_BEFORE);
+	send(thr, ipc::event::Type::FORK, edge);
+	ThreadState * prev = threads.insert(child, thr);
+	if (nullptr != prev) {
+		// the tid was reused without a join
+		release_thread(prev);
+	}
+	*tls = (tls_t)thr;
+}
 
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::FORK;
-	auto * buf = (ipc::event::ForkJoin*)(entry.buffer);
-	buf->child = child;
-	buf->parent = parent;
+void detector::join(tid_t parent, tid_t child) {
+	std::lock_guard<ipc::spinlock> lg(lifecycle_mx);
+	ThreadState * thr = threads.erase(child);
+	if (nullptr == thr) return;
 
-	std::lock_guard<ipc::spinlock> lg(queue.mxspin);
-	queue.insert(entry);
-	*tls = (tls_t)tls_;
+	// the child releases in the JOIN record, the parent acquires in its own queue
+	ipc::event::ForkJoin edge{ parent, child, 0 };
+	edge.edges = send_parent_edge(edge, ipc::event::Type::HAPPENS_AFTER);
+	send(thr, ipc::event::Type::JOIN, edge);
+	release_thread(thr);
 }
 
-void detector::join(tid_t parent, tid_t child, tls_t tls) {
-	using namespace extsan;
-	auto * queue = ((tls_data*)&tls)->queue;
+void detector::detach(tls_t tls, tid_t thread_id) {
+	auto * thr = (ThreadState*)tls;
+	if (nullptr == thr) return;
+	send(thr, ipc::event::Type::DETACH);
+}
 
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::JOIN;
-	auto * buf = (ipc::event::ForkJoin*)(entry.buffer);
-	buf->child = child;
-	buf->parent = parent;
+void detector::finish(tls_t tls, tid_t thread_id) {
+	std::lock_guard<ipc::spinlock> lg(lifecycle_mx);
+	ThreadState * thr = threads.erase(thread_id);
+	if (nullptr == thr) return;
 
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
-	delete ((tls_data*)&tls);
+	send(thr, ipc::event::Type::FINISH);
+	release_thread(thr);
+}
+
+detector::DeliveryStats detector::delivery_stats() {
+	DeliveryStats stats;
+	if (!shm) return stats;
+	ipc::QueueMetadata * qmeta = shm->get();
+
+	stats = sum_counters(qmeta);
+	stats.dropped_events -= session_base.dropped_events;
+	stats.dropped_accesses -= session_base.dropped_accesses;
+	stats.spilled_events -= session_base.spilled_events;
+	stats.blocked -= session_base.blocked;
+
+	uint64_t high_water = 0;
+	for (unsigned i = 0; i < qmeta->num_queues; ++i) {
+		high_water = std::max(high_water, qmeta->channels[i].high_water.load(std::memory_order_relaxed));
+	}
+	stats.queue_high_water = static_cast<unsigned>((high_water * 100) / ipc::queue_t::slots);
+	return stats;
 }
 
 std::string detector::name() {
-	return std::string("Dummy");
+	return std::string("Extsan");
 }
 
 std::string detector::version() {
-	return std::string("1.0.0");
-}
\ No newline at end of file
+	return std::string("1.1.0");
+}
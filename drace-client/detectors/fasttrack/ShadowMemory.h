@@ -0,0 +1,182 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include <detector/detector_if.h>
+#include "VectorClock.h"
+
+namespace detector {
+    namespace fasttrack {
+        /// reads of concurrent threads, referenced from a shadow cell
+        struct ReadSet {
+            VectorClock clocks;
+        };
+
+        /**
+         * Shadow state of 8 bytes of application memory.
+         * The read word is either an epoch, or (if \c shared_flag is set)
+         * a pointer to a \ref ReadSet.
+         */
+        struct Cell {
+            static constexpr uint64_t shared_flag = uint64_t(1) << 63;
+
+            std::atomic<uint64_t> write{ 0 };
+            std::atomic<uint64_t> read{ 0 };
+
+            static inline bool is_shared(uint64_t read) {
+                return (read & shared_flag) != 0;
+            }
+            static inline ReadSet * read_set(uint64_t read) {
+                return reinterpret_cast<ReadSet*>(read & ~shared_flag);
+            }
+        };
+
+        /**
+         * \brief Maps application addresses to shadow cells
+         *
+         * Each 8 byte word below \c proc_addr_limit has a \ref Cell.
+         * Cells are stored in pages which are located using a lazily
+         * populated two-level radix table, hence the shadow memory
+         * only grows with the touched memory. Lookups never lock.
+         */
+        class ShadowMemory {
+        public:
+            static constexpr unsigned cell_bits = 3;
+            static constexpr size_t   cell_size = size_t(1) << cell_bits;
+            /// cells per page (2^n)
+            static constexpr unsigned page_bits = 12;
+            static constexpr unsigned table_bits = 16;
+            static constexpr unsigned address_bits = 43;
+            static constexpr unsigned l1_bits = address_bits - cell_bits - page_bits - table_bits;
+
+            static_assert(proc_addr_limit < (uint64_t(1) << address_bits),
+                "shadow memory does not cover the process address space");
+
+        private:
+            static constexpr size_t page_size = size_t(1) << page_bits;
+            static constexpr size_t table_size = size_t(1) << table_bits;
+            static constexpr size_t l1_size = size_t(1) << l1_bits;
+
+            struct Page {
+                Cell cells[page_size];
+            };
+
+            struct Table {
+                std::atomic<Page*> pages[table_size];
+
+                Table() {
+                    for (auto & p : pages) p.store(nullptr, std::memory_order_relaxed);
+                }
+            };
+
+            std::atomic<Table*> * _l1;
+
+        public:
+            ShadowMemory()
+                : _l1(new std::atomic<Table*>[l1_size])
+            {
+                for (size_t i = 0; i < l1_size; ++i)
+                    _l1[i].store(nullptr, std::memory_order_relaxed);
+            }
+
+            ShadowMemory(const ShadowMemory &) = delete;
+            ShadowMemory & operator=(const ShadowMemory &) = delete;
+
+            ~ShadowMemory() {
+                clear();
+                delete[] _l1;
+            }
+
+            /** Returns the cell of addr, allocates the page if necessary */
+            inline Cell * get(uint64_t addr) {
+                Table * table = get_or_create(_l1[l1_idx(addr)], true);
+                Page * page = get_or_create(table->pages[table_idx(addr)], true);
+                return &(page->cells[cell_idx(addr)]);
+            }
+
+            /**
+             * Calls f(addr, cell) for each allocated cell in [begin, begin + size).
+             * Ranges without shadow pages are skipped.
+             */
+            template<typename F>
+            void for_each_cell(uint64_t begin, size_t size, F && f) {
+                const uint64_t end = begin + size;
+                uint64_t addr = begin & ~(uint64_t)(cell_size - 1);
+                while (addr < end) {
+                    const uint64_t page_end = (addr | ((page_size << cell_bits) - 1)) + 1;
+                    Table * table = get_or_create(_l1[l1_idx(addr)], false);
+                    Page * page = (nullptr != table) ? get_or_create(table->pages[table_idx(addr)], false) : nullptr;
+                    if (nullptr == page) {
+                        addr = page_end;
+                        continue;
+                    }
+                    for (; addr < end && addr < page_end; addr += cell_size) {
+                        f(addr, page->cells[cell_idx(addr)]);
+                    }
+                }
+            }
+
+            /**
+             * Frees all pages and read sets.
+             * \warning not thread-safe
+             */
+            void clear() {
+                for (size_t i = 0; i < l1_size; ++i) {
+                    Table * table = _l1[i].exchange(nullptr, std::memory_order_relaxed);
+                    if (nullptr == table) continue;
+                    for (auto & p : table->pages) {
+                        Page * page = p.load(std::memory_order_relaxed);
+                        if (nullptr == page) continue;
+                        for (auto & cell : page->cells) {
+                            const uint64_t read = cell.read.load(std::memory_order_relaxed);
+                            if (Cell::is_shared(read))
+                                delete Cell::read_set(read);
+                        }
+                        delete page;
+                    }
+                    delete table;
+                }
+            }
+
+        private:
+            static inline size_t cell_idx(uint64_t addr) {
+                return static_cast<size_t>((addr >> cell_bits) & (page_size - 1));
+            }
+            static inline size_t table_idx(uint64_t addr) {
+                return static_cast<size_t>((addr >> (cell_bits + page_bits)) & (table_size - 1));
+            }
+            static inline size_t l1_idx(uint64_t addr) {
+                return static_cast<size_t>((addr >> (cell_bits + page_bits + table_bits)) & (l1_size - 1));
+            }
+
+            /** Loads the entry of a table. If create is set, a missing entry is allocated */
+            template<typename Entry>
+            static Entry * get_or_create(std::atomic<Entry*> & slot, bool create) {
+                Entry * e = slot.load(std::memory_order_acquire);
+                if (nullptr == e && create) {
+                    Entry * fresh = new Entry;
+                    if (slot.compare_exchange_strong(e, fresh, std::memory_order_acq_rel)) {
+                        e = fresh;
+                    }
+                    else {
+                        // another thread was faster
+                        delete fresh;
+                    }
+                }
+                return e;
+            }
+        };
+    } // namespace fasttrack
+} // namespace detector
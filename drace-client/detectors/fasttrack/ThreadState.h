@@ -0,0 +1,208 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include <detector/detector_if.h>
+#include <ipc/spinlock.h>
+#include "VectorClock.h"
+
+namespace detector {
+    namespace fasttrack {
+        /**
+         * \brief Ring buffer of the most recent events of a thread
+         *
+         * Each event (memory access, function entry / exit) advances the clock
+         * of the thread by one, hence the clock is the position in the trace.
+         * The trace is split into parts and a snapshot of the call stack is
+         * taken at the beginning of each part. The stack of an access is
+         * restored by replaying the events of its part.
+         */
+        class Trace {
+        public:
+            static constexpr unsigned trace_bits = 14;
+            static constexpr unsigned part_bits = 11;
+            static constexpr size_t   trace_size = size_t(1) << trace_bits;
+            static constexpr size_t   part_size = size_t(1) << part_bits;
+            static constexpr size_t   num_parts = trace_size / part_size;
+            /// frames kept in a snapshot (innermost ones)
+            static constexpr size_t   snapshot_size = 2 * max_stack_size;
+
+            enum class Type : uint64_t {
+                NONE = 0,
+                READ = 1,
+                WRITE = 2,
+                ENTER = 3,
+                EXIT = 4
+            };
+
+            /** Access which is restored from the trace */
+            struct access_t {
+                bool     write;
+                size_t   size;
+                size_t   stack_size;
+                uint64_t stack[max_stack_size];
+            };
+
+        private:
+            static constexpr unsigned type_shift = 60;
+            static constexpr unsigned size_shift = 56;
+            static constexpr uint64_t pc_mask = (uint64_t(1) << size_shift) - 1;
+
+            struct part_t {
+                /// clock of the first event in this part
+                std::atomic<vclock_t> start{ 0 };
+                size_t                depth{ 0 };
+                uint64_t              frames[snapshot_size];
+            };
+
+            std::unique_ptr<uint64_t[]> _events;
+            part_t                      _parts[num_parts];
+
+        public:
+            Trace() : _events(new uint64_t[trace_size]()) { }
+
+            /**
+             * Records the event at the given clock.
+             * \note Must only be called by the owning thread
+             */
+            inline void add(vclock_t clock, Type type, uint64_t pc, uint8_t size_log2,
+                const std::vector<uint64_t> & stack)
+            {
+                if ((clock & (part_size - 1)) == 0) {
+                    snapshot(clock, stack);
+                }
+                _events[clock & (trace_size - 1)] = ((uint64_t)type << type_shift)
+                    | ((uint64_t)(size_log2 & 0xF) << size_shift)
+                    | (pc & pc_mask);
+            }
+
+            /**
+             * Restores the access at clock. now is the current clock of the thread.
+             * \return false if the event is not available anymore
+             */
+            bool restore(vclock_t clock, vclock_t now, access_t & out) const {
+                // the part of the current clock might be overwritten in the meantime
+                if (clock == 0 || clock > now || (now - clock) >= (trace_size - part_size))
+                    return false;
+
+                const vclock_t start = clock & ~(vclock_t)(part_size - 1);
+                const part_t & part = _parts[(clock >> part_bits) & (num_parts - 1)];
+                if (part.start.load(std::memory_order_acquire) != start)
+                    return false;
+
+                std::vector<uint64_t> stack(part.frames, part.frames + part.depth);
+                for (vclock_t c = start; c < clock; ++c) {
+                    const uint64_t ev = _events[c & (trace_size - 1)];
+                    const Type type = (Type)(ev >> type_shift);
+                    if (type == Type::ENTER) {
+                        stack.push_back(ev & pc_mask);
+                    }
+                    else if (type == Type::EXIT && !stack.empty()) {
+                        stack.pop_back();
+                    }
+                }
+                const uint64_t ev = _events[clock & (trace_size - 1)];
+                const Type type = (Type)(ev >> type_shift);
+                if (type != Type::READ && type != Type::WRITE)
+                    return false;
+
+                out.write = (type == Type::WRITE);
+                out.size = size_t(1) << ((ev >> size_shift) & 0xF);
+                out.stack_size = fill_stack(stack, ev & pc_mask, out.stack);
+
+                // check if part was overwritten during replay
+                return part.start.load(std::memory_order_acquire) == start;
+            }
+
+            /**
+             * Copies the innermost frames of stack followed by pc into out.
+             * \return number of entries
+             */
+            static size_t fill_stack(const std::vector<uint64_t> & stack, uint64_t pc, uint64_t * out) {
+                const size_t frames = std::min(stack.size(), (size_t)max_stack_size - 1);
+                std::copy(stack.end() - frames, stack.end(), out);
+                out[frames] = pc;
+                return frames + 1;
+            }
+
+        private:
+            void snapshot(vclock_t clock, const std::vector<uint64_t> & stack) {
+                part_t & part = _parts[(clock >> part_bits) & (num_parts - 1)];
+                // invalidate part while writing
+                part.start.store(0, std::memory_order_relaxed);
+                const size_t depth = std::min(stack.size(), snapshot_size);
+                std::copy(stack.end() - depth, stack.end(), part.frames);
+                part.depth = depth;
+                part.start.store(clock, std::memory_order_release);
+            }
+        };
+
+        /**
+         * State of a single application thread.
+         * States of joined threads are reused, see \ref reuse.
+         */
+        struct ThreadState {
+            const slot_t          slot;
+            std::atomic<tid_t>    tid;
+            /// logical time of this thread, incremented on each event
+            std::atomic<vclock_t> clock{ 0 };
+            /// happens-before knowledge of this thread, only modified by the owner
+            /// (and under mx, as other threads read it)
+            VectorClock           vc;
+            ipc::spinlock         mx;
+            /// clocks of joined children which are not yet merged into vc (under mx)
+            VectorClock           pending;
+            std::atomic<bool>     has_pending{ false };
+            std::atomic<bool>     active{ true };
+            /// shadow call stack
+            std::vector<uint64_t> stack;
+            Trace                 trace;
+
+            ThreadState(slot_t s, tid_t t) : slot(s), tid(t) {
+                stack.reserve(64);
+            }
+
+            /**
+             * Assigns the state to a new thread. As the clock continues,
+             * old epochs of this slot are treated as program order. Hence,
+             * a slot must only be reused by a thread which happens after
+             * the previous owner of the slot.
+             */
+            void reuse(tid_t t) {
+                tid.store(t, std::memory_order_relaxed);
+                vc.clear();
+                pending.clear();
+                has_pending.store(false, std::memory_order_relaxed);
+                stack.clear();
+                active.store(true, std::memory_order_relaxed);
+            }
+
+            /** Advances the clock and records the event */
+            inline vclock_t tick(Trace::Type type, uint64_t pc, uint8_t size_log2 = 0) {
+                const vclock_t now = clock.load(std::memory_order_relaxed) + 1;
+                trace.add(now, type, pc, size_log2, stack);
+                clock.store(now, std::memory_order_release);
+                return now;
+            }
+
+            /** Epoch of the last event */
+            inline uint64_t epoch() const {
+                return Epoch::make(slot, clock.load(std::memory_order_relaxed));
+            }
+        };
+    } // namespace fasttrack
+} // namespace detector
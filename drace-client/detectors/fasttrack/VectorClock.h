@@ -0,0 +1,87 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+namespace detector {
+    namespace fasttrack {
+        /// index of a thread in vector clocks
+        using slot_t = uint32_t;
+        /// logical time of a single thread
+        using vclock_t = uint64_t;
+
+        /**
+         * An epoch c@t packed into 64 bits:
+         * bits 0-47: clock, bits 48-62: slot of the thread.
+         * Bit 63 is reserved for the shadow memory. Zero is the empty epoch.
+         */
+        struct Epoch {
+            static constexpr unsigned clock_bits = 48;
+            static constexpr uint64_t clock_mask = (uint64_t(1) << clock_bits) - 1;
+            static constexpr slot_t   max_slots = slot_t(1) << 15;
+
+            static inline uint64_t make(slot_t slot, vclock_t clock) {
+                return ((uint64_t)slot << clock_bits) | (clock & clock_mask);
+            }
+            static inline slot_t slot(uint64_t epoch) {
+                return static_cast<slot_t>((epoch >> clock_bits) & (max_slots - 1));
+            }
+            static inline vclock_t clock(uint64_t epoch) {
+                return epoch & clock_mask;
+            }
+        };
+
+        /**
+         * Vector clock indexed by slots.
+         * Missing entries are treated as zero, hence the clock
+         * only grows up to the highest slot it has seen.
+         */
+        class VectorClock {
+            std::vector<vclock_t> _clocks;
+
+        public:
+            inline vclock_t get(slot_t slot) const {
+                return (slot < _clocks.size()) ? _clocks[slot] : 0;
+            }
+
+            inline void set(slot_t slot, vclock_t clock) {
+                if (slot >= _clocks.size())
+                    _clocks.resize(slot + 1, 0);
+                _clocks[slot] = clock;
+            }
+
+            /** Returns true if the epoch happened before this clock */
+            inline bool covers(uint64_t epoch) const {
+                return Epoch::clock(epoch) <= get(Epoch::slot(epoch));
+            }
+
+            /** Pointwise maximum */
+            inline void join(const VectorClock & other) {
+                if (other._clocks.size() > _clocks.size())
+                    _clocks.resize(other._clocks.size(), 0);
+                for (size_t i = 0; i < other._clocks.size(); ++i) {
+                    _clocks[i] = std::max(_clocks[i], other._clocks[i]);
+                }
+            }
+
+            inline size_t size() const {
+                return _clocks.size();
+            }
+
+            inline void clear() {
+                _clocks.clear();
+            }
+        };
+    } // namespace fasttrack
+} // namespace detector
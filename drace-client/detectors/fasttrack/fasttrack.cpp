@@ -0,0 +1,630 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <mutex> // for lock_guard
+#include <unordered_map>
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include <detector/detector_if.h>
+#include <detector/AllocationIndex.h>
+#include <detector/ThreadRegistry.h>
+#include <ipc/spinlock.h>
+
+#include "VectorClock.h"
+#include "ShadowMemory.h"
+#include "ThreadState.h"
+
+namespace detector {
+    /// native detector based on FastTrack-style epochs and vector clocks
+    namespace fasttrack {
+
+        struct fasttrack_params_t {
+            bool heap_only{ false };
+        } params;
+
+        /** Mutexes and happens-before identifiers */
+        struct SyncVar {
+            ipc::spinlock mx;
+            VectorClock   vc;
+        };
+
+        /// number of locks protecting the slow path of shadow updates
+        static constexpr size_t num_stripes = 4096;
+
+        static Callback                 race_clb{ nullptr };
+        static std::atomic<uint64_t>    races{ 0 };
+        // lower bound of heap
+        static std::atomic<uint64_t>    heap_lb{ std::numeric_limits<uint64_t>::max() };
+        // upper bound of heap
+        static std::atomic<uint64_t>    heap_ub{ 0 };
+
+        static ShadowMemory *           shadow{ nullptr };
+        static AllocationIndex<> *      allocations{ nullptr };
+        static ipc::spinlock            stripes[num_stripes];
+
+        /// states of the running threads, lock-free
+        static ThreadRegistry<ThreadState> thread_states;
+
+        /* slot allocation, protected by thr_mx */
+        static ipc::spinlock            thr_mx;
+        static slot_t                   next_slot{ 0 };
+        /// slots of joined threads, which can be reused
+        static std::vector<slot_t>      free_slots;
+        /// owns the thread states, which are never freed until finalize
+        static std::vector<std::unique_ptr<ThreadState>> all_threads;
+        /// thread state of each slot (lock-free readers)
+        static std::atomic<ThreadState*> * slots{ nullptr };
+
+        /// number of recently freed slots which are checked for reuse on fork
+        static constexpr size_t reuse_window = 8;
+
+        /* sync variables, protected by sync_mx */
+        static ipc::spinlock            sync_mx;
+        static std::unordered_map<uint64_t, std::unique_ptr<SyncVar>> sync_vars;
+
+        static inline ipc::spinlock & stripe(uint64_t addr) {
+            return stripes[(addr >> ShadowMemory::cell_bits) & (num_stripes - 1)];
+        }
+
+        static SyncVar * get_sync(void * addr) {
+            std::lock_guard<ipc::spinlock> lg(sync_mx);
+            auto & var = sync_vars[(uint64_t)addr];
+            if (!var) {
+                var.reset(new SyncVar);
+            }
+            return var.get();
+        }
+
+        /**
+         * Merge clocks of joined children. The joining thread cannot modify
+         * the clock of the parent, hence the parent applies them lazily.
+         * Returns true if the clock changed
+         */
+        static bool acquire_joined(ThreadState * thr) {
+            if (!thr->has_pending.load(std::memory_order_acquire))
+                return false;
+
+            std::lock_guard<ipc::spinlock> lg_t(thr->mx);
+            thr->vc.join(thr->pending);
+            thr->pending.clear();
+            thr->has_pending.store(false, std::memory_order_relaxed);
+            return true;
+        }
+
+        /** Returns true if the access at epoch happened before the current event of thr */
+        static inline bool happened_before(ThreadState * thr, uint64_t epoch) {
+            if (Epoch::slot(epoch) == thr->slot || thr->vc.covers(epoch))
+                return true;
+            // slow path: a child might have been joined
+            return acquire_joined(thr) && thr->vc.covers(epoch);
+        }
+
+        /** Makes the current clock of thr visible in its vector clock */
+        static inline void publish_clock(ThreadState * thr) {
+            thr->vc.set(thr->slot, thr->clock.load(std::memory_order_relaxed));
+        }
+
+        static void parse_args(int argc, const char ** argv) {
+            int processed = 1;
+            while (processed < argc) {
+                if (strncmp(argv[processed], "--heap-only", 16) == 0) {
+                    params.heap_only = true;
+                    ++processed;
+                }
+                else {
+                    ++processed;
+                }
+            }
+        }
+        static void print_config() {
+            std::cout << "> Detector Configuration:\n"
+                << "> heap-only: " << (params.heap_only ? "ON" : "OFF") << std::endl
+                << "> version:   " << detector::version() << std::endl;
+        }
+
+        static void report_race(
+            ThreadState * thr,
+            uint64_t addr,
+            size_t size,
+            bool write,
+            uint64_t pc,
+            uint64_t prev,
+            bool prev_write)
+        {
+            races.fetch_add(1, std::memory_order_relaxed);
+            if (nullptr == race_clb)
+                return;
+
+            detector::Race race;
+            detector::AccessEntry & cur = race.second;
+            cur.thread_id = (unsigned)thr->tid;
+            cur.write = write;
+            cur.accessed_memory = addr;
+            cur.access_size = size;
+            cur.access_type = 0;
+            cur.stack_size = Trace::fill_stack(thr->stack, pc, cur.stack_trace);
+            cur.onheap = allocations->find(addr, &cur.heap_block_begin, &cur.heap_block_size);
+
+            detector::AccessEntry & old = race.first;
+            old.write = prev_write;
+            old.accessed_memory = addr;
+            old.access_size = size;
+            old.access_type = 0;
+            old.onheap = cur.onheap;
+            old.heap_block_begin = cur.heap_block_begin;
+            old.heap_block_size = cur.heap_block_size;
+
+            const ThreadState * other = slots[Epoch::slot(prev)].load(std::memory_order_acquire);
+            if (nullptr != other) {
+                old.thread_id = (unsigned)other->tid;
+                Trace::access_t hist;
+                if (other->trace.restore(Epoch::clock(prev), other->clock.load(std::memory_order_acquire), hist)) {
+                    old.access_size = hist.size;
+                    old.stack_size = hist.stack_size;
+                    memcpy(old.stack_trace, hist.stack, hist.stack_size * sizeof(uint64_t));
+                }
+            }
+            race_clb(&race);
+        }
+
+        /**
+         * Checks a write of the cell against previous accesses and updates it.
+         * \return epoch of a conflicting access or 0
+         */
+        static uint64_t write_cell(ThreadState * thr, Cell & cell, uint64_t addr, uint64_t epoch, bool & prev_write) {
+            uint64_t w = cell.write.load(std::memory_order_relaxed);
+            uint64_t r = cell.read.load(std::memory_order_relaxed);
+            // fast path: all previous accesses are from this thread.
+            // The cell is only updated if no other thread changed it in between,
+            // otherwise the locked path re-checks it.
+            if ((w == 0 || Epoch::slot(w) == thr->slot) &&
+                (r == 0 || (!Cell::is_shared(r) && Epoch::slot(r) == thr->slot)) &&
+                cell.write.compare_exchange_strong(w, epoch, std::memory_order_relaxed) &&
+                cell.read.load(std::memory_order_relaxed) == r)
+            {
+                return 0;
+            }
+
+            uint64_t conflict = 0;
+            ReadSet * retired = nullptr;
+            {
+                std::lock_guard<ipc::spinlock> lg(stripe(addr));
+                w = cell.write.load(std::memory_order_relaxed);
+                r = cell.read.load(std::memory_order_relaxed);
+                if (w != 0 && !happened_before(thr, w)) {
+                    conflict = w;
+                    prev_write = true;
+                }
+                else if (Cell::is_shared(r)) {
+                    const VectorClock & reads = Cell::read_set(r)->clocks;
+                    for (slot_t s = 0; s < reads.size() && conflict == 0; ++s) {
+                        const uint64_t re = Epoch::make(s, reads.get(s));
+                        if (Epoch::clock(re) != 0 && !happened_before(thr, re)) {
+                            conflict = re;
+                            prev_write = false;
+                        }
+                    }
+                }
+                else if (r != 0 && !happened_before(thr, r)) {
+                    conflict = r;
+                    prev_write = false;
+                }
+                // the write supersedes the concurrent reads
+                if (Cell::is_shared(r)) {
+                    retired = Cell::read_set(r);
+                    cell.read.store(0, std::memory_order_relaxed);
+                }
+                cell.write.store(epoch, std::memory_order_relaxed);
+            }
+            delete retired;
+            return conflict;
+        }
+
+        /**
+         * Checks a read of the cell against the previous write and updates it.
+         * \return epoch of a conflicting write or 0
+         */
+        static uint64_t read_cell(ThreadState * thr, Cell & cell, uint64_t addr, uint64_t epoch) {
+            uint64_t w = cell.write.load(std::memory_order_relaxed);
+            uint64_t r = cell.read.load(std::memory_order_relaxed);
+            // fast path: all previous accesses are from this thread (see write_cell)
+            if ((w == 0 || Epoch::slot(w) == thr->slot) &&
+                (r == 0 || (!Cell::is_shared(r) && Epoch::slot(r) == thr->slot)) &&
+                cell.read.compare_exchange_strong(r, epoch, std::memory_order_relaxed) &&
+                cell.write.load(std::memory_order_relaxed) == w)
+            {
+                return 0;
+            }
+
+            uint64_t conflict = 0;
+            std::lock_guard<ipc::spinlock> lg(stripe(addr));
+            w = cell.write.load(std::memory_order_relaxed);
+            r = cell.read.load(std::memory_order_relaxed);
+            if (w != 0 && !happened_before(thr, w)) {
+                conflict = w;
+            }
+
+            if (Cell::is_shared(r)) {
+                Cell::read_set(r)->clocks.set(thr->slot, Epoch::clock(epoch));
+            }
+            else if (r == 0 || happened_before(thr, r)) {
+                // previous read is ordered, hence keep an epoch
+                cell.read.store(epoch, std::memory_order_relaxed);
+            }
+            else {
+                // concurrent reads, switch to a read set
+                ReadSet * reads = new ReadSet;
+                reads->clocks.set(Epoch::slot(r), Epoch::clock(r));
+                reads->clocks.set(thr->slot, Epoch::clock(epoch));
+                cell.read.store((uint64_t)reads | Cell::shared_flag, std::memory_order_relaxed);
+            }
+            return conflict;
+        }
+
+        /** Analyzes an access of size bytes, reports at most one race */
+        static void on_access(ThreadState * thr, uint64_t pc, uint64_t addr, size_t size, bool write) {
+            // the trace stores sizes up to 2^15
+            const uint8_t size_log2 = std::min<uint8_t>(MemAccess::size_log2(size), 15);
+            const vclock_t now = thr->tick(write ? Trace::Type::WRITE : Trace::Type::READ, pc, size_log2);
+            const uint64_t epoch = Epoch::make(thr->slot, now);
+
+            bool reported = false;
+            const uint64_t end = addr + std::max(size, (size_t)1);
+            for (uint64_t a = addr & ~(uint64_t)(ShadowMemory::cell_size - 1); a < end; a += ShadowMemory::cell_size) {
+                Cell & cell = *(shadow->get(a));
+                bool prev_write = true;
+                const uint64_t conflict = write ?
+                    write_cell(thr, cell, a, epoch, prev_write) :
+                    read_cell(thr, cell, a, epoch);
+                if (conflict != 0 && !reported) {
+                    report_race(thr, addr, size, write, pc, conflict, prev_write);
+                    reported = true;
+                }
+            }
+        }
+
+        /** Clears the shadow state of a memory range (e.g. on allocation) */
+        static void reset_range(uint64_t addr, size_t size) {
+            shadow->for_each_cell(addr, size, [](uint64_t a, Cell & cell) {
+                const uint64_t r = cell.read.load(std::memory_order_relaxed);
+                if (Cell::is_shared(r)) {
+                    // only the slow path touches read sets
+                    ReadSet * reads = nullptr;
+                    {
+                        std::lock_guard<ipc::spinlock> lg(stripe(a));
+                        const uint64_t cur = cell.read.exchange(0, std::memory_order_relaxed);
+                        if (Cell::is_shared(cur))
+                            reads = Cell::read_set(cur);
+                    }
+                    delete reads;
+                }
+                cell.read.store(0, std::memory_order_relaxed);
+                cell.write.store(0, std::memory_order_relaxed);
+            });
+        }
+
+        /* approximate if addr is on the heap
+        *  (no false-negatives, but possibly false positives)
+        */
+        static inline bool on_heap(uint64_t addr) {
+            return ((addr >= heap_lb.load(std::memory_order_relaxed))
+                && (addr < heap_ub.load(std::memory_order_relaxed)));
+        }
+
+    } // namespace fasttrack
+} // namespace detector
+
+using namespace detector::fasttrack;
+
+bool detector::init(int argc, const char **argv, Callback rc_clb) {
+    parse_args(argc, argv);
+    print_config();
+
+    race_clb = rc_clb;
+    races.store(0, std::memory_order_relaxed);
+    heap_lb.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    heap_ub.store(0, std::memory_order_relaxed);
+
+    shadow = new ShadowMemory;
+    allocations = new AllocationIndex<>;
+    slots = new std::atomic<ThreadState*>[Epoch::max_slots];
+    for (slot_t s = 0; s < Epoch::max_slots; ++s) {
+        slots[s].store(nullptr, std::memory_order_relaxed);
+    }
+    next_slot = 0;
+    return true;
+}
+
+void detector::finalize() {
+    // all state is owned by the detector, hence a later init starts from scratch
+    thread_states.clear();
+    free_slots.clear();
+    all_threads.clear();
+    delete[] slots;
+    slots = nullptr;
+    sync_vars.clear();
+
+    delete shadow;
+    shadow = nullptr;
+    delete allocations;
+    allocations = nullptr;
+    race_clb = nullptr;
+    params = fasttrack_params_t();
+}
+
+detector::DeliveryStats detector::delivery_stats() {
+    // events are analyzed in-process
+    return DeliveryStats();
+}
+
+std::string detector::name() {
+    return std::string("FastTrack");
+}
+
+std::string detector::version() {
+    return std::string("0.1.0");
+}
+
+void detector::func_enter(tls_t tls, void* pc) {
+    ThreadState * thr = (ThreadState*)tls;
+    thr->tick(Trace::Type::ENTER, (uint64_t)pc);
+    thr->stack.push_back((uint64_t)pc);
+}
+
+void detector::func_exit(tls_t tls) {
+    ThreadState * thr = (ThreadState*)tls;
+    thr->tick(Trace::Type::EXIT, 0);
+    if (!thr->stack.empty())
+        thr->stack.pop_back();
+}
+
+void detector::acquire(tls_t tls, void* mutex, int rec, bool write) {
+    ThreadState * thr = (ThreadState*)tls;
+    assert(nullptr != thr);
+
+    SyncVar * var = get_sync(mutex);
+    acquire_joined(thr);
+    std::lock_guard<ipc::spinlock> lg_s(var->mx);
+    std::lock_guard<ipc::spinlock> lg_t(thr->mx);
+    thr->vc.join(var->vc);
+}
+
+void detector::release(tls_t tls, void* mutex, bool write) {
+    ThreadState * thr = (ThreadState*)tls;
+    assert(nullptr != thr);
+
+    SyncVar * var = get_sync(mutex);
+    std::lock_guard<ipc::spinlock> lg_s(var->mx);
+    std::lock_guard<ipc::spinlock> lg_t(thr->mx);
+    publish_clock(thr);
+    if (write) {
+        // exclusive owner, hence the clock of the mutex is replaced
+        var->vc = thr->vc;
+    }
+    else {
+        var->vc.join(thr->vc);
+    }
+}
+
+void detector::happens_before(tls_t tls, void* identifier) {
+    ThreadState * thr = (ThreadState*)tls;
+    SyncVar * var = get_sync(identifier);
+    std::lock_guard<ipc::spinlock> lg_s(var->mx);
+    std::lock_guard<ipc::spinlock> lg_t(thr->mx);
+    publish_clock(thr);
+    var->vc.join(thr->vc);
+}
+
+void detector::happens_after(tls_t tls, void* identifier) {
+    ThreadState * thr = (ThreadState*)tls;
+    SyncVar * var = get_sync(identifier);
+    acquire_joined(thr);
+    std::lock_guard<ipc::spinlock> lg_s(var->mx);
+    std::lock_guard<ipc::spinlock> lg_t(thr->mx);
+    thr->vc.join(var->vc);
+}
+
+void detector::read(tls_t tls, void* pc, void* addr, size_t size)
+{
+    const uint64_t addr_64 = (uint64_t)addr;
+    if (addr_64 > proc_addr_limit)
+        return;
+    if (!params.heap_only || on_heap(addr_64)) {
+        on_access((ThreadState*)tls, (uint64_t)pc, addr_64, size, false);
+    }
+}
+
+void detector::write(tls_t tls, void* pc, void* addr, size_t size)
+{
+    const uint64_t addr_64 = (uint64_t)addr;
+    if (addr_64 > proc_addr_limit)
+        return;
+    if (!params.heap_only || on_heap(addr_64)) {
+        on_access((ThreadState*)tls, (uint64_t)pc, addr_64, size, true);
+    }
+}
+
+size_t detector::access_batch(tls_t tls, const MemAccess* refs, size_t num_refs, uint64_t excl_beg, uint64_t excl_end, const PcTable* pc_table)
+{
+    ThreadState * thr = (ThreadState*)tls;
+    // the heap bounds are approximations anyway, hence load them once per batch
+    const bool     heap_only = params.heap_only;
+    const uint64_t lb = heap_lb.load(std::memory_order_relaxed);
+    const uint64_t ub = heap_ub.load(std::memory_order_relaxed);
+
+    size_t processed = 0;
+    for (const MemAccess * ref = refs; ref != refs + num_refs; ++ref) {
+        uint64_t addr = ref->addr();
+        if ((addr >= excl_beg && addr < excl_end) || addr > proc_addr_limit) {
+            continue;
+        }
+        if (heap_only && !(addr >= lb && addr < ub)) {
+            continue;
+        }
+        uint64_t pc = pc_table ? (uint64_t)pc_table->lookup(ref->pc) : ref->pc;
+        on_access(thr, pc, addr, ref->size(), ref->write());
+        ++processed;
+    }
+    return processed;
+}
+
+void detector::allocate(tls_t tls, void* pc, void* addr, size_t size) {
+    uint64_t addr_64 = (uint64_t)addr;
+
+    // a new block does not inherit the accesses to previous blocks
+    reset_range(addr_64, size);
+    allocations->insert(addr_64, size);
+
+    // this is a bit racy as other allocations might finish first
+    // but this is ok as only approximations are necessary
+
+    // increase heap upper bound
+    uint64_t new_ub = addr_64 + size;
+    if (new_ub > heap_ub.load(std::memory_order_relaxed)) {
+        heap_ub.store(new_ub, std::memory_order_relaxed);
+    }
+    // decrease heap lower bound
+    if (addr_64 < heap_lb.load(std::memory_order_relaxed)) {
+        heap_lb.store(addr_64, std::memory_order_relaxed);
+    }
+}
+
+void detector::deallocate(tls_t tls, void* addr) {
+    uint64_t addr_64 = (uint64_t)addr;
+    size_t size;
+
+    // ocasionally free is called more often than allocate, hence guard
+    if (allocations->erase(addr_64, &size)) {
+        // if allocation was top of heap, decrease heap_limit.
+        // As blocks do not overlap, all remaining blocks end below addr
+        uint64_t block_end = addr_64 + size;
+        heap_ub.compare_exchange_strong(block_end, addr_64, std::memory_order_relaxed);
+
+        reset_range(addr_64, size);
+    }
+}
+
+void detector::fork(tid_t parent, tid_t child, tls_t * tls) {
+    // the child happens after the events of its parent up to now.
+    // An unregistered parent (e.g. not instrumented) has nothing to pass on
+    VectorClock vc;
+    auto inherit = [&vc](detector::tid_t, ThreadState * parent_thr) {
+        std::lock_guard<ipc::spinlock> lg_p(parent_thr->mx);
+        vc.join(parent_thr->vc);
+        vc.join(parent_thr->pending);
+        vc.set(parent_thr->slot, parent_thr->clock.load(std::memory_order_acquire));
+    };
+    if (parent == unknown_thread) {
+        thread_states.for_each(inherit);
+    }
+    else if (parent != child) {
+        ThreadState * parent_thr = thread_states.find(parent);
+        if (nullptr != parent_thr)
+            inherit(parent, parent_thr);
+    }
+
+    ThreadState * thr = nullptr;
+    {
+        std::lock_guard<ipc::spinlock> lg(thr_mx);
+        // reuse a slot whose previous owner happens before the child
+        const size_t window = std::min(free_slots.size(), reuse_window);
+        for (size_t i = free_slots.size(); i-- > free_slots.size() - window;) {
+            ThreadState * prev = slots[free_slots[i]].load(std::memory_order_relaxed);
+            if (vc.get(prev->slot) >= prev->clock.load(std::memory_order_relaxed)) {
+                free_slots.erase(free_slots.begin() + i);
+                thr = prev;
+                thr->reuse(child);
+                break;
+            }
+        }
+        if (nullptr == thr) {
+            if (next_slot == Epoch::max_slots) {
+                std::cerr << "> fasttrack: thread limit (" << Epoch::max_slots << " threads) exceeded" << std::endl;
+                std::abort();
+            }
+            all_threads.emplace_back(new ThreadState(next_slot, child));
+            thr = all_threads.back().get();
+            slots[next_slot].store(thr, std::memory_order_release);
+            ++next_slot;
+        }
+    }
+    {
+        std::lock_guard<ipc::spinlock> lg_t(thr->mx);
+        thr->vc.join(vc);
+    }
+
+    ThreadState * prev = thread_states.insert(child, thr);
+    if (nullptr != prev) {
+        // the tid was reused without a join
+        prev->active.store(false, std::memory_order_relaxed);
+    }
+    *tls = thr;
+}
+
+void detector::join(tid_t parent, tid_t child) {
+    ThreadState * thr = thread_states.erase(child);
+    if (nullptr == thr)
+        return;
+    thr->active.store(false, std::memory_order_relaxed);
+
+    // the parent happens after all events of the child, this is applied lazily
+    ThreadState * parent_thr = (parent != child && parent != unknown_thread) ?
+        thread_states.find(parent) : nullptr;
+    if (nullptr != parent_thr || parent == unknown_thread) {
+        VectorClock final_vc;
+        {
+            std::lock_guard<ipc::spinlock> lg_t(thr->mx);
+            final_vc = thr->vc;
+            final_vc.join(thr->pending);
+        }
+        final_vc.set(thr->slot, thr->clock.load(std::memory_order_acquire));
+
+        auto pass_on = [&final_vc](detector::tid_t, ThreadState * other) {
+            std::lock_guard<ipc::spinlock> lg_p(other->mx);
+            other->pending.join(final_vc);
+            other->has_pending.store(true, std::memory_order_release);
+        };
+        if (parent == unknown_thread) {
+            thread_states.for_each(pass_on);
+        }
+        else {
+            pass_on(parent, parent_thr);
+        }
+    }
+
+    std::lock_guard<ipc::spinlock> lg(thr_mx);
+    free_slots.push_back(thr->slot);
+}
+
+void detector::detach(tls_t tls, tid_t thread_id) {
+    // a detached thread keeps running and is never joined, its state is
+    // released when the thread finishes
+}
+
+void detector::finish(tls_t tls, tid_t thread_id) {
+    ThreadState * thr = thread_states.erase(thread_id);
+    if (nullptr == thr)
+        return;
+    thr->active.store(false, std::memory_order_relaxed);
+
+    // nobody acquires the final clock, hence the slot is only reused
+    // by threads which happen after all of its events (see fork)
+    std::lock_guard<ipc::spinlock> lg(thr_mx);
+    free_slots.push_back(thr->slot);
+}
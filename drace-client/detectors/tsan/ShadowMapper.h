@@ -0,0 +1,161 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <mutex> // for lock_guard
+#include <cstdint>
+#include <cstddef>
+
+#include <detector/detector_if.h>
+#include <ipc/spinlock.h>
+#include <tsan-if.h>
+
+namespace detector {
+    namespace tsan {
+        /**
+         * \brief Maps 64-bit application addresses into the tsan application range
+         *
+         * TSAN (go-runtime flavour) only supports application memory below
+         * \c app_mem_end and requires the shadow memory to be mapped explicitly.
+         * The process address space is split into regions of 2^region_bits bytes.
+         * When a region is touched the first time, it is assigned the next free
+         * slot of the same size in the tsan application range and the shadow of
+         * this slot is mapped. Hence, the shadow memory grows with the number of
+         * used regions and distinct addresses never alias as long as less than
+         * \c num_slots regions are used.
+         *
+         * Slots are handed out in increasing order, as tsan expects subsequent
+         * shadow mappings to be located above the previous ones.
+         */
+        class ShadowMapper {
+        public:
+            /// size of a region (2^n bytes)
+            static constexpr unsigned region_bits = 26;
+            static constexpr uint64_t region_size = 1ull << region_bits;
+            /// end of application memory in the tsan go / windows memory layout
+            static constexpr uint64_t app_mem_end = 0x00e000000000ull;
+            /// slot 0 is never used, as the first page is reserved
+            static constexpr uint32_t num_slots = static_cast<uint32_t>(app_mem_end >> region_bits);
+            static constexpr size_t   num_regions = static_cast<size_t>(proc_addr_limit >> region_bits) + 1;
+
+        private:
+            /// region -> slot, 0 if not mapped yet
+            std::atomic<uint32_t> * _slots;
+            /// slot -> region, used to translate addresses back
+            std::atomic<uint64_t> * _regions;
+            uint32_t                _next_slot{ 1 };
+            ipc::spinlock           _mx;
+
+        public:
+            ShadowMapper()
+                : _slots(new std::atomic<uint32_t>[num_regions]),
+                  _regions(new std::atomic<uint64_t>[num_slots])
+            {
+                for (size_t i = 0; i < num_regions; ++i)
+                    _slots[i].store(0, std::memory_order_relaxed);
+                for (size_t i = 0; i < num_slots; ++i)
+                    _regions[i].store(0, std::memory_order_relaxed);
+            }
+
+            ShadowMapper(const ShadowMapper &) = delete;
+            ShadowMapper & operator=(const ShadowMapper &) = delete;
+
+            ~ShadowMapper() {
+                delete[] _slots;
+                delete[] _regions;
+            }
+
+            /**
+             * Translates an application address to the tsan application range.
+             * The shadow memory of the target region is mapped if necessary.
+             * Addresses above \ref detector::proc_addr_limit (e.g. handles used
+             * as sync identifiers) are folded into the supported range.
+             */
+            inline uint64_t translate(uint64_t addr) {
+                addr &= proc_addr_limit;
+                const uint64_t region = addr >> region_bits;
+                uint32_t slot = _slots[region].load(std::memory_order_acquire);
+                if (slot == 0) {
+                    slot = map_region(region);
+                }
+                return (static_cast<uint64_t>(slot) << region_bits) | (addr & (region_size - 1));
+            }
+
+            /** Translates an address of the tsan application range back */
+            inline uint64_t restore(uint64_t addr) const {
+                const uint64_t slot = addr >> region_bits;
+                if (slot == 0 || slot >= num_slots) {
+                    return addr;
+                }
+                const uint64_t region = _regions[slot].load(std::memory_order_relaxed);
+                return (region << region_bits) | (addr & (region_size - 1));
+            }
+
+            /**
+             * Calls fn(translated_begin, size) for each part of [addr, addr + size)
+             * which is located in a single region. Use this for ranges, as
+             * consecutive regions are not consecutive in the tsan range.
+             */
+            template<typename Fn>
+            inline void for_each_part(uint64_t addr, size_t size, Fn && fn) {
+                const uint64_t end = addr + size;
+                while (addr < end) {
+                    const uint64_t region_end = (addr | (region_size - 1)) + 1;
+                    const uint64_t part_end = (end < region_end) ? end : region_end;
+                    fn(translate(addr), static_cast<size_t>(part_end - addr));
+                    addr = part_end;
+                }
+            }
+
+            /**
+             * Calls fn(begin, size) for each slot in the tsan range which is
+             * backed by shadow memory. Mappings are kept for the lifetime of
+             * the process, as tsan cannot unmap shadow memory.
+             */
+            template<typename Fn>
+            inline void for_each_slot(Fn && fn) {
+                std::lock_guard<ipc::spinlock> lg(_mx);
+                for (uint32_t slot = 1; slot < _next_slot; ++slot) {
+                    fn(static_cast<uint64_t>(slot) << region_bits, static_cast<size_t>(region_size));
+                }
+            }
+
+            /** Number of regions with mapped shadow memory */
+            inline size_t mapped_regions() {
+                std::lock_guard<ipc::spinlock> lg(_mx);
+                return _next_slot - 1;
+            }
+
+        private:
+            uint32_t map_region(uint64_t region) {
+                std::lock_guard<ipc::spinlock> lg(_mx);
+                // another thread might have been faster
+                uint32_t slot = _slots[region].load(std::memory_order_relaxed);
+                if (slot != 0) {
+                    return slot;
+                }
+                if (_next_slot < num_slots) {
+                    slot = _next_slot++;
+                    _regions[slot].store(region, std::memory_order_relaxed);
+                    __tsan_map_shadow((void*)(static_cast<uint64_t>(slot) << region_bits),
+                        static_cast<unsigned long>(region_size));
+                }
+                else {
+                    // tsan range is exhausted, share slots (might produce false positives)
+                    slot = 1 + static_cast<uint32_t>(region % (num_slots - 1));
+                }
+                _slots[region].store(slot, std::memory_order_release);
+                return slot;
+            }
+        };
+    } // namespace tsan
+} // namespace detector
@@ -9,18 +9,21 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <map>
 #include <vector>
 #include <atomic>
 #include <algorithm>
-#include <mutex> // for lock_guard
-#include <unordered_map>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <limits>
+#include <mutex> // for lock_guard
 
 #include <detector/detector_if.h>
-
+#include <detector/AllocationIndex.h>
+#include <detector/ThreadRegistry.h>
 #include <ipc/spinlock.h>
+#include "ShadowMapper.h"
+
 #include <tsan-if.h>
 
 namespace detector {
@@ -31,13 +34,11 @@ namespace detector {
             bool heap_only{ false };
         } params;
 
-        struct ThreadState {
-            detector::tls_t tsan;
-            bool active;
-        };
-
-        /// reserved area at begin of shadow memory addr range;
-        constexpr uint64_t MEMSTART = 4096;
+        /// the tsan runtime can only be initialized once per process
+        static bool                     tsan_initialized{ false };
+        /// internal tsan thread, used to reset the shadow memory on finalize
+        static void *                   reset_thr{ nullptr };
+        static Callback                 race_clb{ nullptr };
 
         /**
          * To avoid false-positives track races only if they are on the heap
@@ -50,12 +51,17 @@ namespace detector {
         static std::atomic<uint64_t>    heap_lb{ std::numeric_limits<uint64_t>::max() };
         // upper bound of heap
         static std::atomic<uint64_t>    heap_ub{ 0 };
-        /* Cannot use std::mutex here, hence use spinlock */
-        static ipc::spinlock            mxspin;
-        static std::map<uint64_t, size_t, std::greater<uint64_t>> allocations;
-        static std::unordered_map<detector::tid_t, ThreadState> thread_states;
-
-        void reportRaceCallBack(__tsan_race_info* raceInfo, void * add_race_clb) {
+        /* live heap blocks, lock-free for readers */
+        static AllocationIndex<>        allocations;
+        /* maps application addresses to tsan addresses */
+        static ShadowMapper             shadow;
+        /* tsan states of the running threads */
+        static ThreadRegistry<void>     thread_states;
+        /* Serializes the lookups of foreign thread states with their teardown,
+        *  as tsan frees the state on finish. The registry itself is lock-free. */
+        static ipc::spinlock            thr_mx;
+
+        void reportRaceCallBack(__tsan_race_info* raceInfo, void * callback_parameter) {
             // Fixes erronous thread exit handling by ignoring races where at least one tid is 0
             if (!raceInfo->access1->user_id || !raceInfo->access2->user_id)
                 return;
@@ -76,7 +82,7 @@ namespace detector {
 
                 access.thread_id = (unsigned) race_info_ac->user_id;
                 access.write = race_info_ac->write;
-                access.accessed_memory = (uint64_t)race_info_ac->accessed_memory;
+                access.accessed_memory = shadow.restore((uint64_t)race_info_ac->accessed_memory);
                 access.access_size = race_info_ac->size;
                 access.access_type = race_info_ac->type;
 
@@ -84,16 +90,7 @@ namespace detector {
                 memcpy(access.stack_trace, race_info_ac->stack_trace, ssize * sizeof(uint64_t));
                 access.stack_size = ssize;
 
-                uint64_t addr = (uint64_t)(race_info_ac->accessed_memory);
-                // todo: lock allocations
-                mxspin.lock();
-                auto it = allocations.lower_bound(addr);
-                if (it != allocations.end() && (addr < (it->first + it->second))) {
-                    access.onheap = true;
-                    access.heap_block_begin = it->first;
-                    access.heap_block_size = it->second;
-                }
-                mxspin.unlock();
+                access.onheap = allocations.find(access.accessed_memory, &access.heap_block_begin, &access.heap_block_size);
 
                 if (i == 0) {
                     race.first = access;
@@ -102,24 +99,11 @@ namespace detector {
                     race.second = access;
                 }
             }
-            ((void(*)(const detector::Race*))add_race_clb)(&race);
-        }
-
-        /*
-         * \brief split address at 32-bit boundary (zero above)
-         *
-         * TSAN internally uses a shadow memory block to track all
-         * accesses. Here, we use a fixed 32-bit block and map
-         * our accesses to this block by just considering the lower
-         * half. This leads to false positives, if the mapping is not
-         * unique. However even with extensive tests on Windows, we
-         * never discovered such a situation.
-         *
-         * TODO: Find a solution to reliably detect all stack and heap
-         *       regions to finally work with full 64-bit addresses
-         */
-        constexpr uint64_t lower_half(uint64_t addr) {
-            return (addr & 0x00000000FFFFFFFF);
+            // the callback might change between two sessions
+            Callback clb = race_clb;
+            if (nullptr != clb) {
+                clb(&race);
+            }
         }
 
         /** Fast trivial hash function using a prime. We expect tids in [1,10^5] */
@@ -153,25 +137,19 @@ namespace detector {
                 << "> version:   " << detector::version() << std::endl;
         }
 
-        /* precisely decide if (cropped to 32 bit) addr is on the heap */
+        /* precisely decide if addr is on the heap */
         template<bool fastapprox = false>
         static inline bool on_heap(uint64_t addr) {
-            // filter step without locking
+            // filter step using only the heap bounds
             if (on_heap<true>(addr)) {
-                std::lock_guard<spinlock> lg(mxspin);
-
-                auto it = allocations.lower_bound(addr);
-                uint64_t beg = it->first;
-                size_t   sz = it->second;
-
-                return (addr < (beg + sz));
+                return allocations.contains(addr);
             }
             else {
                 return false;
             }
         }
 
-        /* approximate if (cropped to 23 bit) addr is on the heap
+        /* approximate if addr is on the heap
         *  (no false-negatives, but possibly false positives)
         */
         template<>
@@ -189,20 +167,42 @@ bool detector::init(int argc, const char **argv, Callback rc_clb) {
     parse_args(argc, argv);
     print_config();
 
-    thread_states.reserve(128);
+    race_clb = rc_clb;
 
-    __tsan_init_simple(reportRaceCallBack, (void*)rc_clb);
-    // we create a shadow memory of nearly the whole 32-bit address range
-    // all memory accesses have to be inside this region
-    __tsan_map_shadow((void*)MEMSTART, (size_t)(0xFFFFFFFF - MEMSTART));
+    if (!tsan_initialized) {
+        // shadow memory is mapped lazily by the ShadowMapper
+        __tsan_init_simple(reportRaceCallBack, nullptr);
+        // races of user id 0 are not reported
+        reset_thr = __tsan_create_thread(0);
+        tsan_initialized = true;
+    }
     return true;
 }
 
 void detector::finalize() {
-    for (auto & t : thread_states) {
-        if (t.second.active)
-            detector::finish(t.second.tsan, t.first);
+    {
+        std::lock_guard<ipc::spinlock> lg(thr_mx);
+        thread_states.for_each([](detector::tid_t tid, void * thr) {
+            if (nullptr != thread_states.erase(tid))
+                __tsan_go_end(thr);
+        });
+        thread_states.clear();
     }
+
+    // The tsan runtime cannot be re-initialized, hence reset all state
+    // which is visible to a later session: sync objects and shadow cells
+    // of all used regions, the heap and the configuration.
+    shadow.for_each_slot([](uint64_t begin, size_t size) {
+        __tsan_free((void*)begin, size);
+        __tsan_malloc(reset_thr, nullptr, (void*)begin, size);
+    });
+    allocations.clear();
+    heap_lb.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    heap_ub.store(0, std::memory_order_relaxed);
+    races.store(0, std::memory_order_relaxed);
+    misses.store(0, std::memory_order_relaxed);
+    race_clb = nullptr;
+    params = tsan_params_t();
     // TODO: this calls exit which we cannot do here
     //__tsan_fini();
     // do not perform IO here, as it crashes / interfers with dotnet
@@ -211,6 +211,11 @@ void detector::finalize() {
     //std::cout << "> Detector missed " << misses.load() << " possible heap refs" << std::endl;
 }
 
+detector::DeliveryStats detector::delivery_stats() {
+    // events are analyzed in-process
+    return DeliveryStats();
+}
+
 std::string detector::name() {
     return std::string("TSAN");
 }
@@ -228,154 +233,197 @@ void detector::func_exit(tls_t tls) {
 }
 
 void detector::acquire(tls_t tls, void* mutex, int rec, bool write) {
-    uint64_t addr_32 = lower_half((uint64_t)mutex);
-    // if the mutex is a handle, the ID might be too small
-    if (addr_32 < MEMSTART)
-        addr_32 += MEMSTART;
+    uint64_t addr_tsan = shadow.translate((uint64_t)mutex);
 
     //std::cout << "detector::acquire " << thread_id << " @ " << mutex << std::endl;
 
     assert(nullptr != tls);
 
-    __tsan_mutex_after_lock(tls, (void*)addr_32, (void*)write);
+    __tsan_mutex_after_lock(tls, (void*)addr_tsan, (void*)write);
 }
 
 void detector::release(tls_t tls, void* mutex, bool write) {
-    uint64_t addr_32 = lower_half((uint64_t)mutex);
-    // if the mutex is a handle, the ID might be too small
-    if (addr_32 < MEMSTART)
-        addr_32 += MEMSTART;
+    uint64_t addr_tsan = shadow.translate((uint64_t)mutex);
 
     //std::cout << "detector::release " << thread_id << " @ " << mutex << std::endl;
 
     assert(nullptr != tls);
 
-    __tsan_mutex_before_unlock(tls, (void*)addr_32, (void*)write);
+    __tsan_mutex_before_unlock(tls, (void*)addr_tsan, (void*)write);
 }
 
 void detector::happens_before(tls_t tls, void* identifier) {
-    uint64_t addr_32 = lower_half((uint64_t)identifier);
-    __tsan_happens_before(tls, (void*)addr_32);
+    uint64_t addr_tsan = shadow.translate((uint64_t)identifier);
+    __tsan_happens_before(tls, (void*)addr_tsan);
 }
 
 void detector::happens_after(tls_t tls, void* identifier) {
-    uint64_t addr_32 = lower_half((uint64_t)identifier);
-    __tsan_happens_after(tls, (void*)addr_32);
+    uint64_t addr_tsan = shadow.translate((uint64_t)identifier);
+    __tsan_happens_after(tls, (void*)addr_tsan);
 }
 
 void detector::read(tls_t tls, void* pc, void* addr, size_t size)
 {
-    uint64_t addr_32 = lower_half((uint64_t)addr);
-    if (!params.heap_only || on_heap<true>((uint64_t)addr_32)) {
-        __tsan_read(tls, (void*)addr_32, (void*)pc);
+    if (!params.heap_only || on_heap<true>((uint64_t)addr)) {
+        __tsan_read(tls, (void*)shadow.translate((uint64_t)addr), (void*)pc);
     }
 }
 
 void detector::write(tls_t tls, void* pc, void* addr, size_t size)
 {
-    uint64_t addr_32 = lower_half((uint64_t)addr);
+    if (!params.heap_only || on_heap<true>((uint64_t)addr)) {
+        __tsan_write(tls, (void*)shadow.translate((uint64_t)addr), (void*)pc);
+    }
+}
 
-    if (!params.heap_only || on_heap<true>((uint64_t)addr_32)) {
-        __tsan_write(tls, (void*)addr_32, (void*)pc);
+size_t detector::access_batch(tls_t tls, const MemAccess* refs, size_t num_refs, uint64_t excl_beg, uint64_t excl_end, const PcTable* pc_table)
+{
+    // the heap bounds are approximations anyway, hence load them once per batch
+    const bool     heap_only = params.heap_only;
+    const uint64_t lb = heap_lb.load(std::memory_order_relaxed);
+    const uint64_t ub = heap_ub.load(std::memory_order_relaxed);
+
+    size_t processed = 0;
+    for (const MemAccess * ref = refs; ref != refs + num_refs; ++ref) {
+        uint64_t addr = ref->addr();
+        if ((addr >= excl_beg && addr < excl_end) || addr > proc_addr_limit) {
+            continue;
+        }
+        if (heap_only && !(addr >= lb && addr < ub)) {
+            continue;
+        }
+        void * pc = pc_table ? pc_table->lookup(ref->pc) : (void*)ref->pc;
+        const size_t size = ref->size();
+        if (size <= 8 && (addr & 7) + size <= 8) {
+            // within a single shadow cell
+            void * addr_tsan = (void*)shadow.translate(addr);
+            if (ref->write()) {
+                __tsan_write(tls, addr_tsan, pc);
+            }
+            else {
+                __tsan_read(tls, addr_tsan, pc);
+            }
+        }
+        else {
+            // ranges (e.g. coalesced accesses) might span multiple regions
+            const bool write = ref->write();
+            shadow.for_each_part(addr, size, [&](uint64_t part, size_t part_size) {
+                if (write) {
+                    tsan_write_range(tls, (void*)part, part_size, pc);
+                }
+                else {
+                    tsan_read_range(tls, (void*)part, part_size, pc);
+                }
+            });
+        }
+        ++processed;
     }
+    return processed;
 }
 
 void detector::allocate(tls_t tls, void* pc, void* addr, size_t size) {
-    uint64_t addr_32 = lower_half((uint64_t)addr);
+    uint64_t addr_64 = (uint64_t)addr;
 
-    __tsan_malloc(tls, pc, (void*)addr_32, size);
+    // the block might span multiple regions, register each part
+    shadow.for_each_part(addr_64, size, [&](uint64_t part, size_t part_size) {
+        __tsan_malloc(tls, pc, (void*)part, part_size);
+    });
 
-    {
-        std::lock_guard<ipc::spinlock> lg(mxspin);
-        allocations.emplace(addr_32, size);
-    }
+    allocations.insert(addr_64, size);
 
-    //std::cout << "alloc: addr: " << (void*)addr_32 << " size " << size << std::endl;
+    //std::cout << "alloc: addr: " << (void*)addr_64 << " size " << size << std::endl;
 
     // this is a bit racy as other allocations might finish first
     // but this is ok as only approximations are necessary
 
     // increase heap upper bound
-    uint64_t new_ub = addr_32 + size;
+    uint64_t new_ub = addr_64 + size;
     if (new_ub > heap_ub.load(std::memory_order_relaxed)) {
         heap_ub.store(new_ub, std::memory_order_relaxed);
         //std::cout << "New heap ub " << std::hex << new_ub << std::endl;
     }
     // decrease heap lower bound
-    if (addr_32 < heap_lb.load(std::memory_order_relaxed)) {
-        heap_lb.store(addr_32, std::memory_order_relaxed);
-        //std::cout << "New heap lb " << std::hex << addr_32 << std::endl;
+    if (addr_64 < heap_lb.load(std::memory_order_relaxed)) {
+        heap_lb.store(addr_64, std::memory_order_relaxed);
+        //std::cout << "New heap lb " << std::hex << addr_64 << std::endl;
     }
 
 }
 
 void detector::deallocate(tls_t tls, void* addr) {
-    uint64_t addr_32 = lower_half((uint64_t)addr);
+    uint64_t addr_64 = (uint64_t)addr;
+    size_t size;
 
-    mxspin.lock();
     // ocasionally free is called more often than allocate, hence guard
-    if (allocations.count(addr_32) == 1) {
-        size_t size = allocations[addr_32];
-        allocations.erase(addr_32);
-        // if allocation was top of heap, decrease heap_limit
-        if (addr_32 + size == heap_ub.load(std::memory_order_relaxed)) {
-            if (allocations.size() != 0) {
-                auto upper_heap = allocations.rbegin();
-                heap_ub.store(upper_heap->first + upper_heap->second);
-            }
-            else {
-                heap_ub.store(0, std::memory_order_relaxed);
-            }
-        }
-        mxspin.unlock();
-
-        __tsan_free((void*)addr_32, size);
-        //std::cout << "free: addr:  " << (void*)addr_32 << " size " << size << std::endl;
+    if (allocations.erase(addr_64, &size)) {
+        // if allocation was top of heap, decrease heap_limit.
+        // As blocks do not overlap, all remaining blocks end below addr
+        uint64_t block_end = addr_64 + size;
+        heap_ub.compare_exchange_strong(block_end, addr_64, std::memory_order_relaxed);
+
+        shadow.for_each_part(addr_64, size, [](uint64_t part, size_t part_size) {
+            __tsan_free((void*)part, part_size);
+        });
+        //std::cout << "free: addr:  " << (void*)addr_64 << " size " << size << std::endl;
     }
     else {
         // we expect some errors here, as either dr does not catch all 
         // alloc events, or they are not fully balanced.
         // TODO: compare with drmemory
-        mxspin.unlock();
-        //std::cout << "Error on free at " << (void*) addr_32 << std::endl;
+        //std::cout << "Error on free at " << (void*) addr_64 << std::endl;
     }
 }
 
 void detector::fork(tid_t parent, tid_t child, tls_t * tls) {
-    const uint64_t event_id = get_event_id(parent, child);
     *tls = __tsan_create_thread(child);
-   
-    std::lock_guard<ipc::spinlock> lg(mxspin);
 
-    for (const auto & t : thread_states) {
-        if (t.second.active) {
-            assert(nullptr != t.second.tsan);
-            __tsan_happens_before(t.second.tsan, (void*)(event_id));
+    std::lock_guard<ipc::spinlock> lg(thr_mx);
+    // the child happens after the events of its parent up to now.
+    // An unregistered parent (e.g. not instrumented) has nothing to pass on
+    const uint64_t event_addr = shadow.translate(get_event_id(parent, child));
+    if (parent == unknown_thread) {
+        thread_states.for_each([event_addr](detector::tid_t, void * thr) {
+            __tsan_happens_before(thr, (void*)(event_addr));
+        });
+        __tsan_happens_after(*tls, (void*)(event_addr));
+    }
+    else if (parent != child) {
+        void * parent_thr = thread_states.find(parent);
+        if (nullptr != parent_thr) {
+            __tsan_happens_before(parent_thr, (void*)(event_addr));
+            __tsan_happens_after(*tls, (void*)(event_addr));
         }
     }
-    __tsan_happens_after(*tls, (void*)(event_id));
-    thread_states[child] = ThreadState{ *tls, true };
+    // if the tid was reused without a join, the old state is dropped
+    void * prev = thread_states.insert(child, *tls);
+    if (nullptr != prev) {
+        __tsan_go_end(prev);
+    }
 }
 
 void detector::join(tid_t parent, tid_t child) {
-    const uint64_t event_id = get_event_id(parent, child);
-
-    std::lock_guard<ipc::spinlock> lg(mxspin);
-    thread_states[child].active = false;
-
-    const auto thr = thread_states[child].tsan;
-    assert(nullptr != thr);
-    __tsan_happens_before(thr, (void*)(event_id));
-    for (const auto & t : thread_states) {
-        if (t.second.active) {
-            assert(nullptr != t.second.tsan);
-            __tsan_happens_after(t.second.tsan, (void*)(event_id));
+    std::lock_guard<ipc::spinlock> lg(thr_mx);
+    void * thr = thread_states.erase(child);
+    if (nullptr == thr)
+        return;
+
+    // the parent happens after all events of the child
+    const uint64_t event_addr = shadow.translate(get_event_id(parent, child));
+    if (parent == unknown_thread) {
+        __tsan_happens_before(thr, (void*)(event_addr));
+        thread_states.for_each([event_addr](detector::tid_t, void * other) {
+            __tsan_happens_after(other, (void*)(event_addr));
+        });
+    }
+    else if (parent != child) {
+        void * parent_thr = thread_states.find(parent);
+        if (nullptr != parent_thr) {
+            __tsan_happens_before(thr, (void*)(event_addr));
+            __tsan_happens_after(parent_thr, (void*)(event_addr));
         }
     }
     // we cannot use __tsan_ThreadJoin here, as local tid is not tracked
-    // hence use thread finish and draw edge between exited thread
-    // and all other threads
-    __tsan_ThreadFinish(thread_states[child].tsan);
+    __tsan_ThreadFinish(thr);
 }
 
 void detector::detach(tls_t tls, tid_t thread_id) {
@@ -384,9 +432,10 @@ void detector::detach(tls_t tls, tid_t thread_id) {
 }
 
 void detector::finish(tls_t tls, tid_t thread_id) {
+    std::lock_guard<ipc::spinlock> lg(thr_mx);
+    // unpublish the state before it is freed
+    thread_states.erase(thread_id);
     if (tls != nullptr) {
         __tsan_go_end(tls);
     }
-    std::lock_guard<ipc::spinlock> lg(mxspin);
-    thread_states[thread_id].active = false;
 }
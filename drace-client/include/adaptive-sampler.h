@@ -0,0 +1,78 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+
+#include <atomic>
+#include <array>
+
+#include <detector/detector_if.h>
+
+namespace drace {
+	/**
+	* Adaptive per-fragment sampling (similar to LiteRace).
+	*
+	* Each code fragment (aligned region of 2^FRAGMENT_RES bytes) keeps a
+	* per-thread sampling rate. The rate starts at 100% and is halved after
+	* each sampled execution, down to 2^-MAX_LEVEL. Hence, hot code is
+	* rarely analyzed, while cold code keeps full coverage.
+	* Fragments are identified by the call instruction which enters the
+	* sampled function, hence they match the frames of a race callstack.
+	* If a fragment takes part in a race, its rate is reset to 100% in all threads.
+	* The racy fragments are published in a ring, which each thread consumes
+	* on its next sample. A thread which fell behind by more than the ring
+	* resets all of its fragments.
+	*/
+	class AdaptiveSampler {
+	public:
+		/** fragment granularity (2^n bytes), equals the granularity of the pc statistics */
+		static constexpr unsigned FRAGMENT_RES = 10;
+		/** minimum sampling rate is 2^-MAX_LEVEL */
+		static constexpr uint8_t  MAX_LEVEL = 10;
+		/** number of recent racy fragments which are kept for the threads */
+		static constexpr size_t   RACY_RING = 4096;
+
+	private:
+		/**
+		* Recently racy fragments, entry i is stored at i % RACY_RING.
+		* Writers reserve an entry before they overwrite it (seqlock), hence
+		* readers detect entries which were overwritten while reading.
+		*/
+		std::array<std::atomic<uint64_t>, RACY_RING> _racy;
+		/** number of published entries */
+		std::atomic<size_t>    _num_racy{ 0 };
+		/** number of reserved entries, protected by _mx */
+		std::atomic<size_t>    _reserved{ 0 };
+		void *                 _mx;
+
+	public:
+		AdaptiveSampler();
+		~AdaptiveSampler();
+
+		AdaptiveSampler(const AdaptiveSampler &) = delete;
+		AdaptiveSampler & operator=(const AdaptiveSampler &) = delete;
+
+		/**
+		* Returns true if this execution of the fragment containing pc
+		* (the call instruction) should be analyzed.
+		* Has to be called by the executing thread.
+		*/
+		bool sample(per_thread_t * data, void * pc);
+
+		/** Resets the sampling rate of all fragments which took part in this race */
+		void on_race(const detector::Race * race);
+
+	private:
+		/** Applies resets of racy fragments which have not been seen by this thread */
+		void sync_racy(per_thread_t * data, size_t num_racy);
+	};
+} // namespace drace
@@ -0,0 +1,116 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "memory-tracker.h"
+#include "aligned-buffer.h"
+
+#include <ipc/ringbuffer.hpp>
+#include <ipc/spinlock.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <dr_api.h>
+
+namespace drace {
+	class AnalysisWorker;
+
+	/** Full memory-reference buffer, handed over to a worker */
+	struct AsyncBatch {
+		byte *   buf;
+		uint32_t num_refs;
+	};
+
+	/**
+	* Per-thread handover queues between the application thread (producer)
+	* and its analysis worker (consumer).
+	*/
+	struct AsyncQueue {
+		/// number of buffers per thread (including the active one)
+		static constexpr size_t num_buffers = 8;
+
+		per_thread_t *   owner;
+		AnalysisWorker * worker;
+
+		/// buffers ready for analysis
+		ipc::Ringbuffer<AsyncBatch, num_buffers, true> full;
+		/// analyzed buffers, returned to the application thread
+		ipc::Ringbuffer<byte*, num_buffers, true> empty;
+		/// memory of the spare buffers
+		AlignedBuffer<byte, 64> storage;
+
+		/// number of handed over buffers (only written by producer)
+		std::atomic<uint64_t> submitted{ 0 };
+		/// number of analyzed buffers (only written by consumer)
+		std::atomic<uint64_t> analyzed{ 0 };
+		/// references passed to the detector (only written by consumer)
+		uint64_t proc_refs{ 0 };
+	};
+
+	/**
+	* Pool of analysis threads which run the detector on the memory-reference
+	* buffers of the application threads, to move this work off the critical path.
+	*
+	* When the buffer of a thread is full, it is handed over to the queue of this
+	* thread and replaced by a spare buffer. If no spare buffer is left, the
+	* application thread waits for its worker (backpressure).
+	*
+	* Each queue is processed by exactly one worker, hence the references of a
+	* thread are analyzed in program order. Function entries and exits are
+	* recorded as markers in the buffer. Before a synchronisation event of a
+	* thread is passed to the detector, the thread waits until its queue is
+	* drained. By that, the detector observes the same happens-before order as
+	* with inline analysis.
+	*/
+	class AnalysisPool {
+	public:
+		using mem_ref_t = MemoryTracker::mem_ref_t;
+
+	private:
+		std::vector<std::unique_ptr<AnalysisWorker>> _workers;
+		std::atomic<unsigned> _next_worker{ 0 };
+
+	public:
+		explicit AnalysisPool(unsigned num_workers);
+		/** Analyzes all pending buffers and stops the workers */
+		~AnalysisPool();
+
+		AnalysisPool(const AnalysisPool &) = delete;
+		AnalysisPool & operator=(const AnalysisPool &) = delete;
+
+		/** Creates the queue of this thread. Call from the thread itself */
+		void register_thread(void * drcontext, per_thread_t * data);
+
+		/** Drains and removes the queue of this thread */
+		void unregister_thread(void * drcontext, per_thread_t * data);
+
+		/**
+		* Drains and removes the queues of all threads which are still alive.
+		* Call on process exit, before the pool is destroyed
+		*/
+		void unregister_all();
+
+		/**
+		* Hands the current buffer (num_refs entries) over to the worker
+		* and continues with an empty one.
+		*/
+		void submit(per_thread_t * data, uint32_t num_refs);
+
+		/** Blocks until all handed over buffers of this thread are analyzed */
+		void drain(per_thread_t * data);
+
+		/** Analyzes a buffer, the caller has to own the detector tls of this thread */
+		static uint64_t analyze(per_thread_t * data, const mem_ref_t * refs, size_t num_refs);
+	};
+} // namespace drace
@@ -15,6 +15,12 @@ namespace drace {
 	static void event_exit(void);
 	static void event_thread_init(void *drcontext);
 	static void event_thread_exit(void *drcontext);
+#ifdef LINUX
+	// clone syscall, records the creator of a thread
+	static bool event_filter_syscall(void *drcontext, int sysnum);
+	static bool event_pre_syscall(void *drcontext, int sysnum);
+	static void event_post_syscall(void *drcontext, int sysnum);
+#endif
 
 	// Runtime Configuration
 	static void parse_args(int argc, const char **argv);
@@ -16,6 +16,7 @@
 
 #include "function-wrapper/internal.h"
 #include "function-wrapper/event.h"
+#include "function-wrapper/symbol-scan.h"
 
 namespace drace {
 	/// application function wrapping
@@ -50,20 +51,24 @@ namespace drace {
 			/** Pre-function callback for each symbol found */
 			wrapcb_pre_t pre,
 			/** Post-function callback for each symbol found */
-			wrapcb_post_t post);
+			wrapcb_post_t post,
+			/** If set, debug symbols are collected for a combined search */
+			SymbolScan * scan = nullptr);
 
 		/** Wrap mutex aquire and release */
-		void wrap_mutexes(const module_data_t *mod, bool sys);
+		void wrap_mutexes(const module_data_t *mod, bool sys, SymbolScan * scan = nullptr);
 		/** Wrap heap alloc and free */
 		void wrap_allocations(const module_data_t *mod);
 		/** Wrap excluded functions */
-		void wrap_excludes(const module_data_t *mod, std::string section = "functions");
+		void wrap_excludes(const module_data_t *mod, std::string section = "functions", SymbolScan * scan = nullptr);
 		/** Wrap annotations */
 		void wrap_annotations(const module_data_t *mod);
 		/** Wrap C++11 thread starters */
 		void wrap_thread_start(const module_data_t *mod);
-		/** Wrap System thread starters */
+		/** Wrap System thread starters, to attribute forks to their creator */
 		void wrap_thread_start_sys(const module_data_t *mod);
+		/** Wrap System waits on threads, to attribute joins to their joiner */
+		void wrap_thread_join_sys(const module_data_t *mod);
 
 		template<typename InputIt>
 		void wrap_dotnet(InputIt a, InputIt b) {
@@ -50,9 +50,21 @@ namespace drace {
 			static void thread_creation(void *wrapctx, void **user_data);
 			static void thread_handover(void *wrapctx, void *user_data);
 
+			/**
+			* CreateThread Windows API call, records the creator and the handle of the thread.
+			* On Linux (pthread_create), only the handle is recorded, as the creator is
+			* known from the clone syscall.
+			*/
 			static void thread_pre_sys(void *wrapctx, void **user_data);
 			static void thread_post_sys(void *wrapctx, void *user_data);
 
+			/**
+			* WaitForSingleObject on a thread handle (pthread_join on Linux),
+			* records the joiner of the thread
+			*/
+			static void thread_join_pre_sys(void *wrapctx, void **user_data);
+			static void thread_join_post_sys(void *wrapctx, void *user_data);
+
 			static void begin_excl(void *wrapctx, void **user_data);
 			static void end_excl(void *wrapctx, void *user_data);
 
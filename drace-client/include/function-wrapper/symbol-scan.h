@@ -0,0 +1,112 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <dr_api.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace drace {
+	namespace funwrap {
+		// forward declare to avoid circular dependency
+		using wrapcb_pre_t = void(void *, void **);
+		using wrapcb_post_t = void(void *, void *);
+
+		/**
+		* Collects the debug-symbol patterns to wrap in a single module and
+		* resolves all of them in one pass over the symbols of the module.
+		* Patterns may contain the wildcards '*' and '?'. As with
+		* drsym_search_symbols, only the first match of each pattern is wrapped.
+		*/
+		class SymbolScan {
+			struct request_t {
+				std::string     pattern;
+				wrapcb_pre_t  * pre;
+				wrapcb_post_t * post;
+				bool            found;
+				uint64_t        offset;
+			};
+
+			struct glob_t {
+				/// literal part before the first wildcard
+				std::string prefix;
+				size_t      request;
+			};
+
+			module_data_t *        _mod;
+			std::vector<request_t> _requests;
+
+			/* compiled matcher */
+			std::unordered_map<std::string, std::vector<size_t>> _exact;
+			std::vector<glob_t>    _globs;
+			/// number of requests without a match
+			size_t                 _pending{ 0 };
+			/// buffer for the current symbol name
+			std::string            _name;
+
+		public:
+			explicit SymbolScan(const module_data_t * mod);
+			~SymbolScan();
+
+			SymbolScan(const SymbolScan &) = delete;
+			SymbolScan & operator=(const SymbolScan &) = delete;
+
+			/** Adds a symbol pattern to wrap with the given callbacks */
+			void add(const std::string & pattern, wrapcb_pre_t pre, wrapcb_post_t post);
+
+			inline bool empty() const {
+				return _requests.empty();
+			}
+
+			inline const module_data_t * module() const {
+				return _mod;
+			}
+
+			/**
+			* Wraps the patterns whose location is known from the decision cache
+			* and removes them. Returns true if no pattern is left.
+			*/
+			bool apply_cached();
+
+			/**
+			* Enumerates the symbols of the module once, wraps all matches
+			* and records the results in the decision cache.
+			*/
+			void run();
+
+			/** Returns true if str matches the pattern (wildcards '*' and '?') */
+			static bool glob_match(const char * pattern, const char * str);
+
+		private:
+			void compile();
+
+			/** Callback of drsym_enumerate_symbols */
+			static bool match_symbol(const char * name, size_t modoffs, void * data);
+		};
+
+		/**
+		* Resolves the patterns of the scan. If some patterns are not cached,
+		* the symbol lookup is done by the scanner thread, so that loading the
+		* debug information overlaps with the application.
+		* \return true if the scan is deferred (the scanner frees the symbol resources)
+		*/
+		bool submit_scan(std::unique_ptr<SymbolScan> scan);
+
+		/** Starts the scanner thread */
+		void start_scanner();
+
+		/** Stops the scanner thread, pending scans are dropped */
+		void stop_scanner();
+	} // namespace funwrap
+} // namespace drace
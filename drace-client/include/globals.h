@@ -25,20 +25,18 @@
 #include <chrono>
 
 #include <dr_api.h>
+#include <container/SmallMap.h>
 
-/// max number of individual mutexes per thread
+/// max number of inline mutex slots per thread (more are stored in an overflow map)
 constexpr int MUTEX_MAP_SIZE = 128;
 
-/** Upper limit of process address space according to
-*   https://docs.microsoft.com/en-us/windows-hardware/drivers/gettingstarted/virtual-address-spaces
-*/
-constexpr uint64_t PROC_ADDR_LIMIT = 0x7FF'FFFFFFFF;
-
 /// DRace instrumentation framework
 namespace drace {
 	/** Runtime parameters */
 	struct params_t {
 		unsigned sampling_rate{ 1 };
+		/** Sample each code fragment with its own, decaying rate */
+		bool     adaptive_sampling{ false };
 		unsigned instr_rate{ 1 };
 		bool     lossy{ false };
 		bool     lossy_flush{ false };
@@ -53,8 +51,14 @@ namespace drace {
 		/** Use external controller */
 		bool     extctrl{ false };
 		bool     break_on_race{ false };
+		/** Number of races which can be pending for the race reporter */
+		unsigned race_queue_size{ 256 };
 		unsigned stack_size{ 31 };
+		/** Number of threads for asynchronous analysis (0 = analyze inline) */
+		unsigned async_workers{ 0 };
 		std::string  config_file{ "drace.ini" };
+		/** Persistent instrumentation decisions (empty = disabled) */
+		std::string  instr_cache;
 		std::string  out_file;
 		std::string  xml_file;
 		std::string  logfile{ "stderr" };
@@ -66,6 +70,18 @@ namespace drace {
 	extern params_t params;
 
 	class Statistics;
+	struct AsyncQueue;
+	namespace module {
+		class Cache;
+	}
+
+	/** Sampling state of a code fragment (adaptive sampling) */
+	struct fragment_state_t {
+		/// current sampling period is 2^level
+		uint8_t  level;
+		/// executions to skip until the next sample
+		uint32_t countdown;
+	};
 
 	/** Per Thread data (thread-private)
 	* \warning This struct is not default-constructed
@@ -74,17 +90,15 @@ namespace drace {
 	*          in memory_instr.
 	*/
 	struct per_thread_t {
-		using tls_map_t = std::vector<std::pair<thread_id_t, per_thread_t*>>;
-
 		byte *        buf_ptr;
 		ptr_int_t     buf_end;
+		/// begin of the current buffer (mem_buf or a buffer of the async queue)
+		byte *        buf_beg;
 
         /// Represents the detector state.
         byte          enabled{ true };
         /// inverse of flush pending, jmpecxz
         std::atomic<byte> no_flush{ false };
-        /// external flush is currently executed;
-        std::atomic<byte> external_flush{ false };
         /// bool external change detected
         /// this flag is used to trigger the enable or disable
         /// logic on this thread
@@ -112,14 +126,26 @@ namespace drace {
 
         /// buffer containing memory accesses
         AlignedBuffer<byte, 64> mem_buf;
+        /// queue to the analysis pool, nullptr if analyzed inline
+        AsyncQueue *  async_queue{ nullptr };
+        /// modules of recently instrumented blocks
+        module::Cache * mod_cache{ nullptr };
 
 		/// Statistics
 		std::unique_ptr<Statistics> stats;
 
         /// book-keeping of active mutexes
-        std::unordered_map<uint64_t, unsigned> mutex_book;
-        /// Used for event syncronisation procedure
-        tls_map_t     th_towait;
+        container::SmallMap<uint64_t, unsigned, MUTEX_MAP_SIZE> mutex_book;
+        /// per-fragment sampling state (adaptive sampling)
+        std::unordered_map<uint64_t, fragment_state_t> fragment_book;
+        /// number of racy fragments already applied to fragment_book
+        size_t        racy_seen{ 0 };
+        /// begin of the allocated block (the struct is cache-line aligned inside)
+        void *        tls_alloc{ nullptr };
+        /// sync epoch at which the buffer was drained last
+        uint64_t      epoch{ 0 };
+        /// time of the oldest pending drain request (steady clock ticks), 0 if none
+        std::atomic<int64_t> drain_request{ 0 };
 	};
 
 	/** Thread local storage */
@@ -152,6 +178,9 @@ namespace drace {
 	class RaceCollector;
 	extern std::unique_ptr<RaceCollector> race_collector;
 
+	class AnalysisPool;
+	extern std::unique_ptr<AnalysisPool> analysis_pool;
+
 	// Global Configuration
 	extern drace::Config config;
 
@@ -12,6 +12,9 @@
 
 #include "Module.h"
 #include "statistics.h"
+#include "pc-table.h"
+#include "adaptive-sampler.h"
+#include "thread-lineage.h"
 
 #include <dr_api.h>
 #include <drmgr.h>
@@ -19,6 +22,8 @@
 #include <drutil.h>
 #include <dr_tools.h>
 
+#include <detector/detector_if.h>
+
 #include <atomic>
 #include <memory>
 #include <random>
@@ -35,16 +40,11 @@ namespace drace {
 	*/
 	class MemoryTracker {
 	public:
-		/** Single memory reference */
-		struct mem_ref_t {
-			void    *addr;
-            app_pc   pc;
-			uint32_t size;
-            bool     write;
-		};
+		/** Single memory reference (layout is shared with the detector) */
+		using mem_ref_t = detector::MemAccess;
 
 		/** Maximum number of references between clean calls */
-		static constexpr int MAX_NUM_MEM_REFS = 128;
+		static constexpr int MAX_NUM_MEM_REFS = 192;
 		static constexpr int MEM_BUF_SIZE = sizeof(mem_ref_t) * MAX_NUM_MEM_REFS;
 
 		/** aggregate frequent pc's on this granularity (2^n bytes)*/
@@ -52,7 +52,71 @@ namespace drace {
 		/** update code-cache after this number of flushes (must be power of two) */
 		static constexpr unsigned CC_UPDATE_PERIOD = 1024 * 64;
 
-		std::atomic<int> flush_active{ false };
+		/** maximum span of coalesced memory operands (bytes) */
+		static constexpr int COALESCE_RANGE = 64;
+
+		/** Reasons to not instrument a memory operand */
+		enum OPND_FLAGS : uint8_t {
+			NONE = 0,
+			/// covered by the range record of a preceding operand
+			COALESCED = 1,
+			/// same location has already been accessed (see \ref eliminate_redundant)
+			REDUNDANT = 2,
+			/// address is derived from the stack pointer (see \ref eliminate_stack)
+			STACK = 4
+		};
+
+		/** Instrumentation decision for a single memory operand of a basic block */
+		struct mem_opnd_t {
+			instr_t * instr;
+			/// index of the operand in the sources / destinations of instr
+			uint16_t  idx;
+			bool      dst;
+			/// access is recorded as write (atomic writes are treated as reads)
+			bool      write;
+			OPND_FLAGS flags;
+			/// displacement and size of the (possibly merged) record
+			int       disp;
+			uint32_t  size;
+
+			inline bool skip() const {
+				return flags != OPND_FLAGS::NONE;
+			}
+		};
+
+		/** Analysis result of a basic block, passed to event_app_instruction using user_data */
+		struct bb_info_t {
+			module::Metadata::INSTR_FLAGS flags;
+			/// memory operands in instrumentation order
+			mem_opnd_t * opnds;
+			unsigned     num_opnds;
+			/// next operand to instrument
+			unsigned     pos;
+
+			/** Returns the decision for this operand, or nullptr if unknown */
+			inline const mem_opnd_t * find(instr_t * instr, bool dst, int idx) {
+				for (unsigned i = pos; i < num_opnds; ++i) {
+					const mem_opnd_t & mo = opnds[i];
+					if (mo.instr == instr && mo.dst == dst && mo.idx == idx) {
+						pos = i + 1;
+						return &mo;
+					}
+				}
+				return nullptr;
+			}
+		};
+
+		/** Incremented on each synchronisation event (sync-mode only) */
+		std::atomic<uint64_t> sync_epoch{ 0 };
+
+		/** pcs of instrumented instructions, referenced by index from mem_ref_t */
+		PcTable pc_table;
+
+		/** per-fragment sampling rates (--adaptive-sampling) */
+		AdaptiveSampler sampler;
+
+		/** creators and joiners of the application threads */
+		ThreadLineage lineage;
 
 	private:
 		size_t page_size;
@@ -69,8 +133,6 @@ namespace drace {
 		/* XCX registers */
 		drvector_t allowed_xcx;
 
-		module::Cache mc;
-
 		// fast random numbers for sampling
 		std::mt19937 _prng;
 
@@ -91,7 +153,39 @@ namespace drace {
 		static void process_buffer(void);
 		static void clear_buffer(void);
 		static void analyze_access(per_thread_t * data);
-		static void flush_all_threads(per_thread_t * data, bool self = true, bool flush_external = false);
+		static void flush_all_threads(per_thread_t * data, bool self = true);
+
+		/**
+		* Waits until the asynchronous analysis of this thread caught up.
+		* Has to be called before a synchronisation event of this thread
+		* is passed to the detector (no-op if analyzed inline).
+		*/
+		static void drain_async(per_thread_t * data);
+
+		/** Returns true if ref is a function entry / exit marker (async mode) */
+		static inline bool is_stack_marker(const mem_ref_t * ref) {
+			return ref->is_marker();
+		}
+
+		/** Returns the pc of a reference */
+		static inline void * get_pc(const mem_ref_t * ref) {
+			return ref->is_marker() ? (void*)ref->pc : memory_tracker->pc_table.lookup(ref->pc);
+		}
+
+		/**
+		* Records a function entry (enter = true) or exit in the buffer.
+		* Used in async mode to keep the order of stack events and accesses.
+		*/
+		static inline void record_stack_event(per_thread_t * data, void * pc, bool enter) {
+			mem_ref_t * ref = (mem_ref_t*)data->buf_ptr;
+			ref->addr_info = (uint64_t)mem_ref_t::encode_meta(0, enter, true) << mem_ref_t::meta_shift;
+			ref->pc = (uint64_t)pc;
+			data->buf_ptr += sizeof(mem_ref_t);
+			// the inline instrumentation expects a non-full buffer
+			if (data->buf_ptr == data->buf_beg + MEM_BUF_SIZE) {
+				analyze_access(data);
+			}
+		}
 
 		// Events
 		void event_thread_init(void *drcontext);
@@ -121,9 +215,14 @@ namespace drace {
 			return false;
 		}
 
-		/** Sets the detector state based on the sampling condition */
-		inline void switch_sampling(per_thread_t * data) {
-			if (!sample_ref(data)) {
+		/**
+		* Sets the detector state based on the sampling condition
+		* \param fragment pc of the call instruction
+		*/
+		inline void switch_sampling(per_thread_t * data, void * fragment) {
+			const bool global = sample_ref(data);
+			const bool local = !params.adaptive_sampling || sampler.sample(data, fragment);
+			if (!(global && local)) {
 				data->enabled = false;
 				data->event_cnt |= ((uint64_t)1 << 63);
 			}
@@ -176,24 +275,73 @@ namespace drace {
 			reg_id_t regxcx, reg_id_t regtls, instr_t *call_flush);
 
 		/** Instrument all memory accessing instructions */
-		void instrument_mem_full(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write);
+		void instrument_mem_full(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write, uint32_t size);
 		/** Instrument all memory accessing instructions (fast-mode)*/
-		void instrument_mem_fast(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write);
+		void instrument_mem_fast(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write, uint32_t size);
 
 		/**
 		* instrument_mem is called whenever a memory reference is identified.
 		* It inserts code before the memory reference to to fill the memory buffer
 		* and jump to our own code cache to call the clean_call when the buffer is full.
 		*/
-		inline void instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write) {
+		inline void instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write, uint32_t size) {
 			if (params.fastmode) {
-				instrument_mem_fast(drcontext, ilist, where, ref, write);
+				instrument_mem_fast(drcontext, ilist, where, ref, write, size);
 			}
 			else {
-				instrument_mem_full(drcontext, ilist, where, ref, write);
+				instrument_mem_full(drcontext, ilist, where, ref, write, size);
 			}
 		}
 
+		/** Instruments a single application instruction according to the bb analysis */
+		void instrument_instr(void *drcontext, void *tag, instrlist_t *bb,
+			instr_t *instr, bool for_trace, bool translating, bb_info_t * info);
+
+		/** Instruments a memory operand. mo is the analysis result of this operand (optional) */
+		void instrument_opnd(void *drcontext, instrlist_t *bb, instr_t *instr,
+			opnd_t ref, bool write, const mem_opnd_t * mo);
+
+		/** Returns true if the memory operands of this instruction are not traced */
+		static bool instr_is_excluded(instr_t * instr);
+
+		/** Returns true if this instruction has synchronizing semantics (e.g. locked instructions) */
+		static inline bool instr_is_sync(instr_t * instr) {
+			return instr_get_prefix_flag(instr, PREFIX_LOCK) || instr_get_opcode(instr) == OP_xchg;
+		}
+
+		/** Allocates the analysis result of a basic block with num_opnds memory operands */
+		static bb_info_t * create_bb_info(void * drcontext, unsigned num_opnds);
+		static void destroy_bb_info(void * drcontext, bb_info_t * info);
+
+		/** Returns the number of traced memory operands of a basic block */
+		static unsigned count_opnds(instrlist_t * bb);
+
+		/** Fills the operand list of info in instrumentation order */
+		static void collect_opnds(instrlist_t * bb, bb_info_t * info);
+
+		/**
+		* Marks operands whose base register holds a stack address, i.e. XSP, XBP
+		* or a register derived from them in this block (excl-stack mode).
+		* Accesses through stack pointers passed from other blocks are still
+		* filtered at analysis time.
+		*/
+		static void eliminate_stack(instrlist_t * bb, bb_info_t * info);
+
+		/**
+		* Marks operands which access a location already accessed in this block.
+		* Per location, only the first read and the first write are kept, as
+		* a race with a later access is also a race with the kept ones,
+		* given no address register is modified and no synchronisation happens in between.
+		*/
+		static void eliminate_redundant(instrlist_t * bb, bb_info_t * info);
+
+		/**
+		* Coalesces memory operands of a basic block which share base and index
+		* registers and touch a small range (at most \ref COALESCE_RANGE bytes).
+		* Only the first operand of a group is instrumented and records the whole range.
+		*/
+		static void coalesce_bb(instrlist_t * bb, bb_info_t * info);
+
 		/** Read data from external CB and modify instrumentation / detection accordingly */
 		void handle_ext_state(per_thread_t * data);
 
@@ -14,27 +14,65 @@
 
 namespace drace {
 	namespace module {
+		/**
+		* Thread-local, set-associative cache of modules.
+		* The set is selected by the 64KiB region of the pc, hence
+		* blocks of the same (or a nearby) module hit the same set.
+		* Entries are bound to a generation of the module list
+		* and are dropped if the list changes.
+		*/
 		class Cache {
+		public:
+			static constexpr unsigned SETS = 16;
+			static constexpr unsigned WAYS = 4;
+			static constexpr unsigned INDEX_SHIFT = 16;
+
 		private:
-			/** keep last module here for faster lookup
-			*  we use a week pointer as we do not obtain ownership */
-			Metadata*  _mod{ nullptr };
-			app_pc       _start;
-			app_pc       _end;
+			struct entry_t {
+				app_pc     start;
+				app_pc     end;
+				/** we use a week pointer as we do not obtain ownership */
+				Metadata * mod;
+			};
+
+			entry_t  _sets[SETS][WAYS]{};
+			/** next way to replace per set (round robin) */
+			uint8_t  _next[SETS]{};
+			uint64_t _generation{ 0 };
+
+			static inline unsigned index(app_pc pc) {
+				return ((ptr_uint_t)pc >> INDEX_SHIFT) & (SETS - 1);
+			}
 
 		public:
-			/** Lookup last module in cache, returns (found, instrument)*/
-			inline Metadata* lookup(app_pc pc) {
-				if (!_mod) return nullptr;
-				if (pc >= _start && pc < _end) {
-					return _mod;
+			/** Lookup module containing pc, returns nullptr if not cached */
+			inline Metadata* lookup(app_pc pc, uint64_t generation) {
+				if (generation != _generation) {
+					clear();
+					_generation = generation;
+					return nullptr;
+				}
+				const entry_t * set = _sets[index(pc)];
+				for (unsigned w = 0; w < WAYS; ++w) {
+					if (pc >= set[w].start && pc < set[w].end) {
+						return set[w].mod;
+					}
 				}
 				return nullptr;
 			}
-			inline void update(Metadata * mod) {
-				_mod = mod;
-				_start = _mod->info->start;
-				_end = _mod->info->end;
+
+			inline void update(app_pc pc, Metadata * mod) {
+				const unsigned idx = index(pc);
+				const unsigned way = _next[idx]++ % WAYS;
+				_sets[idx][way] = entry_t{ mod->base, mod->end, mod };
+			}
+
+			inline void clear() {
+				for (unsigned s = 0; s < SETS; ++s) {
+					for (unsigned w = 0; w < WAYS; ++w) {
+						_sets[s][w] = entry_t{ nullptr, nullptr, nullptr };
+					}
+				}
 			}
 		};
 	} // namespace module
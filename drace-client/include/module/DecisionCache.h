@@ -0,0 +1,110 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <dr_api.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace drace {
+	namespace module {
+		/**
+		* Persistent cache of per-module instrumentation decisions.
+		*
+		* Stores the instrumentation flags, the availability of debug information
+		* and the results of symbol searches used for function wrapping.
+		* Modules are identified by their path and timestamp / checksum (build-id
+		* or content hash on non-windows platforms). A missing debug information
+		* is only reused while the candidate debug files are unchanged. The whole
+		* cache is invalidated if the configuration file changes.
+		*
+		* The file is memory-mapped and parsed on construction,
+		* new decisions are written back by \ref save.
+		*/
+		class DecisionCache {
+		public:
+			static constexpr uint32_t MAGIC = 0x43445244; // "DRDC"
+			static constexpr uint32_t VERSION = 2;
+
+		private:
+			struct entry_t {
+				/// instrument and debug_info are valid
+				bool     has_flags{ false };
+				bool     debug_info{ false };
+				uint8_t  instrument{ 0 };
+				/// state of the debug files, only valid if debug_info is false
+				uint64_t debug_key{ 0 };
+				/// symbol hash -> offsets of found functions
+				std::unordered_map<uint64_t, std::vector<uint64_t>> wraps;
+			};
+
+			std::string _file;
+			uint64_t    _config_hash{ 0 };
+			std::unordered_map<uint64_t, entry_t> _entries;
+			/// decisions were added since the file was loaded
+			bool        _dirty{ false };
+			void *      _mx;
+
+			/* statistics */
+			unsigned long _hits{ 0 };
+			unsigned long _misses{ 0 };
+
+		public:
+			/**
+			* Loads the cache from file, if the file exists and was created
+			* with the same configuration.
+			*/
+			DecisionCache(const std::string & file, const std::string & config_file);
+			~DecisionCache();
+
+			DecisionCache(const DecisionCache &) = delete;
+			DecisionCache & operator=(const DecisionCache &) = delete;
+
+			/** Returns true and sets the flags if decisions are cached for this module */
+			bool get_flags(const module_data_t * mod, uint8_t & instrument, bool & debug_info);
+
+			void set_flags(const module_data_t * mod, uint8_t instrument, bool debug_info);
+
+			/** Returns true and appends the offsets if the search for symbol is cached */
+			bool get_wraps(const module_data_t * mod, const std::string & symbol, std::vector<uint64_t> & offsets);
+
+			void set_wraps(const module_data_t * mod, const std::string & symbol, const std::vector<uint64_t> & offsets);
+
+			/** Atomically replaces the cache file, if the cache has changed */
+			bool save();
+
+		private:
+			/** Parses the mapped file, returns false if it is invalid */
+			bool parse(const byte * data, size_t size);
+
+			static uint64_t module_key(const module_data_t * mod);
+
+			/**
+			* Hash of the existence and size of the files which might hold
+			* the debug information of the module (without symbol servers)
+			*/
+			static uint64_t debug_key(const module_data_t * mod);
+
+#ifdef LINUX
+			/** Reads the GNU build-id from the mapped module, returns false if it has none */
+			static bool build_id(const module_data_t * mod, std::string & id);
+#endif
+
+			/** 64 bit FNV-1a hash */
+			static uint64_t hash(const void * data, size_t size, uint64_t h = 0xcbf29ce484222325ull);
+
+			/** hash of the content of the given file, 0 if not readable */
+			static uint64_t hash_file(const std::string & file);
+		};
+	} // namespace module
+} // namespace drace
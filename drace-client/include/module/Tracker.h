@@ -15,11 +15,16 @@
 #include "symbols.h"
 
 #include <dr_api.h>
+#include <atomic>
 #include <map>
 #include <memory>
+#include <vector>
+#include <algorithm>
 
 namespace drace {
 	namespace module {
+		class DecisionCache;
+
 		class Tracker {
 			/// as we use lower_bound search, we have to reverse the sorting
 			using map_t = std::map<app_pc, std::shared_ptr<Metadata>, std::greater<app_pc>>;
@@ -31,6 +36,42 @@ namespace drace {
 		public:
 			using PMetadata = std::shared_ptr<Metadata>;
 
+			/**
+			* Immutable list of the loaded modules, sorted by base address.
+			* A new list is published on each load and unload, hence readers
+			* never lock. Replaced lists are kept until the tracker is destroyed,
+			* as readers might still use them (loads are rare).
+			*/
+			struct Snapshot {
+				struct entry_t {
+					app_pc     base;
+					app_pc     end;
+					Metadata * mod;
+				};
+				/// incremented on each change of the module list
+				uint64_t             generation;
+				std::vector<entry_t> modules;
+
+				/** Returns the module containing pc, nullptr if not found */
+				inline Metadata * find(app_pc pc) const {
+					auto it = std::upper_bound(modules.begin(), modules.end(), pc,
+						[](app_pc p, const entry_t & e) {return p < e.base; });
+					if (it == modules.begin())
+						return nullptr;
+					--it;
+					return (pc < it->end) ? it->mod : nullptr;
+				}
+			};
+
+		private:
+			std::atomic<const Snapshot*> _snapshot{ nullptr };
+			std::vector<const Snapshot*> _retired;
+
+			/// persistent instrumentation decisions, nullptr if disabled
+			std::unique_ptr<DecisionCache> _decisions;
+
+		public:
+
 			/// private symbol table for trace-logging scripts
 			std::shared_ptr<Symbols> _syms;
 
@@ -69,6 +110,22 @@ namespace drace {
 			/** Registers a module and sets flags accordingly */
 			PMetadata register_module(const module_data_t * mod, bool loaded);
 
+			/** Returns the persistent decision cache, nullptr if disabled */
+			inline DecisionCache * decisions() const {
+				return _decisions.get();
+			}
+
+			/** Returns the current list of loaded modules (lock-free) */
+			inline const Snapshot * loaded_modules() const {
+				return _snapshot.load(std::memory_order_acquire);
+			}
+
+			/**
+			* Publishes a new list of the loaded modules.
+			* Has to be called with the write lock held.
+			*/
+			void publish();
+
 			/** Request a read-lock for the module dataset*/
 			inline void lock_read() const {
 				dr_rwlock_read_lock(mod_lock);
@@ -0,0 +1,101 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstring>
+#include <unordered_map>
+
+#include <dr_api.h>
+#include <detector/detector_if.h>
+
+namespace drace {
+	/**
+	* Assigns a compact index to each instrumented pc, which is stored in the
+	* memory-reference buffer instead of the full pc. The indices are
+	* translated back by the detector using \ref table.
+	*
+	* Each distinct pc gets exactly one index, hence re-instrumented blocks
+	* (e.g. traces or flushed fragments) do not grow the table.
+	* Entries are never removed, so buffered indices stay valid after the
+	* fragment has been flushed from the code cache.
+	*/
+	class PcTable {
+		using table_t = detector::PcTable;
+
+		/** chunks are never moved, hence the detector reads without locking */
+		table_t *                             _table;
+		std::unordered_map<app_pc, uint32_t>  _index;
+		uint32_t                              _next{ 0 };
+		void *                                _mx;
+
+	public:
+		PcTable()
+			: _table((table_t*)dr_global_alloc(sizeof(table_t))),
+			  _mx(dr_mutex_create())
+		{
+			memset(_table, 0, sizeof(table_t));
+			_index.reserve(table_t::chunk_size);
+		}
+
+		PcTable(const PcTable &) = delete;
+		PcTable & operator=(const PcTable &) = delete;
+
+		~PcTable() {
+			for (size_t i = 0; i < table_t::max_chunks && nullptr != _table->chunks[i]; ++i) {
+				dr_global_free(_table->chunks[i], table_t::chunk_size * sizeof(void*));
+			}
+			dr_global_free(_table, sizeof(table_t));
+			dr_mutex_destroy(_mx);
+		}
+
+		/** Returns the index of this pc, registers it if necessary (instrumentation time) */
+		uint32_t index_of(app_pc pc) {
+			dr_mutex_lock(_mx);
+			auto it = _index.find(pc);
+			if (it != _index.end()) {
+				uint32_t idx = it->second;
+				dr_mutex_unlock(_mx);
+				return idx;
+			}
+
+			uint32_t idx = _next;
+			size_t chunk = idx >> table_t::chunk_bits;
+			if (chunk >= table_t::max_chunks) {
+				// table is full, share the last entry (pc of reports gets inaccurate)
+				dr_mutex_unlock(_mx);
+				return idx - 1;
+			}
+			if (nullptr == _table->chunks[chunk]) {
+				_table->chunks[chunk] = (void**)dr_global_alloc(table_t::chunk_size * sizeof(void*));
+			}
+			_table->chunks[chunk][idx & (table_t::chunk_size - 1)] = pc;
+			_index.emplace(pc, idx);
+			++_next;
+			dr_mutex_unlock(_mx);
+			return idx;
+		}
+
+		/** Translates an index back to a pc */
+		inline void * lookup(uint64_t idx) const {
+			return _table->lookup(idx);
+		}
+
+		/** Lookup table as passed to the detector */
+		inline const table_t * table() const {
+			return _table;
+		}
+
+		/** Number of registered pcs */
+		inline uint32_t size() const {
+			return _next;
+		}
+	};
+} // namespace drace
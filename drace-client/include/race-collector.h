@@ -14,6 +14,10 @@
 #include "sink/hr-text.h"
 
 #include <detector/detector_if.h>
+#include <container/MpscQueue.h>
+#include <algorithm>
+#include <atomic>
+#include <set>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
@@ -56,90 +60,114 @@ namespace drace {
 
 		/** Maximum number of races to collect */
 		static constexpr int MAX = 1000;
+		/** Sleep time of the reporter thread if no races are pending */
+		static constexpr int POLL_INTERVAL_MS = 10;
+		/** Number of threads for delayed symbol resolution */
+		static constexpr unsigned RESOLVER_THREADS = 4;
+
 	private:
 		using entry_t = RaceEntryT;
 		using clock_t = std::chrono::high_resolution_clock;
 		using tp_t = decltype(clock_t::now());
 
+		/** Raw race as copied by the reporting thread */
+		struct pending_race_t {
+			detector::AccessEntry first;
+			detector::AccessEntry second;
+			/// time to race in ms
+			unsigned long long    ttr;
+		};
+
 		RaceCollectionT _races;
 		// TODO: histogram
 
 		bool   _delayed_lookup{ false };
 		std::shared_ptr<Symbols> _syms;
 		tp_t   _start_time;
-        std::set<uint64_t> _racy_stacks;
+		std::set<uint64_t> _racy_stacks;
 
 		sink::HRText _console;
 
-		void *_race_mx;
+		/** races reported by the application threads, consumed by the reporter */
+		container::MpscQueue<pending_race_t> _queue;
+		/** number of collected races, read by the application threads */
+		std::atomic<unsigned long> _num_races{ 0 };
+		/** number of processed queue entries, in queue order */
+		std::atomic<size_t>        _processed{ 0 };
+		/** waits of application threads for a free queue slot */
+		std::atomic<unsigned long> _stalls{ 0 };
+		/** races which were dropped as the reporter was already stopped */
+		std::atomic<unsigned long> _dropped{ 0 };
+
+		std::atomic<bool> _running{ true };
+		std::atomic<bool> _active{ false };
+		/** only set if the reporter thread could not be started, serializes inline reporting */
+		void *            _inline_mx{ nullptr };
 
 	public:
+		/**
+		* \param queue_size number of races which can be pending for the
+		*                   reporter thread, before the racing threads wait
+		*/
 		RaceCollector(
 			bool delayed_lookup,
-			const std::shared_ptr<Symbols> & symbols)
-			: _delayed_lookup(delayed_lookup),
-			_syms(symbols),
-			_start_time(clock_t::now()),
-			_console(drace::log_target)
-		{
-			_races.reserve(1000);
-			_race_mx = dr_mutex_create();
-		}
+			const std::shared_ptr<Symbols> & symbols,
+			size_t queue_size = 256);
 
-		~RaceCollector() {
-			dr_mutex_destroy(_race_mx);
-			LOG_INFO(-1, "found %i possible data-races", _races.size());
-		}
+		~RaceCollector();
 
-        /**
-        * suppress this race if similar race is already reported
-        * \return: true if race is suppressed
-        */
-        bool filter_duplicates(const detector::Race * r) {
-            // TODO: add more precise control over suppressions
-            if (params.suppression_level == 0)
-                return false;
-
-            uint64_t hash = r->first.stack_trace[0] ^ (r->second.stack_trace[0] << 1);
-            if (_racy_stacks.count(hash) == 0) {
-                // suppress this race
-                _racy_stacks.insert(hash);
-                return false;
-            }
-            return true;
-        }
-
-		/** Adds a race and updates histogram
-		* TODO: The locking has to be removed completely as this callback
-		* heavily interferes with application locks. Use lockfree queue for
-		* storing the races
+		/**
+		* Copies the race into the queue of the reporter thread.
+		* Called by the detector on the racing application thread, hence this
+		* function does not allocate memory. If the queue is full, the thread
+		* waits for the reporter. With \ref params_t::break_on_race, the race
+		* is reported before the application is aborted.
 		*/
-		void add_race(const detector::Race * r) {
-			if (num_races() > MAX)
+		inline void add_race(const detector::Race * r) {
+			if (_num_races.load(std::memory_order_relaxed) > MAX)
 				return;
 
 			auto ttr = std::chrono::duration_cast<std::chrono::milliseconds>(clock_t::now() - _start_time);
-
-            if (filter_duplicates(r))
-                return;
-
-			if (!_delayed_lookup) {
-				DecoratedRace dr(
-					std::move(resolve_symbols(r->first)),
-					std::move(resolve_symbols(r->second)));
-
-				//dr_mutex_lock(_race_mx);
-				_races.emplace_back(ttr.count(), dr);
-				//dr_mutex_unlock(_race_mx);
+			const pending_race_t race{ r->first, r->second, (unsigned long long)ttr.count() };
+			size_t position;
+			bool stalled = false;
+			while (!_queue.push(race, &position)) {
+				if (!_running.load(std::memory_order_relaxed)) {
+					// the reporter is stopped, nobody frees a slot
+					_dropped.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				if (!stalled) {
+					_stalls.fetch_add(1, std::memory_order_relaxed);
+					stalled = true;
+				}
+				if (nullptr != _inline_mx)
+					process_inline();
+				else
+					dr_thread_yield();
 			}
-			else {
-				//dr_mutex_lock(_race_mx);
-				_races.emplace_back(ttr.count(), *r);
-				//dr_mutex_unlock(_race_mx);
+			if (nullptr != _inline_mx) {
+				// no reporter thread, process the race on this thread
+				process_inline();
+			}
+
+			// for benchmarking and testing
+			if (params.break_on_race) {
+				while (_processed.load(std::memory_order_acquire) <= position
+					&& _active.load(std::memory_order_acquire))
+				{
+					dr_thread_yield();
+				}
+				dr_abort();
 			}
-			print_last_race();
 		}
 
+		/**
+		* Processes all pending races and stops the reporter thread.
+		* Has to be called before the collected races are accessed.
+		*/
+		void stop();
+
 		/** Takes a detector Access Entry, resolves symbols and converts it to a ResolvedAccess */
 		ResolvedAccess resolve_symbols(const detector::AccessEntry & e) const {
 			ResolvedAccess ra(e);
@@ -147,12 +175,6 @@ namespace drace {
 				ra.resolved_stack.emplace_back(_syms->get_symbol_info((app_pc)e.stack_trace[i]));
 			}
 
-			void* drcontext = dr_get_current_drcontext();
-			dr_mcontext_t mc;
-			mc.size = sizeof(dr_mcontext_t);
-			mc.flags = DR_MC_ALL;
-			dr_get_mcontext(drcontext, &mc);
-
 			// TODO: Validate external callstacks
 			//if(shmdriver)
 			//	MSR::getCurrentStack(e.thread_id, (void*)mc.xbp, (void*)mc.xsp, (void*)e.stack_trace[e.stack_size-1]);
@@ -160,19 +182,42 @@ namespace drace {
 			return ra;
 		}
 
-		/** Resolves all unresolved race entries */
+		/**
+		* Resolves all unresolved race entries.
+		* Each distinct pc is resolved only once, using RESOLVER_THREADS threads.
+		*/
 		void resolve_all() {
-			for (auto & r : _races) {
-				if (!r.second.is_resolved) {
-					r.second.first = std::move(resolve_symbols(r.second.first));
-					r.second.second = std::move(resolve_symbols(r.second.second));
+			std::vector<app_pc> pcs;
+			for (const auto & r : _races) {
+				if (r.second.is_resolved)
+					continue;
+				for (const ResolvedAccess * ac : { &r.second.first, &r.second.second }) {
+					for (size_t i = 0; i < ac->stack_size; ++i) {
+						pcs.push_back((app_pc)ac->stack_trace[i]);
+					}
 				}
 			}
-		}
+			if (pcs.empty())
+				return;
 
-		inline void print_last_race() const {
-			DR_ASSERT(!dr_using_app_state(dr_get_current_drcontext()));
-			_console.process_single_race(_races.back());
+			std::sort(pcs.begin(), pcs.end());
+			pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+			const std::vector<app_pc> keys(pcs);
+			const auto locs = _syms->resolve_bulk(std::move(pcs), RESOLVER_THREADS);
+
+			// map the locations back to the stack frames
+			for (auto & r : _races) {
+				if (r.second.is_resolved)
+					continue;
+				for (ResolvedAccess * ac : { &r.second.first, &r.second.second }) {
+					ac->resolved_stack.clear();
+					for (size_t i = 0; i < ac->stack_size; ++i) {
+						auto it = std::lower_bound(keys.begin(), keys.end(), (app_pc)ac->stack_trace[i]);
+						ac->resolved_stack.push_back(locs[it - keys.begin()]);
+					}
+				}
+				r.second.is_resolved = true;
+			}
 		}
 
 		const RaceCollectionT & get_races() const {
@@ -180,7 +225,62 @@ namespace drace {
 		}
 
 		unsigned long num_races() const {
-			return static_cast<unsigned long>(_races.size());
+			return _num_races.load(std::memory_order_relaxed);
+		}
+
+		/** Number of times a racing thread waited for a free queue slot */
+		unsigned long stalls() const {
+			return _stalls.load(std::memory_order_relaxed);
+		}
+
+		/** Number of races which were reported after the reporter was stopped */
+		unsigned long dropped() const {
+			return _dropped.load(std::memory_order_relaxed);
+		}
+
+	private:
+		static void thread_main(void * arg);
+
+		/** Reporter thread */
+		void run();
+
+		/** Waits for the reserved slots, processes them and reports dropped races */
+		void drain();
+
+		/** Processes all pending races, returns the number of processed races */
+		size_t process_pending();
+
+		/** Processes the pending races on the calling thread, if there is no reporter thread */
+		void process_inline() {
+			dr_mutex_lock(_inline_mx);
+			process_pending();
+			dr_mutex_unlock(_inline_mx);
+		}
+
+		/** Deduplicates, symbolizes and prints a single race */
+		void process_race(const pending_race_t & r);
+
+		/**
+		* suppress this race if similar race is already reported
+		* \return: true if race is suppressed
+		*/
+		bool filter_duplicates(const pending_race_t & r) {
+			// TODO: add more precise control over suppressions
+			if (params.suppression_level == 0)
+				return false;
+
+			uint64_t hash = r.first.stack_trace[0] ^ (r.second.stack_trace[0] << 1);
+			if (_racy_stacks.count(hash) == 0) {
+				// suppress this race
+				_racy_stacks.insert(hash);
+				return false;
+			}
+			return true;
+		}
+
+		inline void print_last_race() const {
+			DR_ASSERT(!dr_using_app_state(dr_get_current_drcontext()));
+			_console.process_single_race(_races.back());
 		}
 	};
 
@@ -190,10 +290,6 @@ namespace drace {
 	*/
 	static void race_collector_add_race(const detector::Race * r) {
 		race_collector->add_race(r);
-		// for benchmarking and testing
-		if (params.break_on_race) {
-			dr_abort();
-		}
 	}
 
 } // namespace drace
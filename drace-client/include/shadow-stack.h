@@ -24,6 +24,8 @@ namespace drace {
 	* Whenever a call has been detected, the memory-refs buffer is
 	* flushed as all memory-refs happend in the current function.
 	* This avoids storing a stack-trace per memory-entry.
+	* In async mode, entries and exits are recorded as markers
+	* in the memory-refs buffer instead.
 	*/
 	class ShadowStack {
 	public:
@@ -51,7 +53,12 @@ namespace drace {
 			for (unsigned i = 0; i < size; ++i)
 				if (stack->data[i] == addr) return;
 #endif
-			detector::func_enter(data->detector_data, addr);
+			if (nullptr != data->async_queue) {
+				MemoryTracker::record_stack_event(data, addr, true);
+			}
+			else {
+				detector::func_enter(data->detector_data, addr);
+			}
 			stack.data[stack.entries++] = addr;
 		}
 
@@ -61,7 +68,12 @@ namespace drace {
 			DR_ASSERT(stack.entries > 0);
 			stack.entries--;
 
-			detector::func_exit(data->detector_data);
+			if (nullptr != data->async_queue) {
+				MemoryTracker::record_stack_event(data, nullptr, false);
+			}
+			else {
+				detector::func_exit(data->detector_data);
+			}
 			return stack.data[stack.entries];
 		}
 
@@ -72,16 +84,13 @@ namespace drace {
 			DR_ASSERT(!dr_using_app_state(drcontext));
 
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
-			if (!params.fastmode) {
-				while (data->external_flush.load(std::memory_order_relaxed)) {
-					// wait
-				}
+			// in async mode, the stack events are recorded in the buffer
+			if (nullptr == data->async_queue) {
+				MemoryTracker::analyze_access(data);
 			}
-			// TODO: possibibly racy in non-fast-mode
-			MemoryTracker::analyze_access(data);
 
 			// Sampling: Possibly disable detector during this function
-			memory_tracker->switch_sampling(data);
+			memory_tracker->switch_sampling(data, call_ins);
 			
 			// if lossy_flush, disable detector instead of changeing the instructions
 			if (params.lossy && !params.lossy_flush && MemoryTracker::pc_in_freq(data, call_ins)) {
@@ -97,12 +106,9 @@ namespace drace {
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(dr_get_current_drcontext(), tls_idx);
 			stack_t * stack = &(data->stack);
 
-			if (!params.fastmode) {
-				while (data->external_flush.load(std::memory_order_relaxed)) {
-					// wait
-				}
+			if (nullptr == data->async_queue) {
+				MemoryTracker::analyze_access(data);
 			}
-			MemoryTracker::analyze_access(data);
 
 			if (stack->entries == 0) return;
 
@@ -19,6 +19,7 @@
 #include <algorithm>
 
 #include <dr_api.h>
+#include <detector/detector_if.h>
 
 #include <lcm/lossyCountingModel.hpp>
 
@@ -31,18 +32,39 @@ namespace drace {
 	class Statistics {
 	public:
 		using ms_t = std::chrono::milliseconds;
+		using us_t = std::chrono::microseconds;
 		using hist_t = std::vector<std::pair<uint64_t, size_t>>;
 
 		std::vector<thread_id_t> thread_ids;
 		unsigned long mutex_ops{ 0 };
 		unsigned long flushes{ 0 };
 		unsigned long flush_events{ 0 };
-		unsigned long external_flushes{ 0 };
 		ms_t time_in_flushes{ 0 };
+		/// served drain requests of other threads
+		unsigned long drains{ 0 };
+		us_t drain_latency{ 0 };
+		us_t drain_latency_max{ 0 };
+		/// max. number of sync epochs a buffer was drained late
+		uint64_t max_epoch_lag{ 0 };
+		/// buffers handed over to the analysis pool
+		unsigned long async_batches{ 0 };
+		/// waits for a free buffer (analysis pool fell behind)
+		unsigned long async_stalls{ 0 };
+		/// waits for the analysis pool on sync events
+		unsigned long async_waits{ 0 };
+		/// analyzed / skipped fragment executions (adaptive sampling)
+		unsigned long sampling_hits{ 0 };
+		unsigned long sampling_skips{ 0 };
 		unsigned long module_loads{ 0 };
 		ms_t module_load_duration{ 0 };
 		uint64_t proc_refs{ 0 };
 		uint64_t total_refs{ 0 };
+		/// event delivery of detectors which analyze in a different process
+		detector::DeliveryStats delivery;
+		/// waits of racing threads for the race reporter
+		unsigned long race_stalls{ 0 };
+		/// races reported after the race reporter was stopped
+		unsigned long dropped_races{ 0 };
 
 		LossyCountingModel<uint64_t> page_hits;
 		LossyCountingModel<uint64_t> pc_hits;
@@ -76,10 +98,27 @@ namespace drace {
 			if (flushes > 0) {
 				s << "avg. buffer size:\t" << std::dec << (total_refs / flushes) << std::endl;
 			}
-			s << "e-flushes:\t\t" << std::dec << external_flushes << std::endl
-				<< "flush-time (total):\t" << std::dec << time_in_flushes.count() << "ms" << std::endl
+			s << "flush-time (total):\t" << std::dec << time_in_flushes.count() << "ms" << std::endl
+				<< "drains:\t\t\t" << std::dec << drains << std::endl;
+			if (drains > 0) {
+				s << "drain-latency (avg):\t" << std::dec << (drain_latency.count() / drains) << "us" << std::endl;
+			}
+			s << "drain-latency (max):\t" << std::dec << drain_latency_max.count() << "us" << std::endl
+				<< "max. epoch lag:\t\t" << std::dec << max_epoch_lag << std::endl
+				<< "async-batches:\t\t" << std::dec << async_batches << std::endl
+				<< "async-stalls:\t\t" << std::dec << async_stalls << std::endl
+				<< "async-waits:\t\t" << std::dec << async_waits << std::endl
+				<< "sampled-fragments:\t" << std::dec << sampling_hits << std::endl
+				<< "skipped-fragments:\t" << std::dec << sampling_skips << std::endl
 				<< "analyzed-refs:\t\t" << std::dec << proc_refs << std::endl
 				<< "total-refs:\t\t" << std::dec << total_refs << std::endl
+				<< "dropped-events:\t\t" << std::dec << delivery.dropped_events << std::endl
+				<< "dropped-refs:\t\t" << std::dec << delivery.dropped_accesses << std::endl
+				<< "spilled-events:\t\t" << std::dec << delivery.spilled_events << std::endl
+				<< "blocked-waits:\t\t" << std::dec << delivery.blocked << std::endl
+				<< "queue-high-water:\t" << std::dec << delivery.queue_high_water << "%" << std::endl
+				<< "race-stalls:\t\t" << std::dec << race_stalls << std::endl
+				<< "dropped-races:\t\t" << std::dec << dropped_races << std::endl
 				<< "module loads:\t\t" << std::dec << module_loads << std::endl
 				<< "mod. load time(total):\t" << std::dec << module_load_duration.count() << "ms" << std::endl;
 			s << "top pages:\t\t";
@@ -103,12 +142,30 @@ namespace drace {
 			mutex_ops += other.mutex_ops;
 			flushes += other.flushes;
 			flush_events += other.flush_events;
-			external_flushes += other.external_flushes;
 			time_in_flushes += other.time_in_flushes;
+			drains += other.drains;
+			drain_latency += other.drain_latency;
+			if (other.drain_latency_max > drain_latency_max)
+				drain_latency_max = other.drain_latency_max;
+			if (other.max_epoch_lag > max_epoch_lag)
+				max_epoch_lag = other.max_epoch_lag;
 			module_loads += other.module_loads;
 			module_load_duration += other.module_load_duration;
+			async_batches += other.async_batches;
+			async_stalls += other.async_stalls;
+			async_waits += other.async_waits;
+			sampling_hits += other.sampling_hits;
+			sampling_skips += other.sampling_skips;
 			proc_refs += other.proc_refs;
 			total_refs += other.total_refs;
+			delivery.dropped_events += other.delivery.dropped_events;
+			delivery.dropped_accesses += other.delivery.dropped_accesses;
+			delivery.spilled_events += other.delivery.spilled_events;
+			delivery.blocked += other.delivery.blocked;
+			if (other.delivery.queue_high_water > delivery.queue_high_water)
+				delivery.queue_high_water = other.delivery.queue_high_water;
+			race_stalls += other.race_stalls;
+			dropped_races += other.dropped_races;
 			return *this;
 		}
 	};
@@ -15,6 +15,8 @@
 
 #include <string>
 #include <sstream>
+#include <map>
+#include <vector>
 
 namespace drace {
 
@@ -60,16 +62,48 @@ namespace drace {
 		}
 	};
 
+	struct bulk_job_t;
+
 	/** Symbol Access Lib Functions */
 	class Symbols {
+		friend struct bulk_job_t;
+
 		/* Maximum distance between a pc and the first found symbol */
 		static constexpr std::ptrdiff_t max_distance = 32;
 		/* Maximum length of file pathes and sym names */
 		static constexpr int buffer_size = 256;
 		drsym_info_t syminfo;
 
+		/** Address range of a function, relative to the module base */
+		struct func_range_t {
+			uint64_t    start;
+			uint64_t    end;
+			std::string name;
+
+			inline bool operator<(const func_range_t & other) const {
+				return start < other.start;
+			}
+		};
+		/** Functions of a module, sorted by start offset */
+		using func_table_t = std::vector<func_range_t>;
+
+		/** resolved locations of native pcs */
+		std::map<app_pc, SymbolLocation> _cache;
+		/** function tables, indexed by module base */
+		std::map<app_pc, func_table_t>   _func_tables;
+		/** build function tables on first lookup in a module */
+		bool  _use_func_tables{ false };
+		/** protects the location cache and the lookup buffer */
+		void *_mx;
+		/** protects the function tables */
+		void *_table_mx;
+
 	public:
-		Symbols() {
+		explicit Symbols(bool use_func_tables = false)
+			: _use_func_tables(use_func_tables),
+			  _mx(dr_mutex_create()),
+			  _table_mx(dr_mutex_create())
+		{
 			drsym_init(0);
 			create_drsym_info();
 		}
@@ -77,6 +111,8 @@ namespace drace {
 		~Symbols() {
 			free_drsmy_info();
 			drsym_exit();
+			dr_mutex_destroy(_mx);
+			dr_mutex_destroy(_table_mx);
 		}
 
 		/** Get last known symbol near the given location
@@ -90,7 +126,9 @@ namespace drace {
 		std::string get_bb_symbol(app_pc pc);
 
 		/** Get last known symbol including as much information as possible.
-		*  Internally a reverse-search is performed starting at the given pc.
+		*  Locations in native modules are cached. If function tables are enabled,
+		*  the function is found by a binary search in the table of the module.
+		*  Otherwise a reverse-search is performed starting at the given pc.
 		*  When the first symbol lookup was successful, the search is stopped.
 		*
 		* \warning If no debug information is available the returned symbol might
@@ -104,11 +142,37 @@ namespace drace {
 		*/
 		bool debug_info_available(const module_data_t *mod) const;
 
+		/** Drops all cached information of the module in [base, end) (module unload) */
+		void invalidate(app_pc base, app_pc end);
+
+		/**
+		* Resolves a sorted set of unique pcs. The pcs are grouped by module
+		* and the groups are resolved in parallel by num_threads threads
+		* (including the calling one).
+		* \return locations in the order of pcs
+		*/
+		std::vector<SymbolLocation> resolve_bulk(std::vector<app_pc> && pcs, unsigned num_threads);
+
 	private:
 		/** Create global symbol lookup data structures */
 		void create_drsym_info();
 
 		/** Cleanup global symbol lookup data structures */
 		void free_drsmy_info();
+
+		/** Returns the function table of the module, builds it if necessary */
+		const func_table_t & get_func_table(app_pc base, const char * path);
+
+		/** Callback of drsym_enumerate_symbols_ex */
+		static bool add_func_range(drsym_info_t * info, drsym_error_t status, void * data);
+
+		/** Resolves the location in a native module (uncached), info is used as lookup buffer */
+		void lookup_native(SymbolLocation & sloc, app_pc base, const char * path, drsym_info_t & info);
+
+		/** Resolves pcs of a native module and updates the cache (thread safe) */
+		void resolve_module(const module_data_t * mod, const app_pc * pcs, size_t num, SymbolLocation * out);
+
+		/** Worker of resolve_bulk */
+		static void bulk_worker(void * job);
 	};
 } // namespace drace
@@ -0,0 +1,133 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+
+#include <unordered_map>
+#include <unordered_set>
+
+#include <detector/detector_if.h>
+
+namespace drace {
+	/**
+	* Tracks which thread created and which thread joins another thread.
+	* The creator is recorded by the wrapped thread creation (CreateThread
+	* on Windows, the clone syscall on Linux) and the joiner while it waits
+	* for the thread handle.
+	*
+	* A thread which exits without a waiting joiner releases a sync object,
+	* which later joiners acquire. Only threads which are not created by an
+	* observed thread creation are forked / joined with
+	* \ref detector::unknown_thread.
+	*/
+	class ThreadLineage {
+	public:
+		/** How an exiting thread is joined */
+		struct Exit {
+			/// thread which waits for the exit, or unknown_thread
+			detector::tid_t joiner{ detector::unknown_thread };
+			/// sync object of later joiners, nullptr if the thread cannot be joined
+			void * sync{ nullptr };
+			/// false if the creation of the thread was not observed
+			bool known{ false };
+		};
+
+	private:
+		struct Lineage {
+			thread_id_t parent;
+			/// true if the creator was taken for the fork
+			bool forked{ false };
+			/// thread which currently waits for the exit, if it is the only one
+			thread_id_t joiner{ 0 };
+			unsigned waiters{ 0 };
+			/// handle returned by the creation, 0 if not known (yet)
+			uint64_t handle{ 0 };
+			bool exited{ false };
+		};
+
+		/// max. time a child waits for the return of a pending thread creation
+		static constexpr uint64_t create_timeout_ms = 100;
+
+		/* Threads with an observed creation. An entry lives until the handle
+		*  cannot be used anymore, hence at most until the id is reused. The
+		*  address of an entry is the sync object of its exit. */
+		std::unordered_map<thread_id_t, Lineage>  _threads;
+		std::unordered_map<uint64_t, thread_id_t> _handles;
+		/// thread which was created last by a thread (to attach the handle)
+		std::unordered_map<thread_id_t, thread_id_t> _last_created;
+		/// threads which are currently creating a thread
+		std::unordered_set<thread_id_t> _creating;
+		void * _mx;
+
+		using iterator = std::unordered_map<thread_id_t, Lineage>::iterator;
+
+		/** Removes the thread and its handle, requires _mx */
+		void forget(iterator it);
+
+		/** Binds the handle to the thread, requires _mx */
+		void bind_handle(iterator it, uint64_t handle);
+
+		/**
+		* Returns the current incarnation of the thread, requires _mx.
+		* If it is not known yet but creations are pending, the lock is
+		* released while waiting (bounded) for their return.
+		*/
+		iterator find_created(thread_id_t child);
+
+	public:
+		ThreadLineage();
+		~ThreadLineage();
+
+		ThreadLineage(const ThreadLineage &) = delete;
+		ThreadLineage & operator=(const ThreadLineage &) = delete;
+
+		/** The parent starts creating a thread, the child might run before it returns */
+		void begin_create(thread_id_t parent);
+
+		/**
+		* The thread creation of parent returned.
+		* \param child  id of the created thread, 0 if the creation failed
+		* \param handle handle of the created thread, 0 if not known yet
+		*/
+		void end_create(thread_id_t parent, thread_id_t child, uint64_t handle = 0);
+
+		/** Attaches the handle to the thread which was created last by parent */
+		void attach_handle(thread_id_t parent, uint64_t handle);
+
+		/**
+		* Returns the id of the thread which is referenced by handle,
+		* or 0 if the handle was not returned by a thread creation
+		*/
+		thread_id_t thread_of(uint64_t handle) const;
+
+		/**
+		* Returns the creator of child for the fork, called once per thread.
+		* If a creation is still pending, waits (bounded) until it returns.
+		*/
+		detector::tid_t take_creator(thread_id_t child);
+
+		/** Records that joiner waits for the exit of child */
+		void begin_wait(thread_id_t joiner, thread_id_t child);
+
+		/**
+		* The waiting of joiner for child ended (e.g. timeout).
+		* \return sync object of the exit if the child exited already, otherwise nullptr
+		*/
+		void * end_wait(thread_id_t joiner, thread_id_t child);
+
+		/** The handle is not valid anymore (e.g. the thread was joined) */
+		void close_handle(uint64_t handle);
+
+		/** Records the exit of child and returns how it is joined */
+		Exit exited(thread_id_t child);
+	};
+} // namespace drace
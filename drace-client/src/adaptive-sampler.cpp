@@ -0,0 +1,108 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "adaptive-sampler.h"
+#include "memory-tracker.h"
+#include "statistics.h"
+
+#include <dr_api.h>
+
+#include <vector>
+
+namespace drace {
+	static_assert(AdaptiveSampler::FRAGMENT_RES == MemoryTracker::HIST_PC_RES,
+		"fragments have to match the pc statistics");
+
+	AdaptiveSampler::AdaptiveSampler()
+		: _mx(dr_mutex_create())
+	{ }
+
+	AdaptiveSampler::~AdaptiveSampler() {
+		dr_mutex_destroy(_mx);
+	}
+
+	bool AdaptiveSampler::sample(per_thread_t * data, void * pc) {
+		const size_t num_racy = _num_racy.load(std::memory_order_acquire);
+		if (num_racy != data->racy_seen) {
+			sync_racy(data, num_racy);
+		}
+
+		const uint64_t fragment = (uint64_t)pc >> FRAGMENT_RES;
+		auto it = data->fragment_book.find(fragment);
+		if (it == data->fragment_book.end()) {
+			fragment_state_t state{ 0, 0 };
+			// fragments which are already known to be hot (lossy counting)
+			// start with a lower rate
+			if (MemoryTracker::pc_in_freq(data, pc)) {
+				state.level = MAX_LEVEL / 2;
+			}
+			it = data->fragment_book.emplace(fragment, state).first;
+		}
+
+		fragment_state_t & state = it->second;
+		if (state.countdown > 0) {
+			--state.countdown;
+			data->stats->sampling_skips++;
+			return false;
+		}
+		// analyze this execution and halve the rate of this fragment
+		if (state.level < MAX_LEVEL) {
+			++state.level;
+		}
+		state.countdown = (1u << state.level) - 1;
+		data->stats->sampling_hits++;
+		return true;
+	}
+
+	void AdaptiveSampler::on_race(const detector::Race * race) {
+		dr_mutex_lock(_mx);
+		size_t num_racy = _num_racy.load(std::memory_order_relaxed);
+		for (const detector::AccessEntry * ac : { &race->first, &race->second }) {
+			for (size_t i = 0; i < ac->stack_size; ++i) {
+				// each race resets its fragments again
+				_reserved.store(num_racy + 1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_release);
+				_racy[num_racy % RACY_RING].store(ac->stack_trace[i] >> FRAGMENT_RES, std::memory_order_relaxed);
+				++num_racy;
+			}
+		}
+		_num_racy.store(num_racy, std::memory_order_release);
+		dr_mutex_unlock(_mx);
+	}
+
+	void AdaptiveSampler::sync_racy(per_thread_t * data, size_t num_racy) {
+		bool lost = (num_racy - data->racy_seen > RACY_RING);
+		if (!lost) {
+			std::vector<uint64_t> fragments;
+			fragments.reserve(num_racy - data->racy_seen);
+			for (size_t i = data->racy_seen; i < num_racy; ++i) {
+				fragments.push_back(_racy[i % RACY_RING].load(std::memory_order_relaxed));
+			}
+			// the oldest read entry must not have been overwritten meanwhile
+			std::atomic_thread_fence(std::memory_order_acquire);
+			lost = (_reserved.load(std::memory_order_relaxed) - data->racy_seen > RACY_RING);
+			if (!lost) {
+				for (uint64_t fragment : fragments) {
+					// analyze the next execution with full rate
+					data->fragment_book[fragment] = fragment_state_t{ 0, 0 };
+				}
+			}
+		}
+		if (lost) {
+			// the thread fell behind, reset all fragments
+			for (auto & entry : data->fragment_book) {
+				entry.second = fragment_state_t{ 0, 0 };
+			}
+		}
+		data->racy_seen = num_racy;
+	}
+} // namespace drace
@@ -0,0 +1,282 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "analysis-pool.h"
+#include "memory-tracker.h"
+#include "statistics.h"
+
+#include <algorithm>
+#include <mutex> // for lock_guard
+#include <vector>
+
+#include <dr_api.h>
+#include <detector/detector_if.h>
+
+namespace drace {
+	/** Analysis thread, processes the queues assigned to it */
+	class AnalysisWorker {
+	public:
+		/// unsuccessful polling rounds before the worker goes to sleep
+		static constexpr unsigned spin_rounds = 64;
+
+		/// protects the queue list, held while processing
+		ipc::spinlock              mx;
+		std::vector<AsyncQueue*>   queues;
+
+		std::atomic<bool>          running{ true };
+		std::atomic<bool>          active{ false };
+		std::atomic<bool>          sleeping{ false };
+		void *                     wakeup;
+
+		AnalysisWorker() : wakeup(dr_event_create()) {}
+
+		~AnalysisWorker() {
+			dr_event_destroy(wakeup);
+		}
+
+		/** Wakes the worker if it is sleeping */
+		inline void notify() {
+			// pairs with the fence in run(), as otherwise
+			// the worker could miss the new batch before sleeping
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (sleeping.load(std::memory_order_relaxed) &&
+				sleeping.exchange(false, std::memory_order_relaxed))
+			{
+				dr_event_signal(wakeup);
+			}
+		}
+
+		static void thread_main(void * arg) {
+			static_cast<AnalysisWorker*>(arg)->run();
+		}
+
+	private:
+		void run() {
+			unsigned idle = 0;
+			while (running.load(std::memory_order_relaxed)) {
+				if (process_all()) {
+					idle = 0;
+					continue;
+				}
+				if (++idle < spin_rounds) {
+					dr_thread_yield();
+					continue;
+				}
+				idle = 0;
+
+				dr_event_reset(wakeup);
+				sleeping.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!has_work() && running.load(std::memory_order_relaxed)) {
+					dr_event_wait(wakeup);
+				}
+				sleeping.store(false, std::memory_order_relaxed);
+			}
+			// analyze what is left
+			while (process_all()) {}
+			active.store(false, std::memory_order_release);
+		}
+
+		/** Processes all pending batches, returns true if there were any */
+		bool process_all() {
+			bool progress = false;
+			std::lock_guard<ipc::spinlock> lg(mx);
+			for (AsyncQueue * q : queues) {
+				AsyncBatch batch;
+				while (q->full.remove(batch)) {
+					q->proc_refs += AnalysisPool::analyze(
+						q->owner, (const AnalysisPool::mem_ref_t*)batch.buf, batch.num_refs);
+					// cannot fail, as there are not more buffers than slots
+					q->empty.insert(batch.buf);
+					q->analyzed.fetch_add(1, std::memory_order_release);
+					progress = true;
+				}
+			}
+			return progress;
+		}
+
+		bool has_work() {
+			std::lock_guard<ipc::spinlock> lg(mx);
+			return std::any_of(queues.begin(), queues.end(),
+				[](const AsyncQueue * q) {return !q->full.isEmpty(); });
+		}
+	};
+
+	AnalysisPool::AnalysisPool(unsigned num_workers) {
+		_workers.reserve(num_workers);
+		for (unsigned i = 0; i < num_workers; ++i) {
+			_workers.emplace_back(std::make_unique<AnalysisWorker>());
+			AnalysisWorker * w = _workers.back().get();
+			w->active.store(true, std::memory_order_relaxed);
+			if (!dr_create_client_thread(AnalysisWorker::thread_main, w)) {
+				LOG_ERROR(-1, "could not start analysis thread");
+				DR_ASSERT(false);
+			}
+		}
+		LOG_INFO(-1, "started %i analysis threads", num_workers);
+	}
+
+	AnalysisPool::~AnalysisPool() {
+		for (auto & w : _workers) {
+			w->running.store(false, std::memory_order_relaxed);
+			w->sleeping.store(false, std::memory_order_relaxed);
+			dr_event_signal(w->wakeup);
+		}
+		for (auto & w : _workers) {
+			while (w->active.load(std::memory_order_acquire)) {
+				dr_thread_yield();
+			}
+		}
+	}
+
+	void AnalysisPool::register_thread(void * drcontext, per_thread_t * data) {
+		AsyncQueue * q = new AsyncQueue;
+		q->owner = data;
+		q->storage.resize((AsyncQueue::num_buffers - 1) * MemoryTracker::MEM_BUF_SIZE, drcontext);
+		for (size_t i = 0; i < AsyncQueue::num_buffers - 1; ++i) {
+			q->empty.insert(q->storage.data + i * MemoryTracker::MEM_BUF_SIZE);
+		}
+
+		// assign threads round-robin
+		unsigned wid = _next_worker.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+		q->worker = _workers[wid].get();
+		{
+			std::lock_guard<ipc::spinlock> lg(q->worker->mx);
+			q->worker->queues.push_back(q);
+		}
+		data->async_queue = q;
+	}
+
+	void AnalysisPool::unregister_thread(void * drcontext, per_thread_t * data) {
+		AsyncQueue * q = data->async_queue;
+		if (nullptr == q) return;
+
+		drain(data);
+		{
+			std::lock_guard<ipc::spinlock> lg(q->worker->mx);
+			auto & queues = q->worker->queues;
+			queues.erase(std::remove(queues.begin(), queues.end(), q), queues.end());
+		}
+		data->stats->proc_refs += q->proc_refs;
+
+		// switch back to the thread-owned buffer
+		data->buf_beg = data->mem_buf.data;
+		data->buf_ptr = data->buf_beg;
+		data->buf_end = -(ptr_int_t)(data->buf_beg + MemoryTracker::MEM_BUF_SIZE);
+		data->async_queue = nullptr;
+
+		q->storage.deallocate(drcontext);
+		delete q;
+	}
+
+	void AnalysisPool::unregister_all() {
+		std::vector<per_thread_t*> owners;
+		for (auto & w : _workers) {
+			std::lock_guard<ipc::spinlock> lg(w->mx);
+			for (AsyncQueue * q : w->queues) {
+				owners.push_back(q->owner);
+			}
+		}
+		// the owners do not run anymore, hence free with their allocation context
+		for (per_thread_t * data : owners) {
+			unregister_thread(nullptr, data);
+		}
+	}
+
+	void AnalysisPool::submit(per_thread_t * data, uint32_t num_refs) {
+		AsyncQueue * q = data->async_queue;
+		DR_ASSERT(nullptr != q);
+
+		byte * next;
+		if (!q->empty.remove(next)) {
+			// worker falls behind, wait for a free buffer
+			data->stats->async_stalls++;
+			q->worker->notify();
+			unsigned tries = 0;
+			while (!q->empty.remove(next)) {
+				if (++tries > 100) {
+					dr_thread_yield();
+					tries = 0;
+				}
+			}
+		}
+		// cannot fail, as there are not more buffers than slots
+		q->full.insert(AsyncBatch{ data->buf_beg, num_refs });
+		q->submitted.store(q->submitted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		q->worker->notify();
+		data->stats->async_batches++;
+
+		data->buf_beg = next;
+		data->buf_ptr = next;
+		data->buf_end = -(ptr_int_t)(next + MemoryTracker::MEM_BUF_SIZE);
+	}
+
+	void AnalysisPool::drain(per_thread_t * data) {
+		AsyncQueue * q = data->async_queue;
+		if (nullptr == q) return;
+
+		const uint64_t target = q->submitted.load(std::memory_order_relaxed);
+		if (q->analyzed.load(std::memory_order_acquire) == target)
+			return;
+
+		data->stats->async_waits++;
+		q->worker->notify();
+		unsigned tries = 0;
+		while (q->analyzed.load(std::memory_order_acquire) != target) {
+			if (++tries > 100) {
+				dr_thread_yield();
+				tries = 0;
+			}
+		}
+	}
+
+	uint64_t AnalysisPool::analyze(per_thread_t * data, const mem_ref_t * refs, size_t num_refs) {
+		uint64_t excl_beg = 0;
+		uint64_t excl_end = 0;
+		if (params.excl_stack) {
+			excl_beg = data->appstack_beg;
+			excl_end = data->appstack_end;
+		}
+
+		const detector::PcTable * pc_table = memory_tracker->pc_table.table();
+		uint64_t processed = 0;
+		const mem_ref_t * run = refs;
+		const mem_ref_t * end = refs + num_refs;
+
+		if (!params.fastmode)
+			dr_mutex_lock(th_mutex);
+
+		for (const mem_ref_t * ref = refs; ref != end; ++ref) {
+			if (!MemoryTracker::is_stack_marker(ref))
+				continue;
+			// flush accesses before marker
+			if (ref != run) {
+				processed += detector::access_batch(data->detector_data, run, ref - run, excl_beg, excl_end, pc_table);
+			}
+			if (ref->write()) {
+				detector::func_enter(data->detector_data, (void*)ref->pc);
+			}
+			else {
+				detector::func_exit(data->detector_data);
+			}
+			run = ref + 1;
+		}
+		if (run != end) {
+			processed += detector::access_batch(data->detector_data, run, end - run, excl_beg, excl_end, pc_table);
+		}
+
+		if (!params.fastmode)
+			dr_mutex_unlock(th_mutex);
+
+		return processed;
+	}
+} // namespace drace
@@ -29,6 +29,7 @@
 #include "drace-client.h"
 #include "race-collector.h"
 #include "memory-tracker.h"
+#include "analysis-pool.h"
 #include "function-wrapper.h"
 #include "Module.h"
 #include "symbols.h"
@@ -43,6 +44,14 @@
 #include <detector/detector_if.h>
 #include <version/version.h>
 
+#ifdef LINUX
+#include <sched.h>
+#include <sys/syscall.h>
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+#endif
+
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 {
     using namespace drace;
@@ -78,6 +87,11 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
     dr_register_exit_event(event_exit);
     drmgr_register_thread_init_event(event_thread_init);
     drmgr_register_thread_exit_event(event_thread_exit);
+#ifdef LINUX
+    dr_register_filter_syscall_event(event_filter_syscall);
+    drmgr_register_pre_syscall_event(event_pre_syscall);
+    drmgr_register_post_syscall_event(event_post_syscall);
+#endif
 
     // Setup Statistics Collector
     stats = std::make_unique<Statistics>(0);
@@ -85,7 +99,9 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
     // Setup Function Wrapper
     DR_ASSERT(funwrap::init());
 
-    auto symbol_table = std::make_shared<Symbols>();
+    // with delayed lookup, symbols are resolved in bulk,
+    // hence index the functions of each module
+    auto symbol_table = std::make_shared<Symbols>(params.delayed_sym_lookup);
 
     // Setup Module Tracking
     module_tracker = std::make_unique<drace::module::Tracker>(symbol_table);
@@ -96,11 +112,17 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
     // Setup Race Collector and bind lookup function
     race_collector = std::make_unique<RaceCollector>(
         params.delayed_sym_lookup,
-        symbol_table);
+        symbol_table,
+        params.race_queue_size);
 
     // Initialize Detector
     detector::init(argc, argv, race_collector_add_race);
 
+    // Setup asynchronous analysis
+    if (params.async_workers > 0) {
+        analysis_pool = std::make_unique<AnalysisPool>(params.async_workers);
+    }
+
     LOG_INFO(-1, "application pid: %i", dr_get_process_id());
 
     // if we try to access a non-existing SHM,
@@ -123,9 +145,35 @@ namespace drace {
         if (!drmgr_unregister_thread_init_event(event_thread_init) ||
             !drmgr_unregister_thread_exit_event(event_thread_exit))
             DR_ASSERT(false);
+#ifdef LINUX
+        if (!dr_unregister_filter_syscall_event(event_filter_syscall) ||
+            !drmgr_unregister_pre_syscall_event(event_pre_syscall) ||
+            !drmgr_unregister_post_syscall_event(event_post_syscall))
+            DR_ASSERT(false);
+#endif
+
+        if (analysis_pool) {
+            // threads which are still alive refer to their queues in the pool
+            analysis_pool->unregister_all();
+        }
+        // analyze pending buffers and stop analysis threads
+        analysis_pool.reset();
+        // threads which are still alive did not pass event_thread_exit
+        dr_rwlock_read_lock(tls_rw_mutex);
+        for (const auto & td : TLS_buckets) {
+            *stats |= *(td.second->stats);
+        }
+        dr_rwlock_read_unlock(tls_rw_mutex);
+        // report pending races and stop reporter thread
+        race_collector->stop();
+        // stop symbol scanner, as it uses the module tracker
+        funwrap::stop_scanner();
 
         // Generate summary while information is still present
         generate_summary();
+        stats->delivery = detector::delivery_stats();
+        stats->race_stalls = race_collector->stalls();
+        stats->dropped_races = race_collector->dropped();
         stats->print_summary(drace::log_target);
 
         // Cleanup all drace modules
@@ -176,6 +224,38 @@ namespace drace {
         LOG_INFO(-1, "Thread exited");
     }
 
+#ifdef LINUX
+    static bool event_filter_syscall(void *drcontext, int sysnum)
+    {
+        return sysnum == SYS_clone || sysnum == SYS_clone3;
+    }
+
+    static bool event_pre_syscall(void *drcontext, int sysnum)
+    {
+        uint64_t flags = 0;
+        if (sysnum == SYS_clone) {
+            flags = (uint64_t)dr_syscall_get_param(drcontext, 0);
+        }
+        else if (sysnum == SYS_clone3) {
+            // flags are the first member of struct clone_args
+            if (!dr_safe_read((void*)dr_syscall_get_param(drcontext, 0), sizeof(flags), &flags, nullptr))
+                flags = 0;
+        }
+        // forks of processes are not tracked
+        if (flags & CLONE_THREAD) {
+            memory_tracker->lineage.begin_create(dr_get_thread_id(drcontext));
+        }
+        return true;
+    }
+
+    static void event_post_syscall(void *drcontext, int sysnum)
+    {
+        // the parent returns with the id of the child
+        const ptr_int_t child = (ptr_int_t)dr_syscall_get_result(drcontext);
+        memory_tracker->lineage.end_create(dr_get_thread_id(drcontext), child > 0 ? (thread_id_t)child : 0);
+    }
+#endif
+
     static void parse_args(int argc, const char ** argv) {
         params.argc = argc;
         params.argv = argv;
@@ -185,7 +265,8 @@ namespace drace {
             (clipp::option("-c", "--config") & clipp::value("config", params.config_file)) % ("config file (default: " + params.config_file + ")"),
             (
             (clipp::option("-s", "--sample-rate") & clipp::integer("sample-rate", params.sampling_rate)) % "sample each nth instruction (default: no sampling)",
-                (clipp::option("-i", "--instr-rate")  & clipp::integer("instr-rate", params.instr_rate)) % "instrument each nth instruction (default: no sampling)"
+                (clipp::option("-i", "--instr-rate")  & clipp::integer("instr-rate", params.instr_rate)) % "instrument each nth instruction (default: no sampling)",
+                clipp::option("--adaptive-sampling").set(params.adaptive_sampling) % "sample each code fragment with a decaying rate, reset on races"
                 ) % "sampling options",
                 (
             (clipp::option("--lossy").set(params.lossy) % "dynamically exclude fragments using lossy counting") &
@@ -200,7 +281,10 @@ namespace drace {
             clipp::option("--delay-syms").set(params.delayed_sym_lookup) % "perform symbol lookup after application shutdown",
             clipp::option("--sync-mode").set(params.fastmode, false) % "flush all buffers on a sync event (instead of participating only)",
             clipp::option("--fast-mode").set(params.fastmode) % "DEPRECATED: inverse of sync-mode",
+            (clipp::option("--async-workers") & clipp::integer("threads", params.async_workers)) % "analyze memory accesses in this number of background threads (default: 0, analyze inline)",
+            (clipp::option("--instr-cache") & clipp::value("filename", params.instr_cache)) % "cache instrumentation decisions of modules in this file (speeds up subsequent runs)",
             (clipp::option("--suplevel") & clipp::integer("level", params.suppression_level)) % "suppress similar races (0=detector-default, 1=unique top-of-callstack entry, default: 1)",
+            (clipp::option("--race-queue") & clipp::integer("slots", params.race_queue_size)) % ("number of races pending for the reporter, before racing threads wait (default: " + std::to_string(params.race_queue_size) + ")"),
             (
 #ifndef DRACE_USE_LEGACY_API
             (clipp::option("--xml-file", "-x") & clipp::value("filename", params.xml_file)) % "log races in valkyries xml format in this file",
@@ -264,6 +348,7 @@ namespace drace {
             "< Runtime Configuration:\n"
             "< Sampling Rate:\t%i\n"
             "< Instr. Rate:\t\t%i\n"
+            "< Adaptive Sampling:\t%s\n"
             "< Lossy:\t\t%s\n"
             "< Lossy-Flush:\t\t%s\n"
             "< Exclude Traces:\t%s\n"
@@ -272,15 +357,19 @@ namespace drace {
             "< Annotation Sup.:\t%s\n"
             "< Delayed Sym Lookup:\t%s\n"
             "< Fast Mode:\t\t%s\n"
+            "< Async Workers:\t%i\n"
+            "< Instr. Cache:\t\t%s\n"
             "< Config File:\t\t%s\n"
             "< Output File:\t\t%s\n"
             "< XML File:\t\t%s\n"
             "< Stack-Size:\t\t%i\n"
+            "< Race Queue:\t\t%i\n"
             "< External Ctrl:\t%s\n"
             "< Log Target:\t\t%s\n"
             "< Private Caches:\t%s\n",
             params.sampling_rate,
             params.instr_rate,
+            params.adaptive_sampling ? "ON" : "OFF",
             params.lossy ? "ON" : "OFF",
             params.lossy_flush ? "ON" : "OFF",
             params.excl_traces ? "ON" : "OFF",
@@ -289,6 +378,8 @@ namespace drace {
             params.annotations ? "ON" : "OFF",
             params.delayed_sym_lookup ? "ON" : "OFF",
             params.fastmode ? "ON" : "OFF",
+            params.async_workers,
+            params.instr_cache != "" ? params.instr_cache.c_str() : "OFF",
             params.config_file.c_str(),
             params.out_file != "" ? params.out_file.c_str() : "OFF",
 #ifdef DRACE_USE_LEGACY_API
@@ -297,6 +388,7 @@ namespace drace {
             params.xml_file != "" ? params.xml_file.c_str() : "OFF",
 #endif
             params.stack_size,
+            params.race_queue_size,
             params.extctrl ? "ON" : "OFF",
             params.logfile,
             dr_using_all_private_caches() ? "ON" : "OFF");
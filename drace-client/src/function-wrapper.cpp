@@ -14,6 +14,8 @@
 #include "memory-tracker.h"
 #include "config.h"
 #include "MSR.h"
+#include "Module.h"
+#include "module/DecisionCache.h"
 
 #include <vector>
 #include <string>
@@ -30,6 +32,7 @@
 namespace drace {
 	bool funwrap::init() {
 		bool state = drwrap_init();
+		start_scanner();
 
 		// performance tuning
 		drwrap_set_global_flags((drwrap_global_flags_t)(DRWRAP_NO_FRILLS | DRWRAP_FAST_CLEANCALLS));
@@ -37,16 +40,30 @@ namespace drace {
 	}
 
 	void funwrap::finalize() {
+		stop_scanner();
 		drwrap_exit();
 	}
 
+	/** Wrap info which additionally records the wrapped offsets */
+	struct record_info_t {
+		funwrap::wrap_info_t    info;
+		std::vector<uint64_t> * offsets;
+	};
+
+	static bool record_wrap_clbck(const char *name, size_t modoffs, void *data) {
+		record_info_t * rec = (record_info_t*)data;
+		rec->offsets->push_back(modoffs);
+		return funwrap::internal::wrap_function_clbck(name, modoffs, (void*)&rec->info);
+	}
+
 	bool funwrap::wrap_functions(
 		const module_data_t *mod,
 		const std::vector<std::string> & syms,
 		bool full_search,
 		funwrap::Method method,
 		wrapcb_pre_t pre,
-		wrapcb_post_t post)
+		wrapcb_post_t post,
+		SymbolScan * scan)
 	{
         // set to true if at least one function is wrapped
         bool wrapped_some = false;
@@ -69,14 +86,35 @@ namespace drace {
 			}
 			else if (method == Method::DBGSYMS)
 			{
+				if (nullptr != scan) {
+					// resolved later in a single pass
+					scan->add(name, pre, post);
+					continue;
+				}
 				wrap_info_t info{ mod, pre, post };
+				module::DecisionCache * cache = module_tracker->decisions();
+				std::vector<uint64_t> offsets;
+				if (nullptr != cache && cache->get_wraps(mod, name, offsets)) {
+					// warm start, skip the symbol search
+					for (uint64_t offs : offsets) {
+						internal::wrap_function_clbck("<cached>", (size_t)offs, (void*)&info);
+					}
+					wrapped_some |= !offsets.empty();
+					continue;
+				}
+
+				record_info_t rec{ info, &offsets };
 				drsym_error_t err = drsym_search_symbols(
 					mod->full_path,
 					name.c_str(),
 					false,
-					(drsym_enumerate_cb)internal::wrap_function_clbck,
-					(void*)&info);
-                wrapped_some |= (err == DRSYM_SUCCESS);
+					(drsym_enumerate_cb)record_wrap_clbck,
+					(void*)&rec);
+				wrapped_some |= (err == DRSYM_SUCCESS);
+				// do not persist results of a failed search
+				if (nullptr != cache && err == DRSYM_SUCCESS) {
+					cache->set_wraps(mod, name, offsets);
+				}
 			}
 			else if (method == Method::EXPORTS)
 			{
@@ -110,20 +148,6 @@ namespace drace {
 		return true;
 	}
 
-	bool starters_sys_callback(const char *name, size_t modoffs, void *data) {
-		module_data_t * mod = (module_data_t*)data;
-		bool ok = drwrap_wrap_ex(
-			mod->start + modoffs,
-			funwrap::event::thread_pre_sys,
-			funwrap::event::thread_post_sys,
-			(void*)name,
-			DRWRAP_CALLCONV_FASTCALL);
-        if (ok) {
-            LOG_NOTICE(0, "wrapped system thread-start function %s", name);
-        }
-		return true;
-	}
-
 	void funwrap::wrap_thread_start(const module_data_t *mod) {
 		for (const auto & name : config.get_multi("functions", "thread_starters")) {
 			drsym_error_t err = drsym_search_symbols(
@@ -136,21 +160,18 @@ namespace drace {
 	}
 
 	void funwrap::wrap_thread_start_sys(const module_data_t *mod) {
-		for (const auto & name : config.get_multi("functions", "thread_starters_sys")) {
-			drsym_error_t err = drsym_search_symbols(
-				mod->full_path,
-				name.c_str(),
-				false,
-				(drsym_enumerate_cb)starters_sys_callback,
-				(void*)mod);
-		}
+		wrap_functions(mod, config.get_multi("functions", "thread_starters_sys"), false, Method::EXPORTS, event::thread_pre_sys, event::thread_post_sys);
+	}
+
+	void funwrap::wrap_thread_join_sys(const module_data_t *mod) {
+		wrap_functions(mod, config.get_multi("functions", "thread_joiners_sys"), false, Method::EXPORTS, event::thread_join_pre_sys, event::thread_join_post_sys);
 	}
 
-	void funwrap::wrap_excludes(const module_data_t *mod, std::string section) {
-		wrap_functions(mod, config.get_multi(section, "exclude"), false, Method::DBGSYMS, event::begin_excl, event::end_excl);
+	void funwrap::wrap_excludes(const module_data_t *mod, std::string section, SymbolScan * scan) {
+		wrap_functions(mod, config.get_multi(section, "exclude"), false, Method::DBGSYMS, event::begin_excl, event::end_excl, scan);
 	}
 
-	void funwrap::wrap_mutexes(const module_data_t *mod, bool sys) {
+	void funwrap::wrap_mutexes(const module_data_t *mod, bool sys, SymbolScan * scan) {
 		using namespace internal;
 
 		if (sys) {
@@ -182,17 +203,17 @@ namespace drace {
 		else {
 			LOG_INFO(0, "try to wrap non-system mutexes");
 			// Std mutexes
-			wrap_functions(mod, config.get_multi("stdsync", "acquire_excl"), false, Method::DBGSYMS, event::get_arg, event::mutex_lock);
-			wrap_functions(mod, config.get_multi("stdsync", "acquire_excl_try"), false, Method::DBGSYMS, event::get_arg, event::mutex_trylock);
-			wrap_functions(mod, config.get_multi("stdsync", "release_excl"), false, Method::DBGSYMS, event::mutex_unlock, NULL);
+			wrap_functions(mod, config.get_multi("stdsync", "acquire_excl"), false, Method::DBGSYMS, event::get_arg, event::mutex_lock, scan);
+			wrap_functions(mod, config.get_multi("stdsync", "acquire_excl_try"), false, Method::DBGSYMS, event::get_arg, event::mutex_trylock, scan);
+			wrap_functions(mod, config.get_multi("stdsync", "release_excl"), false, Method::DBGSYMS, event::mutex_unlock, NULL, scan);
 
 			// Qt Mutexes
-			wrap_functions(mod, config.get_multi("qtsync", "acquire_excl"), false, Method::DBGSYMS, event::get_arg, event::recmutex_lock);
-			wrap_functions(mod, config.get_multi("qtsync", "acquire_excl_try"), false, Method::DBGSYMS, event::get_arg, event::recmutex_trylock);
-			wrap_functions(mod, config.get_multi("qtsync", "release_excl"), false, Method::DBGSYMS, event::recmutex_unlock, NULL);
+			wrap_functions(mod, config.get_multi("qtsync", "acquire_excl"), false, Method::DBGSYMS, event::get_arg, event::recmutex_lock, scan);
+			wrap_functions(mod, config.get_multi("qtsync", "acquire_excl_try"), false, Method::DBGSYMS, event::get_arg, event::recmutex_trylock, scan);
+			wrap_functions(mod, config.get_multi("qtsync", "release_excl"), false, Method::DBGSYMS, event::recmutex_unlock, NULL, scan);
 
-			wrap_functions(mod, config.get_multi("qtsync", "acquire_shared"), false, Method::DBGSYMS, event::get_arg, event::mutex_read_lock);
-			wrap_functions(mod, config.get_multi("qtsync", "acquire_shared_try"), false, Method::DBGSYMS, event::get_arg, event::mutex_read_trylock);
+			wrap_functions(mod, config.get_multi("qtsync", "acquire_shared"), false, Method::DBGSYMS, event::get_arg, event::mutex_read_lock, scan);
+			wrap_functions(mod, config.get_multi("qtsync", "acquire_shared_try"), false, Method::DBGSYMS, event::get_arg, event::mutex_read_trylock, scan);
 		}
 	}
 
@@ -77,6 +77,7 @@ namespace drace {
 				// to avoid high pressure on the internal spinlock,
 				// we lock externally using a os lock
 				// TODO: optimize tsan wrapper internally
+				MemoryTracker::drain_async(data);
 				dr_mutex_lock(th_mutex);
 				//detector::happens_after(data->tid, retval);
 				detector::allocate(data->detector_data, pc, retval, size);
@@ -160,30 +161,137 @@ namespace drace {
 			LOG_INFO(data->tid, "new thread created: %i", last_th_start.load());
 		}
 
+		/** The joiner acquires the exit of the child, if it exited before the wait */
+		static void join_exited(per_thread_t * data, void * exit_sync) {
+			if (nullptr == exit_sync || nullptr == data->detector_data)
+				return;
+			MemoryTracker::drain_async(data);
+			detector::happens_after(data->detector_data, exit_sync);
+		}
+
+#ifdef WINDOWS
+		/** Returns the id of the thread referenced by handle, or 0 if it is not a thread */
+		static DWORD thread_id_of(void * drcontext, HANDLE handle) {
+			// dr does not support this natively, so make syscall in app context
+			dr_switch_to_app_state(drcontext);
+			DWORD tid = GetThreadId(handle);
+			dr_switch_to_dr_state(drcontext);
+			return tid;
+		}
+
 		void event::thread_pre_sys(void *wrapctx, void **user_data) {
+			app_pc drcontext = drwrap_get_drcontext(wrapctx);
+			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+			DR_ASSERT(nullptr != data);
+
+			// the child might run before CreateThread returns
+			memory_tracker->lineage.begin_create(data->tid);
+			// optional out parameter for the id of the new thread
+			*user_data = drwrap_get_arg(wrapctx, 5);
 		}
 
-		/* Deprecated as this did never really work */
 		void event::thread_post_sys(void *wrapctx, void *user_data) {
-			return; // TODO: Fix or remove this code
-#if 0
-			//app_pc drcontext = drwrap_get_drcontext(wrapctx);
-			//per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
-			dr_rwlock_read_lock(tls_rw_mutex);
-			auto other_th = last_th_start.load(std::memory_order_acquire);
-			// There are some spurious failures where the thread init event
-			// is not called but the system call has already returned
-			// Hence, skip the fork here and rely on fallback-fork in
-			// analyze_access
-			if (TLS_buckets.count(other_th) == 1) {
-				auto other_tls = TLS_buckets[other_th];
-				//MemoryTracker::flush_all_threads(data, false);
-				//detector::fork(dr_get_thread_id(drcontext), other_tls->tid, &(other_tls->detector_data));
+			// also called if the creation was left by an exception
+			void * drcontext = dr_get_current_drcontext();
+			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+			DR_ASSERT(nullptr != data);
+
+			HANDLE handle = (nullptr != wrapctx) ? (HANDLE)drwrap_get_retval(wrapctx) : nullptr;
+			DWORD child = 0;
+			if (nullptr != handle) {
+				child = (nullptr != user_data) ? *((DWORD*)user_data) : thread_id_of(drcontext, handle);
 			}
-			dr_rwlock_read_unlock(tls_rw_mutex);
-#endif
+			// the child is forked lazily, hence usually after this point
+			memory_tracker->lineage.end_create(data->tid, child, (uint64_t)handle);
+			LOG_TRACE(data->tid, "created thread %i", child);
 		}
 
+		void event::thread_join_pre_sys(void *wrapctx, void **user_data) {
+			app_pc drcontext = drwrap_get_drcontext(wrapctx);
+			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+			DR_ASSERT(nullptr != data);
+			*user_data = nullptr;
+
+			HANDLE handle = (HANDLE)drwrap_get_arg(wrapctx, 0);
+			// most waits are not on threads, hence filter by the known handles
+			if (memory_tracker->lineage.thread_of((uint64_t)handle) == 0)
+				return;
+			// the handle value might have been reused, hence validate it
+			DWORD child = thread_id_of(drcontext, handle);
+			if (child == 0 || child == data->tid)
+				return;
+
+			memory_tracker->lineage.begin_wait(data->tid, child);
+			*user_data = (void*)(uintptr_t)child;
+		}
+
+		void event::thread_join_post_sys(void *wrapctx, void *user_data) {
+			if (nullptr == user_data)
+				return;
+			// also cleanup if the wait was left by an exception
+			void * drcontext = dr_get_current_drcontext();
+			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+			DR_ASSERT(nullptr != data);
+
+			void * exit_sync = memory_tracker->lineage.end_wait(data->tid, (thread_id_t)(uintptr_t)user_data);
+			// if the thread exited while we were waiting, the join is already done
+			if (nullptr != wrapctx && (DWORD)(uintptr_t)drwrap_get_retval(wrapctx) == WAIT_OBJECT_0)
+				join_exited(data, exit_sync);
+		}
+#else
+		void event::thread_pre_sys(void *wrapctx, void **user_data) {
+			// the creation itself is tracked by the clone syscall,
+			// here we only learn the handle (pthread_t) of the child
+			*user_data = drwrap_get_arg(wrapctx, 0);
+		}
+
+		void event::thread_post_sys(void *wrapctx, void *user_data) {
+			SKIP_ON_EXCEPTION(wrapctx);
+			app_pc drcontext = drwrap_get_drcontext(wrapctx);
+			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+			DR_ASSERT(nullptr != data);
+
+			if ((int)(ptr_int_t)drwrap_get_retval(wrapctx) != 0 || nullptr == user_data)
+				return;
+			uint64_t handle = 0;
+			if (dr_safe_read(user_data, sizeof(handle), &handle, nullptr) && handle != 0) {
+				memory_tracker->lineage.attach_handle(data->tid, handle);
+			}
+		}
+
+		void event::thread_join_pre_sys(void *wrapctx, void **user_data) {
+			app_pc drcontext = drwrap_get_drcontext(wrapctx);
+			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+			DR_ASSERT(nullptr != data);
+			*user_data = nullptr;
+
+			uint64_t handle = (uint64_t)drwrap_get_arg(wrapctx, 0);
+			thread_id_t child = memory_tracker->lineage.thread_of(handle);
+			if (child == 0 || child == data->tid)
+				return;
+
+			memory_tracker->lineage.begin_wait(data->tid, child);
+			*user_data = (void*)handle;
+		}
+
+		void event::thread_join_post_sys(void *wrapctx, void *user_data) {
+			if (nullptr == user_data)
+				return;
+			// also cleanup if the wait was left by an exception
+			void * drcontext = dr_get_current_drcontext();
+			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+			DR_ASSERT(nullptr != data);
+
+			const uint64_t handle = (uint64_t)user_data;
+			void * exit_sync = memory_tracker->lineage.end_wait(data->tid, memory_tracker->lineage.thread_of(handle));
+			if (nullptr != wrapctx && (int)(ptr_int_t)drwrap_get_retval(wrapctx) == 0) {
+				join_exited(data, exit_sync);
+				// a joined pthread_t is invalid
+				memory_tracker->lineage.close_handle(handle);
+			}
+		}
+#endif
+
 		void event::begin_excl(void *wrapctx, void **user_data) {
 			app_pc drcontext = drwrap_get_drcontext(wrapctx);
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
@@ -239,6 +347,7 @@ namespace drace {
 
 			LOG_TRACE(data->tid, "Mutex book size: %i, count: %i, mutex: %p\n", data->mutex_book.size(), cnt, mutex);
 
+			MemoryTracker::drain_async(data);
 			detector::acquire(data->detector_data, mutex, (int)cnt, write);
 			//detector::happens_after(data->tid, mutex);
 
@@ -260,13 +369,13 @@ namespace drace {
 			void* mutex = drwrap_get_arg(wrapctx, 0);
 			//detector::happens_before(data->tid, mutex);
 
-			if (!data->mutex_book.count((uint64_t)mutex)) {
+			unsigned * cnt = data->mutex_book.find((uint64_t)mutex);
+			if (nullptr == cnt) {
 				LOG_TRACE(data->tid, "Mutex Error %p at : %s", mutex, module_tracker->_syms->get_symbol_info(drwrap_get_func(wrapctx)).sym_name.c_str());
 				// mutex not in book
 				return;
 			}
-			auto & cnt = --(data->mutex_book[(uint64_t)mutex]);
-			if (cnt == 0) {
+			if (--(*cnt) == 0) {
 				data->mutex_book.erase((uint64_t)mutex);
 			}
 
@@ -411,6 +520,7 @@ namespace drace {
             LOG_TRACE(static_cast<detector::tid_t>(data->tid), "barrier enter %p", *addr);
             // each thread enters the barrier individually
 
+            MemoryTracker::drain_async(data);
             detector::happens_before(data->detector_data, *addr);
         }
 
@@ -424,6 +534,7 @@ namespace drace {
 			LOG_TRACE(data->tid, "barrier passed");
 
 			// each thread leaves individually, but only after all barrier_enters have been called
+			MemoryTracker::drain_async(data);
 			detector::happens_after(data->detector_data, addr);
 		}
 
@@ -439,6 +550,7 @@ namespace drace {
 			// TODO: Validate cancellation path, where happens_before will be called again
 			if (passed) {
 				// each thread leaves individually, but only after all barrier_enters have been called
+				MemoryTracker::drain_async(data);
 				detector::happens_after(data->detector_data, addr);
 			}
 		}
@@ -449,6 +561,7 @@ namespace drace {
 			app_pc drcontext = drwrap_get_drcontext(wrapctx);
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
 			DR_ASSERT(nullptr != data);
+			MemoryTracker::drain_async(data);
 			detector::happens_before(data->detector_data, identifier);
 			LOG_TRACE(data->tid, "happens-before @ %p", identifier);
 		}
@@ -459,6 +572,7 @@ namespace drace {
 			app_pc drcontext = drwrap_get_drcontext(wrapctx);
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
 			DR_ASSERT(nullptr != data);
+			MemoryTracker::drain_async(data);
 			detector::happens_after(data->detector_data, identifier);
 			LOG_TRACE(data->tid, "happens-after  @ %p", identifier);
 		}
@@ -0,0 +1,269 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "function-wrapper.h"
+#include "function-wrapper/symbol-scan.h"
+#include "module/Tracker.h"
+#include "module/DecisionCache.h"
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+
+#include <dr_api.h>
+#include <drsyms.h>
+
+namespace drace {
+	namespace funwrap {
+		SymbolScan::SymbolScan(const module_data_t * mod)
+			: _mod(dr_copy_module_data(mod))
+		{ }
+
+		SymbolScan::~SymbolScan() {
+			dr_free_module_data(_mod);
+		}
+
+		void SymbolScan::add(const std::string & pattern, wrapcb_pre_t pre, wrapcb_post_t post) {
+			_requests.push_back(request_t{ pattern, pre, post, false, 0 });
+		}
+
+		bool SymbolScan::apply_cached() {
+			module::DecisionCache * cache = module_tracker->decisions();
+			if (nullptr == cache)
+				return empty();
+
+			std::vector<request_t> missing;
+			std::vector<uint64_t> offsets;
+			for (const auto & req : _requests) {
+				offsets.clear();
+				if (!cache->get_wraps(_mod, req.pattern, offsets)) {
+					missing.push_back(req);
+					continue;
+				}
+				// warm start, skip the symbol search
+				wrap_info_t info{ _mod, req.pre, req.post };
+				for (uint64_t offs : offsets) {
+					internal::wrap_function_clbck("<cached>", (size_t)offs, (void*)&info);
+				}
+			}
+			_requests.swap(missing);
+			return empty();
+		}
+
+		void SymbolScan::compile() {
+			_exact.clear();
+			_globs.clear();
+			for (size_t i = 0; i < _requests.size(); ++i) {
+				const std::string & pattern = _requests[i].pattern;
+				size_t wildcard = pattern.find_first_of("*?");
+				if (wildcard == std::string::npos) {
+					_exact[pattern].push_back(i);
+				}
+				else {
+					_globs.push_back(glob_t{ pattern.substr(0, wildcard), i });
+				}
+			}
+			_pending = _requests.size();
+		}
+
+		bool SymbolScan::match_symbol(const char * name, size_t modoffs, void * data) {
+			SymbolScan * scan = (SymbolScan*)data;
+
+			auto mark = [scan, modoffs](request_t & req) {
+				if (!req.found) {
+					req.found = true;
+					req.offset = modoffs;
+					--scan->_pending;
+				}
+			};
+
+			if (!scan->_exact.empty()) {
+				scan->_name.assign(name);
+				auto it = scan->_exact.find(scan->_name);
+				if (it != scan->_exact.end()) {
+					for (size_t idx : it->second) {
+						mark(scan->_requests[idx]);
+					}
+				}
+			}
+			for (const auto & glob : scan->_globs) {
+				request_t & req = scan->_requests[glob.request];
+				if (req.found)
+					continue;
+				if (strncmp(name, glob.prefix.c_str(), glob.prefix.size()) != 0)
+					continue;
+				if (glob_match(req.pattern.c_str() + glob.prefix.size(), name + glob.prefix.size())) {
+					mark(req);
+				}
+			}
+			// stop the enumeration as soon as all patterns are resolved
+			return scan->_pending > 0;
+		}
+
+		void SymbolScan::run() {
+			compile();
+			drsym_error_t err = drsym_enumerate_symbols(
+				_mod->full_path,
+				(drsym_enumerate_cb)match_symbol,
+				(void*)this,
+				DRSYM_DEMANGLE);
+			if (err != DRSYM_SUCCESS) {
+				LOG_WARN(-1, "symbol scan of %s failed", _mod->full_path);
+				return;
+			}
+
+			module::DecisionCache * cache = module_tracker->decisions();
+			for (const auto & req : _requests) {
+				std::vector<uint64_t> offsets;
+				if (req.found) {
+					wrap_info_t info{ _mod, req.pre, req.post };
+					internal::wrap_function_clbck("<scan>", (size_t)req.offset, (void*)&info);
+					offsets.push_back(req.offset);
+				}
+				if (nullptr != cache) {
+					cache->set_wraps(_mod, req.pattern, offsets);
+				}
+			}
+			LOG_INFO(-1, "symbol scan of %s: matched %i of %i patterns",
+				_mod->full_path, _requests.size() - _pending, _requests.size());
+		}
+
+		bool SymbolScan::glob_match(const char * pattern, const char * str) {
+			// position of the last star and the matching position in str
+			const char * star = nullptr;
+			const char * resume = nullptr;
+			while (*str != '\0') {
+				if (*pattern == '?' || *pattern == *str) {
+					++pattern;
+					++str;
+				}
+				else if (*pattern == '*') {
+					star = pattern++;
+					resume = str;
+				}
+				else if (nullptr != star) {
+					// let the last star consume one more character
+					pattern = star + 1;
+					str = ++resume;
+				}
+				else {
+					return false;
+				}
+			}
+			while (*pattern == '*')
+				++pattern;
+			return *pattern == '\0';
+		}
+
+		/** Background thread which performs the symbol scans */
+		struct scanner_t {
+			void *                                  mx;
+			void *                                  wakeup;
+			std::deque<std::unique_ptr<SymbolScan>> queue;
+			std::atomic<bool>                       running{ true };
+			std::atomic<bool>                       active{ true };
+		};
+
+		static scanner_t * scanner = nullptr;
+
+		/**
+		* The module might be unloaded while the scan is pending,
+		* hence check if it is still present before wrapping
+		*/
+		static bool is_loaded(const module_data_t * mod) {
+			const module::Tracker::Snapshot * snap = module_tracker->loaded_modules();
+			if (nullptr == snap)
+				return false;
+			module::Metadata * meta = snap->find(mod->start);
+			return nullptr != meta && meta->base == mod->start;
+		}
+
+		static void scanner_main(void * arg) {
+			scanner_t * sc = (scanner_t*)arg;
+			while (true) {
+				dr_mutex_lock(sc->mx);
+				while (sc->queue.empty() && sc->running.load(std::memory_order_relaxed)) {
+					// reset under lock, as producers signal under lock
+					dr_event_reset(sc->wakeup);
+					dr_mutex_unlock(sc->mx);
+					dr_event_wait(sc->wakeup);
+					dr_mutex_lock(sc->mx);
+				}
+				if (!sc->running.load(std::memory_order_relaxed)) {
+					dr_mutex_unlock(sc->mx);
+					break;
+				}
+				std::unique_ptr<SymbolScan> scan = std::move(sc->queue.front());
+				sc->queue.pop_front();
+				dr_mutex_unlock(sc->mx);
+
+				if (is_loaded(scan->module())) {
+					scan->run();
+				}
+				// Free symbol information. A later access re-creates them, so its safe to do it here
+				drsym_free_resources(scan->module()->full_path);
+			}
+			sc->active.store(false, std::memory_order_release);
+		}
+
+		void start_scanner() {
+			scanner = new scanner_t;
+			scanner->mx = dr_mutex_create();
+			scanner->wakeup = dr_event_create();
+			if (!dr_create_client_thread(scanner_main, scanner)) {
+				LOG_WARN(-1, "could not start symbol scanner, scan synchronously");
+				scanner->active.store(false, std::memory_order_relaxed);
+				scanner->running.store(false, std::memory_order_relaxed);
+			}
+		}
+
+		void stop_scanner() {
+			if (nullptr == scanner)
+				return;
+
+			dr_mutex_lock(scanner->mx);
+			scanner->running.store(false, std::memory_order_relaxed);
+			dr_event_signal(scanner->wakeup);
+			dr_mutex_unlock(scanner->mx);
+
+			while (scanner->active.load(std::memory_order_acquire)) {
+				dr_thread_yield();
+			}
+			if (!scanner->queue.empty()) {
+				LOG_INFO(-1, "dropped %i pending symbol scans", scanner->queue.size());
+			}
+			dr_event_destroy(scanner->wakeup);
+			dr_mutex_destroy(scanner->mx);
+			delete scanner;
+			scanner = nullptr;
+		}
+
+		bool submit_scan(std::unique_ptr<SymbolScan> scan) {
+			if (scan->apply_cached())
+				return false;
+
+			if (nullptr != scanner) {
+				dr_mutex_lock(scanner->mx);
+				if (scanner->running.load(std::memory_order_relaxed)) {
+					scanner->queue.push_back(std::move(scan));
+					dr_event_signal(scanner->wakeup);
+					dr_mutex_unlock(scanner->mx);
+					return true;
+				}
+				dr_mutex_unlock(scanner->mx);
+			}
+			// no scanner available, hence block
+			scan->run();
+			return false;
+		}
+	} // namespace funwrap
+} // namespace drace
@@ -0,0 +1,344 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "memory-tracker.h"
+
+using namespace drace;
+
+namespace {
+	/** Memory operands which are recorded using a single range record */
+	struct group_t {
+		/// operand of the first access, provides base, index, scale and segment
+		opnd_t   ref;
+		bool     write;
+		int      min_disp;
+		int      max_end;
+		/// position of the first operand, which records the range
+		unsigned leader;
+	};
+
+	/** Location which has already been accessed in this block */
+	struct location_t {
+		opnd_t   ref;
+		uint32_t size;
+		bool     read;
+		bool     write;
+	};
+
+	/** Small set of tracked entries, replaces entries round-robin if full */
+	template<typename T, unsigned N>
+	struct entry_set_t {
+		T        entries[N];
+		unsigned num{ 0 };
+		unsigned next_victim{ 0 };
+
+		inline T * insert() {
+			if (num < N)
+				return &entries[num++];
+			T * e = &entries[next_victim];
+			next_victim = (next_victim + 1) % N;
+			return e;
+		}
+
+		inline void clear() {
+			num = 0;
+			next_victim = 0;
+		}
+
+		/** Removes all entries for which pred is true */
+		template<typename Pred>
+		inline void remove_if(Pred && pred) {
+			for (unsigned i = 0; i < num;) {
+				if (pred(entries[i]))
+					entries[i] = entries[--num];
+				else
+					++i;
+			}
+			if (next_victim >= num)
+				next_victim = 0;
+		}
+	};
+
+	/** Returns true if both operands use the same address computation (except disp) */
+	inline bool same_base(opnd_t a, opnd_t b) {
+		return opnd_get_base(a) == opnd_get_base(b) &&
+			opnd_get_index(a) == opnd_get_index(b) &&
+			opnd_get_scale(a) == opnd_get_scale(b) &&
+			opnd_get_segment(a) == opnd_get_segment(b);
+	}
+
+	/** Returns true if the address of this operand only depends on registers and disp */
+	inline bool is_trackable(opnd_t ref, uint32_t size) {
+		if (!opnd_is_base_disp(ref))
+			return false;
+		// exclude vector-indexed (gather / scatter) operands
+		reg_id_t index = opnd_get_index(ref);
+		if (index != DR_REG_NULL && !reg_is_gpr(index))
+			return false;
+		return size > 0 && size <= 16;
+	}
+
+	/** Returns true if instr modifies a register which is used by the address of ref */
+	inline bool writes_address_reg(instr_t * instr, opnd_t ref) {
+		for (reg_id_t reg : { opnd_get_base(ref), opnd_get_index(ref), opnd_get_segment(ref) }) {
+			if (reg != DR_REG_NULL && instr_writes_to_reg(instr, reg, DR_QUERY_INCLUDE_ALL))
+				return true;
+		}
+		return false;
+	}
+
+	/** Returns the bit of the pointer-sized gpr which contains reg, 0 if reg is no gpr */
+	inline uint32_t gpr_bit(reg_id_t reg) {
+		if (reg == DR_REG_NULL || !reg_is_gpr(reg))
+			return 0;
+		return 1u << (reg_to_pointer_sized(reg) - DR_REG_START_GPR);
+	}
+
+	/** Returns true if the register written by instr holds a stack address afterwards */
+	inline bool result_is_stack(instr_t * instr, uint32_t stack_regs) {
+		switch (instr_get_opcode(instr)) {
+		case OP_lea: {
+			opnd_t src = instr_get_src(instr, 0);
+			return opnd_is_base_disp(src) && (gpr_bit(opnd_get_base(src)) & stack_regs);
+		}
+		case OP_mov_ld:
+		case OP_mov_st: {
+			opnd_t src = instr_get_src(instr, 0);
+			return opnd_is_reg(src) && reg_is_pointer_sized(opnd_get_reg(src)) &&
+				(gpr_bit(opnd_get_reg(src)) & stack_regs);
+		}
+		case OP_add:
+		case OP_sub: {
+			// pointer arithmetic, the destination is a source as well
+			for (int i = 0; i < instr_num_srcs(instr); ++i) {
+				opnd_t src = instr_get_src(instr, i);
+				if (opnd_is_reg(src) && reg_is_pointer_sized(opnd_get_reg(src)) &&
+					(gpr_bit(opnd_get_reg(src)) & stack_regs))
+					return true;
+			}
+			return false;
+		}
+		default:
+			return false;
+		}
+	}
+
+	inline opnd_t get_opnd(const MemoryTracker::mem_opnd_t & mo) {
+		return mo.dst ? instr_get_dst(mo.instr, mo.idx) : instr_get_src(mo.instr, mo.idx);
+	}
+}
+
+unsigned MemoryTracker::count_opnds(instrlist_t * bb) {
+	unsigned num_opnds = 0;
+	for (instr_t * instr = instrlist_first_app(bb); nullptr != instr; instr = instr_get_next_app(instr)) {
+		if (instr_is_excluded(instr))
+			continue;
+		for (int i = 0; i < instr_num_srcs(instr); ++i)
+			num_opnds += opnd_is_memory_reference(instr_get_src(instr, i));
+		for (int i = 0; i < instr_num_dsts(instr); ++i)
+			num_opnds += opnd_is_memory_reference(instr_get_dst(instr, i));
+	}
+	return num_opnds;
+}
+
+/* The operands are enumerated in the same order as they are instrumented */
+void MemoryTracker::collect_opnds(instrlist_t * bb, bb_info_t * info) {
+	unsigned pos = 0;
+	for (instr_t * instr = instrlist_first_app(bb); nullptr != instr; instr = instr_get_next_app(instr)) {
+		if (instr_is_excluded(instr))
+			continue;
+		const bool atomic = instr_get_prefix_flag(instr, PREFIX_LOCK);
+		for (int dst = 0; dst < 2; ++dst) {
+			const int num = dst ? instr_num_dsts(instr) : instr_num_srcs(instr);
+			for (int i = 0; i < num; ++i) {
+				opnd_t ref = dst ? instr_get_dst(instr, i) : instr_get_src(instr, i);
+				if (!opnd_is_memory_reference(ref))
+					continue;
+
+				DR_ASSERT(pos < info->num_opnds);
+				mem_opnd_t & mo = info->opnds[pos++];
+				mo.instr = instr;
+				mo.idx = static_cast<uint16_t>(i);
+				mo.dst = (dst != 0);
+				mo.write = dst && !atomic;
+				mo.flags = OPND_FLAGS::NONE;
+				mo.disp = opnd_is_base_disp(ref) ? opnd_get_disp(ref) : 0;
+				/* drutil_opnd_mem_size_in_bytes handles OP_enter */
+				mo.size = drutil_opnd_mem_size_in_bytes(ref, instr);
+			}
+		}
+	}
+	DR_ASSERT(pos == info->num_opnds);
+}
+
+/*
+* Forward dataflow over the block: XSP and XBP hold stack addresses on entry.
+* Registers which are computed from them by moves, lea or pointer arithmetic
+* hold stack addresses as well, until they are overwritten otherwise.
+* XSP always points to the stack.
+*/
+void MemoryTracker::eliminate_stack(instrlist_t * bb, bb_info_t * info) {
+	const uint32_t xsp = gpr_bit(DR_REG_XSP);
+	uint32_t stack_regs = xsp | gpr_bit(DR_REG_XBP);
+	unsigned pos = 0;
+
+	for (instr_t * instr = instrlist_first_app(bb); nullptr != instr; instr = instr_get_next_app(instr)) {
+		// address is computed using the register values before the instruction
+		for (; pos < info->num_opnds && info->opnds[pos].instr == instr; ++pos) {
+			mem_opnd_t & mo = info->opnds[pos];
+			opnd_t ref = get_opnd(mo);
+			if (opnd_is_base_disp(ref) && (gpr_bit(opnd_get_base(ref)) & stack_regs)) {
+				mo.flags = OPND_FLAGS::STACK;
+			}
+		}
+
+		uint32_t written = 0;
+		for (int i = 0; i < instr_num_dsts(instr); ++i) {
+			opnd_t dst = instr_get_dst(instr, i);
+			if (opnd_is_reg(dst))
+				written |= gpr_bit(opnd_get_reg(dst));
+		}
+		written &= ~xsp;
+		if (written == 0)
+			continue;
+
+		const bool is_stack = result_is_stack(instr, stack_regs);
+		stack_regs &= ~written;
+		if (is_stack)
+			stack_regs |= written;
+	}
+}
+
+/*
+* Forward dataflow over the block: a location is identified by its address
+* operand. It is valid until one of its address registers is modified.
+* Locked instructions invalidate all locations, as the detector has to see
+* accesses after a synchronizing instruction.
+*/
+void MemoryTracker::eliminate_redundant(instrlist_t * bb, bb_info_t * info) {
+	entry_set_t<location_t, 16> locations;
+	unsigned pos = 0;
+
+	for (instr_t * instr = instrlist_first_app(bb); nullptr != instr; instr = instr_get_next_app(instr)) {
+		const bool sync = instr_is_sync(instr);
+		if (sync) {
+			locations.clear();
+		}
+
+		for (; pos < info->num_opnds && info->opnds[pos].instr == instr; ++pos) {
+			mem_opnd_t & mo = info->opnds[pos];
+			opnd_t ref = get_opnd(mo);
+			if (sync || mo.skip() || !is_trackable(ref, mo.size))
+				continue;
+
+			location_t * loc = nullptr;
+			for (unsigned l = 0; l < locations.num; ++l) {
+				location_t & cand = locations.entries[l];
+				if (cand.size == mo.size && opnd_get_disp(cand.ref) == mo.disp && same_base(cand.ref, ref)) {
+					loc = &cand;
+					break;
+				}
+			}
+
+			if (nullptr == loc) {
+				loc = locations.insert();
+				loc->ref = ref;
+				loc->size = mo.size;
+				loc->read = !mo.write;
+				loc->write = mo.write;
+				continue;
+			}
+			// a write dominates all later accesses, a read only later reads
+			if (loc->write || (loc->read && !mo.write)) {
+				mo.flags = OPND_FLAGS::REDUNDANT;
+			}
+			else {
+				loc->write = true;
+			}
+		}
+
+		if (sync) {
+			locations.clear();
+			continue;
+		}
+		locations.remove_if([instr](const location_t & loc) {
+			return writes_address_reg(instr, loc.ref);
+		});
+	}
+}
+
+/*
+* A record of a group is inserted at the first operand, hence later operands
+* are only added if the address registers have not been modified in between.
+* Locked instructions close all groups, as accesses must not be moved
+* across synchronizing instructions.
+*/
+void MemoryTracker::coalesce_bb(instrlist_t * bb, bb_info_t * info) {
+	// only a few distinct address registers are used per block
+	entry_set_t<group_t, 8> groups;
+	unsigned pos = 0;
+
+	for (instr_t * instr = instrlist_first_app(bb); nullptr != instr; instr = instr_get_next_app(instr)) {
+		const bool sync = instr_is_sync(instr);
+		if (sync) {
+			groups.clear();
+		}
+
+		for (; pos < info->num_opnds && info->opnds[pos].instr == instr; ++pos) {
+			mem_opnd_t & mo = info->opnds[pos];
+			opnd_t ref = get_opnd(mo);
+			if (sync || mo.skip() || !is_trackable(ref, mo.size))
+				continue;
+
+			// extend the record of a group which is contiguous with this operand
+			bool merged = false;
+			const int end = mo.disp + static_cast<int>(mo.size);
+			for (unsigned g = 0; g < groups.num && !merged; ++g) {
+				group_t & grp = groups.entries[g];
+				if (grp.write != mo.write || !same_base(grp.ref, ref))
+					continue;
+				const int min_disp = (mo.disp < grp.min_disp) ? mo.disp : grp.min_disp;
+				const int max_end = (end > grp.max_end) ? end : grp.max_end;
+				// the detectors report all words of a range, hence gaps must not be merged
+				const bool contiguous = mo.disp <= grp.max_end && end >= grp.min_disp;
+				if (contiguous && max_end - min_disp <= COALESCE_RANGE) {
+					grp.min_disp = min_disp;
+					grp.max_end = max_end;
+					mem_opnd_t & leader = info->opnds[grp.leader];
+					leader.disp = min_disp;
+					leader.size = static_cast<uint32_t>(max_end - min_disp);
+					mo.flags = OPND_FLAGS::COALESCED;
+					merged = true;
+				}
+			}
+			if (merged)
+				continue;
+
+			// the other groups stay open for later operands
+			group_t * grp = groups.insert();
+			// this operand starts a new group
+			grp->ref = ref;
+			grp->write = mo.write;
+			grp->min_disp = mo.disp;
+			grp->max_end = mo.disp + static_cast<int>(mo.size);
+			grp->leader = pos;
+		}
+
+		if (sync) {
+			groups.clear();
+			continue;
+		}
+		// close groups whose address registers are modified
+		groups.remove_if([instr](const group_t & grp) {
+			return writes_address_reg(instr, grp.ref);
+		});
+	}
+}
@@ -38,7 +38,7 @@ void MemoryTracker::insert_jmp_on_flush(void *drcontext, instrlist_t *ilist, ins
 
 /* insert inline code to add a memory reference info entry into the buffer */
 void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, instr_t *where,
-	opnd_t ref, bool write)
+	opnd_t ref, bool write, uint32_t size)
 {
 	/*
 	* instrument_mem is called whenever a memory reference is identified.
@@ -48,7 +48,8 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	instr_t *instr;
 	opnd_t   opnd1, opnd2;
 	reg_id_t reg1, reg2, reg3;
-	app_pc pc;
+	uint16_t meta;
+	uint32_t pc_idx;
 
 	/* Steal two scratch registers.
 	* reg2 must be ECX or RCX for jecxz.
@@ -77,10 +78,8 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	*   jmp .restore;
 	* if (flush)
 	*   jmp .call
-	* buf_ptr->write = write;
-	* buf_ptr->addr  = addr;
-	* buf_ptr->size  = size;
-	* buf_ptr->pc    = pc;
+	* buf_ptr->addr_info = addr | (meta << 48);
+	* buf_ptr->pc        = pc_idx;
 	* buf_ptr++;
 	* if (buf_ptr >= buf_end_ptr)
 	*    clean_call();
@@ -117,34 +116,28 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
-	/* Move write/read to write field */
-	opnd1 = OPND_CREATE_MEM8(reg2, offsetof(mem_ref_t, write));
-	opnd2 = OPND_CREATE_INT8(write);
-	instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-	instrlist_meta_preinsert(ilist, where, instr);
-
 	/* Store address in memory ref */
-	opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, addr));
+	opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, addr_info));
 	opnd2 = opnd_create_reg(reg1);
 	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
-	/* Store size in memory ref */
-	opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, size));
-	/* drutil_opnd_mem_size_in_bytes handles OP_enter */
-	opnd2 = OPND_CREATE_INT32(drutil_opnd_mem_size_in_bytes(ref, where));
-	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+	/* Store size and flags in the upper 16 bits of the address */
+	meta = mem_ref_t::encode_meta(size, write);
+	opnd1 = OPND_CREATE_MEM16(reg2, offsetof(mem_ref_t, addr_info) + mem_ref_t::meta_shift / 8);
+	opnd2 = OPND_CREATE_INT16((int16_t)meta);
+	instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
-	///* Store pc in memory ref */
-	pc = instr_get_app_pc(where);
-	///* For 64-bit, we can't use a 64-bit immediate so we split pc into two halves.
-	//* We could alternatively load it into reg1 and then store reg1.
-	//* We use a convenience routine that does the two-step store for us.
-	//*/
-	opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, pc));
-	instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)pc, opnd1,
-		ilist, where, NULL, NULL);
+	/* Store pc index in memory ref.
+	* The index is below 2^31, hence a single store of a sign-extended
+	* 32-bit immediate is sufficient.
+	*/
+	pc_idx = pc_table.index_of(instr_get_app_pc(where));
+	opnd1 = OPND_CREATE_MEM64(reg2, offsetof(mem_ref_t, pc));
+	opnd2 = OPND_CREATE_INT32(pc_idx);
+	instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
 
 	/* Increment reg value by pointer size using lea instr */
 	opnd1 = opnd_create_reg(reg2);
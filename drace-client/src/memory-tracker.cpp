@@ -26,11 +26,15 @@
 #include "shadow-stack.h"
 #include "function-wrapper.h"
 #include "statistics.h"
+#include "analysis-pool.h"
 #include "ipc/SharedMemory.h"
 #include "ipc/SMData.h"
 
 
 namespace drace {
+	/** per_thread_t is over-allocated to align it inside the block */
+	static constexpr size_t tls_alloc_size = sizeof(per_thread_t) + alignof(per_thread_t);
+
 	MemoryTracker::MemoryTracker()
 		: _prng(static_cast<unsigned>(
                     std::chrono::high_resolution_clock::now().time_since_epoch().count()))
@@ -133,10 +137,10 @@ namespace drace {
 			// Thread starts with a pending clean-call
 			// We missed a fork
 			// 1. Flush all threads (except this thread)
-			// 2. Fork thread
+			// 2. Fork thread (from all threads, if the creator is not known)
 			LOG_TRACE(data->tid, "Missed a fork, do it now");
 			detector::fork(
-                runtime_tid.load(std::memory_order_relaxed),
+                memory_tracker->lineage.take_creator(data->tid),
                 static_cast<detector::tid_t>(data->tid),
                 &(data->detector_data));
 		}
@@ -148,8 +152,18 @@ namespace drace {
 			memory_tracker->handle_ext_state(data);
 		}
 
-		if (data->enabled) {
-			mem_ref_t * mem_ref = (mem_ref_t *)data->mem_buf.data;
+		int64_t drain_request = 0;
+		if (!params.fastmode) {
+			// acknowledge pending drain requests before processing the buffer.
+			// Requests arriving meanwhile trigger another drain
+			data->no_flush.store(true, std::memory_order_relaxed);
+			drain_request = data->drain_request.exchange(0, std::memory_order_relaxed);
+		}
+
+		// in async mode, the buffer might contain stack markers, hence always process it
+		const bool inline_analysis = (nullptr == data->async_queue);
+		if (data->enabled || !inline_analysis) {
+			mem_ref_t * mem_ref = (mem_ref_t *)data->buf_beg;
 			uint64_t num_refs = (uint64_t)((mem_ref_t *)data->buf_ptr - mem_ref);
 
 			if (num_refs > 0) {
@@ -159,58 +173,57 @@ namespace drace {
 				auto * stack = &(data->stack);
 
 				// In non-fast-mode we have to protect the stack
-				if (!params.fastmode)
+				if (!params.fastmode && inline_analysis)
 					dr_mutex_lock(th_mutex);
 
 				DR_ASSERT(stack->entries >= 0);
 				
 				// Lossy count first mem-ref (all are adiacent as after each call is flushed)
 				if (params.lossy) {
-					data->stats->pc_hits.processItem((uint64_t)mem_ref->pc >> HIST_PC_RES);
+					data->stats->pc_hits.processItem((uint64_t)get_pc(mem_ref) >> HIST_PC_RES);
 					if ((data->stats->flushes & (CC_UPDATE_PERIOD - 1)) == (CC_UPDATE_PERIOD - 1)) {
 						update_cache(data);
 					}
 				}
 
-				for (uint64_t i = 0; i < num_refs; ++i) {
-					// todo: better use iterator like access
-					mem_ref = &((mem_ref_t *)data->mem_buf.data)[i];
-					if (params.excl_stack &&
-						((ULONG_PTR)mem_ref->addr > data->appstack_beg) && 
-						((ULONG_PTR)mem_ref->addr < data->appstack_end))
-					{
-						// this reference points into the stack range, skip
-						continue;
-					}
-					if ((uint64_t)mem_ref->addr > PROC_ADDR_LIMIT) {
-						// outside process address space
-						continue;
+				if (inline_analysis) {
+					// Filter and analyze all references in a single detector call
+					uint64_t excl_beg = 0;
+					uint64_t excl_end = 0;
+					if (params.excl_stack) {
+						excl_beg = data->appstack_beg;
+						excl_end = data->appstack_end;
 					}
-					// this is a mem-ref candidate
-					//if (!memory_tracker->sample_ref(data)) {
-					//	continue;
-					//}
-
-					if (mem_ref->write) {
-						detector::write(data->detector_data, mem_ref->pc, mem_ref->addr, mem_ref->size);
-						//printf("[%i] WRITE %p, PC: %p\n", data->tid, mem_ref->addr, mem_ref->pc);
-					}
-					else {
-						detector::read(data->detector_data, mem_ref->pc, mem_ref->addr, mem_ref->size);
-						//printf("[%i] READ  %p, PC: %p\n", data->tid, mem_ref->addr, mem_ref->pc);
-					}
-					++(data->stats->proc_refs);
+					data->stats->proc_refs += detector::access_batch(
+						data->detector_data, mem_ref, num_refs, excl_beg, excl_end,
+						memory_tracker->pc_table.table());
 				}
-				if (!params.fastmode)
+				else {
+					// hand over buffer, continue with an empty one
+					analysis_pool->submit(data, static_cast<uint32_t>(num_refs));
+				}
+
+				if (!params.fastmode && inline_analysis)
 					dr_mutex_unlock(th_mutex);
 				data->stats->total_refs += num_refs;
 			}
 		}
-		data->buf_ptr = data->mem_buf.data;
-
-		if (!params.fastmode && !data->no_flush.load(std::memory_order_relaxed)) {
-			byte expect = 0;
-			data->no_flush.compare_exchange_weak(expect, (byte)1, std::memory_order_relaxed);
+		data->buf_ptr = data->buf_beg;
+
+		if (drain_request != 0) {
+			// buffer was drained on request of another thread
+			const uint64_t epoch = memory_tracker->sync_epoch.load(std::memory_order_acquire);
+			auto latency = std::chrono::duration_cast<Statistics::us_t>(
+				std::chrono::steady_clock::duration(
+					std::chrono::steady_clock::now().time_since_epoch().count() - drain_request));
+			Statistics & stats = *(data->stats);
+			stats.drains++;
+			stats.drain_latency += latency;
+			if (latency > stats.drain_latency_max)
+				stats.drain_latency_max = latency;
+			if (epoch - data->epoch > stats.max_epoch_lag)
+				stats.max_epoch_lag = epoch - data->epoch;
+			data->epoch = epoch;
 		}
 	}
 
@@ -219,22 +232,25 @@ namespace drace {
 	 */
 	void MemoryTracker::event_thread_init(void *drcontext)
 	{
-		/* allocate thread private data */
-		void * tls_buffer = dr_thread_alloc(drcontext, sizeof(per_thread_t));
+		/* allocate thread private data, the mutex book has to be cache-line aligned */
+		void * tls_alloc = dr_thread_alloc(drcontext, tls_alloc_size);
+		void * tls_buffer = (void*)ALIGN_FORWARD(tls_alloc, alignof(per_thread_t));
 		drmgr_set_tls_field(drcontext, tls_idx, tls_buffer);
 
 		// Initialize struct at given location (placement new)
 		per_thread_t * data = new (tls_buffer) per_thread_t;
+		data->tls_alloc = tls_alloc;
 
 		data->mem_buf.resize(MEM_BUF_SIZE, drcontext);
-		data->buf_ptr = data->mem_buf.data;
+		data->buf_beg = data->mem_buf.data;
+		data->buf_ptr = data->buf_beg;
 		/* set buf_end to be negative of address of buffer end for the lea later */
-		data->buf_end = -(ptr_int_t)(data->mem_buf.data + MEM_BUF_SIZE);
+		data->buf_end = -(ptr_int_t)(data->buf_beg + MEM_BUF_SIZE);
 		data->tid = dr_get_thread_id(drcontext);
 		// Init ShadowStack with max_size + 1 Element for PC of access
 		data->stack.resize(ShadowStack::max_size + 1, drcontext);
+		data->mod_cache = new (dr_thread_alloc(drcontext, sizeof(module::Cache))) module::Cache;
 
-		data->mutex_book.reserve(MUTEX_MAP_SIZE);
 		// set first sampling period
 		data->sampling_pos = params.sampling_rate;
 
@@ -256,10 +272,10 @@ namespace drace {
 
 		dr_rwlock_write_lock(tls_rw_mutex);
 		TLS_buckets.emplace(data->tid, data);
-		data->th_towait.reserve(TLS_buckets.bucket_count());
 		dr_rwlock_write_unlock(tls_rw_mutex);
 
-		flush_all_threads(data, false, false);
+		data->epoch = sync_epoch.load(std::memory_order_relaxed);
+		flush_all_threads(data, false);
 
 #ifndef DRACE_USE_LEGACY_API
         // TODO: emulate this for windows 7
@@ -267,17 +283,39 @@ namespace drace {
 		dr_switch_to_app_state(drcontext);
 		// dr does not support this natively, so make syscall in app context
 		GetCurrentThreadStackLimits(&(data->appstack_beg), &(data->appstack_end));
+		dr_switch_to_dr_state(drcontext);
 		LOG_NOTICE(data->tid, "stack from %p to %p", data->appstack_beg, data->appstack_end);
 #endif
+
+		if (analysis_pool) {
+			analysis_pool->register_thread(drcontext, data);
+		}
 	}
 
 	void MemoryTracker::event_thread_exit(void *drcontext)
 	{
 		per_thread_t* data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
 
-		flush_all_threads(data, true, false);
+		flush_all_threads(data, true);
+		if (analysis_pool) {
+			analysis_pool->unregister_thread(drcontext, data);
+		}
 
-        detector::join(runtime_tid.load(std::memory_order_relaxed), static_cast<detector::tid_t>(data->tid));
+		const auto tid = static_cast<detector::tid_t>(data->tid);
+		const ThreadLineage::Exit th_exit = lineage.exited(data->tid);
+		if (!th_exit.known) {
+			// the joiner is not observable, hence joined by all threads
+			detector::join(detector::unknown_thread, tid);
+		}
+		else {
+			// threads which wait for us later acquire the sync object
+			if (nullptr != th_exit.sync && nullptr != data->detector_data)
+				detector::happens_before(data->detector_data, th_exit.sync);
+			if (th_exit.joiner != detector::unknown_thread)
+				detector::join(th_exit.joiner, tid);
+			else
+				detector::finish(data->detector_data, tid);
+		}
 
 		dr_rwlock_write_lock(tls_rw_mutex);
 		// as this is a exclusive lock and this is the only place
@@ -300,9 +338,12 @@ namespace drace {
 		// As we cannot rely on current drcontext here, use provided one
 		data->stack.deallocate(drcontext);
 		data->mem_buf.deallocate(drcontext);
+		data->mod_cache->~Cache();
+		dr_thread_free(drcontext, data->mod_cache, sizeof(module::Cache));
 		// deconstruct struct
+		void * tls_alloc = data->tls_alloc;
 		data->~per_thread_t();
-		dr_thread_free(drcontext, data, sizeof(per_thread_t));
+		dr_thread_free(drcontext, tls_alloc, tls_alloc_size);
 	}
 
 
@@ -326,45 +367,57 @@ namespace drace {
 			return DR_EMIT_DEFAULT;
 
 		if (for_trace && params.excl_traces) {
-			*user_data = (void*)INSTR_FLAGS::STACK;
+			bb_info_t * info = create_bb_info(drcontext, 0);
+			info->flags = INSTR_FLAGS::STACK;
+			*user_data = (void*)info;
 			return DR_EMIT_DEFAULT;
 		}
 
         INSTR_FLAGS instrument_bb;
 		app_pc bb_addr = dr_fragment_app_pc(tag);
 
-		// Lookup module from cache, hit is very likely as adiacent bb's 
-		// are mostly in the same module
-		module::Metadata * modptr = mc.lookup(bb_addr);
-		if (nullptr != modptr) {
+		// Lookup module from thread-local cache, hit is very likely as adiacent bb's
+		// are mostly in the same module. Misses are served without locking.
+		per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+		const module::Tracker::Snapshot * modules = module_tracker->loaded_modules();
+		module::Metadata * modptr = data->mod_cache->lookup(bb_addr, modules->generation);
+		if (nullptr == modptr) {
+			modptr = modules->find(bb_addr);
+			if (modptr) {
+				data->mod_cache->update(bb_addr, modptr);
+			}
+		}
+		if (modptr) {
+			// bb in known module
 			instrument_bb = modptr->instrument;
 		}
 		else {
-			module_tracker->lock_read();
-			modptr = (module_tracker->get_module_containing(bb_addr)).get();
-			if (modptr) {
-				// bb in known module
-				instrument_bb = modptr->instrument;
-				mc.update(modptr);
-			}
-			else {
-				// Module not known
-				LOG_TRACE(0, "Module unknown, probably JIT code (%p)", bb_addr);
-				instrument_bb = (INSTR_FLAGS)(INSTR_FLAGS::MEMORY | INSTR_FLAGS::STACK);
-			}
-			module_tracker->unlock_read();
+			// Module not known
+			LOG_TRACE(0, "Module unknown, probably JIT code (%p)", bb_addr);
+			instrument_bb = (INSTR_FLAGS)(INSTR_FLAGS::MEMORY | INSTR_FLAGS::STACK);
 		}
 
 		// Do not instrument if block is frequent
 		if (for_trace && instrument_bb) {
-			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
 			if (pc_in_freq(data, bb_addr)) {
 				instrument_bb = INSTR_FLAGS::NONE;
 			}
 		}
 
-		// Avoid temporary allocation by using ptr-value directly
-		*user_data = (void*)instrument_bb;
+		bb_info_t * info;
+		if (instrument_bb & INSTR_FLAGS::MEMORY) {
+			info = create_bb_info(drcontext, count_opnds(bb));
+			collect_opnds(bb, info);
+			if (params.excl_stack)
+				eliminate_stack(bb, info);
+			eliminate_redundant(bb, info);
+			coalesce_bb(bb, info);
+		}
+		else {
+			info = create_bb_info(drcontext, 0);
+		}
+		info->flags = instrument_bb;
+		*user_data = (void*)info;
 		return DR_EMIT_DEFAULT;
 	}
 
@@ -375,42 +428,37 @@ namespace drace {
 		if (translating)
 			return DR_EMIT_DEFAULT;
 
+		bb_info_t * info = (bb_info_t*)user_data;
+		instrument_instr(drcontext, tag, bb, instr, for_trace, translating, info);
+
+		// the analysis result is not needed any longer
+		if (drmgr_is_last_instr(drcontext, instr)) {
+			destroy_bb_info(drcontext, info);
+		}
+		return DR_EMIT_DEFAULT;
+	}
+
+	void MemoryTracker::instrument_instr(void *drcontext, void *tag, instrlist_t *bb,
+		instr_t *instr, bool for_trace, bool translating, bb_info_t * info)
+	{
 		using INSTR_FLAGS = module::Metadata::INSTR_FLAGS;
-		auto instrument_instr = (INSTR_FLAGS)(util::unsafe_ptr_cast<uint8_t>(user_data));
+		auto instr_flags = info->flags;
 		// we treat all atomic accesses as reads
 		bool instr_is_atomic{ false };
 
 		if (!instr_is_app(instr))
-			return DR_EMIT_DEFAULT;
+			return;
 
-		if (instrument_instr & INSTR_FLAGS::STACK) {
+		if (instr_flags & INSTR_FLAGS::STACK) {
 			// Instrument ShadowStack
-			ShadowStack::instrument(drcontext, tag, bb, instr, for_trace, translating, user_data);
+			ShadowStack::instrument(drcontext, tag, bb, instr, for_trace, translating, info);
 		}
 
-		if (!(instrument_instr & INSTR_FLAGS::MEMORY))
-			return DR_EMIT_DEFAULT;
-
-		if (!instr_reads_memory(instr) && !instr_writes_memory(instr))
-			return DR_EMIT_DEFAULT;
-
-		if (params.excl_stack) {
-			// exclude pop and push
-			int opcode = instr_get_opcode(instr);
-			if (opcode == OP_pop || opcode == OP_popa || opcode == OP_popf ||
-				opcode == OP_push || opcode == OP_pusha || opcode == OP_pushf) {
-				return DR_EMIT_DEFAULT;
-			}
+		if (!(instr_flags & INSTR_FLAGS::MEMORY))
+			return;
 
-			// exclude other modifications of stackptr
-			if (instr_reads_from_reg(instr, DR_REG_XSP, DR_QUERY_DEFAULT) ||
-				instr_writes_to_reg(instr, DR_REG_XSP, DR_QUERY_DEFAULT) ||
-				instr_reads_from_reg(instr, DR_REG_XBP, DR_QUERY_DEFAULT) ||
-				instr_writes_to_reg(instr, DR_REG_XBP, DR_QUERY_DEFAULT))
-			{
-				return DR_EMIT_DEFAULT;
-			}
-		}
+		if (instr_is_excluded(instr))
+			return;
 
 		// atomic instruction
 		if (instr_get_prefix_flag(instr, PREFIX_LOCK))
@@ -420,23 +468,58 @@ namespace drace {
 		// This is a racy increment, but we do not rely on exact numbers
 		auto cnt = ++instrum_count;
 		if (cnt % params.instr_rate != 0) {
-			return DR_EMIT_DEFAULT;
+			return;
 		}
 
 		/* insert code to add an entry for each memory reference opnd */
 		for (int i = 0; i < instr_num_srcs(instr); i++) {
 			opnd_t src = instr_get_src(instr, i);
 			if (opnd_is_memory_reference(src))
-				instrument_mem(drcontext, bb, instr, src, false);
+				instrument_opnd(drcontext, bb, instr, src, false, info->find(instr, false, i));
 		}
 
 		for (int i = 0; i < instr_num_dsts(instr); i++) {
 			opnd_t dst = instr_get_dst(instr, i);
 			if (opnd_is_memory_reference(dst))
-				instrument_mem(drcontext, bb, instr, dst, !instr_is_atomic);
+				instrument_opnd(drcontext, bb, instr, dst, !instr_is_atomic, info->find(instr, true, i));
 		}
+	}
 
-		return DR_EMIT_DEFAULT;
+	void MemoryTracker::instrument_opnd(void *drcontext, instrlist_t *bb, instr_t *instr,
+		opnd_t ref, bool write, const mem_opnd_t * mo)
+	{
+		if (nullptr == mo) {
+			/* drutil_opnd_mem_size_in_bytes handles OP_enter */
+			instrument_mem(drcontext, bb, instr, ref, write, drutil_opnd_mem_size_in_bytes(ref, instr));
+			return;
+		}
+		if (mo->skip())
+			return;
+		// record the whole range of coalesced operands
+		if (opnd_is_base_disp(ref))
+			opnd_set_disp(&ref, mo->disp);
+		instrument_mem(drcontext, bb, instr, ref, write, mo->size);
+	}
+
+	bool MemoryTracker::instr_is_excluded(instr_t * instr) {
+		// stack accesses (excl-stack) are filtered per operand, see eliminate_stack
+		return !instr_reads_memory(instr) && !instr_writes_memory(instr);
+	}
+
+	MemoryTracker::bb_info_t * MemoryTracker::create_bb_info(void * drcontext, unsigned num_opnds) {
+		// allocate result and operands in a single block
+		size_t size = sizeof(bb_info_t) + num_opnds * sizeof(mem_opnd_t);
+		bb_info_t * info = (bb_info_t*)dr_thread_alloc(drcontext, size);
+		info->flags = module::Metadata::INSTR_FLAGS::NONE;
+		info->opnds = (mem_opnd_t*)(info + 1);
+		info->num_opnds = num_opnds;
+		info->pos = 0;
+		return info;
+	}
+
+	void MemoryTracker::destroy_bb_info(void * drcontext, bb_info_t * info) {
+		size_t size = sizeof(bb_info_t) + info->num_opnds * sizeof(mem_opnd_t);
+		dr_thread_free(drcontext, info, size);
 	}
 
 	/* clean_call dumps the memory reference info into the analyzer */
@@ -447,39 +530,34 @@ namespace drace {
 
 		analyze_access(data);
 		data->stats->flushes++;
-
-		// block until flush is done
-		if (!params.fastmode) {
-            unsigned tries = 0;
-			while (memory_tracker->flush_active.load(std::memory_order_relaxed)) {
-				++tries;
-				if (tries > 100) {
-					dr_thread_yield();
-					tries = 0;
-				}
-			}
-		}
 	}
 
 	void MemoryTracker::clear_buffer(void)
 	{
 		void *drcontext = dr_get_current_drcontext();
 		per_thread_t *data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
-		mem_ref_t *mem_ref = (mem_ref_t *)data->mem_buf.data;
+		mem_ref_t *mem_ref = (mem_ref_t *)data->buf_beg;
 		uint64_t num_refs = (uint64_t)((mem_ref_t *)data->buf_ptr - mem_ref);
 
 		data->stats->proc_refs += num_refs;
 		data->stats->flushes++;
-		data->buf_ptr = data->mem_buf.data;
+		data->buf_ptr = data->buf_beg;
 		data->no_flush.store(true, std::memory_order_relaxed);
 	}
 
-	/* Request a flush of all non-disabled threads.
+	/* Publish a new sync epoch and request a drain of all non-disabled threads.
+	*  Other threads are not awaited. Instead, they drain their own buffer
+	*  at the next check (pending flush in inline instrumentation or
+	*  next clean call). As buffers are only processed by their owner,
+	*  no references are lost.
 	*  \Warning: This function read-locks the TLS mutex
 	*/
-	void MemoryTracker::flush_all_threads(per_thread_t * data, bool self, bool flush_external) {
+	void MemoryTracker::flush_all_threads(per_thread_t * data, bool self) {
 		if (params.fastmode) {
-			if (self) process_buffer();
+			if (self) {
+				process_buffer();
+				drain_async(data);
+			}
 			return;
 		}
 
@@ -487,74 +565,43 @@ namespace drace {
 		auto start = std::chrono::system_clock::now();
 		data->stats->flush_events++;
 
-		// Do not run two flushes simultaneously
-		int expect = false;
-		int cntr = 0;
-		while (memory_tracker->flush_active.compare_exchange_weak(expect, true, std::memory_order_relaxed)) {
-			if (++cntr > 100) {
-				dr_thread_yield();
-			}
-		}
-
 		if (self) {
 			analyze_access(data);
+			drain_async(data);
 		}
 
-		data->th_towait.clear();
+		memory_tracker->sync_epoch.fetch_add(1, std::memory_order_release);
+		const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
 
-		// Preserve state by copying tls pointers to local array
 		dr_rwlock_read_lock(tls_rw_mutex);
-
-
-		// Get threads and notify them
 		for (const auto & td : TLS_buckets) {
-			if (td.first != data->tid && td.second->enabled && td.second->no_flush.load(std::memory_order_relaxed))
-			{
-				uint64_t refs = (td.second->buf_ptr - td.second->mem_buf.data) / sizeof(mem_ref_t);
-				if (refs > 0) {
-					//printf("[%.5i] Flush thread %.5i, ~numrefs, %u\n",
-					//	data->tid, td.first, refs);
-					// TODO: check if memory_order_relaxed is sufficient
-					td.second->no_flush.store(false, std::memory_order_relaxed);
-					data->th_towait.push_back(td);
-				}
-			}
+			per_thread_t * other = td.second;
+			if (td.first == data->tid || !other->enabled)
+				continue;
+			// drain already pending
+			if (!other->no_flush.load(std::memory_order_relaxed))
+				continue;
+			// racy read, but refs added later are issued after this event anyway
+			if (other->buf_ptr == other->buf_beg)
+				continue;
+
+			// keep timestamp of oldest pending request
+			int64_t expect = 0;
+			other->drain_request.compare_exchange_strong(expect, now, std::memory_order_relaxed);
+			other->no_flush.store(false, std::memory_order_release);
 		}
-
-		// wait until all threads flushed
-		// this is a hacky half-barrier implementation
-		for (const auto & td : data->th_towait) {
-			// Flush thread given that:
-			// 1. thread is not the calling thread
-			// 2. thread is not disabled
-			unsigned waits = 0;
-			while (!td.second->no_flush.load(std::memory_order_relaxed)) {
-				if (++waits > 100) {
-					// avoid busy-waiting and blocking CPU if other thread did not flush
-					// within given period
-					if (flush_external) {
-						byte expect_bool = false;
-						if (td.second->external_flush.compare_exchange_weak(expect_bool, (byte)true, std::memory_order_release)) {
-							//	//dr_printf("<< Thread %i took to long to flush, flush externaly\n", td.first);
-							analyze_access(td.second);
-							td.second->stats->external_flushes++;
-							td.second->external_flush.store(false, std::memory_order_release);
-						}
-					}
-					// Here we might loose some refs, clear them
-					td.second->buf_ptr = td.second->mem_buf.data;
-					td.second->no_flush.store(true, std::memory_order_relaxed);
-					break;
-				}
-			}
-		}
-		memory_tracker->flush_active.store(false, std::memory_order_relaxed);
 		dr_rwlock_read_unlock(tls_rw_mutex);
 
 		auto duration = std::chrono::system_clock::now() - start;
 		data->stats->time_in_flushes += std::chrono::duration_cast<std::chrono::milliseconds>(duration);
 	}
 
+	void MemoryTracker::drain_async(per_thread_t * data) {
+		if (nullptr != data->async_queue) {
+			analysis_pool->drain(data);
+		}
+	}
+
 	void MemoryTracker::code_cache_init(void) {
 		void         *drcontext;
 		instrlist_t  *ilist;
@@ -0,0 +1,381 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "module/DecisionCache.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <string>
+
+#ifdef LINUX
+#include <elf.h>
+#endif
+
+namespace drace {
+	namespace module {
+		/* On-disk format (native endianess):
+		*  header_t, followed by the modules.
+		*  Each module_t is followed by its symbols, each symbol_t by its offsets.
+		*/
+		struct header_t {
+			uint32_t magic;
+			uint32_t version;
+			uint64_t config_hash;
+			uint64_t num_modules;
+		};
+
+		struct module_t {
+			uint64_t key;
+			uint8_t  has_flags;
+			uint8_t  debug_info;
+			uint8_t  instrument;
+			uint8_t  pad;
+			uint32_t num_symbols;
+			uint64_t debug_key;
+		};
+
+		struct symbol_t {
+			uint64_t hash;
+			uint64_t num_offsets;
+		};
+
+		DecisionCache::DecisionCache(const std::string & file, const std::string & config_file)
+			: _file(file),
+			  _config_hash(hash_file(config_file)),
+			  _mx(dr_mutex_create())
+		{
+			file_t fd = dr_open_file(_file.c_str(), DR_FILE_READ);
+			if (fd == INVALID_FILE) {
+				LOG_INFO(-1, "instrumentation cache %s not found, start cold", _file.c_str());
+				return;
+			}
+			uint64 fsize = 0;
+			if (dr_file_size(fd, &fsize) && fsize >= sizeof(header_t)) {
+				size_t map_size = (size_t)fsize;
+				byte * data = (byte*)dr_map_file(fd, &map_size, 0, nullptr, DR_MEMPROT_READ, DR_MAP_PRIVATE);
+				if (nullptr != data) {
+					if (!parse(data, (size_t)fsize)) {
+						_entries.clear();
+						LOG_WARN(-1, "instrumentation cache %s is outdated or invalid, start cold", _file.c_str());
+					}
+					dr_unmap_file(data, map_size);
+				}
+			}
+			dr_close_file(fd);
+			LOG_INFO(-1, "loaded instrumentation decisions of %i modules", _entries.size());
+		}
+
+		DecisionCache::~DecisionCache() {
+			LOG_INFO(-1, "instrumentation cache: %i hits, %i misses", _hits, _misses);
+			dr_mutex_destroy(_mx);
+		}
+
+		bool DecisionCache::parse(const byte * data, size_t size) {
+			const byte * pos = data;
+			const byte * end = data + size;
+
+			header_t header;
+			memcpy(&header, pos, sizeof(header_t));
+			pos += sizeof(header_t);
+			if (header.magic != MAGIC || header.version != VERSION || header.config_hash != _config_hash)
+				return false;
+
+			for (uint64_t m = 0; m < header.num_modules; ++m) {
+				module_t mod;
+				if ((size_t)(end - pos) < sizeof(module_t))
+					return false;
+				memcpy(&mod, pos, sizeof(module_t));
+				pos += sizeof(module_t);
+
+				entry_t & entry = _entries[mod.key];
+				entry.has_flags = (mod.has_flags != 0);
+				entry.debug_info = (mod.debug_info != 0);
+				entry.instrument = mod.instrument;
+				entry.debug_key = mod.debug_key;
+
+				for (uint32_t s = 0; s < mod.num_symbols; ++s) {
+					symbol_t sym;
+					if ((size_t)(end - pos) < sizeof(symbol_t))
+						return false;
+					memcpy(&sym, pos, sizeof(symbol_t));
+					pos += sizeof(symbol_t);
+
+					if ((size_t)(end - pos) / sizeof(uint64_t) < sym.num_offsets)
+						return false;
+					auto & offsets = entry.wraps[sym.hash];
+					offsets.resize((size_t)sym.num_offsets);
+					if (sym.num_offsets > 0) {
+						memcpy(offsets.data(), pos, (size_t)sym.num_offsets * sizeof(uint64_t));
+					}
+					pos += sym.num_offsets * sizeof(uint64_t);
+				}
+			}
+			return true;
+		}
+
+		bool DecisionCache::get_flags(const module_data_t * mod, uint8_t & instrument, bool & debug_info) {
+			const uint64_t key = module_key(mod);
+			dr_mutex_lock(_mx);
+			auto it = _entries.find(key);
+			bool found = (it != _entries.end() && it->second.has_flags);
+			if (found && !it->second.debug_info) {
+				// debug information might have been installed since
+				dr_mutex_unlock(_mx);
+				const uint64_t dkey = debug_key(mod);
+				dr_mutex_lock(_mx);
+				it = _entries.find(key);
+				found = (it != _entries.end() && it->second.has_flags && it->second.debug_key == dkey);
+			}
+			if (found) {
+				instrument = it->second.instrument;
+				debug_info = it->second.debug_info;
+				++_hits;
+			}
+			else {
+				++_misses;
+			}
+			dr_mutex_unlock(_mx);
+			return found;
+		}
+
+		void DecisionCache::set_flags(const module_data_t * mod, uint8_t instrument, bool debug_info) {
+			const uint64_t key = module_key(mod);
+			const uint64_t dkey = debug_info ? 0 : debug_key(mod);
+			dr_mutex_lock(_mx);
+			entry_t & entry = _entries[key];
+			entry.has_flags = true;
+			entry.instrument = instrument;
+			entry.debug_info = debug_info;
+			entry.debug_key = dkey;
+			_dirty = true;
+			dr_mutex_unlock(_mx);
+		}
+
+		bool DecisionCache::get_wraps(const module_data_t * mod, const std::string & symbol, std::vector<uint64_t> & offsets) {
+			const uint64_t key = module_key(mod);
+			const uint64_t sym = hash(symbol.data(), symbol.size());
+			bool found = false;
+			dr_mutex_lock(_mx);
+			auto it = _entries.find(key);
+			if (it != _entries.end()) {
+				auto s_it = it->second.wraps.find(sym);
+				if (s_it != it->second.wraps.end()) {
+					offsets.insert(offsets.end(), s_it->second.begin(), s_it->second.end());
+					found = true;
+				}
+			}
+			found ? ++_hits : ++_misses;
+			dr_mutex_unlock(_mx);
+			return found;
+		}
+
+		void DecisionCache::set_wraps(const module_data_t * mod, const std::string & symbol, const std::vector<uint64_t> & offsets) {
+			const uint64_t key = module_key(mod);
+			const uint64_t sym = hash(symbol.data(), symbol.size());
+			dr_mutex_lock(_mx);
+			_entries[key].wraps[sym] = offsets;
+			_dirty = true;
+			dr_mutex_unlock(_mx);
+		}
+
+		bool DecisionCache::save() {
+			dr_mutex_lock(_mx);
+			if (!_dirty) {
+				dr_mutex_unlock(_mx);
+				return true;
+			}
+
+			std::vector<byte> buf;
+			auto append = [&buf](const void * p, size_t n) {
+				buf.insert(buf.end(), (const byte*)p, (const byte*)p + n);
+			};
+
+			header_t header{ MAGIC, VERSION, _config_hash, _entries.size() };
+			append(&header, sizeof(header_t));
+			for (const auto & e : _entries) {
+				module_t mod{ e.first,
+					(uint8_t)e.second.has_flags, (uint8_t)e.second.debug_info, e.second.instrument, 0,
+					(uint32_t)e.second.wraps.size(), e.second.debug_key };
+				append(&mod, sizeof(module_t));
+				for (const auto & w : e.second.wraps) {
+					symbol_t sym{ w.first, w.second.size() };
+					append(&sym, sizeof(symbol_t));
+					append(w.second.data(), w.second.size() * sizeof(uint64_t));
+				}
+			}
+			_dirty = false;
+			dr_mutex_unlock(_mx);
+
+			// write to a temporary file first, hence readers never see a partial cache
+			const std::string tmp_file = _file + "." + std::to_string(dr_get_process_id()) + ".tmp";
+			file_t fd = dr_open_file(tmp_file.c_str(), DR_FILE_WRITE_OVERWRITE);
+			if (fd == INVALID_FILE) {
+				LOG_ERROR(-1, "could not write instrumentation cache %s", tmp_file.c_str());
+				return false;
+			}
+			bool ok = (dr_write_file(fd, buf.data(), buf.size()) == (ssize_t)buf.size());
+			dr_close_file(fd);
+			if (ok) {
+				ok = dr_rename_file(tmp_file.c_str(), _file.c_str(), true);
+			}
+			if (!ok) {
+				LOG_ERROR(-1, "could not write instrumentation cache %s", _file.c_str());
+				dr_delete_file(tmp_file.c_str());
+			}
+			return ok;
+		}
+
+		uint64_t DecisionCache::module_key(const module_data_t * mod) {
+			std::string path(mod->full_path);
+			std::transform(path.begin(), path.end(), path.begin(), ::tolower);
+			uint64_t h = hash(path.data(), path.size());
+#ifdef WINDOWS
+			h = hash(&mod->timestamp, sizeof(mod->timestamp), h);
+			h = hash(&mod->checksum, sizeof(mod->checksum), h);
+#else
+			const uint64_t size = mod->end - mod->start;
+			h = hash(&size, sizeof(size), h);
+			// the path and size do not change if a library is rebuilt
+			std::string id;
+			if (build_id(mod, id)) {
+				h = hash(id.data(), id.size(), h);
+			}
+			else {
+				const uint64_t content = hash_file(mod->full_path);
+				h = hash(&content, sizeof(content), h);
+			}
+#endif
+			return h;
+		}
+
+		uint64_t DecisionCache::debug_key(const module_data_t * mod) {
+			const std::string path(mod->full_path);
+			std::vector<std::string> candidates;
+#ifdef WINDOWS
+			// pdb next to the module
+			const size_t ext = path.find_last_of('.');
+			candidates.push_back(path.substr(0, ext == std::string::npos ? path.size() : ext) + ".pdb");
+#else
+			// debug link locations, see gdb "Separate Debug Files"
+			const size_t sep = path.find_last_of('/');
+			const std::string dir = path.substr(0, sep + 1);
+			const std::string name = path.substr(sep + 1);
+			candidates.push_back(path + ".debug");
+			candidates.push_back(dir + ".debug/" + name + ".debug");
+			candidates.push_back("/usr/lib/debug" + path + ".debug");
+			std::string id;
+			if (build_id(mod, id) && id.size() > 1) {
+				static const char digits[] = "0123456789abcdef";
+				std::string hex;
+				for (unsigned char c : id) {
+					hex.push_back(digits[c >> 4]);
+					hex.push_back(digits[c & 0xf]);
+				}
+				candidates.push_back("/usr/lib/debug/.build-id/" + hex.substr(0, 2) + "/" + hex.substr(2) + ".debug");
+			}
+#endif
+			uint64_t h = 0xcbf29ce484222325ull;
+			for (const auto & file : candidates) {
+				uint64 size = 0;
+				file_t fd = dr_open_file(file.c_str(), DR_FILE_READ);
+				if (fd != INVALID_FILE) {
+					// a missing file and an empty one differ
+					if (!dr_file_size(fd, &size) || size == 0)
+						size = 1;
+					dr_close_file(fd);
+				}
+				h = hash(&size, sizeof(size), h);
+			}
+			return h;
+		}
+
+#ifdef LINUX
+		bool DecisionCache::build_id(const module_data_t * mod, std::string & id) {
+			Elf64_Ehdr ehdr;
+			if (!dr_safe_read(mod->start, sizeof(ehdr), &ehdr, nullptr)
+				|| memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0
+				|| ehdr.e_ident[EI_CLASS] != ELFCLASS64
+				|| ehdr.e_phentsize != sizeof(Elf64_Phdr))
+			{
+				return false;
+			}
+			std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+			if (phdrs.empty() || !dr_safe_read(mod->start + ehdr.e_phoff,
+				phdrs.size() * sizeof(Elf64_Phdr), phdrs.data(), nullptr))
+			{
+				return false;
+			}
+			// the segments are mapped relative to the first loadable one
+			uint64_t first_load = UINT64_MAX;
+			for (const auto & ph : phdrs) {
+				if (ph.p_type == PT_LOAD)
+					first_load = std::min<uint64_t>(first_load, ph.p_vaddr & ~(uint64_t)(dr_page_size() - 1));
+			}
+			if (first_load == UINT64_MAX)
+				return false;
+
+			for (const auto & ph : phdrs) {
+				if (ph.p_type != PT_NOTE)
+					continue;
+				std::vector<byte> notes((size_t)ph.p_filesz);
+				if (notes.empty() || !dr_safe_read(mod->start + (ph.p_vaddr - first_load),
+					notes.size(), notes.data(), nullptr))
+				{
+					continue;
+				}
+				size_t pos = 0;
+				while (pos + sizeof(Elf64_Nhdr) <= notes.size()) {
+					Elf64_Nhdr nhdr;
+					memcpy(&nhdr, notes.data() + pos, sizeof(nhdr));
+					const size_t name_pos = pos + sizeof(nhdr);
+					const size_t desc_pos = name_pos + ((nhdr.n_namesz + 3) & ~3u);
+					const size_t next = desc_pos + ((nhdr.n_descsz + 3) & ~3u);
+					if (next > notes.size())
+						break;
+					if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4
+						&& memcmp(notes.data() + name_pos, "GNU", 4) == 0)
+					{
+						id.assign((const char*)notes.data() + desc_pos, nhdr.n_descsz);
+						return true;
+					}
+					pos = next;
+				}
+			}
+			return false;
+		}
+#endif
+
+		uint64_t DecisionCache::hash(const void * data, size_t size, uint64_t h) {
+			const byte * p = (const byte*)data;
+			for (size_t i = 0; i < size; ++i) {
+				h ^= p[i];
+				h *= 0x100000001b3ull;
+			}
+			return h;
+		}
+
+		uint64_t DecisionCache::hash_file(const std::string & file) {
+			file_t fd = dr_open_file(file.c_str(), DR_FILE_READ);
+			if (fd == INVALID_FILE)
+				return 0;
+			uint64_t h = 0xcbf29ce484222325ull;
+			byte buf[512];
+			ssize_t len;
+			while ((len = dr_read_file(fd, buf, sizeof(buf))) > 0) {
+				h = hash(buf, (size_t)len, h);
+			}
+			dr_close_file(fd);
+			return h;
+		}
+	} // namespace module
+} // namespace drace
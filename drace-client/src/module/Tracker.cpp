@@ -11,6 +11,7 @@
 
 #include "globals.h"
 #include "Module.h"
+#include "module/DecisionCache.h"
 
 #include "function-wrapper.h"
 #include "statistics.h"
@@ -48,6 +49,14 @@ namespace drace {
 				std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::tolower);
 			}
 
+			if (!params.instr_cache.empty()) {
+				_decisions = std::make_unique<DecisionCache>(params.instr_cache, params.config_file);
+			}
+
+			lock_write();
+			publish();
+			unlock_write();
+
 			if (!drmgr_register_module_load_event(event_module_load) ||
 				!drmgr_register_module_unload_event(event_module_unload)) {
 				DR_ASSERT(false);
@@ -60,9 +69,36 @@ namespace drace {
 				DR_ASSERT(false);
 			}
 
+			if (_decisions) {
+				_decisions->save();
+			}
+
+			delete _snapshot.load(std::memory_order_relaxed);
+			for (const Snapshot * snap : _retired) {
+				delete snap;
+			}
 			dr_rwlock_destroy(mod_lock);
 		}
 
+		void Tracker::publish() {
+			const Snapshot * old = _snapshot.load(std::memory_order_relaxed);
+
+			Snapshot * snap = new Snapshot;
+			snap->generation = (nullptr != old) ? old->generation + 1 : 1;
+			snap->modules.reserve(_modules_idx.size());
+			// index is sorted descending
+			for (auto it = _modules_idx.rbegin(); it != _modules_idx.rend(); ++it) {
+				if (it->second->loaded) {
+					snap->modules.push_back(Snapshot::entry_t{ it->second->base, it->second->end, it->second.get() });
+				}
+			}
+			_snapshot.store(snap, std::memory_order_release);
+
+			if (nullptr != old) {
+				_retired.push_back(old);
+			}
+		}
+
 		Tracker::PMetadata Tracker::get_module_containing(const app_pc pc) const
 		{
 			auto m_it = _modules_idx.lower_bound(pc);
@@ -84,7 +120,10 @@ namespace drace {
 
 			if (modptr) {
 				if (!modptr->loaded && (modptr->info == mod)) {
+					lock_write();
 					modptr->loaded = true;
+					publish();
+					unlock_write();
 					return modptr;
 				}
 			}
@@ -95,6 +134,7 @@ namespace drace {
 
 			lock_write();
 			modptr = add_emplace(mod->start, mod->end);
+			publish();
 			unlock_write();
 
 			// Module not already registered
@@ -105,6 +145,13 @@ namespace drace {
                 LOG_WARN(0, "managed module detected, but MSR not available");
             }
 
+			// warm start: skip the path matching and the debug info lookup
+			uint8_t cached_flags;
+			if (_decisions && _decisions->get_flags(mod, cached_flags, modptr->debug_info)) {
+				modptr->instrument = (INSTR_FLAGS)cached_flags;
+				return modptr;
+			}
+
 			std::string mod_path(mod->full_path);
 			std::string mod_name(dr_module_preferred_name(mod));
 			std::transform(mod_path.begin(), mod_path.end(), mod_path.begin(), ::tolower);
@@ -128,6 +175,9 @@ namespace drace {
 				// check if debug info is available
 				modptr->debug_info = _syms->debug_info_available(mod);
 			}
+			if (_decisions) {
+				_decisions->set_flags(mod, modptr->instrument, modptr->debug_info);
+			}
 
 			return modptr;
 		}
@@ -150,17 +200,28 @@ namespace drace {
 			auto modptr = module_tracker->register_module(mod, loaded);
 
 			std::string mod_name = dr_module_preferred_name(mod);
+			// symbol search is performed by the scanner thread
+			bool scan_deferred = false;
 
 			// wrap functions
 			if (util::common_prefix(mod_name, "MSVCP") ||
 				util::common_prefix(mod_name, "KERNELBASE"))
 			{
 				funwrap::wrap_mutexes(mod, true);
+				funwrap::wrap_thread_join_sys(mod);
 			}
 			else if (util::common_prefix(mod_name, "KERNEL"))
 			{
 				funwrap::wrap_allocations(mod);
-				//funwrap::wrap_thread_start_sys(mod);
+				funwrap::wrap_thread_start_sys(mod);
+				funwrap::wrap_thread_join_sys(mod);
+			}
+			else if (util::common_prefix(mod_name, "libc.") ||
+				util::common_prefix(mod_name, "libpthread."))
+			{
+				// creators are tracked by the clone syscall, only the handles are missing
+				funwrap::wrap_thread_start_sys(mod);
+				funwrap::wrap_thread_join_sys(mod);
 			}
 			else if (util::common_prefix(mod_name, "clr.dll") ||
 				util::common_prefix(mod_name, "coreclr.dll"))
@@ -220,14 +281,17 @@ namespace drace {
 			}
 			else if (modptr->instrument != INSTR_FLAGS::NONE && params.annotations) {
 				// no special handling of this module
-                funwrap::wrap_excludes(mod);
+				// debug symbols of all patterns are searched in a single pass
+				auto scan = std::make_unique<funwrap::SymbolScan>(mod);
+                funwrap::wrap_excludes(mod, "functions", scan.get());
                 funwrap::wrap_annotations(mod);
                 // This requires debug symbols, but avoids false positives during
                 // C++11 thread construction and startup
                 if (modptr->debug_info) {
                     //funwrap::wrap_thread_start(mod);
-                    funwrap::wrap_mutexes(mod, false);
+                    funwrap::wrap_mutexes(mod, false, scan.get());
                 }
+				scan_deferred = funwrap::submit_scan(std::move(scan));
 			}
 
 			LOG_INFO(tid,
@@ -238,7 +302,10 @@ namespace drace {
 				modptr->info->full_path);
 
 			// Free symbol information. A later access re-creates them, so its safe to do it here
-			drsym_free_resources(mod->full_path);
+			// (a deferred scan frees them when done)
+			if (!scan_deferred) {
+				drsym_free_resources(mod->full_path);
+			}
 			// free symbols on MPCR side
 			if (modptr->modtype == Metadata::MOD_TYPE_FLAGS::MANAGED && shmdriver) {
 				MSR::unload_symbols(mod->start);
@@ -255,12 +322,15 @@ namespace drace {
 			LOG_INFO(-1, "Unload module: % 20s, beg : %p, end : %p, full path : %s",
 				dr_module_preferred_name(mod), mod->start, mod->end, mod->full_path);
 
-			module_tracker->lock_read();
+			module_tracker->lock_write();
 			auto modptr = module_tracker->get_module_containing(mod->start);
-			module_tracker->unlock_read();
 			if (modptr) {
 				modptr->loaded = false;
+				module_tracker->publish();
 			}
+			module_tracker->unlock_write();
+			// another module might be loaded at this address
+			module_tracker->_syms->invalidate(mod->start, mod->end);
 		}
 	} // namespace module
 } // namespace drace
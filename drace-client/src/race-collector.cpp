@@ -0,0 +1,124 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "race-collector.h"
+#include "memory-tracker.h"
+
+#include <dr_api.h>
+
+namespace drace {
+	RaceCollector::RaceCollector(
+		bool delayed_lookup,
+		const std::shared_ptr<Symbols> & symbols,
+		size_t queue_size)
+		: _delayed_lookup(delayed_lookup),
+		_syms(symbols),
+		_start_time(clock_t::now()),
+		_console(drace::log_target),
+		_queue(queue_size)
+	{
+		_races.reserve(MAX + 1);
+		// the reporter only clears _active after stop(), hence it is set afterwards
+		if (dr_create_client_thread(RaceCollector::thread_main, this)) {
+			_active.store(true, std::memory_order_release);
+		}
+		else {
+			LOG_WARN(-1, "could not start race reporter thread, report races inline");
+			_inline_mx = dr_mutex_create();
+		}
+	}
+
+	RaceCollector::~RaceCollector() {
+		stop();
+		if (nullptr != _inline_mx) {
+			dr_mutex_destroy(_inline_mx);
+		}
+		LOG_INFO(-1, "found %i possible data-races", _races.size());
+	}
+
+	void RaceCollector::stop() {
+		if (!_running.exchange(false, std::memory_order_relaxed))
+			return;
+		if (nullptr != _inline_mx) {
+			dr_mutex_lock(_inline_mx);
+			drain();
+			dr_mutex_unlock(_inline_mx);
+			return;
+		}
+		while (_active.load(std::memory_order_acquire)) {
+			dr_thread_yield();
+		}
+	}
+
+	void RaceCollector::thread_main(void * arg) {
+		static_cast<RaceCollector*>(arg)->run();
+	}
+
+	void RaceCollector::run() {
+		while (_running.load(std::memory_order_relaxed)) {
+			if (process_pending() == 0) {
+				dr_sleep(POLL_INTERVAL_MS);
+			}
+		}
+		drain();
+		_active.store(false, std::memory_order_release);
+	}
+
+	void RaceCollector::drain() {
+		// reserved slots are filled shortly, hence wait for them
+		while (_queue.consumed() != _queue.produced()) {
+			if (process_pending() == 0) {
+				dr_thread_yield();
+			}
+		}
+		const unsigned long stalls = _stalls.load(std::memory_order_relaxed);
+		if (stalls > 0) {
+			LOG_WARN(-1, "racing threads waited %i times for the race reporter", stalls);
+		}
+	}
+
+	size_t RaceCollector::process_pending() {
+		size_t processed = 0;
+		pending_race_t race;
+		while (_queue.pop(race)) {
+			process_race(race);
+			_processed.fetch_add(1, std::memory_order_release);
+			++processed;
+		}
+		return processed;
+	}
+
+	void RaceCollector::process_race(const pending_race_t & r) {
+		if (_races.size() > MAX)
+			return;
+
+		if (filter_duplicates(r))
+			return;
+
+		detector::Race race{ r.first, r.second };
+		if (params.adaptive_sampling) {
+			memory_tracker->sampler.on_race(&race);
+		}
+
+		if (!_delayed_lookup) {
+			DecoratedRace dr(
+				std::move(resolve_symbols(r.first)),
+				std::move(resolve_symbols(r.second)));
+			_races.emplace_back(r.ttr, dr);
+		}
+		else {
+			_races.emplace_back(r.ttr, race);
+		}
+		_num_races.store(static_cast<unsigned long>(_races.size()), std::memory_order_relaxed);
+		print_last_race();
+	}
+} // namespace drace
@@ -18,6 +18,8 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <vector>
 
 namespace drace {
 
@@ -25,15 +27,19 @@ namespace drace {
 		auto modptr = module_tracker->get_module_containing(pc);
 
 		if (modptr) {
+			dr_mutex_lock(_mx);
 			// Reverse search from pc until symbol can be decoded
 			uint64_t offset = pc - modptr->base;
 			auto limit = std::max((uint64_t)0, offset - (uint64_t)max_distance);
 			for (; offset >= limit; --offset) {
 				drsym_error_t err = drsym_lookup_address(modptr->info->full_path, offset, &syminfo, DRSYM_DEMANGLE);
 				if (err == DRSYM_SUCCESS || err == DRSYM_ERROR_LINE_NOT_AVAILABLE) {
-					return std::string(syminfo.name);
+					std::string name(syminfo.name);
+					dr_mutex_unlock(_mx);
+					return name;
 				}
 			}
+			dr_mutex_unlock(_mx);
 		}
 		return std::string("unknown");
 	}
@@ -48,26 +54,21 @@ namespace drace {
 		if (modptr && ((modptr->modtype == module::Metadata::MOD_TYPE_FLAGS::NATIVE)
 			|| (modptr->modtype == module::Metadata::MOD_TYPE_FLAGS::MANAGED && !shmdriver)))
 		{
+			dr_mutex_lock(_mx);
+			auto it = _cache.find(pc);
+			if (it != _cache.end()) {
+				sloc = it->second;
+				dr_mutex_unlock(_mx);
+				return sloc;
+			}
 
 			sloc.mod_base = modptr->base;
 			sloc.mod_end = modptr->end;
 			sloc.mod_name = dr_module_preferred_name(modptr->info);
+			lookup_native(sloc, modptr->base, modptr->info->full_path, syminfo);
 
-			// Reverse search from pc until symbol can be decoded
-			uint64_t offset = pc - modptr->base;
-			auto limit = std::max((uint64_t)0, offset - (uint64_t)max_distance);
-			for (; offset >= limit; --offset) {
-				drsym_error_t err = drsym_lookup_address(modptr->info->full_path, offset, &syminfo, DRSYM_DEMANGLE);
-				if (err == DRSYM_SUCCESS || err == DRSYM_ERROR_LINE_NOT_AVAILABLE) {
-					sloc.sym_name = syminfo.name;
-					if (err != DRSYM_ERROR_LINE_NOT_AVAILABLE) {
-						sloc.file = syminfo.file;
-						sloc.line = syminfo.line;
-						sloc.line_offs = syminfo.line_offs;
-					}
-					break;
-				}
-			}
+			_cache.emplace(pc, sloc);
+			dr_mutex_unlock(_mx);
 		}
 		else {
 			// Managed Code
@@ -92,6 +93,213 @@ namespace drace {
 		return sloc;
 	}
 
+	void Symbols::lookup_native(SymbolLocation & sloc, app_pc base, const char * path, drsym_info_t & info) {
+		uint64_t offset = sloc.pc - base;
+
+		if (_use_func_tables) {
+			const func_table_t & funcs = get_func_table(base, path);
+			auto it = std::upper_bound(funcs.begin(), funcs.end(), offset,
+				[](uint64_t offs, const func_range_t & f) {return offs < f.start; });
+			if (it != funcs.begin() && offset < (--it)->end) {
+				sloc.sym_name = it->name;
+				// line information is only available at the exact offset
+				drsym_error_t err = drsym_lookup_address(path, offset, &info, DRSYM_DEMANGLE);
+				if (err == DRSYM_SUCCESS) {
+					sloc.file = info.file;
+					sloc.line = info.line;
+					sloc.line_offs = info.line_offs;
+				}
+				return;
+			}
+			// not covered by a function (e.g. only exports are available)
+		}
+
+		// Reverse search from pc until symbol can be decoded
+		auto limit = std::max((uint64_t)0, offset - (uint64_t)max_distance);
+		for (; offset >= limit; --offset) {
+			drsym_error_t err = drsym_lookup_address(path, offset, &info, DRSYM_DEMANGLE);
+			if (err == DRSYM_SUCCESS || err == DRSYM_ERROR_LINE_NOT_AVAILABLE) {
+				sloc.sym_name = info.name;
+				if (err != DRSYM_ERROR_LINE_NOT_AVAILABLE) {
+					sloc.file = info.file;
+					sloc.line = info.line;
+					sloc.line_offs = info.line_offs;
+				}
+				break;
+			}
+		}
+	}
+
+	const Symbols::func_table_t & Symbols::get_func_table(app_pc base, const char * path) {
+		dr_mutex_lock(_table_mx);
+		auto it = _func_tables.find(base);
+		if (it != _func_tables.end()) {
+			dr_mutex_unlock(_table_mx);
+			return it->second;
+		}
+		dr_mutex_unlock(_table_mx);
+
+		// enumeration is slow, hence do not block other modules
+		func_table_t funcs;
+		drsym_enumerate_symbols_ex(path, add_func_range, sizeof(drsym_info_t), &funcs, DRSYM_DEMANGLE);
+		std::sort(funcs.begin(), funcs.end());
+		LOG_INFO(-1, "symbol table of %s: %i functions", path, funcs.size());
+
+		dr_mutex_lock(_table_mx);
+		// keeps the existing table if another thread was faster
+		const func_table_t & table = _func_tables.emplace(base, std::move(funcs)).first->second;
+		dr_mutex_unlock(_table_mx);
+		return table;
+	}
+
+	bool Symbols::add_func_range(drsym_info_t * info, drsym_error_t status, void * data) {
+		if ((status == DRSYM_SUCCESS || status == DRSYM_ERROR_LINE_NOT_AVAILABLE) &&
+			info->end_offs > info->start_offs && nullptr != info->name)
+		{
+			func_table_t * funcs = static_cast<func_table_t*>(data);
+			funcs->push_back(func_range_t{ info->start_offs, info->end_offs, info->name });
+		}
+		// continue iteration
+		return true;
+	}
+
+	void Symbols::invalidate(app_pc base, app_pc end) {
+		dr_mutex_lock(_mx);
+		_cache.erase(_cache.lower_bound(base), _cache.lower_bound(end));
+		dr_mutex_unlock(_mx);
+
+		dr_mutex_lock(_table_mx);
+		_func_tables.erase(base);
+		dr_mutex_unlock(_table_mx);
+	}
+
+	/**
+	* Shared state of a bulk resolution. Owned by all participating threads,
+	* as a worker might start after the resolution is already finished.
+	*/
+	struct bulk_job_t {
+		/** pcs of a single module */
+		struct group_t {
+			size_t                     begin;
+			size_t                     end;
+			module::Tracker::PMetadata mod;
+		};
+
+		Symbols *                   syms;
+		std::vector<app_pc>         pcs;
+		std::vector<SymbolLocation> locs;
+		std::vector<group_t>        groups;
+		std::atomic<size_t>         next{ 0 };
+		std::atomic<size_t>         done{ 0 };
+		std::atomic<unsigned>       refs{ 1 };
+
+		/** Resolves groups until all are claimed */
+		void process() {
+			size_t g;
+			while ((g = next.fetch_add(1, std::memory_order_relaxed)) < groups.size()) {
+				const group_t & grp = groups[g];
+				syms->resolve_module(grp.mod->info, pcs.data() + grp.begin,
+					grp.end - grp.begin, locs.data() + grp.begin);
+				done.fetch_add(1, std::memory_order_release);
+			}
+		}
+
+		void release() {
+			if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				delete this;
+			}
+		}
+	};
+
+	void Symbols::bulk_worker(void * arg) {
+		bulk_job_t * job = static_cast<bulk_job_t*>(arg);
+		job->process();
+		job->release();
+	}
+
+	std::vector<SymbolLocation> Symbols::resolve_bulk(std::vector<app_pc> && pcs, unsigned num_threads) {
+		bulk_job_t * job = new bulk_job_t;
+		job->syms = this;
+		job->pcs = std::move(pcs);
+		job->locs.resize(job->pcs.size());
+
+		// group the sorted pcs by module, resolve the others directly
+		const auto & all = job->pcs;
+		for (size_t i = 0; i < all.size();) {
+			auto modptr = module_tracker->get_module_containing(all[i]);
+			if (!modptr || !((modptr->modtype == module::Metadata::MOD_TYPE_FLAGS::NATIVE)
+				|| (modptr->modtype == module::Metadata::MOD_TYPE_FLAGS::MANAGED && !shmdriver)))
+			{
+				job->locs[i] = get_symbol_info(all[i]);
+				++i;
+				continue;
+			}
+			size_t end = i + 1;
+			while (end < all.size() && all[end] < modptr->end) {
+				++end;
+			}
+			job->groups.push_back(bulk_job_t::group_t{ i, end, modptr });
+			i = end;
+		}
+
+		const size_t num_groups = job->groups.size();
+		unsigned workers = 0;
+		for (; workers + 1 < num_threads && workers + 1 < num_groups; ++workers) {
+			job->refs.fetch_add(1, std::memory_order_relaxed);
+			if (!dr_create_client_thread(bulk_worker, job)) {
+				job->refs.fetch_sub(1, std::memory_order_relaxed);
+				break;
+			}
+		}
+		LOG_INFO(-1, "resolve %i pcs in %i modules using %i threads", all.size(), num_groups, workers + 1);
+
+		// the calling thread participates, hence this finishes even if no worker starts
+		job->process();
+		while (job->done.load(std::memory_order_acquire) != num_groups) {
+			dr_thread_yield();
+		}
+
+		std::vector<SymbolLocation> locs(std::move(job->locs));
+		job->release();
+		return locs;
+	}
+
+	void Symbols::resolve_module(const module_data_t * mod, const app_pc * pcs, size_t num, SymbolLocation * out) {
+		// private lookup buffer, as this runs concurrently
+		char name[buffer_size];
+		char file[buffer_size];
+		drsym_info_t info;
+		info.struct_size = sizeof(drsym_info_t);
+		info.debug_kind = DRSYM_SYMBOLS;
+		info.name_size = buffer_size;
+		info.file_size = buffer_size;
+		info.name = name;
+		info.file = file;
+
+		const std::string mod_name(dr_module_preferred_name(mod));
+		for (size_t i = 0; i < num; ++i) {
+			dr_mutex_lock(_mx);
+			auto it = _cache.find(pcs[i]);
+			if (it != _cache.end()) {
+				out[i] = it->second;
+				dr_mutex_unlock(_mx);
+				continue;
+			}
+			dr_mutex_unlock(_mx);
+
+			SymbolLocation & sloc = out[i];
+			sloc.pc = pcs[i];
+			sloc.mod_base = mod->start;
+			sloc.mod_end = mod->end;
+			sloc.mod_name = mod_name;
+			lookup_native(sloc, mod->start, mod->full_path, info);
+
+			dr_mutex_lock(_mx);
+			_cache.emplace(sloc.pc, sloc);
+			dr_mutex_unlock(_mx);
+		}
+	}
+
 	bool Symbols::debug_info_available(const module_data_t *mod) const {
 		drsym_debug_kind_t flags;
 		drsym_error_t error;
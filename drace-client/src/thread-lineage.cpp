@@ -0,0 +1,211 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "thread-lineage.h"
+
+#include <dr_api.h>
+
+namespace drace {
+	ThreadLineage::ThreadLineage()
+		: _mx(dr_mutex_create())
+	{ }
+
+	ThreadLineage::~ThreadLineage() {
+		dr_mutex_destroy(_mx);
+	}
+
+	void ThreadLineage::forget(iterator it) {
+		auto h = _handles.find(it->second.handle);
+		if (h != _handles.end() && h->second == it->first)
+			_handles.erase(h);
+		_threads.erase(it);
+	}
+
+	void ThreadLineage::bind_handle(iterator it, uint64_t handle) {
+		auto h = _handles.find(handle);
+		if (h != _handles.end() && h->second != it->first) {
+			// the handle value was reused, the previous thread cannot be joined anymore
+			auto prev = _threads.find(h->second);
+			if (prev != _threads.end() && prev->second.handle == handle) {
+				prev->second.handle = 0;
+				if (prev->second.exited)
+					_threads.erase(prev);
+			}
+		}
+		_handles[handle] = it->first;
+		it->second.handle = handle;
+	}
+
+	ThreadLineage::iterator ThreadLineage::find_created(thread_id_t child) {
+		// an exited entry belongs to a previous thread with the same id
+		auto it = _threads.find(child);
+		if ((it == _threads.end() || it->second.exited) && !_creating.empty()) {
+			const uint64_t deadline = dr_get_milliseconds() + create_timeout_ms;
+			do {
+				dr_mutex_unlock(_mx);
+				dr_thread_yield();
+				dr_mutex_lock(_mx);
+				it = _threads.find(child);
+			} while ((it == _threads.end() || it->second.exited)
+				&& !_creating.empty() && dr_get_milliseconds() < deadline);
+		}
+		return (it != _threads.end() && !it->second.exited) ? it : _threads.end();
+	}
+
+	void ThreadLineage::begin_create(thread_id_t parent) {
+		dr_mutex_lock(_mx);
+		_creating.insert(parent);
+		dr_mutex_unlock(_mx);
+	}
+
+	void ThreadLineage::end_create(thread_id_t parent, thread_id_t child, uint64_t handle) {
+		dr_mutex_lock(_mx);
+		// only announced creations, e.g. not forks of processes
+		if (_creating.erase(parent) != 0 && child != 0) {
+			// the id was reused, hence the previous thread is gone
+			auto prev = _threads.find(child);
+			if (prev != _threads.end())
+				forget(prev);
+
+			auto it = _threads.emplace(child, Lineage{ parent }).first;
+			if (handle != 0) {
+				bind_handle(it, handle);
+			}
+			else {
+				// the handle is attached after the creation returned,
+				// an exited previous child without handle cannot be joined anymore
+				auto last = _last_created.find(parent);
+				if (last != _last_created.end()) {
+					auto old = _threads.find(last->second);
+					if (old != _threads.end() && old->second.exited && old->second.handle == 0)
+						forget(old);
+				}
+				_last_created[parent] = child;
+			}
+		}
+		dr_mutex_unlock(_mx);
+	}
+
+	void ThreadLineage::attach_handle(thread_id_t parent, uint64_t handle) {
+		dr_mutex_lock(_mx);
+		auto last = _last_created.find(parent);
+		if (last != _last_created.end()) {
+			auto it = _threads.find(last->second);
+			if (it != _threads.end() && it->second.handle == 0)
+				bind_handle(it, handle);
+			_last_created.erase(last);
+		}
+		dr_mutex_unlock(_mx);
+	}
+
+	thread_id_t ThreadLineage::thread_of(uint64_t handle) const {
+		thread_id_t tid = 0;
+		dr_mutex_lock(_mx);
+		auto it = _handles.find(handle);
+		if (it != _handles.end())
+			tid = it->second;
+		dr_mutex_unlock(_mx);
+		return tid;
+	}
+
+	detector::tid_t ThreadLineage::take_creator(thread_id_t child) {
+		detector::tid_t parent = detector::unknown_thread;
+		dr_mutex_lock(_mx);
+		auto it = find_created(child);
+		if (it != _threads.end() && !it->second.forked) {
+			parent = it->second.parent;
+			it->second.forked = true;
+		}
+		dr_mutex_unlock(_mx);
+		return parent;
+	}
+
+	void ThreadLineage::begin_wait(thread_id_t joiner, thread_id_t child) {
+		dr_mutex_lock(_mx);
+		auto it = _threads.find(child);
+		if (it != _threads.end() && !it->second.exited) {
+			// with multiple waiters, the join cannot be attributed
+			it->second.joiner = (it->second.waiters++ == 0) ? joiner : 0;
+		}
+		dr_mutex_unlock(_mx);
+	}
+
+	void * ThreadLineage::end_wait(thread_id_t joiner, thread_id_t child) {
+		void * sync = nullptr;
+		dr_mutex_lock(_mx);
+		auto it = _threads.find(child);
+		if (it != _threads.end()) {
+			Lineage & lin = it->second;
+			if (lin.exited) {
+				sync = &lin;
+			}
+			else {
+				if (lin.waiters > 0)
+					--lin.waiters;
+				if (lin.joiner == joiner)
+					lin.joiner = 0;
+			}
+		}
+		dr_mutex_unlock(_mx);
+		return sync;
+	}
+
+	void ThreadLineage::close_handle(uint64_t handle) {
+		dr_mutex_lock(_mx);
+		auto h = _handles.find(handle);
+		if (h != _handles.end()) {
+			auto it = _threads.find(h->second);
+			_handles.erase(h);
+			if (it != _threads.end() && it->second.handle == handle) {
+				it->second.handle = 0;
+				if (it->second.exited)
+					_threads.erase(it);
+			}
+		}
+		dr_mutex_unlock(_mx);
+	}
+
+	ThreadLineage::Exit ThreadLineage::exited(thread_id_t child) {
+		Exit exit;
+		dr_mutex_lock(_mx);
+		_creating.erase(child);
+		// a thread created last by the exiting one cannot get a handle anymore
+		auto last = _last_created.find(child);
+		if (last != _last_created.end()) {
+			auto it = _threads.find(last->second);
+			if (it != _threads.end() && it->second.exited && it->second.handle == 0)
+				forget(it);
+			_last_created.erase(last);
+		}
+
+		auto it = find_created(child);
+		if (it != _threads.end()) {
+			Lineage & lin = it->second;
+			lin.exited = true;
+			exit.known = true;
+			if (lin.waiters == 1 && lin.joiner != 0 && lin.joiner != child)
+				exit.joiner = lin.joiner;
+
+			auto pending = _last_created.find(lin.parent);
+			if (lin.handle != 0 || (pending != _last_created.end() && pending->second == child)) {
+				// later joiners synchronize with the entry
+				exit.sync = &lin;
+			}
+			else {
+				// nobody can wait for this thread
+				forget(it);
+			}
+		}
+		dr_mutex_unlock(_mx);
+		return exit;
+	}
+} // namespace drace
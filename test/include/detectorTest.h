@@ -30,31 +30,16 @@ public:
 	DetectorTest() {
 		num_races = 0;
         last_race = {};
-		if (detector::name() != "TSAN") {
-			const char * _argv = "drace-tests.exe";
-			detector::init(1, &_argv, callback);
-		}
+		const char * _argv = "drace-tests.exe";
+		detector::init(1, &_argv, callback);
 	}
 
 	~DetectorTest() {
-		if (detector::name() != "TSAN") {
-			detector::finalize();
-		}
+		detector::finalize();
 	}
 
 protected:
-	// TSAN can only be initialized once, even after a finalize
 	static void SetUpTestCase() {
 		std::cout << "Detector: " << detector::name() << std::endl;
-		if (detector::name() == "TSAN") {
-			const char * _argv = "drace-tests-tsan.exe";
-			detector::init(1, &_argv, callback);
-		}
-	}
-
-	static void TearDownTestCase() {
-		if (detector::name() == "TSAN") {
-			detector::finalize();
-		}
 	}
 };
@@ -12,6 +12,9 @@
 #include "gtest/gtest.h"
 #include "detectorTest.h"
 
+#include <memory>
+#include <vector>
+
 TEST_F(DetectorTest, WR_Race) {
 	detector::tls_t tls10;
 	detector::tls_t tls11;
@@ -53,7 +56,7 @@ TEST_F(DetectorTest, ThreadExit) {
 	detector::fork(1, 30u, &tls30);
 	detector::write(tls30, (void*)0x0031, (void*)0x00320000, 8);
 
-	detector::fork(1, 31u, &tls31);
+	detector::fork(30u, 31u, &tls31);
 	detector::write(tls31, (void*)0x0032, (void*)0x00320000, 8);
 	detector::join(30u, 31u);
 
@@ -95,7 +98,7 @@ TEST_F(DetectorTest, ForkInitialize) {
 
 	detector::fork(1, 60, &tls60);
 	detector::write(tls60, (void*)0x0060, (void*)0x00600000, 8);
-	detector::fork(1, 61, &tls61);
+	detector::fork(60, 61, &tls61);
 	detector::write(tls61, (void*)0x0060, (void*)0x00600000, 8);
 
 	EXPECT_EQ(num_races, 0);
@@ -157,6 +160,191 @@ TEST_F(DetectorTest, ResetRange) {
 	EXPECT_EQ(num_races, 0);
 }
 
+TEST_F(DetectorTest, AccessBatch) {
+	detector::tls_t tls100;
+	detector::tls_t tls101;
+
+	detector::fork(1, 100, &tls100);
+	detector::fork(1, 101, &tls101);
+
+	detector::MemAccess refs[] = {
+		detector::MemAccess::make((void*)0x01000000, 0x0100, 8, true),
+		detector::MemAccess::make((void*)0x01000008, 0x0101, 8, true),
+		// excluded range
+		detector::MemAccess::make((void*)0x01100000, 0x0102, 8, true)
+	};
+	size_t processed = detector::access_batch(tls100, refs, 3, 0x01100000, 0x01200000);
+	EXPECT_EQ(processed, 2);
+	EXPECT_EQ(num_races, 0);
+
+	detector::MemAccess racy[] = {
+		detector::MemAccess::make((void*)0x01000000, 0x0103, 8, false)
+	};
+	detector::access_batch(tls101, racy, 1, 0, 0);
+	EXPECT_EQ(num_races, 1);
+}
+
+TEST_F(DetectorTest, PackedAccess) {
+	detector::tls_t tls120;
+	detector::tls_t tls121;
+
+	detector::fork(1, 120, &tls120);
+	detector::fork(1, 121, &tls121);
+
+	detector::MemAccess ref = detector::MemAccess::make((void*)0x0000020A00940008, 1, 8, true);
+	EXPECT_EQ(ref.addr(), 0x0000020A00940008ull);
+	EXPECT_EQ(ref.size(), 8);
+	EXPECT_TRUE(ref.write());
+	EXPECT_FALSE(ref.is_marker());
+	// sizes below 4 KiB are stored exactly, larger ones rounded up to the next power of two
+	EXPECT_EQ(detector::MemAccess::make((void*)0x10, 0, 24, false).size(), 24);
+	EXPECT_EQ(detector::MemAccess::make((void*)0x10, 0, 300, false).size(), 300);
+	EXPECT_EQ(detector::MemAccess::make((void*)0x10, 0, 4095, true).size(), 4095);
+	EXPECT_EQ(detector::MemAccess::make((void*)0x10, 0, 5000, false).size(), 8192);
+	EXPECT_TRUE(detector::MemAccess::make((void*)0x10, 0, 5000, true).write());
+	EXPECT_FALSE(detector::MemAccess::make((void*)0x10, 0, 1, false).write());
+
+	// pcs are stored as index into the pc table
+	std::unique_ptr<detector::PcTable> pc_table(new detector::PcTable());
+	std::vector<void*> chunk(detector::PcTable::chunk_size, nullptr);
+	pc_table->chunks[0] = chunk.data();
+	chunk[1] = (void*)0x0120;
+	chunk[2] = (void*)0x0121;
+	EXPECT_EQ(pc_table->lookup(ref.pc), (void*)0x0120);
+
+	detector::access_batch(tls120, &ref, 1, 0, 0, pc_table.get());
+	EXPECT_EQ(num_races, 0);
+
+	detector::MemAccess racy = detector::MemAccess::make((void*)0x0000020A00940008, 2, 8, false);
+	detector::access_batch(tls121, &racy, 1, 0, 0, pc_table.get());
+	EXPECT_EQ(num_races, 1);
+	EXPECT_EQ(last_race.first.accessed_memory, 0x0000020A00940008ull);
+}
+
+TEST_F(DetectorTest, FullAddress) {
+	detector::tls_t tls110;
+	detector::tls_t tls111;
+
+	detector::fork(1, 110, &tls110);
+	detector::fork(1, 111, &tls111);
+
+	// addresses only differ in the upper half
+	detector::write(tls110, (void*)0x0110, (void*)0x0000020A00920000, 8);
+	detector::read(tls111, (void*)0x0111, (void*)0x0000030A00920000, 8);
+	EXPECT_EQ(num_races, 0);
+
+	detector::read(tls111, (void*)0x0112, (void*)0x0000020A00920000, 8);
+	EXPECT_EQ(num_races, 1);
+	EXPECT_EQ(last_race.first.accessed_memory, 0x0000020A00920000ull);
+	EXPECT_EQ(last_race.second.accessed_memory, 0x0000020A00920000ull);
+}
+
+TEST_F(DetectorTest, SharedRead) {
+	detector::tls_t tls130;
+	detector::tls_t tls131;
+	detector::tls_t tls132;
+
+	detector::fork(1, 130, &tls130);
+	detector::fork(1, 131, &tls131);
+	detector::fork(1, 132, &tls132);
+
+	// concurrent reads do not race
+	detector::read(tls130, (void*)0x0130, (void*)0x01300000, 8);
+	detector::read(tls131, (void*)0x0131, (void*)0x01300000, 8);
+	EXPECT_EQ(num_races, 0);
+
+	// write is ordered after the first, but not after the second read
+	detector::happens_before(tls130, (void*)0x01300000);
+	detector::happens_after(tls132, (void*)0x01300000);
+	detector::write(tls132, (void*)0x0132, (void*)0x01300000, 8);
+	EXPECT_EQ(num_races, 1);
+	// races are not ordered
+	EXPECT_EQ(last_race.first.thread_id + last_race.second.thread_id, 131 + 132);
+}
+
+TEST_F(DetectorTest, Reinitialize) {
+	detector::tls_t tls140;
+	detector::tls_t tls141;
+
+	detector::fork(1, 140, &tls140);
+	detector::write(tls140, (void*)0x0140, (void*)0x01400000, 8);
+
+	// a new session does not see accesses of the previous one
+	detector::finalize();
+	const char * _argv = "drace-tests.exe";
+	detector::init(1, &_argv, callback);
+
+	detector::fork(1, 141, &tls141);
+	detector::write(tls141, (void*)0x0141, (void*)0x01400000, 8);
+	EXPECT_EQ(num_races, 0);
+}
+
+TEST_F(DetectorTest, ParentChild) {
+	detector::tls_t tls150;
+	detector::tls_t tls151;
+
+	detector::fork(1, 150, &tls150);
+	detector::write(tls150, (void*)0x0150, (void*)0x01500000, 8);
+
+	// child happens after parent
+	detector::fork(150, 151, &tls151);
+	detector::read(tls151, (void*)0x0151, (void*)0x01500000, 8);
+	detector::write(tls151, (void*)0x0152, (void*)0x01500008, 8);
+
+	// parent happens after joined child
+	detector::join(150, 151);
+	detector::write(tls150, (void*)0x0153, (void*)0x01500008, 8);
+	EXPECT_EQ(num_races, 0);
+}
+
+TEST_F(DetectorTest, ForkSiblings) {
+	detector::tls_t tls160;
+	detector::tls_t tls161;
+
+	// threads of the same parent are not ordered
+	detector::fork(1, 160, &tls160);
+	detector::write(tls160, (void*)0x0160, (void*)0x01600000, 8);
+	detector::fork(1, 161, &tls161);
+	detector::write(tls161, (void*)0x0161, (void*)0x01600000, 8);
+	EXPECT_EQ(num_races, 1);
+}
+
+TEST_F(DetectorTest, UnknownParent) {
+	detector::tls_t tls170;
+	detector::tls_t tls171;
+	detector::tls_t tls172;
+
+	detector::fork(1, 170, &tls170);
+	detector::write(tls170, (void*)0x0170, (void*)0x01700000, 8);
+
+	// child of an unknown creator happens after all running threads
+	detector::fork(detector::unknown_thread, 171, &tls171);
+	detector::write(tls171, (void*)0x0171, (void*)0x01700000, 8);
+	detector::write(tls171, (void*)0x0172, (void*)0x01700008, 8);
+
+	// all running threads happen after a child joined by an unknown thread
+	detector::fork(1, 172, &tls172);
+	detector::join(detector::unknown_thread, 171);
+	detector::write(tls170, (void*)0x0173, (void*)0x01700008, 8);
+	detector::read(tls172, (void*)0x0174, (void*)0x01700008, 8);
+	EXPECT_EQ(num_races, 1);
+}
+
+TEST_F(DetectorTest, DetachedThread) {
+	detector::tls_t tls180;
+	detector::tls_t tls181;
+
+	detector::fork(1, 180, &tls180);
+	detector::detach(tls180, 180);
+	detector::write(tls180, (void*)0x0180, (void*)0x01800000, 8);
+	detector::finish(tls180, 180);
+
+	// a finished thread is not joined, hence unordered to its siblings
+	detector::fork(1, 181, &tls181);
+	detector::write(tls181, (void*)0x0181, (void*)0x01800000, 8);
+	EXPECT_EQ(num_races, 1);
+}
+
 void callstack_funA() {};
 void callstack_funB() {};
 
@@ -0,0 +1,91 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <thread>
+
+#include "ipc/RecordQueue.h"
+
+using queue_t = ipc::RecordQueue<64>;
+
+TEST(RecordQueue, ReserveCommit) {
+	auto queue = std::make_unique<queue_t>();
+	ASSERT_EQ(queue->front(), nullptr);
+
+	uint64_t * rec = queue->reserve(4);
+	ASSERT_NE(rec, nullptr);
+	rec[0] = 42;
+	rec[1] = 43;
+	// record is not visible before commit
+	ASSERT_EQ(queue->front(), nullptr);
+	// shrink record to final size
+	queue->commit(2);
+	ASSERT_EQ(queue->read_available(), 2);
+
+	const uint64_t * front = queue->front();
+	ASSERT_NE(front, nullptr);
+	ASSERT_EQ(front[0], 42);
+	ASSERT_EQ(front[1], 43);
+	queue->pop(2);
+	ASSERT_EQ(queue->front(), nullptr);
+	ASSERT_EQ(queue->write_available(), static_cast<size_t>(queue_t::slots));
+}
+
+TEST(RecordQueue, Full) {
+	auto queue = std::make_unique<queue_t>();
+	uint64_t * rec = queue->reserve(queue_t::max_record);
+	ASSERT_NE(rec, nullptr);
+	rec[0] = 1;
+	queue->commit(queue_t::max_record);
+
+	rec = queue->reserve(queue_t::max_record);
+	ASSERT_NE(rec, nullptr);
+	rec[0] = 2;
+	queue->commit(queue_t::max_record);
+
+	ASSERT_EQ(queue->reserve(1), nullptr);
+}
+
+TEST(RecordQueue, WrapAround) {
+	auto queue = std::make_unique<queue_t>();
+	constexpr uint64_t num_records = 1000;
+
+	// record i has (i % 7) + 1 words, each containing i + 1
+	std::thread producer([&]() {
+		for (uint64_t i = 0; i < num_records; ++i) {
+			const size_t words = (i % 7) + 1;
+			uint64_t * rec;
+			while (nullptr == (rec = queue->reserve(words))) {
+				std::this_thread::yield();
+			}
+			for (size_t w = 0; w < words; ++w) {
+				rec[w] = i + 1;
+			}
+			queue->commit(words);
+		}
+	});
+
+	for (uint64_t i = 0; i < num_records; ++i) {
+		const uint64_t * rec;
+		while (nullptr == (rec = queue->front())) {
+			std::this_thread::yield();
+		}
+		const size_t words = (i % 7) + 1;
+		for (size_t w = 0; w < words; ++w) {
+			ASSERT_EQ(rec[w], i + 1);
+		}
+		queue->pop(words);
+	}
+	producer.join();
+	ASSERT_EQ(queue->read_available(), 0);
+}
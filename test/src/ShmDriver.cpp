@@ -11,6 +11,9 @@
 
 #include "gtest/gtest.h"
 
+#include <chrono>
+#include <thread>
+
 #include "ipc/SyncSHMDriver.h"
 
 TEST(SyncShmDriver, InitFinalize) {
@@ -51,4 +54,28 @@ TEST(SyncShmDriver, Emplace) {
 	ASSERT_EQ(receiver.id(), ipc::SMDataID::SYMBOL);
 	ASSERT_EQ(ret.a, 10);
 	ASSERT_FALSE(ret.b);
-}
\ No newline at end of file
+}
+TEST(SyncShmDriver, NotifyWait) {
+	ipc::SyncSHMDriver<true, false> sender("test-shm-notify", true);
+	ipc::SyncSHMDriver<false, false> receiver("test-shm-notify", false);
+	ASSERT_TRUE(receiver.valid());
+
+	// no pending notification
+	ASSERT_FALSE(receiver.wait_receive(std::chrono::milliseconds(10)));
+
+	std::thread peer([&]() {
+		if (receiver.wait_receive(std::chrono::seconds(10))) {
+			receiver.put<int>(ipc::SMDataID::CONFIRM, receiver.get<int>() + 1);
+			receiver.commit();
+		}
+	});
+	sender.put<int>(ipc::SMDataID::READY, 41);
+	sender.commit();
+
+	ASSERT_TRUE(sender.wait_receive(std::chrono::seconds(10)));
+	peer.join();
+	ASSERT_EQ(sender.id(), ipc::SMDataID::CONFIRM);
+	ASSERT_EQ(sender.get<int>(), 42);
+	// notifications are consumed by the wait
+	ASSERT_FALSE(sender.wait_receive(std::chrono::milliseconds(10)));
+}